@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cdict.h"
+#include "zmalloc.h"
+#include "redisassert.h"
+#include "mt19937-64.h"
+
+//how many entries dictGetSomeKeys hands back per shard visit
+#define CDICT_SAMPLE_BATCH 64
+
+static inline cdictShard *cdictShardOf(cdict *cd, const void *key){
+    uint64_t h = cd->type->hashFunction(key);
+    return &cd->shards[cd->shard_bits? h >> (64 - cd->shard_bits): 0];
+}
+
+//the writer holding the shard lock moves one more bucket, like dictAdd/dictDelete on a plain dict
+static inline void cdictShardRehashStep(cdictShard *sh){
+    if(sh->d->reHashIdx != -1)
+        dictRehash(sh->d, 1);
+}
+
+cdict *cdictCreate(dictType *type, int shard_bits){
+    assert(shard_bits >= 0 && shard_bits <= CDICT_MAX_SHARD_BITS);
+    assert(!type->open_addressing);
+    cdict *cd = zmalloc(sizeof(*cd));
+    cd->type = type;
+    cd->shard_bits = shard_bits;
+    cd->nshards = (uint64_t)1 << shard_bits;
+    pthread_mutex_init(&cd->sample_lock, NULL);
+    cd->shards = zmalloc_aligned(sizeof(cdictShard), cd->nshards * sizeof(cdictShard));
+    for(uint64_t i = 0; i < cd->nshards; i++){
+        cdictShard *sh = &cd->shards[i];
+        pthread_rwlock_init(&sh->lock, NULL);
+        sh->d = dictCreate(type);
+        //lookups run under the read lock next to each other, so they must not rehash
+        sh->d->pauseRehash = 1;
+    }
+    return cd;
+}
+
+void cdictRelease(cdict *cd){
+    for(uint64_t i = 0; i < cd->nshards; i++){
+        cdictShard *sh = &cd->shards[i];
+        dictRelease(sh->d);
+        pthread_rwlock_destroy(&sh->lock);
+    }
+    pthread_mutex_destroy(&cd->sample_lock);
+    zfree(cd->shards);
+    zfree(cd);
+}
+
+int cdictAdd(cdict *cd, void *key, void *val){
+    cdictShard *sh = cdictShardOf(cd, key);
+    pthread_rwlock_wrlock(&sh->lock);
+    cdictShardRehashStep(sh);
+    int ret = dictAdd(sh->d, key, val);
+    pthread_rwlock_unlock(&sh->lock);
+    return ret;
+}
+
+int cdictReplace(cdict *cd, void *key, void *val){
+    cdictShard *sh = cdictShardOf(cd, key);
+    pthread_rwlock_wrlock(&sh->lock);
+    cdictShardRehashStep(sh);
+    int ret = dictReplace(sh->d, key, val);
+    pthread_rwlock_unlock(&sh->lock);
+    return ret;
+}
+
+int cdictDelete(cdict *cd, const void *key){
+    cdictShard *sh = cdictShardOf(cd, key);
+    pthread_rwlock_wrlock(&sh->lock);
+    cdictShardRehashStep(sh);
+    int ret = dictDelete(sh->d, key);
+    pthread_rwlock_unlock(&sh->lock);
+    return ret;
+}
+
+//fn gets the entry of key while the shard is read locked, return 1 when key was found
+int cdictFind(cdict *cd, const void *key, cdictEntryFunction *fn, void *privdata){
+    cdictShard *sh = cdictShardOf(cd, key);
+    pthread_rwlock_rdlock(&sh->lock);
+    dictEntry *de = dictFind(sh->d, key);
+    if(de && fn)
+        fn(privdata, de);
+    pthread_rwlock_unlock(&sh->lock);
+    return de != NULL;
+}
+
+//the value may be released by a concurrent delete, only use it when values outlive their keys
+void *cdictFetchValue(cdict *cd, const void *key){
+    cdictShard *sh = cdictShardOf(cd, key);
+    pthread_rwlock_rdlock(&sh->lock);
+    void *val = dictFetchValue(sh->d, key);
+    pthread_rwlock_unlock(&sh->lock);
+    return val;
+}
+
+uint64_t cdictSize(cdict *cd){
+    uint64_t size = 0;
+    for(uint64_t i = 0; i < cd->nshards; i++){
+        cdictShard *sh = &cd->shards[i];
+        pthread_rwlock_rdlock(&sh->lock);
+        size += sh->d->ht_used[0] + sh->d->ht_used[1];
+        pthread_rwlock_unlock(&sh->lock);
+    }
+    return size;
+}
+
+//the cursor keeps the shard in its top shard_bits bits and the dictScan cursor of that shard in
+//the others, which is enough as a dictScan cursor never has bits above the largest table mask.
+//so every element present for the whole scan is returned at least once, like with dictScan
+uint64_t cdictScan(cdict *cd, uint64_t v, dictScanFunction *fn, void *privdata){
+    int inner_bits = 64 - cd->shard_bits;
+    uint64_t shard = cd->shard_bits? v >> inner_bits: 0;
+    uint64_t inner = cd->shard_bits? v & (((uint64_t)1 << inner_bits) - 1): v;
+    cdictShard *sh = &cd->shards[shard];
+
+    //dictScan pauses the rehash of the shard, that is a write
+    pthread_rwlock_wrlock(&sh->lock);
+    inner = dictScan(sh->d, inner, fn, privdata);
+    pthread_rwlock_unlock(&sh->lock);
+    if(inner == 0 && ++shard == cd->nshards)
+        return 0;
+    return cd->shard_bits? shard << inner_bits | inner: inner;
+}
+
+//hand up to count entries to fn, taken with dictGetSomeKeys from the shards in turn starting
+//at a random one, so a sample is spread over the shards instead of coming from a single one
+uint32_t cdictGetSomeKeys(cdict *cd, uint32_t count, cdictEntryFunction *fn, void *privdata){
+    dictEntry *des[CDICT_SAMPLE_BATCH];
+    uint32_t stored = 0;
+    uint32_t per_shard = count / cd->nshards + 1;
+
+    if(per_shard > CDICT_SAMPLE_BATCH)
+        per_shard = CDICT_SAMPLE_BATCH;
+    pthread_mutex_lock(&cd->sample_lock);
+    uint64_t start = genrand64_int64() & (cd->nshards - 1);
+    for(uint64_t i = 0; i < cd->nshards && stored < count; i++){
+        cdictShard *sh = &cd->shards[(start + i) & (cd->nshards - 1)];
+        uint32_t want = count - stored < per_shard? count - stored: per_shard;
+
+        pthread_rwlock_rdlock(&sh->lock);
+        uint32_t got = dictGetSomeKeys(sh->d, des, want);
+        for(uint32_t j = 0; j < got; j++)
+            fn(privdata, des[j]);
+        pthread_rwlock_unlock(&sh->lock);
+        stored += got;
+    }
+    pthread_mutex_unlock(&cd->sample_lock);
+    return stored;
+}
+
+//the entry of key with its shard locked, read locked when key was there, else write locked
+//after adding it. another thread may add key between the two locks, dictAddOrFind finds it then
+static dictEntry *cdictCounterLock(cdictShard *sh, void *key){
+    pthread_rwlock_rdlock(&sh->lock);
+    dictEntry *de = dictFind(sh->d, key);
+    if(de)
+        return de;
+    pthread_rwlock_unlock(&sh->lock);
+    pthread_rwlock_wrlock(&sh->lock);
+    cdictShardRehashStep(sh);
+    return dictAddOrFind(sh->d, key);
+}
+
+int64_t cdictIncrSignedIntegerVal(cdict *cd, void *key, int64_t val){
+    cdictShard *sh = cdictShardOf(cd, key);
+    int64_t ret = dictAtomicIncrSignedIntegerVal(cdictCounterLock(sh, key), val);
+    pthread_rwlock_unlock(&sh->lock);
+    return ret;
+}
+
+uint64_t cdictIncrUnsignedIntegerVal(cdict *cd, void *key, uint64_t val){
+    cdictShard *sh = cdictShardOf(cd, key);
+    uint64_t ret = dictAtomicIncrUnsignedIntegerVal(cdictCounterLock(sh, key), val);
+    pthread_rwlock_unlock(&sh->lock);
+    return ret;
+}
+
+double cdictIncrDoubleVal(cdict *cd, void *key, double val){
+    cdictShard *sh = cdictShardOf(cd, key);
+    double ret = dictAtomicIncrDoubleVal(cdictCounterLock(sh, key), val);
+    pthread_rwlock_unlock(&sh->lock);
+    return ret;
+}
+
+#ifdef REDIS_TEST
+#include "monotonic.h"
+
+#define CDICT_TEST_KEYS (1 << 20)
+#define CDICT_TEST_MAX_THREADS 32
+
+typedef struct{
+    cdict *cd;
+    uint64_t ops;
+    uint64_t seed;
+    uint64_t found;
+}cdictTestWorker;
+
+static dictType cdictTestType = {
+    .hashFunction = dictTestIntHash,
+};
+
+//90% lookups and 10% overwrites of random keys of a preloaded cdict
+static void *cdictTestWorkerMain(void *arg){
+    cdictTestWorker *w = arg;
+    uint64_t x = w->seed;
+    for(uint64_t i = 0; i < w->ops; i++){
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        void *key = (void *)(uintptr_t)(x % CDICT_TEST_KEYS + 1);
+        if(x % 10 == 0)
+            cdictReplace(w->cd, key, (void *)(uintptr_t)i);
+        else
+            w->found += cdictFind(w->cd, key, NULL, NULL);
+    }
+    return NULL;
+}
+
+static void cdictTestCountEntry(void *privdata, const dictEntry *de){
+    (void)de;
+    (*(uint64_t *)privdata)++;
+}
+
+static void cdictTestCountSample(void *privdata, dictEntry *de){
+    (void)de;
+    (*(uint64_t *)privdata)++;
+}
+
+//redis-server test cdict [ops per thread] [shard bits]
+int cdictTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t ops = argc > 3? strtoull(argv[3], NULL, 10): 1000000;
+    int shard_bits = argc > 4? atoi(argv[4]): 8;
+    int bits[2] = {0, shard_bits};
+
+    for(int b = 0; b < 2; b++){
+        cdict *cd = cdictCreate(&cdictTestType, bits[b]);
+        for(uintptr_t k = 1; k <= CDICT_TEST_KEYS; k++)
+            assert(cdictAdd(cd, (void *)k, NULL) == DICT_OK);
+        assert(cdictSize(cd) == CDICT_TEST_KEYS);
+
+        uint64_t scanned = 0, cursor = 0;
+        do{
+            cursor = cdictScan(cd, cursor, cdictTestCountEntry, &scanned);
+        }while(cursor);
+        assert(scanned == CDICT_TEST_KEYS);
+        uint64_t sampled = 0;
+        uint32_t got = cdictGetSomeKeys(cd, 20, cdictTestCountSample, &sampled);
+        assert(got == sampled && got > 0);
+
+        printf("%llu shard(s):\n", (unsigned long long)cd->nshards);
+        for(int threads = 1; threads <= CDICT_TEST_MAX_THREADS; threads *= 2){
+            pthread_t tids[CDICT_TEST_MAX_THREADS];
+            cdictTestWorker workers[CDICT_TEST_MAX_THREADS];
+            long long start = monotonicUs();
+            for(int t = 0; t < threads; t++){
+                workers[t] = (cdictTestWorker){cd, ops, 0x9e3779b97f4a7c15ULL * (t + 1), 0};
+                pthread_create(&tids[t], NULL, cdictTestWorkerMain, &workers[t]);
+            }
+            uint64_t found = 0;
+            for(int t = 0; t < threads; t++){
+                pthread_join(tids[t], NULL);
+                found += workers[t].found;
+            }
+            long long elapsed = monotonicUs() - start;
+            printf("  %2d threads: %8.2f Mops/sec (%llu lookups hit)\n", threads,
+                (double)ops * threads / (elapsed? elapsed: 1), (unsigned long long)found);
+        }
+        assert(cdictSize(cd) == CDICT_TEST_KEYS);
+        cdictRelease(cd);
+    }
+    return 0;
+}
+typedef struct{
+    cdict *cd;
+    uint64_t ops;
+    uint64_t seed;
+    uint64_t keys;
+    int mode;
+}cdictTestCounterWorker;
+
+static const char *cdict_test_counter_modes[] = {"atomic uint64", "atomic double", "write locked uint64"};
+
+//increments of random keys out of w->keys, the write locked mode is what a cdict offered before
+//the counter calls: the shard write lock around dictAddOrFind and a plain increment
+static void *cdictTestCounterMain(void *arg){
+    cdictTestCounterWorker *w = arg;
+    uint64_t x = w->seed;
+    for(uint64_t i = 0; i < w->ops; i++){
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        void *key = (void *)(uintptr_t)(x % w->keys + 1);
+        if(w->mode == 0){
+            cdictIncrUnsignedIntegerVal(w->cd, key, 1);
+        }else if(w->mode == 1){
+            cdictIncrDoubleVal(w->cd, key, 1.0);
+        }else{
+            cdictShard *sh = cdictShardOf(w->cd, key);
+            pthread_rwlock_wrlock(&sh->lock);
+            cdictShardRehashStep(sh);
+            dictIncrUnsignedIntegerVal(dictAddOrFind(sh->d, key), 1);
+            pthread_rwlock_unlock(&sh->lock);
+        }
+    }
+    return NULL;
+}
+
+static void cdictTestSumUnsigned(void *privdata, const dictEntry *de){
+    *(uint64_t *)privdata += dictGetUnsignedIntegerVal(de);
+}
+
+static void cdictTestSumDouble(void *privdata, const dictEntry *de){
+    *(uint64_t *)privdata += (uint64_t)dictGetDoubleVal(de);
+}
+
+//redis-server test cdictcounters [ops per thread] [keys] [shard bits], threads incrementing
+//counters of an empty cdict, all on one key and spread over keys, no increment may be lost
+int cdictCounterTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t ops = argc > 3? strtoull(argv[3], NULL, 10): 1000000;
+    uint64_t keys = argc > 4? strtoull(argv[4], NULL, 10): 1024;
+    int shard_bits = argc > 5? atoi(argv[5]): 4;
+    uint64_t keyspaces[2] = {1, keys};
+
+    //signed counters go below zero, new keys start from 0
+    cdict *cd = cdictCreate(&cdictTestType, shard_bits);
+    assert(cdictIncrSignedIntegerVal(cd, (void *)1, -5) == -5);
+    assert(cdictIncrSignedIntegerVal(cd, (void *)1, 3) == -2);
+    assert(cdictIncrDoubleVal(cd, (void *)2, 0.5) == 0.5);
+    assert(cdictIncrDoubleVal(cd, (void *)2, 0.25) == 0.75);
+    assert(cdictSize(cd) == 2);
+    cdictRelease(cd);
+
+    for(int k = 0; k < 2; k++){
+        printf("%llu key(s), %d shard bits:\n", (unsigned long long)keyspaces[k], shard_bits);
+        for(int threads = 1; threads <= CDICT_TEST_MAX_THREADS; threads *= 4){
+            printf("  %2d threads:", threads);
+            for(int mode = 0; mode < 3; mode++){
+                pthread_t tids[CDICT_TEST_MAX_THREADS];
+                cdictTestCounterWorker workers[CDICT_TEST_MAX_THREADS];
+                cd = cdictCreate(&cdictTestType, shard_bits);
+                long long start = monotonicUs();
+                for(int t = 0; t < threads; t++){
+                    workers[t] = (cdictTestCounterWorker){cd, ops, 0x9e3779b97f4a7c15ULL * (t + 1), keyspaces[k], mode};
+                    pthread_create(&tids[t], NULL, cdictTestCounterMain, &workers[t]);
+                }
+                for(int t = 0; t < threads; t++)
+                    pthread_join(tids[t], NULL);
+                long long elapsed = monotonicUs() - start;
+                uint64_t sum = 0, cursor = 0;
+                do{
+                    cursor = cdictScan(cd, cursor, mode == 1? cdictTestSumDouble: cdictTestSumUnsigned, &sum);
+                }while(cursor);
+                assert(sum == ops * threads);
+                assert(cdictSize(cd) <= keyspaces[k]);
+                printf("  %s %7.2f Mops/sec", cdict_test_counter_modes[mode],
+                    (double)ops * threads / (elapsed? elapsed: 1));
+                cdictRelease(cd);
+            }
+            printf("\n");
+        }
+    }
+    return 0;
+}
+#endif
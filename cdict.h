@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "dict.h"
+
+//a dict split into 2^shard_bits shards by the high bits of the key hash, so it can be used
+//from several threads. every shard has its own rwlock and its own incremental rehash, which
+//only the writers of that shard drive, readers never change a shard
+#define CDICT_MAX_SHARD_BITS 16
+
+typedef struct cdictShard{
+    pthread_rwlock_t lock;
+    dict *d;
+}__attribute__((aligned(64))) cdictShard;//one cache line each, shards don't false share
+
+typedef struct cdict{
+    dictType *type;
+    int shard_bits;
+    uint64_t nshards;
+    pthread_mutex_t sample_lock;//dictGetSomeKeys draws from the shared genrand64 state
+    cdictShard *shards;
+}cdict;
+
+//called with the shard lock held, it must not call back into the cdict
+typedef void (cdictEntryFunction)(void *privdata, dictEntry *de);
+
+cdict *cdictCreate(dictType *type, int shard_bits);
+void cdictRelease(cdict *cd);
+int cdictAdd(cdict *cd, void *key, void *val);
+int cdictReplace(cdict *cd, void *key, void *val);
+int cdictDelete(cdict *cd, const void *key);
+int cdictFind(cdict *cd, const void *key, cdictEntryFunction *fn, void *privdata);
+void *cdictFetchValue(cdict *cd, const void *key);
+uint64_t cdictSize(cdict *cd);
+uint64_t cdictScan(cdict *cd, uint64_t v, dictScanFunction *fn, void *privdata);
+uint32_t cdictGetSomeKeys(cdict *cd, uint32_t count, cdictEntryFunction *fn, void *privdata);
+
+//counters in the value union, e.g. rate limiters keyed by client id. an increment of a key that
+//is there runs under the shard read lock with an atomic add, so threads updating the counters
+//of one shard don't wait for each other. a missing key is added like cdictAdd would add it,
+//with its value starting from 0, under the write lock. return the new value
+int64_t cdictIncrSignedIntegerVal(cdict *cd, void *key, int64_t val);
+uint64_t cdictIncrUnsignedIntegerVal(cdict *cd, void *key, uint64_t val);
+double cdictIncrDoubleVal(cdict *cd, void *key, double val);
+
+#ifdef REDIS_TEST
+int cdictTest(int argc, char *argv[], int flags);
+int cdictCounterTest(int argc, char *argv[], int flags);
+#endif
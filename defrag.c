@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defrag.h"
+#include "zmalloc.h"
+#include "redisassert.h"
+#include "monotonic.h"
+
+//how many scan steps run between two looks at the clock
+#define DEFRAG_STEPS_PER_CHECK 16
+
+//stashed allocations freed per step of the release
+#define DEFRAG_RELEASE_STEP 1024
+
+#define DEFRAG_PAGE_SHIFT 12
+//pages this full are left alone
+#define DEFRAG_PAGE_FULL ((1 << DEFRAG_PAGE_SHIFT) * 3 / 4)
+
+struct defragPage{
+    uintptr_t page;
+    size_t used;
+};
+
+//the defragger in defragCycle, whose page map defragAlloc works on
+static defragger *defrag_current;
+
+/* ----------------------------- page map -----------------------------
+ * glibc has no hint like jemalloc's on how full the run of an allocation is, so a pass
+ * surveys the dicts first and counts the bytes of their allocations in every page, open
+ * addressing on the page number. Memory allocated elsewhere isn't counted, its pages look
+ * emptier than they are. */
+
+static struct defragPage *defragPageFind(defragger *df, void *ptr, int create){
+    uintptr_t page = ((uintptr_t)ptr >> DEFRAG_PAGE_SHIFT) + 1;//0 is an empty slot
+    size_t idx = (page * 0x9E3779B97F4A7C15ULL) >> (64 - df->pages_bits);
+    size_t mask = ((size_t)1 << df->pages_bits) - 1;
+    for(size_t i = 0; i <= mask; i++){
+        struct defragPage *pg = &df->pages[(idx + i) & mask];
+        if(pg->page == page)
+            return pg;
+        if(pg->page == 0){
+            if(!create || df->npages * 4 >= (mask + 1) * 3)
+                return NULL;
+            pg->page = page;
+            df->npages++;
+            return pg;
+        }
+    }
+    return NULL;
+}
+
+//sized for twice the resident pages, the ones the allocations are in
+static void defragPagesCreate(defragger *df){
+    size_t pages = (zmalloc_get_rss() >> DEFRAG_PAGE_SHIFT) * 2;
+    for(df->pages_bits = 10; ((size_t)1 << df->pages_bits) < pages; df->pages_bits++);
+    df->pages = zcalloc(sizeof(struct defragPage) << df->pages_bits);
+    df->npages = 0;
+}
+
+static void defragPagesRelease(defragger *df){
+    zfree(df->pages);
+    df->pages = NULL;
+}
+
+/* ----------------------------- moving allocations -----------------------------
+ * An allocation in a page that isn't full is moved when a fresh allocation of its size comes
+ * from a page at least as full, which fills the full pages up and empties the others, and
+ * jemalloc_purge gives back the pages left empty. Freed, an allocation would be the next one
+ * glibc hands out, so the old copies and the fresh allocations that don't qualify stay in the
+ * stash, linked through their first word, until the pass is over: every try gets a hole that
+ * wasn't tried yet. A fresh allocation out of the surveyed pages is freed right away, the
+ * holes are used up and stashing it would only grow the heap. */
+
+static void defragStash(defragger *df, void *ptr){
+    *(void **)ptr = df->stash;
+    df->stash = ptr;
+}
+
+//frees up to count stashed allocations, returns 1 when the stash is empty
+static int defragStashRelease(defragger *df, int count){
+    while(df->stash && count--){
+        void *ptr = df->stash;
+        df->stash = *(void **)ptr;
+        zfree(ptr);
+    }
+    return df->stash == NULL;
+}
+
+void *defragAlloc(void *ptr){
+    defragger *df = defrag_current;
+    if(!df || df->phase == DEFRAG_PHASE_RELEASE)
+        return NULL;
+    size_t size = malloc_usable_size(ptr);
+    if(size >= DEFRAG_MAX_ALLOC_SIZE || size < sizeof(void *))
+        return NULL;
+    struct defragPage *from = defragPageFind(df, ptr, df->phase == DEFRAG_PHASE_SURVEY);
+    if(df->phase == DEFRAG_PHASE_SURVEY){
+        if(from)
+            from->used += size;
+        return NULL;
+    }
+    if(!from || from->used >= DEFRAG_PAGE_FULL)
+        return NULL;
+    void *newptr = zmalloc(size);
+    struct defragPage *to = defragPageFind(df, newptr, 0);
+    if(!to || to == from || to->used < from->used){
+        if(to)
+            defragStash(df, newptr);
+        else
+            zfree(newptr);
+        df->misses++;
+        return NULL;
+    }
+    memcpy(newptr, ptr, size);
+    defragStash(df, ptr);
+    from->used = from->used > size? from->used - size: 0;//it may have come after the survey
+    to->used += size;
+    df->hits++;
+    return newptr;
+}
+
+/* ----------------------------- defragger ----------------------------- */
+
+defragger *defraggerCreate(void){
+    defragger *df = zcalloc(sizeof(*df));
+    df->ignore_bytes = DEFRAG_DEFAULT_IGNORE_BYTES;
+    df->threshold_lower = DEFRAG_DEFAULT_THRESHOLD_LOWER;
+    df->threshold_upper = DEFRAG_DEFAULT_THRESHOLD_UPPER;
+    df->cycle_min = DEFRAG_DEFAULT_CYCLE_MIN;
+    df->cycle_max = DEFRAG_DEFAULT_CYCLE_MAX;
+    df->estimate_interval_us = DEFRAG_DEFAULT_ESTIMATE_INTERVAL_US;
+    return df;
+}
+
+void defraggerRelease(defragger *df){
+    defragStashRelease(df, -1);
+    defragPagesRelease(df);
+    zfree(df);
+}
+
+//entries are moved with defragAlloc, keys and values with defragKey and defragVal when set.
+//not for concurrent_reads dicts, whose writer must not defrag
+int defraggerAddDict(defragger *df, dict *d, dictDefragAllocFunction *defragKey, dictDefragAllocFunction *defragVal){
+    if(df->ndicts == DEFRAG_MAX_DICTS)
+        return -1;
+    assert(!d->type->concurrent_reads);
+    df->dicts[df->ndicts] = d;
+    df->fns[df->ndicts].defragAlloc = defragAlloc;
+    df->fns[df->ndicts].defragKey = defragKey;
+    df->fns[df->ndicts].defragVal = defragVal;
+    df->ndicts++;
+    return 0;
+}
+
+//call it before releasing d, a pass that was walking d goes on with the next dict
+void defraggerRemoveDict(defragger *df, dict *d){
+    int id;
+    for(id = 0; id < df->ndicts && df->dicts[id] != d; id++);
+    if(id == df->ndicts)
+        return;
+    memmove(&df->dicts[id], &df->dicts[id + 1], sizeof(dict *) * (df->ndicts - id - 1));
+    memmove(&df->fns[id], &df->fns[id + 1], sizeof(df->fns[0]) * (df->ndicts - id - 1));
+    df->ndicts--;
+    if(df->current == id)
+        df->cursor = 0;
+    else if(df->current > id)
+        df->current--;
+}
+
+//the memory the allocator holds beyond what is allocated, as bytes and as a percentage of
+//the allocated memory. the holes of the heap count only as far as they are resident, the
+//RSS beyond zmalloc_used_memory bounds them once jemalloc_purge gave their pages back
+void defragEstimate(size_t *frag_bytes, double *frag_perc){
+    size_t allocated, active, resident, used = zmalloc_used_memory();
+    zmalloc_get_allocator_info(&allocated, &active, &resident);
+    size_t heap = active > allocated? active - allocated: 0;
+    size_t rss = resident > used? resident - used: 0;
+    *frag_bytes = heap < rss? heap: rss;
+    *frag_perc = allocated? (double)*frag_bytes * 100 / allocated: 0;
+}
+
+static void defragScanNothing(void *privdata, const dictEntry *de){
+    (void)privdata;
+    (void)de;
+}
+
+//the share of the CPU for the fragmentation, 0 when it isn't worth a pass
+static int defragCpuPerc(defragger *df){
+    defragEstimate(&df->frag_bytes, &df->frag_perc);
+    if(df->frag_perc < df->threshold_lower || df->frag_bytes < df->frag_floor + df->ignore_bytes)
+        return 0;
+    double range = df->threshold_upper - df->threshold_lower;
+    double scaled = range > 0? (df->frag_perc - df->threshold_lower) / range: 1;
+    int perc = df->cycle_min + (int)((df->cycle_max - df->cycle_min) * (scaled < 1? scaled: 1));
+    return perc > df->cycle_min? perc: df->cycle_min;
+}
+
+//a pass walks the dicts twice, once to survey the pages and once to move, then frees the stash
+static void defragWalkDone(defragger *df){
+    df->current = 0;
+    df->cursor = 0;
+    df->phase++;
+    if(df->phase == DEFRAG_PHASE_RELEASE)
+        defragPagesRelease(df);
+}
+
+//the emptied pages go back and the next cycle estimates again. what a pass that moved next to
+//nothing leaves is as good as it gets, the next one waits until the fragmentation grew past it
+static void defragPassDone(defragger *df){
+    jemalloc_purge();
+    df->passes++;
+    df->running = 0;
+    df->frag_floor = 0;
+    if((df->hits - df->pass_hits) * 100 < df->misses - df->pass_misses){
+        double frag_perc;
+        defragEstimate(&df->frag_floor, &frag_perc);
+    }
+}
+
+//walk the dicts for cpu_perc percent of period_us, the time since the last call. a pass starts
+//when the fragmentation calls for it, the share of the CPU is decided then and kept for the
+//pass. returns the allocations moved
+uint64_t defragCycle(defragger *df, uint64_t period_us){
+    uint64_t start = monotonicUs(), deadline, now;
+    if(!df->running){
+        //mallinfo2 walks the free chunks, it isn't asked on every call
+        if(df->ndicts == 0 || start < df->next_estimate_us)
+            return 0;
+        df->next_estimate_us = start + df->estimate_interval_us;
+        if((df->cpu_perc = defragCpuPerc(df)) == 0)
+            return 0;
+        defragPagesCreate(df);
+        df->running = 1;
+        df->phase = DEFRAG_PHASE_SURVEY;
+        df->current = 0;
+        df->cursor = 0;
+        df->pass_hits = df->hits;
+        df->pass_misses = df->misses;
+    }
+    uint64_t hits = df->hits;
+    deadline = start + period_us * df->cpu_perc / 100;
+    now = monotonicUs();
+    defrag_current = df;
+    while(df->running && now < deadline){
+        for(int step = 0; step < DEFRAG_STEPS_PER_CHECK && df->running; step++){
+            if(df->phase == DEFRAG_PHASE_RELEASE){
+                if(defragStashRelease(df, DEFRAG_RELEASE_STEP))
+                    defragPassDone(df);
+                continue;
+            }
+            if(df->current < df->ndicts){
+                df->cursor = dictScanDefrag(df->dicts[df->current], df->cursor, defragScanNothing,
+                    &df->fns[df->current], NULL);
+                if(df->cursor || ++df->current < df->ndicts)
+                    continue;
+            }
+            defragWalkDone(df);
+        }
+        now = monotonicUs();
+    }
+    defrag_current = NULL;
+    df->time_us += now - start;
+    return df->hits - hits;
+}
+
+#ifdef REDIS_TEST
+#define DEFRAG_TEST_VALUE 40
+
+static void defragTestValDestructor(dict *d, void *val){
+    (void)d;
+    zfree(val);
+}
+
+static dictType defragTestType = {
+    .hashFunction = dictTestIntHash,
+    .valDestructor = defragTestValDestructor,
+};
+
+static void defragTestPrint(const char *what){
+    size_t frag_bytes;
+    double frag_perc;
+    defragEstimate(&frag_bytes, &frag_perc);
+    printf("%-28s rss %7.1f MB, used %7.1f MB, fragmentation %7.1f MB (%.0f%%)\n", what,
+        zmalloc_get_rss() / 1048576.0, zmalloc_used_memory() / 1048576.0, frag_bytes / 1048576.0, frag_perc);
+}
+
+//redis-server test defrag [keys], keys with DEFRAG_TEST_VALUE byte values, 3 of every 4 deleted
+//so every page keeps a few, then defragCycle calls until the fragmentation is gone
+int defragTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 1000000;
+
+    dict *d = dictCreate(&defragTestType);
+    for(uintptr_t k = 1; k <= keys; k++){
+        char *val = zmalloc(DEFRAG_TEST_VALUE);
+        memset(val, (int)(k & 0xff), DEFRAG_TEST_VALUE);
+        assert(dictAdd(d, (void *)k, val) == DICT_OK);
+    }
+    defragTestPrint("loaded");
+    for(uintptr_t k = 1; k <= keys; k++)
+        if(k % 4)
+            assert(dictDelete(d, (void *)k) == DICT_OK);
+    size_t rss_deleted = zmalloc_get_rss();
+    jemalloc_purge();
+    size_t rss_purged = zmalloc_get_rss();
+    defragTestPrint("3/4 deleted, purged");
+
+    defragger *df = defraggerCreate();
+    df->ignore_bytes = 1 << 20;
+    df->estimate_interval_us = 0;
+    assert(defraggerAddDict(df, d, NULL, defragAlloc) == 0);
+    uint64_t calls = 0, max_us = 0, period_us = 100000;
+    while(df->passes < 10){
+        uint64_t start = monotonicUs(), passes = df->passes;
+        defragCycle(df, period_us);
+        uint64_t us = monotonicUs() - start;
+        //the purge that ends a pass isn't in the budget
+        if(df->passes == passes)
+            max_us = us > max_us? us: max_us;
+        calls++;
+        if(!df->running && df->cpu_perc == 0)
+            break;
+    }
+    defragTestPrint("defragged");
+    size_t rss_defragged = zmalloc_get_rss();
+    printf("%llu passes in %llu calls, %llu moved, %llu left, %.1f ms, longest call %.1f ms at up to %d%% of %llu ms\n",
+        (unsigned long long)df->passes, (unsigned long long)calls, (unsigned long long)df->hits,
+        (unsigned long long)df->misses, df->time_us / 1e3, max_us / 1e3, df->cycle_max,
+        (unsigned long long)period_us / 1000);
+    printf("rss: %.1f MB after the deletes, %.1f MB purged, %.1f MB defragged\n", rss_deleted / 1048576.0,
+        rss_purged / 1048576.0, rss_defragged / 1048576.0);
+    //a call stays in its share of the period, give or take the last steps
+    assert(max_us < period_us * df->cycle_max / 100 + 5000);
+    assert(df->hits > 0 && rss_defragged < rss_purged);
+
+    for(uintptr_t k = 1; k <= keys; k++){
+        char *val = dictFetchValue(d, (void *)k);
+        assert((val != NULL) == (k % 4 == 0));
+        for(int i = 0; val && i < DEFRAG_TEST_VALUE; i++)
+            assert(val[i] == (char)(k & 0xff));
+    }
+
+    //a dict removed in the middle of a pass
+    dict *e = dictCreate(&defragTestType);
+    for(uintptr_t k = 1; k <= 1000; k++)
+        assert(dictAdd(e, (void *)k, zmalloc(DEFRAG_TEST_VALUE)) == DICT_OK);
+    assert(defraggerAddDict(df, e, NULL, defragAlloc) == 0);
+    defragPagesCreate(df);
+    df->running = 1;
+    df->phase = DEFRAG_PHASE_SURVEY;
+    df->cpu_perc = df->cycle_max;
+    df->current = 1;
+    df->cursor = 1;
+    defraggerRemoveDict(df, e);
+    assert(df->ndicts == 1 && df->cursor == 0);
+    while(df->running)
+        defragCycle(df, period_us);
+    dictRelease(e);
+    defraggerRelease(df);
+    dictRelease(d);
+    return 0;
+}
+#endif
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dict.h"
+
+//active defragmentation of the entries, keys and values of up to DEFRAG_MAX_DICTS dicts.
+//defragCycle is called periodically, from a cron, with the time since its last call. while the
+//fragmentation is over threshold_lower percent of the allocated memory, and more than
+//ignore_bytes, it walks the dicts with dictScanDefrag for its share of that time, between
+//cycle_min and cycle_max percent of the CPU depending on how far it got to threshold_upper.
+//a pass surveys how full the pages are, moves what sits in the sparse ones, and ends with
+//jemalloc_purge, which gives the emptied pages back
+#define DEFRAG_MAX_DICTS 16
+#define DEFRAG_DEFAULT_IGNORE_BYTES (100 << 20)
+#define DEFRAG_DEFAULT_THRESHOLD_LOWER 10//%
+#define DEFRAG_DEFAULT_THRESHOLD_UPPER 100//%
+#define DEFRAG_DEFAULT_CYCLE_MIN 1//% of the CPU
+#define DEFRAG_DEFAULT_CYCLE_MAX 25//% of the CPU
+#define DEFRAG_DEFAULT_ESTIMATE_INTERVAL_US 1000000//between two passes
+#define DEFRAG_MAX_ALLOC_SIZE (64 * 1024)//bigger ones have pages of their own, or are mmapped
+
+//a pass counts the bytes in every page, moves, then frees what it held on to
+#define DEFRAG_PHASE_SURVEY 0
+#define DEFRAG_PHASE_MOVE 1
+#define DEFRAG_PHASE_RELEASE 2
+
+typedef struct defragger{
+    int ndicts;
+    dict *dicts[DEFRAG_MAX_DICTS];
+    dictDefragAllocFunctions fns[DEFRAG_MAX_DICTS];
+
+    size_t ignore_bytes;
+    int threshold_lower;
+    int threshold_upper;
+    int cycle_min;
+    int cycle_max;
+    uint64_t estimate_interval_us;
+
+    int running;//a pass is under way
+    int phase;//DEFRAG_PHASE_*
+    int current;//dict the cursor belongs to
+    uint64_t cursor;
+    struct defragPage *pages;//open addressing, 1 << pages_bits slots
+    int pages_bits;
+    size_t npages;
+    void *stash;//allocations held until the end of the pass
+
+    size_t frag_bytes;//the last estimate
+    size_t frag_floor;//left by a pass that moved next to nothing
+    uint64_t next_estimate_us;
+    double frag_perc;
+    int cpu_perc;//the share of the current pass
+    uint64_t passes;
+    uint64_t hits;//allocations moved
+    uint64_t pass_hits;//hits and misses when the pass started
+    uint64_t pass_misses;
+    uint64_t misses;//fresh allocations that landed in an emptier page
+    uint64_t time_us;
+}defragger;
+
+defragger *defraggerCreate(void);
+void defraggerRelease(defragger *df);
+int defraggerAddDict(defragger *df, dict *d, dictDefragAllocFunction *defragKey, dictDefragAllocFunction *defragVal);
+void defraggerRemoveDict(defragger *df, dict *d);
+void defragEstimate(size_t *frag_bytes, double *frag_perc);
+uint64_t defragCycle(defragger *df, uint64_t period_us);
+
+//in defragCycle, a copy of ptr in a page at least as full as its own, NULL when ptr stays.
+//fits defragKey and defragVal for keys and values that are one allocation starting at the pointer
+void *defragAlloc(void *ptr);
+
+#ifdef REDIS_TEST
+int defragTest(int argc, char *argv[], int flags);
+#endif
@@ -4,11 +4,22 @@
 #include <string.h>
 #include <stdarg.h>
 #include <limits.h>
+#include <math.h>
+#include <time.h>
 #include <sys/time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <pthread.h>
 
 #include "dict.h"
 #include "zmalloc.h"
 #include "redisassert.h"
+#include "slab.h"
+#include "epoch.h"
+#include "workerpool.h"
+#include "monotonic.h"
 
 static dictResizeEnable dict_can_resize = DICT_RESIZE_ENABLE;
 static uint32_t dict_force_resize_ratio = 5;
@@ -18,12 +29,323 @@ typedef struct{
     dictEntry *next;
 }dictEntryNoValue;
 
+//the state of opt-in features, so a plain dict doesn't carry it. created by the first feature
+//that sets some of it, open addressing and concurrent_reads dicts get it from _dictInit
+typedef struct dictExt{
+    uint64_t ht_tombstones[2];//DELETED slots of open addressing tables
+    uint8_t ht_overflowed[2];//bounded_probe tables where a key spilled past its two groups
+    struct dictBgRehash *bgRehash;//set when a helper thread does the rehashing
+    struct slab *entrySlab;//entry allocator of entry_slab dicts, created on the first insert
+    struct dictLockFree *lockFree;//set for concurrent_reads dicts
+    struct dictStats *stats;//set while dictEnableStats is on
+    struct dictRehashing *rehashing;//set while a scheduled_rehash dict rehashes
+    struct dictBloom *bloom;//set while dictEnableBloom is on
+}dictExt;
+
+#define dictExtField(d, field) ((d)->ext? (d)->ext->field: 0)
+
+static dictExt *dictExtOf(dict *d){
+    if(!d->ext)
+        d->ext = zcalloc(sizeof(*d->ext));
+    return d->ext;
+}
+
+//with the tables cleared, the features other threads know of are off by then
+static void dictExtRelease(dict *d){
+    if(!d->ext)
+        return;
+    if(d->ext->entrySlab)
+        slabRelease(d->ext->entrySlab);
+    zfree(d->ext->stats);
+    zfree(d->ext);
+    d->ext = NULL;
+}
+
 static int _dictExpandIfNeeded(dict *d);
 static int8_t _dictNextExp(uint64_t size);
 static int _dictInit(dict *d, dictType *type);
 static dictEntry *dictGetNext(const dictEntry *de);
 static dictEntry **dictGetNextRef(dictEntry *de);
 static void dictSetNext(dictEntry *de, dictEntry *next);
+static void *_dictFindPositionForInsertWithHash(dict *d, const void *key, uint64_t hash, dictEntry **existing);
+static dictEntry *_dictInsertAtPositionWithHash(dict *d, void *key, void *position, uint64_t hash, int dupkey);
+static void dictBgRehashNotify(dict *d);
+static void dictRehashingStarted(dict *d);
+static void dictRehashingStopped(dict *d);
+static int dictLazyFreeAllowed(dict *d);
+static void dictReleaseLazily(dict *d);
+static void dictEmptyLazily(dict *d);
+static dictEntry *dictFindLockFree(dict *d, const void *key, uint64_t h);
+static void dictIteratorStart(dictIterator *iter);
+static int dictTypeExpandAllowed(dict *d);
+static uint64_t rev(uint64_t v);
+unsigned long long dictFingerprint(dict *d);
+
+static int dictOaExpand(dict *d, uint64_t size, int *malloc_failed);
+static int dictOaRehash(dict *d, int n);
+static dictEntry *dictOaFind(dict *d, const void *key, uint64_t hash);
+static size_t dictOaFindBatch(dict *d, const void **keys, size_t n, dictEntry **out);
+static void *dictOaFindPositionWithHash(dict *d, const void *key, uint64_t hash, dictEntry **existing);
+static dictEntry *dictOaAddRawWithHash(dict *d, void *key, uint64_t hash, dictEntry **existing);
+static dictEntry *dictOaInsertAtPosition(dict *d, void *key, void *position, uint64_t hash);
+static dictEntry *dictOaGenericDelete(dict *d, const void *key, int nofree);
+static dictEntry *dictOaTwoPhaseUnlinkFind(dict *d, const void *key, uint64_t hash, dictEntry ***plink, int *table_index);
+static void dictOaTwoPhaseUnlinkFree(dict *d, dictEntry *he, int table_index);
+static void dictOaClear(dict *d, int htidx, void(callback)(dict *));
+static dictEntry *dictOaNext(dictIterator *iter);
+static dictEntry *dictOaGetRandomKey(dict *d);
+static uint32_t dictOaGetSomeKeys(dict *d, dictEntry **des, uint32_t count);
+static uint64_t dictOaScan(dict *d, uint64_t v, dictScanFunction *fn, dictDefragAllocFunctions *defragfns, void *privdata);
+static dictEntry *dictOaFindEntryByPtrAndHash(dict *d, const void *oldptr, uint64_t hash);
+static size_t dictOaMemUsage(const dict *d);
+static size_t dictOaTableBytes(int8_t exp);
+static size_t dictOaGetStatsHt(char *buf, size_t bufSize, size_t l, dict *d, int table);
+static inline uint64_t oaSlots(int8_t exp);
+static void oaGrowTarget(dict *d);
+
+static inline int dictIsOpenAddressing(const dict *d){
+    return d->type->open_addressing;
+}
+
+struct dictBgRehash{
+    pthread_mutex_t lock;//recursive, held by the helper thread while it migrates a batch
+    dict *d;
+    struct dictBgRehash *prev, *next;
+    int pending, busy;
+    uint64_t moved;//buckets the helper migrated in the current rehash
+    uint64_t total_moved;
+    long long start_us, last_us, work_us;
+};
+
+//state of concurrent_reads dicts, see the lock free reads section
+struct dictLockFree{
+    uint64_t seq;//odd while the writer moves buckets or swaps tables
+    epochLimbo limbo;//entries, values and tables unlinked by the writer
+};
+
+//counters of dicts with dictEnableStats on, guarded like the tables
+struct dictStats{
+    uint64_t lookups;
+    uint64_t key_compares;
+    uint64_t key_compare_misses;//keyCompare calls that returned false
+    uint64_t rehash_calls;
+    uint64_t rehash_ns;
+    uint64_t expand_calls;
+    uint64_t expand_ns;
+};
+
+static inline void dictStatLookup(dict *d){
+    if(dictExtField(d, stats))
+        d->ext->stats->lookups++;
+}
+
+//the caller already checked key == other
+static inline int dictCompareKeys(dict *d, const void *key, const void *other){
+    int equal = d->type->keyCompare? d->type->keyCompare(d, key, other): key == other;
+    if(dictExtField(d, stats)){
+        d->ext->stats->key_compares++;
+        d->ext->stats->key_compare_misses += !equal;
+    }
+    return equal;
+}
+
+static inline void dictHashKeys(dict *d, const void **keys, size_t n, uint64_t *hashes){
+    if(d->type->hashFunctionBatch){
+        d->type->hashFunctionBatch(keys, n, hashes);
+        return;
+    }
+    for(size_t i = 0; i < n; i++)
+        hashes[i] = d->type->hashFunction(keys[i]);
+}
+
+/* ----------------------------- negative lookup filter -----------------------------
+ * dictEnableBloom puts a counting Bloom filter in front of a chained dict, so most lookups of
+ * keys that aren't there stop before the buckets, and before the second table while the dict
+ * rehashes. The filter is blocked: the counters of a key all sit in one 64 byte block, a check
+ * costs a single cache miss. Counters are 4 bits, one that saturates at 15 is never
+ * decremented again, it only costs false positives. A filter has DICT_BLOOM_BUCKET_COUNTERS
+ * counters per bucket of the table it was sized for. A hit pays for the extra line, the bucket
+ * is prefetched alongside it, so it only pays off for dicts where most lookups miss.
+ * When a rehash starts a second filter is sized for the new table. Inserts go to both, the
+ * rehash steps add the entries they move, and lookups keep checking the first one, which
+ * still covers every key. When the rehash is done the second filter takes over, saturated
+ * counters and all. Inserts don't check the filter, they touch the bucket anyway. */
+
+#define DICT_BLOOM_BLOCK 64
+#define DICT_BLOOM_BLOCK_COUNTERS (DICT_BLOOM_BLOCK * 2)
+#define DICT_BLOOM_BUCKET_COUNTERS 8
+#define DICT_BLOOM_K 5
+#define DICT_BLOOM_COUNTER_MAX 15
+
+typedef struct{
+    uint8_t *counters;
+    uint64_t blocks;//a power of two
+}dictBloomFilter;
+
+struct dictBloom{
+    dictBloomFilter f[2];//f[1] is built while the dict rehashes
+    uint64_t checks;
+    uint64_t negatives;//checks that kept a lookup off the buckets
+    uint64_t false_positives;//checks that passed for keys that weren't there
+};
+
+static size_t dictBloomBytes(const dictBloomFilter *f){
+    return f->blocks * DICT_BLOOM_BLOCK;
+}
+
+static void dictBloomAlloc(dictBloomFilter *f, int8_t exp){
+    f->blocks = DICTHT_SIZE(exp) * DICT_BLOOM_BUCKET_COUNTERS / DICT_BLOOM_BLOCK_COUNTERS;
+    if(f->blocks == 0)
+        f->blocks = 1;
+    size_t bytes = dictBloomBytes(f);
+    if(bytes >= ZMALLOC_HUGE_THRESHOLD){
+        f->counters = zcalloc_huge(bytes);
+    }else{
+        f->counters = zmalloc_aligned(DICT_BLOOM_BLOCK, bytes);
+        memset(f->counters, 0, bytes);
+    }
+}
+
+static void dictBloomFree(dictBloomFilter *f){
+    if(!f->counters)
+        return;
+    size_t bytes = dictBloomBytes(f);
+    if(bytes >= ZMALLOC_HUGE_THRESHOLD)
+        zfree_huge(f->counters, bytes);
+    else
+        zfree(f->counters);
+    f->counters = NULL;
+    f->blocks = 0;
+}
+
+//the block and the K counters of a hash, remixed so they don't follow the bucket index bits
+static inline uint8_t *dictBloomCounters(const dictBloomFilter *f, uint64_t hash, unsigned *idx){
+    uint64_t h = hash * 0x9e3779b97f4a7c15ULL;
+    uint8_t *block = f->counters + ((h >> 32) & (f->blocks - 1)) * DICT_BLOOM_BLOCK;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+    for(int i = 0; i < DICT_BLOOM_K; i++)
+        idx[i] = (h >> (i * 7)) & (DICT_BLOOM_BLOCK_COUNTERS - 1);
+    return block;
+}
+
+static inline unsigned dictBloomCounter(const uint8_t *block, unsigned i){
+    return (block[i >> 1] >> ((i & 1) * 4)) & 15;
+}
+
+static void dictBloomAdd(dictBloomFilter *f, uint64_t hash){
+    unsigned idx[DICT_BLOOM_K];
+    uint8_t *block = dictBloomCounters(f, hash, idx);
+    for(int i = 0; i < DICT_BLOOM_K; i++){
+        if(dictBloomCounter(block, idx[i]) < DICT_BLOOM_COUNTER_MAX)
+            block[idx[i] >> 1] += 1 << ((idx[i] & 1) * 4);
+    }
+}
+
+static void dictBloomRemove(dictBloomFilter *f, uint64_t hash){
+    unsigned idx[DICT_BLOOM_K];
+    uint8_t *block = dictBloomCounters(f, hash, idx);
+    for(int i = 0; i < DICT_BLOOM_K; i++){
+        unsigned c = dictBloomCounter(block, idx[i]);
+        if(c > 0 && c < DICT_BLOOM_COUNTER_MAX)
+            block[idx[i] >> 1] -= 1 << ((idx[i] & 1) * 4);
+    }
+}
+
+static inline int dictBloomMayContain(const dictBloomFilter *f, uint64_t hash){
+    unsigned idx[DICT_BLOOM_K];
+    const uint8_t *block = dictBloomCounters(f, hash, idx);
+    for(int i = 0; i < DICT_BLOOM_K; i++){
+        if(!dictBloomCounter(block, idx[i]))
+            return 0;
+    }
+    return 1;
+}
+
+//1 when the key of hash is surely not in d
+static inline int dictBloomSkip(dict *d, uint64_t hash){
+    if(!dictExtField(d, bloom))
+        return 0;
+    d->ext->bloom->checks++;
+    if(dictBloomMayContain(&d->ext->bloom->f[0], hash))
+        return 0;
+    d->ext->bloom->negatives++;
+    return 1;
+}
+
+//a lookup the filter let through found nothing
+static inline void dictBloomMissed(dict *d){
+    if(dictExtField(d, bloom))
+        d->ext->bloom->false_positives++;
+}
+
+static inline void dictBloomInsert(dict *d, uint64_t hash){
+    if(!dictExtField(d, bloom))
+        return;
+    dictBloomAdd(&d->ext->bloom->f[0], hash);
+    if(d->ext->bloom->f[1].counters)
+        dictBloomAdd(&d->ext->bloom->f[1], hash);
+}
+
+//only entries of table 1 are in the filter of the new table
+static inline void dictBloomDelete(dict *d, uint64_t hash, int table){
+    if(!dictExtField(d, bloom))
+        return;
+    dictBloomRemove(&d->ext->bloom->f[0], hash);
+    if(table == 1 && d->ext->bloom->f[1].counters)
+        dictBloomRemove(&d->ext->bloom->f[1], hash);
+}
+
+static void dictBloomRehashStarted(dict *d){
+    if(!dictExtField(d, bloom))
+        return;
+    dictBloomFree(&d->ext->bloom->f[1]);
+    dictBloomAlloc(&d->ext->bloom->f[1], d->ht_size_exp[1]);
+}
+
+static void dictBloomRehashDone(dict *d){
+    if(!dictExtField(d, bloom))
+        return;
+    dictBloomFree(&d->ext->bloom->f[0]);
+    d->ext->bloom->f[0] = d->ext->bloom->f[1];
+    d->ext->bloom->f[1].counters = NULL;
+    d->ext->bloom->f[1].blocks = 0;
+}
+
+//an empty filter sized for table 0
+static void dictBloomReset(dict *d){
+    if(!dictExtField(d, bloom))
+        return;
+    dictBloomFree(&d->ext->bloom->f[0]);
+    dictBloomFree(&d->ext->bloom->f[1]);
+    dictBloomAlloc(&d->ext->bloom->f[0], d->ht_size_exp[0]);
+}
+
+static void dictBloomRelease(dict *d){
+    if(!dictExtField(d, bloom))
+        return;
+    dictBloomFree(&d->ext->bloom->f[0]);
+    dictBloomFree(&d->ext->bloom->f[1]);
+    zfree(d->ext->bloom);
+    d->ext->bloom = NULL;
+}
+
+static inline uint64_t dictStatsNs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void dictBgLock(dict *d){
+    if(dictExtField(d, bgRehash))
+        pthread_mutex_lock(&d->ext->bgRehash->lock);
+}
+
+static inline void dictBgUnlock(dict *d){
+    if(dictExtField(d, bgRehash))
+        pthread_mutex_unlock(&d->ext->bgRehash->lock);
+}
 
 static uint8_t dict_hash_function_seed[16];
 
@@ -37,6 +359,9 @@ uint8_t *dictGetHashFunctionSeed(void){
 
 uint64_t siphash(const uint8_t *in, const size_t inlin, const uint8_t *k);
 uint64_t siphash_nocase(const uint8_t *in, const size_t inlen, const uint8_t *k);
+void siphash_batch(const uint8_t *const *in, const size_t *inlen, size_t n, const uint8_t *k, uint64_t *out);
+uint64_t fasthash(const uint8_t *in, const size_t inlen, const uint8_t *k);
+uint64_t fasthash_nocase(const uint8_t *in, const size_t inlen, const uint8_t *k);
 
 uint64_t dictGenHashFunction(const void *key, size_t len){
     return siphash(key, len, dict_hash_function_seed);
@@ -46,10 +371,45 @@ uint64_t dictGenCaseHashFunction(const uint8_t *buf, size_t len){
     return siphash_nocase(buf, len, dict_hash_function_seed);
 }
 
+//hashes[i] = dictGenHashFunction(keys[i], lens[i]), several keys per siphash run in SIMD lanes
+void dictGenHashFunctionBatch(const void **keys, const size_t *lens, size_t n, uint64_t *hashes){
+    siphash_batch((const uint8_t *const *)keys, lens, n, dict_hash_function_seed, hashes);
+}
+
+//several times faster than siphash on short keys but not made to withstand hash flooding
+//by clients that can learn about hash values, e.g. through SCAN order. a dictType picks it
+//in its hashFunction for keys no attacker chooses, the seed is the same
+uint64_t dictGenFastHashFunction(const void *key, size_t len){
+    return fasthash(key, len, dict_hash_function_seed);
+}
+
+uint64_t dictGenFastCaseHashFunction(const uint8_t *buf, size_t len){
+    return fasthash_nocase(buf, len, dict_hash_function_seed);
+}
+
 #define ENTRY_PTR_MASK 7
 #define ENTRY_PTR_NORMAL 0
 #define ENTRY_PTR_NO_VALUE 2
 
+//entries keep the hash bits [exp, exp + 12) of the table they are linked in, and how many of
+//them are still valid, in the unused top 16 bits of their next pointer. lookups then call
+//keyCompare only on a tag match, and rehashing takes the new bucket index from the tag
+//instead of hashing the key again. only where user space pointers are known to fit in 48 bits
+#if UINTPTR_MAX == UINT64_MAX && defined(__x86_64__)
+#define DICT_ENTRY_TAGS 1
+#define ENTRY_TAG_SHIFT 48
+#define ENTRY_TAG_PTR_MASK (((uintptr_t)1 << ENTRY_TAG_SHIFT) - 1)
+#else
+#define DICT_ENTRY_TAGS 0
+#define ENTRY_TAG_SHIFT 0
+#define ENTRY_TAG_PTR_MASK (~(uintptr_t)0)
+#endif
+#define ENTRY_TAG_BITS 12
+#define ENTRY_TAG_HASH_MASK ((1u << ENTRY_TAG_BITS) - 1)
+//set in the next field of an entry whose key lives in the entry allocation, entries are
+//8 byte aligned so the bit is free unless the field holds an odd key
+#define ENTRY_LINK_EMBEDDED_KEY 4
+
 static inline int entryIsKey(const dictEntry *de){
     return (uintptr_t)(void *)de & 1;
 }
@@ -62,8 +422,58 @@ static inline int entryIsNoValue(const dictEntry *de){
     return ((uintptr_t)(void *)de & ENTRY_PTR_MASK) == ENTRY_PTR_NO_VALUE;
 }
 
-static inline dictEntry *createEntryNoValue(void *key, dictEntry *next){
-    dictEntryNoValue *entry = zmalloc(sizeof(*entry));
+static inline int dictKeysEmbedded(const dict *d){
+    return d->type->keyEmbedSize && !dictIsOpenAddressing(d);
+}
+
+//entries of entry_slab dicts come from a slab owned by the dict, created on the first insert
+static void *dictAllocEntryMem(dict *d, size_t size){
+    if(d->type->entry_slab && !dictIsOpenAddressing(d) && !dictKeysEmbedded(d)){
+        if(!dictExtField(d, entrySlab))
+            dictExtOf(d)->entrySlab = slabCreate(size);
+        assert(d->ext->entrySlab->objsize >= size);
+        return slabAlloc(d->ext->entrySlab);
+    }
+    return zmalloc(size);
+}
+
+static void dictFreeEntryMemNow(dict *d, void *ptr){
+    if(dictExtField(d, entrySlab))
+        slabFree(d->ext->entrySlab, ptr);
+    else
+        zfree(ptr);
+}
+
+static void dictReclaimEntryMem(void *ptr, void *privdata){
+    dictFreeEntryMemNow(privdata, ptr);
+}
+
+//readers of concurrent_reads dicts may still walk an unlinked entry, it is freed after them
+static void dictFreeEntryMem(dict *d, void *ptr){
+    if(dictExtField(d, lockFree))
+        epochRetire(&d->ext->lockFree->limbo, ptr, dictReclaimEntryMem, d);
+    else
+        dictFreeEntryMemNow(d, ptr);
+}
+
+//big bucket arrays are backed by huge pages, fewer TLB misses for random lookups
+static size_t dictTableBytes(int8_t exp){
+    return DICTHT_SIZE(exp) * sizeof(dictEntry *);
+}
+
+static void dictReclaimTable(void *ptr, void *privdata){
+    zfree_huge(ptr, (size_t)(uintptr_t)privdata);
+}
+
+static void dictFreeTable(dict *d, dictEntry **table, int8_t exp){
+    if(dictExtField(d, lockFree) && table)
+        epochRetire(&d->ext->lockFree->limbo, table, dictReclaimTable, (void *)(uintptr_t)dictTableBytes(exp));
+    else
+        zfree_huge(table, dictTableBytes(exp));
+}
+
+static inline dictEntry *createEntryNoValue(dict *d, void *key, dictEntry *next){
+    dictEntryNoValue *entry = dictAllocEntryMem(d, sizeof(*entry));
     entry->key = key;
     entry->next = next;
     return (dictEntry *)(void *)((uintptr_t)(void *)entry | ENTRY_PTR_NO_VALUE);
@@ -87,10 +497,147 @@ static inline int entryHasValue(const dictEntry *de){
     return entryIsNormal(de);
 }
 
+//a link is a bucket slot or the next field of an entry, the top bits and ENTRY_LINK_EMBEDDED_KEY
+//of a next field describe the entry owning it, so links are only read and written through these two
+static inline uintptr_t dictLinkOwnerBits(uintptr_t link){
+    uintptr_t bits = link & ~ENTRY_TAG_PTR_MASK;
+    if(!(link & 1))
+        bits |= link & ENTRY_LINK_EMBEDDED_KEY;
+    return bits;
+}
+
+static inline dictEntry *dictLinkGet(dictEntry *const *link){
+    uintptr_t v = (uintptr_t)(void *)*link;
+    return (dictEntry *)(void *)(v & ~dictLinkOwnerBits(v));
+}
+
+//every store to a link a reader may walk is a single release store, so lock free readers of
+//concurrent_reads dicts see either the old or the new link and the entry it points to in full
+static inline void dictLinkStore(dictEntry **link, uintptr_t v){
+    __atomic_store_n(link, (dictEntry *)(void *)v, __ATOMIC_RELEASE);
+}
+
+static inline void dictLinkSet(dictEntry **link, dictEntry *de){
+    dictLinkStore(link, dictLinkOwnerBits((uintptr_t)(void *)*link) | (uintptr_t)(void *)de);
+}
+
+static dictEntry *dictGetNext(const dictEntry *de){
+    if(entryIsKey(de))
+        return NULL;
+    if(entryIsNoValue(de))
+        return dictLinkGet(&decodeEntryNoValue(de)->next);
+    return dictLinkGet(&de->next);
+}
+
+static dictEntry **dictGetNextRef(dictEntry *de){
+    if(entryIsKey(de))
+        return NULL;
+    if(entryIsNoValue(de))
+        return &decodeEntryNoValue(de)->next;
+    return &de->next;
+}
+
+static void dictSetNext(dictEntry *de, dictEntry *next){
+    assert(!entryIsKey(de));
+    dictLinkSet(dictGetNextRef(de), next);
+}
+
+static inline int entryHasEmbeddedKey(const dictEntry *de){
+    if(entryIsKey(de))
+        return 0;
+    dictEntry *const *link = entryIsNoValue(de)? &decodeEntryNoValue(de)->next: &de->next;
+    return ((uintptr_t)(void *)*link & (ENTRY_LINK_EMBEDDED_KEY | 1)) == ENTRY_LINK_EMBEDDED_KEY;
+}
+
+static inline void entrySetEmbeddedKey(dictEntry *de, int embedded){
+    dictEntry **link = dictGetNextRef(de);
+    uintptr_t v = (uintptr_t)(void *)*link & ~(uintptr_t)ENTRY_LINK_EMBEDDED_KEY;
+    dictLinkStore(link, embedded? v | ENTRY_LINK_EMBEDDED_KEY: v);
+}
+
+//embedded keys are freed with their entry
+static inline void dictFreeEntryKey(dict *d, dictEntry *de){
+    if(d->type->keyDestructor && !entryHasEmbeddedKey(de))
+        d->type->keyDestructor(d, dictGetKey(de));
+}
+
+static inline uint16_t dictGetTag(const dictEntry *de){
+    if(!DICT_ENTRY_TAGS || entryIsKey(de))
+        return 0;
+    dictEntry *const *link = entryIsNoValue(de)? &decodeEntryNoValue(de)->next: &de->next;
+    return (uint16_t)((uintptr_t)(void *)*link >> ENTRY_TAG_SHIFT);
+}
+
+static inline void dictSetTag(dictEntry *de, uint16_t tag){
+    if(!DICT_ENTRY_TAGS || entryIsKey(de))
+        return;
+    dictEntry **link = dictGetNextRef(de);
+    dictLinkStore(link, ((uintptr_t)(void *)*link & ENTRY_TAG_PTR_MASK) | ((uintptr_t)tag << ENTRY_TAG_SHIFT));
+}
+
+//the tag of an entry linked in a table of size 2^exp
+static inline uint16_t entryTagMake(uint64_t h, int8_t exp){
+    return (uint16_t)(ENTRY_TAG_BITS << ENTRY_TAG_BITS | ((h >> exp) & ENTRY_TAG_HASH_MASK));
+}
+
+static inline int entryTagValid(uint16_t tag){
+    return tag >> ENTRY_TAG_BITS;
+}
+
+//false only when the entry surely has a different hash, keyCompare is needed otherwise
+static inline int entryTagMatch(uint16_t tag, uint64_t h, int8_t exp){
+    uint64_t mask = ((uint64_t)1 << entryTagValid(tag)) - 1;
+    return ((tag ^ (h >> exp)) & mask) == 0;
+}
+
+static inline int dictEntryTagMatch(const dictEntry *de, uint64_t h, int8_t exp){
+    return entryTagMatch(dictGetTag(de), h, exp);
+}
+
+//the tag after moving from a table of size 2^exp0 to 2^exp1, the moved entry sat in bucket idx0.
+//growing consumes the low tag bits, shrinking takes the bits dropped from the index
+static inline uint16_t entryTagRebase(uint16_t tag, uint64_t idx0, int8_t exp0, int8_t exp1){
+    uint64_t bits = tag & ENTRY_TAG_HASH_MASK;
+    int valid = entryTagValid(tag);
+    if(exp1 >= exp0){
+        int grow = exp1 - exp0;
+        if(grow >= valid)
+            return 0;
+        return (uint16_t)((valid - grow) << ENTRY_TAG_BITS | (bits >> grow));
+    }
+    int shrink = exp0 - exp1;
+    bits = (idx0 >> exp1) & (((uint64_t)1 << shrink) - 1);
+    if(shrink < ENTRY_TAG_BITS)
+        bits |= (uint64_t)(tag & ENTRY_TAG_HASH_MASK) << shrink;
+    valid = valid + shrink > ENTRY_TAG_BITS? ENTRY_TAG_BITS: valid + shrink;
+    return (uint16_t)(valid << ENTRY_TAG_BITS | (bits & ENTRY_TAG_HASH_MASK));
+}
+
+//lock free readers load the table and its exponent, in between dictSeqBegin and dictSeqEnd
+static inline void dictSetTable(dict *d, int htidx, dictEntry **table, int8_t exp){
+    __atomic_store_n(&d->ht_table[htidx], table, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->ht_size_exp[htidx], exp, __ATOMIC_RELAXED);
+}
+
+static inline void dictSeqBegin(dict *d){
+    if(!dictExtField(d, lockFree))
+        return;
+    __atomic_store_n(&d->ext->lockFree->seq, d->ext->lockFree->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void dictSeqEnd(dict *d){
+    if(dictExtField(d, lockFree))
+        __atomic_store_n(&d->ext->lockFree->seq, d->ext->lockFree->seq + 1, __ATOMIC_RELEASE);
+}
+
 static void _dictReset(dict *d, int htidx){
-    d->ht_table[htidx] = NULL;
-    d->ht_size_exp[htidx] = -1;
+    dictSetTable(d, htidx, NULL, -1);
     d->ht_used[htidx] = 0;
+    if(d->ext){
+        d->ext->ht_tombstones[htidx] = 0;
+        d->ext->ht_overflowed[htidx] = 0;
+    }
 }
 
 dict *dictCreate(dictType *type){
@@ -104,15 +651,23 @@ dict *dictCreate(dictType *type){
 }
 
 int _dictInit(dict *d, dictType *type){
+    d->ext = NULL;
     _dictReset(d, 0);
     _dictReset(d, 1);
     d->type = type;
     d->reHashIdx = -1;
     d->pauseRehash = 0;
+    assert(!type->bounded_probe || type->open_addressing);
+    if(type->open_addressing)
+        dictExtOf(d);
+    if(type->concurrent_reads){
+        assert(!type->open_addressing);
+        dictExtOf(d)->lockFree = zcalloc(sizeof(struct dictLockFree));
+    }
     return DICT_OK;
 }
 
-int dictResize(dict *d){
+static int _dictResize(dict *d){
     if(dict_can_resize != DICT_RESIZE_ENABLE || d->reHashIdx != -1)
         return DICT_ERR;
     uint64_t minimal = d->ht_used[0];
@@ -121,7 +676,9 @@ int dictResize(dict *d){
     return dictExpand(d, minimal);
 }
 
-int _dictExpand(dict *d, uint64_t size, int *malloc_failed){
+static int dictExpandTables(dict *d, uint64_t size, int *malloc_failed){
+    if(dictIsOpenAddressing(d))
+        return dictOaExpand(d, size, malloc_failed);
     if(malloc_failed)
         *malloc_failed = 0;
     if(d->reHashIdx != -1 || d->ht_used[0] > size)
@@ -137,50 +694,73 @@ int _dictExpand(dict *d, uint64_t size, int *malloc_failed){
 
     dictEntry **new_ht_table;
     if(malloc_failed){
-        new_ht_table = ztrycalloc(newsize * sizeof(dictEntry *));
+        new_ht_table = ztrycalloc_huge(dictTableBytes(new_ht_size_exp));
         *malloc_failed = new_ht_table == NULL;
         if(*malloc_failed)
             return DICT_ERR;
     }else{
-        new_ht_table = zcalloc(newsize * sizeof(dictEntry *));
+        new_ht_table = zcalloc_huge(dictTableBytes(new_ht_size_exp));
     }
 
     uint64_t new_ht_used = 0;
     if(d->ht_table[0] == NULL){
-        d->ht_size_exp[0] == new_ht_size_exp;
+        dictSeqBegin(d);
+        dictSetTable(d, 0, new_ht_table, new_ht_size_exp);
+        dictSeqEnd(d);
         d->ht_used[0] = new_ht_used;
-        d->ht_table[0] = new_ht_table;
+        dictBloomReset(d);
         return DICT_OK;
     }
 
-    d->ht_size_exp[1] = new_ht_size_exp;
+    dictSeqBegin(d);
+    dictSetTable(d, 1, new_ht_table, new_ht_size_exp);
+    dictSeqEnd(d);
     d->ht_used[1] = new_ht_used;
-    d->ht_table[1] = new_ht_table;
     d->reHashIdx = 0;
+    dictRehashingStarted(d);
+    dictBloomRehashStarted(d);
+    if(dictExtField(d, bgRehash))
+        dictBgRehashNotify(d);
     return DICT_OK;
 }
 
+int _dictExpand(dict *d, uint64_t size, int *malloc_failed){
+    if(!dictExtField(d, stats))
+        return dictExpandTables(d, size, malloc_failed);
+    uint64_t start = dictStatsNs();
+    int ret = dictExpandTables(d, size, malloc_failed);
+    d->ext->stats->expand_ns += dictStatsNs() - start;
+    d->ext->stats->expand_calls++;
+    return ret;
+}
+
 int dictExpand(dict *d, uint64_t size){
-    return _dictExpand(d, size, NULL);
+    dictBgLock(d);
+    int ret = _dictExpand(d, size, NULL);
+    dictBgUnlock(d);
+    return ret;
 }
 
 int dictTryExpand(dict *d, uint64_t size){
     int malloc_failed;
+    dictBgLock(d);
     _dictExpand(d, size, &malloc_failed);
+    dictBgUnlock(d);
     return malloc_failed? DICT_ERR: DICT_OK;
 }
 
-int dictRehash(dict *d, int n){
+static int dictRehashBuckets(dict *d, int n){
     int empty_visits = n * 10;
     uint64_t s0 = d->ht_size_exp[0] == -1? 0: (uint64_t)1 << (d->ht_size_exp[0]);
     uint64_t s1 = d->ht_size_exp[1] == -1? 0: (uint64_t)1 << (d->ht_size_exp[1]);
-    if(dict_can_resize == DICT_RESIZE_FORBID || !d->reHashIdx != -1)
+    if(dict_can_resize == DICT_RESIZE_FORBID || d->reHashIdx == -1)
         return 0;
     if(dict_can_resize == DICT_RESIZE_AVOID && ((s1 > s0 && s1 / s0 < dict_force_resize_ratio) ||
     (s1 < s0 && s0 / s1 < dict_force_resize_ratio))){
         return 0;
     }
 
+    int8_t exp0 = d->ht_size_exp[0], exp1 = d->ht_size_exp[1];
     while(n-- && d->ht_used[0] != 0){
         dictEntry *de, *nextde;
 
@@ -196,19 +776,32 @@ int dictRehash(dict *d, int n){
 
             nextde = dictGetNext(de);
             void *key = dictGetKey(de);
-            if(d->ht_size_exp[1] > d->ht_size_exp[0]){
-                h = (d->type->hashFunction(key)) & (d->ht_size_exp[1] == -1? 0: (d->ht_size_exp[1] == -1? 0: ((uint64_t)1 << d->ht_size_exp[1])) - 1);
+            uint16_t tag = dictGetTag(de);
+            //the filter of the new table needs the hash of every entry moved
+            uint64_t hash = dictExtField(d, bloom)? d->type->hashFunction(key): 0;
+            if(dictExtField(d, bloom))
+                dictBloomAdd(&d->ext->bloom->f[1], hash);
+            if(exp1 > exp0 && entryTagValid(tag) < exp1 - exp0){
+                if(!dictExtField(d, bloom))
+                    hash = d->type->hashFunction(key);
+                h = hash & DICTHT_SIZE_MASK(exp1);
+                tag = entryTagMake(hash, exp1);
+            }else if(exp1 > exp0){
+                //the bits added to the index are the low bits of the tag
+                h = d->reHashIdx | (tag & DICTHT_SIZE_MASK(exp1 - exp0)) << exp0;
+                tag = entryTagRebase(tag, d->reHashIdx, exp0, exp1);
             }else{
-                h = d->reHashIdx & (d->ht_size_exp[1] == -1? 0: (d->ht_size_exp[1] == -1? 0: ((uint64_t)1 << d->ht_size_exp[1])) - 1);
+                h = d->reHashIdx & DICTHT_SIZE_MASK(exp1);
+                tag = entryTagRebase(tag, d->reHashIdx, exp0, exp1);
             }
             if(d->type->no_value){
                 if(d->type->key_are_odd && !d->ht_table[1][h]){
                     assert(entryIsKey(key));
                     if(!entryIsKey(de))
-                        zfree(decodeMaskedPtr(de));
+                        dictFreeEntryMem(d, decodeMaskedPtr(de));
                     de = key;
                 }else if(entryIsKey(de)){
-                    de = createEntryNoValue(key, d->ht_table[1][h]);
+                    de = createEntryNoValue(d, key, d->ht_table[1][h]);
                 }else{
                     assert(entryIsNoValue(de));
                     dictSetNext(de, d->ht_table[1][h]);
@@ -216,50 +809,169 @@ int dictRehash(dict *d, int n){
             }else{
                 dictSetNext(de, d->ht_table[1][h]);
             }
-            d->ht_table[1][h] = de;
+            dictSetTag(de, tag);
+            dictLinkStore(&d->ht_table[1][h], (uintptr_t)(void *)de);
             d->ht_used[0]--;
             d->ht_used[1]++;
             de = nextde;
         }
-        d->ht_table[0][d->reHashIdx] = NULL;
+        dictLinkStore(&d->ht_table[0][d->reHashIdx], 0);
         d->reHashIdx++;
     }
 
     if(d->ht_used[0] == 0){
-        zfree(d->ht_table[0]);
-        d->ht_table[0] = d->ht_table[1];
+        dictFreeTable(d, d->ht_table[0], d->ht_size_exp[0]);
+        dictSetTable(d, 0, d->ht_table[1], d->ht_size_exp[1]);
         d->ht_used[0] = d->ht_used[1];
-        d->ht_size_exp[0] = d->ht_size_exp[1];
         _dictReset(d, 1);
         d->reHashIdx = -1;
+        dictRehashingStopped(d);
+        dictBloomRehashDone(d);
         return 0;
     }
     return 1;
 }
 
-long long timeInMilliseconds(void){
+static int dictRehashTables(dict *d, int n){
+    if(dictIsOpenAddressing(d))
+        return dictOaRehash(d, n);
+    if(!dictExtField(d, lockFree))
+        return dictRehashBuckets(d, n);
+    //a lookup that raced with the moved buckets or the table swap retries
+    dictSeqBegin(d);
+    int more = dictRehashBuckets(d, n);
+    dictSeqEnd(d);
+    return more;
+}
+
+static int _dictRehash(dict *d, int n){
+    if(!dictExtField(d, stats))
+        return dictRehashTables(d, n);
+    uint64_t start = dictStatsNs();
+    int more = dictRehashTables(d, n);
+    d->ext->stats->rehash_ns += dictStatsNs() - start;
+    d->ext->stats->rehash_calls++;
+    return more;
+}
+
+long long timeInMicroseconds(void){
     struct timeval tv;
     gettimeofday(&tv, NULL);
-    return (((long long)tv.tv_sec) * 1000) + tv.tv_usec / 1000;
+    return (((long long)tv.tv_sec) * 1000000) + tv.tv_usec;
+}
+
+/* ----------------------------- rehash budget -----------------------------
+ * dictRehashMicroseconds runs dictRehash in batches of at most DICT_REHASH_MAX_BATCH steps and
+ * reads the clock after each one. A step may walk over ten empty buckets before it moves one,
+ * so the cost kept is per bucket visited, and a batch is only as long as its worst case of
+ * eleven visits a step fits in the time left. The cost is a moving average per table layout,
+ * shared by all dicts. scheduled_rehash dicts are on a global list while they rehash,
+ * dictRehashCron gives each an equal share of what is left of one budget, starting every call
+ * where the last one stopped. */
+
+#define DICT_REHASH_MAX_BATCH 100
+#define DICT_REHASH_VISITS_PER_STEP 11//the bucket moved and up to ten empty ones
+
+typedef struct dictRehashing{
+    dict *d;
+    struct dictRehashing *prev, *next;
+}dictRehashing;
+
+static dictRehashing *rehashing_head, *rehashing_cursor;
+static uint64_t rehashing_count;
+static uint64_t rehash_visit_ns[2] = {20, 100};//per bucket or group, chained and open addressing, first guesses
+
+static void dictRehashingStarted(dict *d){
+    if(!d->type->scheduled_rehash || dictExtField(d, rehashing))
+        return;
+    dictRehashing *r = zmalloc(sizeof(*r));
+    r->d = d;
+    r->prev = NULL;
+    r->next = rehashing_head;
+    if(rehashing_head)
+        rehashing_head->prev = r;
+    rehashing_head = r;
+    rehashing_count++;
+    dictExtOf(d)->rehashing = r;
+}
+
+static void dictRehashingStopped(dict *d){
+    dictRehashing *r = dictExtField(d, rehashing);
+    if(!r)
+        return;
+    if(rehashing_cursor == r)
+        rehashing_cursor = r->next;
+    if(r->prev)
+        r->prev->next = r->next;
+    else
+        rehashing_head = r->next;
+    if(r->next)
+        r->next->prev = r->prev;
+    rehashing_count--;
+    d->ext->rehashing = NULL;
+    zfree(r);
+}
+
+//rehash until deadline, at least one step
+static uint64_t dictRehashUntil(dict *d, uint64_t deadline){
+    uint64_t *cost = &rehash_visit_ns[dictIsOpenAddressing(d)];
+    uint64_t steps = 0, now = monotonicNs(), visit_ns = __atomic_load_n(cost, __ATOMIC_RELAXED);
+    do{
+        uint64_t batch = (deadline > now? deadline - now: 0) / (visit_ns * DICT_REHASH_VISITS_PER_STEP);
+        batch = batch < 1? 1: batch > DICT_REHASH_MAX_BATCH? DICT_REHASH_MAX_BATCH: batch;
+        uint64_t from = d->reHashIdx, size = DICTHT_SIZE(d->ht_size_exp[0]);
+        int more = dictRehash(d, batch);
+        uint64_t end = monotonicNs();
+        //empty buckets count as much as full ones, a finished rehash went to the end of table 0
+        uint64_t to = d->reHashIdx == -1? size: (uint64_t)d->reHashIdx;
+        uint64_t visits = to > from? to - from: 0;
+        if(visits)
+            visit_ns = (visit_ns * 7 + (end - now) / visits) / 8 + 1;
+        steps += batch;
+        now = end;
+        if(!more)
+            break;
+    }while(now < deadline);
+    __atomic_store_n(cost, visit_ns, __ATOMIC_RELAXED);
+    return steps;
 }
 
 int dictRehashMilliseconds(dict *d, int ms){
-    if(d->pauseRehash > 0)
+    return dictRehashMicroseconds(d, (uint64_t)ms * 1000);
+}
+
+//returns the rehash steps done, 0 when d isn't rehashing or rehashing is paused
+int dictRehashMicroseconds(dict *d, uint64_t us){
+    if(d->pauseRehash > 0 || d->reHashIdx == -1)
         return 0;
-    long long start = timeInMilliseconds();
-    int rehashes = 0;
+    return dictRehashUntil(d, monotonicNs() + us * 1000);
+}
 
-    while(dictRehash(d, 100)){
-        rehashes += 100;
-        if(timeInMilliseconds() - start > ms)
-            break;
+//rehash the scheduled_rehash dicts for about us microseconds in all, for a server cron. dicts
+//with background rehashing or paused rehashing are skipped. returns the rehash steps done
+uint64_t dictRehashCron(uint64_t us){
+    uint64_t now = monotonicNs(), deadline = now + us * 1000, steps = 0, visits = rehashing_count;
+    if(!rehashing_cursor)
+        rehashing_cursor = rehashing_head;
+    while(visits && rehashing_cursor && now < deadline){
+        dictRehashing *r = rehashing_cursor;
+        rehashing_cursor = r->next? r->next: rehashing_head;
+        dict *d = r->d;
+        if(d->pauseRehash == 0 && !dictExtField(d, bgRehash))
+            steps += dictRehashUntil(d, now + (deadline - now) / visits);
+        visits--;
+        now = monotonicNs();
     }
-    return rehashes;
+    return steps;
+}
+
+uint64_t dictRehashingCount(void){
+    return rehashing_count;
 }
 
 static void _dictRehashStep(dict *d){
     if(d->pauseRehash == 0)
-        dictRehash(d, 1);
+        _dictRehash(d, 1);
 }
 
 void *dictMetadata(dict *d){
@@ -276,45 +988,80 @@ int dictAdd(dict *d, void *key, void *val){
     return DICT_OK;
 }
 
-dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing){
-    void *position = dictFindPositionForInsert(d, key, existing);
+static dictEntry *_dictAddRawWithHash(dict *d, void *key, uint64_t hash, dictEntry **existing){
+    if(dictIsOpenAddressing(d))
+        return dictOaAddRawWithHash(d, key, hash, existing);
+    void *position = _dictFindPositionForInsertWithHash(d, key, hash, existing);
     if(!position)
         return NULL;
-    
-    if(d->type->keyDup)
-        key = d->type->keyDup(d, key);
-    
-    return dictInsertAtPosition(d, key, position);
+    return _dictInsertAtPositionWithHash(d, key, position, hash, 1);
 }
 
-dictEntry *dictInsertAtPosition(dict *d, void *key, void *position){
+static dictEntry *_dictAddRaw(dict *d, void *key, dictEntry **existing){
+    return _dictAddRawWithHash(d, key, d->type->hashFunction(key), existing);
+}
+
+static dictEntry *_dictInsertAtPosition(dict *d, void *key, void *position){
+    //the position does not carry the hash, it is only needed for the tag and the filter
+    if(dictIsOpenAddressing(d))
+        return dictOaInsertAtPosition(d, key, position, d->type->hashFunction(key));
+    uint64_t hash = DICT_ENTRY_TAGS || dictExtField(d, bloom)? d->type->hashFunction(key): 0;
+    return _dictInsertAtPositionWithHash(d, key, position, hash, 0);
+}
+
+//dupkey: key is borrowed and goes through keyDup when the type has one, otherwise the dict owns
+//it from now on. keys that fit are copied into the entry instead, and an owned original is destructed
+static dictEntry *_dictInsertAtPositionWithHash(dict *d, void *key, void *position, uint64_t hash, int dupkey){
     dictEntry **bucket = position;
     dictEntry *entry;
 
     int htidx = d->reHashIdx != -1? 1: 0;
     assert(bucket >= &d->ht_table[htidx][0] && bucket <= &d->ht_table[htidx][d->ht_size_exp[htidx] == -1? 0: (d->ht_size_exp[htidx] == -1? 0: (uint64_t)1 << d->ht_size_exp[htidx])]);
     size_t metasize = d->type->dictEntryMetadataBYtes? d->type->dictEntryMetadataBYtes(d): 0;
+    size_t embedsize = dictKeysEmbedded(d)? d->type->keyEmbedSize(d, key): 0;
+    if(!embedsize && dupkey && d->type->keyDup)
+        key = d->type->keyDup(d, key);
     if(d->type->no_value){
         assert(!metasize);
         if(d->type->key_are_odd && !*bucket){
             entry = key;
             assert(entryIsKey(entry));
+        }else if(embedsize){
+            assert(!d->type->key_are_odd);
+            dictEntryNoValue *nv = dictAllocEntryMem(d, sizeof(*nv) + embedsize);
+            nv->key = d->type->keyEmbed(d, nv + 1, key);
+            nv->next = *bucket;
+            entry = encodeMaskedPtr(nv, ENTRY_PTR_NO_VALUE);
         }else{
-            entry = createEntryNoValue(key, *bucket);
+            entry = createEntryNoValue(d, key, *bucket);
         }
     }else{
-        entry = zmalloc(sizeof(*entry) + metasize);
+        entry = dictAllocEntryMem(d, sizeof(*entry) + metasize + embedsize);
         assert(entryIsNormal(entry));
         if(metasize > 0)
             memset(dictEntryMetadata(entry), 0, metasize);
-        entry->key = key;
+        entry->key = embedsize? d->type->keyEmbed(d, (char *)dictEntryMetadata(entry) + metasize, key): key;
+        entry->v.u64 = 0;//lock free readers may see the entry before dictAdd sets the value
         entry->next = *bucket;
     }
-    *bucket = entry;
+    if(embedsize){
+        entrySetEmbeddedKey(entry, 1);
+        //only a key borrowed for keyDup stays the caller's
+        if(!(dupkey && d->type->keyDup) && d->type->keyDestructor)
+            d->type->keyDestructor(d, key);
+    }
+    dictSetTag(entry, entryTagMake(hash, d->ht_size_exp[htidx]));
+    dictLinkStore(bucket, (uintptr_t)(void *)entry);
     d->ht_used[htidx]++;
+    dictBloomInsert(d, hash);
     return entry;
 }
 
+static void dictReclaimVal(void *ptr, void *privdata){
+    dict *d = privdata;
+    d->type->valDestructor(d, ptr);
+}
+
 int dictReplace(dict *d, void *key, void *val){
     dictEntry *entry, *existing;
 
@@ -326,8 +1073,12 @@ int dictReplace(dict *d, void *key, void *val){
 
     void *oldval = dictGetVal(existing);
     dictSetVal(d, existing, val);
-    if(d->type->valDestructor)
-        d->type->valDestructor(d, oldval);
+    if(d->type->valDestructor){
+        if(dictExtField(d, lockFree))
+            epochRetire(&d->ext->lockFree->limbo, oldval, dictReclaimVal, d);
+        else
+            d->type->valDestructor(d, oldval);
+    }
     return 0;
 }
 
@@ -342,26 +1093,34 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree){
     dictEntry *he, *prevHe;
     int table;
 
+    if(dictIsOpenAddressing(d))
+        return dictOaGenericDelete(d, key, nofree);
+
     if(d->ht_used[0] + d->ht_used[1] == 0)
         return 0;
     if(d->reHashIdx != -1)
         _dictRehashStep(d);
     h = d->type->hashFunction(key);
+    dictStatLookup(d);
+    if(dictBloomSkip(d, h))
+        return NULL;
 
     for(table = 0; table <= 1; table++){
-        idx = h & d->ht_size_exp[table] == -1? 0: ((d->ht_size_exp[table] == -1? 0: (uint64_t)1 << d->ht_size_exp[table]) - 1);
+        idx = h & DICTHT_SIZE_MASK(d->ht_size_exp[table]);
         he = d->ht_table[table][idx];
         prevHe = NULL;
         while(he){
             void *he_key = dictGetKey(he);
-            if(key == he_key || d->type->keyCompare? d->type->keyCompare(d, key, he_key): key == he_key){
+            if(key == he_key || (dictEntryTagMatch(he, h, d->ht_size_exp[table]) &&
+            dictCompareKeys(d, key, he_key))){
                 if(prevHe)
                     dictSetNext(prevHe, dictGetNext(he));
                 else
-                    d->ht_table[table][idx] = dictGetNext(he);
+                    dictLinkStore(&d->ht_table[table][idx], (uintptr_t)(void *)dictGetNext(he));
                 if(!nofree)
                     dictFreeUnlinkedEntry(d, he);
                 d->ht_used[table]--;
+                dictBloomDelete(d, h, table);
                 return he;
             }
             prevHe = he;
@@ -370,30 +1129,56 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree){
         if(d->reHashIdx == -1)
             break;
     }
+    dictBloomMissed(d);
     return NULL;
 }
 
 int dictDelete(dict *ht, const void *key){
-    return dictGenericDelete(ht, key, 0)? DICT_OK: DICT_ERR;
+    dictBgLock(ht);
+    dictEntry *he = dictGenericDelete(ht, key, 0);
+    dictBgUnlock(ht);
+    return he? DICT_OK: DICT_ERR;
 }
 
 dictEntry *dictUnlink(dict *d, const void *key){
-    return dictGenericDelete(d, key, 1);
+    dictBgLock(d);
+    dictEntry *he = dictGenericDelete(d, key, 1);
+    dictBgUnlock(d);
+    return he;
 }
 
-void dictFreeUnlinkedEntry(dict *d, dictEntry *he){
-    if(he == NULL)
-        return;
-    if(d->type->keyDestructor)
-        d->type->keyDestructor(d, dictGetKey(he));
+static void dictFreeEntryNow(dict *d, dictEntry *he){
+    dictFreeEntryKey(d, he);
     if(d->type->valDestructor)
         d->type->valDestructor(d, dictGetVal(he));
     if(!entryIsKey(he))
-        zfree(decodeMaskedPtr(he));
+        dictFreeEntryMemNow(d, decodeMaskedPtr(he));
+}
+
+static void dictReclaimEntry(void *ptr, void *privdata){
+    dictFreeEntryNow(privdata, ptr);
+}
+
+//the key and the value go with the entry, readers may still compare the key
+static void dictFreeEntry(dict *d, dictEntry *he){
+    if(dictExtField(d, lockFree))
+        epochRetire(&d->ext->lockFree->limbo, he, dictReclaimEntry, d);
+    else
+        dictFreeEntryNow(d, he);
+}
+
+void dictFreeUnlinkedEntry(dict *d, dictEntry *he){
+    if(he == NULL)
+        return;
+    dictFreeEntry(d, he);
 }
 
 int _dictClear(dict *d, int htidx, void(callback)(dict *)){
-    for (size_t i = 0; i < d->ht_size_exp[htidx] == -1? 0: ((uint64_t)1 << d->ht_size_exp[htidx]) && d->ht_used[htidx]; i++)
+    if(dictIsOpenAddressing(d)){
+        dictOaClear(d, htidx, callback);
+        return DICT_OK;
+    }
+    for (size_t i = 0; i < DICTHT_SIZE(d->ht_size_exp[htidx]) && d->ht_used[htidx]; i++)
     {
         dictEntry *he, *nextHe;
         if(callback && (i & 0xffff) == 0)
@@ -402,76 +1187,191 @@ int _dictClear(dict *d, int htidx, void(callback)(dict *)){
             continue;
         while(he){
             nextHe = dictGetNext(he);
-            if(d->type->keyDestructor)
-                d->type->keyDestructor(d, dictGetKey(he));
-            if(d->type->valDestructor)
-                d->type->valDestructor(d, dictGetVal(he));
-            if(!entryIsKey(he))
-                zfree(decodeMaskedPtr(he));
+            dictFreeEntry(d, he);
             d->ht_used[htidx]--;
             he = nextHe;
         }
     }
-    zfree(d->ht_table[htidx]);
+    dictFreeTable(d, d->ht_table[htidx], d->ht_size_exp[htidx]);
+    dictSeqBegin(d);
     _dictReset(d, htidx);
+    dictSeqEnd(d);
     return DICT_OK;
 }
 
-void dictRElease(dict *d){
+void dictRelease(dict *d){
+    dictRehashingStopped(d);
+    dictBloomRelease(d);
+    if(dictExtField(d, bgRehash))
+        dictDisableBackgroundRehash(d);
+    if(dictLazyFreeAllowed(d)){
+        dictReleaseLazily(d);
+        return;
+    }
     _dictClear(d, 0, NULL);
     _dictClear(d, 1, NULL);
+    if(dictExtField(d, lockFree)){
+        //no reader may start on d anymore, the ones still inside are waited for
+        epochDrain(&d->ext->lockFree->limbo);
+        zfree(d->ext->lockFree);
+    }
+    dictExtRelease(d);
     zfree(d);
 }
 
-dictEntry *dictFind(dict *d, const void *key){
+static dictEntry *_dictFindWithHash(dict *d, const void *key, uint64_t h){
     dictEntry *he;
-    uint64_t h, idx, table;
+    uint64_t idx, table;
 
+    if(dictExtField(d, lockFree))
+        return dictFindLockFree(d, key, h);
+    if(dictIsOpenAddressing(d))
+        return dictOaFind(d, key, h);
     if(d->ht_used[0] + d->ht_used[1] == 0)
         return NULL;
     if(d->reHashIdx != -1)
         _dictRehashStep(d);
-    h = d->type->hashFunction(key);
+    dictStatLookup(d);
+    if(dictExtField(d, bloom)){
+        //the bucket load overlaps the filter load, a hit doesn't wait for both in turn
+        __builtin_prefetch(&d->ht_table[0][h & DICTHT_SIZE_MASK(d->ht_size_exp[0])]);
+        if(dictBloomSkip(d, h))
+            return NULL;
+    }
     for(table = 0; table <= 1; table++){
-        idx = h & d->ht_size_exp[table] == -1? 0: ((d->ht_size_exp[table] == -1? 0: (uint64_t)1 << d->ht_size_exp[table]) - 1);
+        idx = h & DICTHT_SIZE_MASK(d->ht_size_exp[table]);
         he = d->ht_table[table][idx];
         while(he){
             void *he_key = dictGetKey(he);
-            if(key == he_key || (d->type->keyCompare? d->type->keyCompare(d, key, he_key): key == he_key))
+            if(key == he_key || (dictEntryTagMatch(he, h, d->ht_size_exp[table]) &&
+            dictCompareKeys(d, key, he_key)))
                 return he;
             he = dictGetNext(he);
         }
         if(d->reHashIdx == -1)
-            return NULL;
+            break;
     }
+    dictBloomMissed(d);
     return NULL;
 }
 
-void *dictFetchValue(dict *d, const void *key){
-    dictEntry *he = dictFind(d, key);
-    return he? dictGetVal(he): NULL;
+//an empty dict isn't worth hashing the key
+static dictEntry *_dictFind(dict *d, const void *key){
+    if(!dictExtField(d, lockFree) && d->ht_used[0] + d->ht_used[1] == 0)
+        return NULL;
+    return _dictFindWithHash(d, key, d->type->hashFunction(key));
 }
 
-dictEntry *dictTwoPhaseUnlinkFind(dict *d, const void *key, dictEntry ***plink, int *table_index){
-    uint64_t idx;
-    if(d->ht_used[0] + d->ht_used[1] == 0)
-        return NULL;
+#define DICT_FIND_BATCH_SIZE 16
+
+//look up n keys at once, out[i] is the entry of keys[i] or NULL, return the number found.
+//keys are hashed first, then the bucket slots and the chain heads are prefetched in two passes,
+//so the cache misses of the whole batch overlap instead of stalling one lookup after another
+static size_t _dictFindBatch(dict *d, const void **keys, size_t n, dictEntry **out){
+    uint64_t idx[DICT_FIND_BATCH_SIZE][2], hashes[DICT_FIND_BATCH_SIZE];
+    uint8_t absent[DICT_FIND_BATCH_SIZE];
+    size_t found = 0;
+
+    if(d->ht_used[0] + d->ht_used[1] == 0){
+        memset(out, 0, n * sizeof(*out));
+        return 0;
+    }
+    if(dictIsOpenAddressing(d))
+        return dictOaFindBatch(d, keys, n, out);
+    if(dictExtField(d, lockFree)){
+        for(size_t j = 0; j < n; j++)
+            found += (out[j] = dictFindLockFree(d, keys[j], d->type->hashFunction(keys[j]))) != NULL;
+        return found;
+    }
+    for(size_t base = 0; base < n; base += DICT_FIND_BATCH_SIZE){
+        size_t cnt = n - base < DICT_FIND_BATCH_SIZE? n - base: DICT_FIND_BATCH_SIZE;
+        const void **bkeys = keys + base;
+        dictEntry **bout = out + base;
+
+        //one rehash step per key, the same amount of work dictFind would have done
+        for(size_t j = 0; j < cnt && d->reHashIdx != -1; j++)
+            _dictRehashStep(d);
+        int tables = d->reHashIdx != -1? 2: 1;
+
+        dictHashKeys(d, bkeys, cnt, hashes);
+        for(size_t j = 0; j < cnt; j++){
+            uint64_t h = hashes[j];
+            dictStatLookup(d);
+            if((absent[j] = dictBloomSkip(d, h)))
+                continue;
+            for(int table = 0; table < tables; table++){
+                idx[j][table] = h & DICTHT_SIZE_MASK(d->ht_size_exp[table]);
+                __builtin_prefetch(&d->ht_table[table][idx[j][table]]);
+            }
+        }
+        for(size_t j = 0; j < cnt; j++){
+            for(int table = 0; table < tables && !absent[j]; table++){
+                dictEntry *he = d->ht_table[table][idx[j][table]];
+                if(he)
+                    __builtin_prefetch((void *)((uintptr_t)(void *)he & ~(uintptr_t)ENTRY_PTR_MASK));
+            }
+        }
+        for(size_t j = 0; j < cnt; j++){
+            const void *key = bkeys[j];
+            bout[j] = NULL;
+            if(absent[j])
+                continue;
+            for(int table = 0; table < tables && !bout[j]; table++){
+                dictEntry *he = d->ht_table[table][idx[j][table]];
+                while(he){
+                    void *he_key = dictGetKey(he);
+                    if(key == he_key || (dictEntryTagMatch(he, hashes[j], d->ht_size_exp[table]) &&
+                    dictCompareKeys(d, key, he_key))){
+                        bout[j] = he;
+                        found++;
+                        break;
+                    }
+                    he = dictGetNext(he);
+                }
+            }
+            if(!bout[j])
+                dictBloomMissed(d);
+        }
+    }
+    return found;
+}
+
+void *dictFetchValue(dict *d, const void *key){
+    if(dictExtField(d, lockFree)){
+        dictEntry *he = dictFindLockFree(d, key, d->type->hashFunction(key));
+        if(!he)
+            return NULL;
+        assert(entryHasValue(he));
+        return __atomic_load_n(&he->v.val, __ATOMIC_ACQUIRE);
+    }
+    dictEntry *he = dictFind(d, key);
+    return he? dictGetVal(he): NULL;
+}
+
+static dictEntry *_dictTwoPhaseUnlinkFindWithHash(dict *d, const void *key, uint64_t h, dictEntry ***plink, int *table_index){
+    uint64_t idx;
+    if(dictIsOpenAddressing(d))
+        return dictOaTwoPhaseUnlinkFind(d, key, h, plink, table_index);
+    if(d->ht_used[0] + d->ht_used[1] == 0)
+        return NULL;
     if(d->reHashIdx != -1)
         _dictRehashStep(d);
-    uint64_t h = d->type->hashFunction(key);
+    dictStatLookup(d);
 
     for(uint64_t table = 0; table <= 1; table++){
-        idx = h & d->ht_size_exp[table] == -1? 0: ((d->ht_size_exp[table] == -1? 0: (uint64_t)1 << d->ht_size_exp[table]) - 1);
+        idx = h & DICTHT_SIZE_MASK(d->ht_size_exp[table]);
         dictEntry **ref = &d->ht_table[table][idx];
-        while(ref && *ref){
-            void *de_key = dictGetKey(*ref);
-            if(key == de_key || (d->type->keyCompare? d->type->keyCompare(d, key, de_key): key == de_key)){
+        while(ref && dictLinkGet(ref)){
+            dictEntry *de = dictLinkGet(ref);
+            void *de_key = dictGetKey(de);
+            if(key == de_key || (dictEntryTagMatch(de, h, d->ht_size_exp[table]) &&
+            dictCompareKeys(d, key, de_key))){
                 *table_index = table;
                 *plink = ref;
                 d->pauseRehash++;
-                return *ref;
+                return de;
             }
-            ref = dictGetNextRef(*ref);
+            ref = dictGetNextRef(de);
         }
         if(d->reHashIdx == -1)
             return NULL;
@@ -479,31 +1379,63 @@ dictEntry *dictTwoPhaseUnlinkFind(dict *d, const void *key, dictEntry ***plink,
     return NULL;
 }
 
-void dictTwoPhaseUnlinkFree(dict *d, dictEntry *he, dictEntry **plink, int table_index){
+static dictEntry *_dictTwoPhaseUnlinkFind(dict *d, const void *key, dictEntry ***plink, int *table_index){
+    if(d->ht_used[0] + d->ht_used[1] == 0)
+        return NULL;
+    return _dictTwoPhaseUnlinkFindWithHash(d, key, d->type->hashFunction(key), plink, table_index);
+}
+
+static void _dictTwoPhaseUnlinkFree(dict *d, dictEntry *he, dictEntry **plink, int table_index){
     if(he == NULL)
         return;
+    if(dictIsOpenAddressing(d)){
+        dictOaTwoPhaseUnlinkFree(d, he, table_index);
+        return;
+    }
     d->ht_used[table_index]--;
-    *plink = dictGetNext(he);
-    if(d->type->keyDestructor)
-        d->type->keyDestructor(d, dictGetKey(he));
-    if(d->type->valDestructor)
-        d->type->valDestructor(d, dictGetVal(he));
-    if(!entryIsKey(he))
-        zfree(decodeMaskedPtr(he));
+    dictLinkSet(plink, dictGetNext(he));
+    if(dictExtField(d, bloom))
+        dictBloomDelete(d, d->type->hashFunction(dictGetKey(he)), table_index);
+    dictFreeEntry(d, he);
     d->pauseRehash--;
 }
 
-void dictSetKey(dict *d, dictEntry *de, void *key){
+static void _dictSetKey(dict *d, dictEntry *de, void *key){
     assert(!d->type->no_value);
+    if(entryHasEmbeddedKey(de)){
+        //overwrite the embedded key when the new one fits in its place, else it goes out of line
+        size_t size = d->type->keyEmbedSize(d, key);
+        if(size && size <= d->type->keyEmbedSize(d, de->key)){
+            size_t metasize = d->type->dictEntryMetadataBYtes? d->type->dictEntryMetadataBYtes(d): 0;
+            de->key = d->type->keyEmbed(d, (char *)dictEntryMetadata(de) + metasize, key);
+            if(!d->type->keyDup && d->type->keyDestructor)
+                d->type->keyDestructor(d, key);
+            return;
+        }
+        entrySetEmbeddedKey(de, 0);
+    }
     if(d->type->keyDup)
         de->key = d->type->keyDup(d, key);
     else
         de->key = key;
 }
 
+//the helper thread hashes keys and relinks next pointers, an embedded key is rewritten in place
+void dictSetKey(dict *d, dictEntry *de, void *key){
+    dictBgLock(d);
+    _dictSetKey(d, de, key);
+    dictBgUnlock(d);
+}
+
 void dictSetVal(dict *d, dictEntry *de, void *val){
     assert(entryHasValue(de));
-    de->v.val = d->type->valDup? d->type->valDup(d, val): val;
+    val = d->type->valDup? d->type->valDup(d, val): val;
+    dictBgLock(d);
+    if(dictExtField(d, lockFree))
+        __atomic_store_n(&de->v.val, val, __ATOMIC_RELEASE);
+    else
+        de->v.val = val;
+    dictBgUnlock(d);
 }
 
 void dictSetSignedIntegerVal(dictEntry *de, int64_t val){
@@ -536,6 +1468,30 @@ double dictIncrDoubleVal(dictEntry *de, double val){
     return de->v.d += val;
 }
 
+//the same for values other threads increment at the same time, only the counter itself is
+//ordered. doubles have no atomic add, they retry a compare and swap of the bits
+int64_t dictAtomicIncrSignedIntegerVal(dictEntry *de, int64_t val){
+    assert(entryHasValue(de));
+    return __atomic_add_fetch(&de->v.s64, val, __ATOMIC_RELAXED);
+}
+
+uint64_t dictAtomicIncrUnsignedIntegerVal(dictEntry *de, uint64_t val){
+    assert(entryHasValue(de));
+    return __atomic_add_fetch(&de->v.u64, val, __ATOMIC_RELAXED);
+}
+
+double dictAtomicIncrDoubleVal(dictEntry *de, double val){
+    assert(entryHasValue(de));
+    uint64_t old = __atomic_load_n(&de->v.u64, __ATOMIC_RELAXED), new;
+    double d;
+    do{
+        memcpy(&d, &old, sizeof(d));
+        d += val;
+        memcpy(&new, &d, sizeof(new));
+    }while(!__atomic_compare_exchange_n(&de->v.u64, &old, new, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return d;
+}
+
 void *dictEntryMetadata(dictEntry *de){
     assert(entryHasValue(de));
     return &de->metadata;
@@ -574,40 +1530,30 @@ double *dictGetDoubleValPtr(dictEntry *de){
     return &de->v.d;
 }
 
-static dictEntry *dictGetNext(const dictEntry *de){
-    if(entryIsKey(de))
-        return NULL;
-    if(entryIsNoValue(de))
-        return decodeEntryNoValue(de)->next;
-    return de->next;
-}
-
-static dictEntry **dictGetNextRef(dictEntry *de){
-    if(entryIsKey(de))
-        return NULL;
-    if(entryIsNoValue(de))
-        return &decodeEntryNoValue(de)->next;
-    return &de->next;
-}
-
-static void dictSetNext(dictEntry *de, dictEntry *next){
-    assert(!entryIsKey(de));
-    if(entryIsNoValue(de)){
-        dictEntryNoValue *entry = decodeEntryNoValue(de);
-        entry->next = next;
-    }else{
-        de->next = next;
-    }
+static size_t dictEntryAllocSize(dict *d){
+    if(d->type->no_value)
+        return sizeof(dictEntryNoValue);
+    return sizeof(dictEntry) + (d->type->dictEntryMetadataBYtes? d->type->dictEntryMetadataBYtes(d): 0);
 }
 
-size_t dictMemUsage(const dict *d){
-    return (d->ht_used[0] + d->ht_used[1]) * sizeof(dictEntry) + 
-    sizeof(dictEntry *) * ((d->ht_size_exp[0] == -1? 0: (uint64_t)1 << d->ht_size_exp[0]) + 
-    (d->ht_size_exp[1] == -1? 0: (uint64_t)1 << d->ht_size_exp[1]));
+static size_t _dictMemUsage(const dict *d){
+    if(dictIsOpenAddressing(d))
+        return dictOaMemUsage(d);
+    size_t buckets = sizeof(dictEntry *) * (DICTHT_SIZE(d->ht_size_exp[0]) + DICTHT_SIZE(d->ht_size_exp[1]));
+    if(dictExtField(d, bloom))
+        buckets += dictBloomBytes(&d->ext->bloom->f[0]) + dictBloomBytes(&d->ext->bloom->f[1]);
+    if(dictExtField(d, entrySlab))
+        return slabMemUsage(d->ext->entrySlab) + buckets;
+    return (d->ht_used[0] + d->ht_used[1]) * dictEntryAllocSize((dict *)d) + buckets;
 }
 
-size_t dictEntryMemUsage(void){
-    return sizeof(dictEntry);
+//the memory one entry really costs, slab dicts include their share of partly used pages
+size_t dictEntryMemUsage(dict *d){
+    if(dictIsOpenAddressing(d))
+        return d->ht_used[0] + d->ht_used[1]? dictOaMemUsage(d) / (d->ht_used[0] + d->ht_used[1]): 0;
+    if(dictExtField(d, entrySlab) && d->ext->entrySlab->objects)
+        return slabMemUsage(d->ext->entrySlab) / d->ext->entrySlab->objects;
+    return dictEntryAllocSize(d);
 }
 
 unsigned long long dictFingerprint(dict *d){
@@ -650,13 +1596,25 @@ void dictInitSafeIterator(dictIterator *iter, dict *d){
 
 void dictResetIterator(dictIterator *iter){
     if(!(iter->index == -1 && iter->table == 0)){
-        if(iter->safe)
+        dictBgLock(iter->d);
+        if(iter->safe || dictExtField(iter->d, bgRehash))
             iter->d->pauseRehash--;
-        else
+        if(!iter->safe)
             assert(iter->fingerPrint == dictFingerprint(iter->d));
+        dictBgUnlock(iter->d);
     }
 }
 
+//a background rehash would break the fingerprint of an unsafe iterator, pause it as well
+static void dictIteratorStart(dictIterator *iter){
+    dictBgLock(iter->d);
+    if(iter->safe || dictExtField(iter->d, bgRehash))
+        iter->d->pauseRehash++;
+    if(!iter->safe)
+        iter->fingerPrint = dictFingerprint(iter->d);
+    dictBgUnlock(iter->d);
+}
+
 dictIterator *dictGetIterator(dict *d){
     dictIterator *iter = zmalloc(sizeof(*iter));
     dictInitIterator(iter, d);
@@ -670,14 +1628,12 @@ dictIterator *dictGetSafeIterator(dict *d){
 }
 
 dictEntry *dictNext(dictIterator *iter){
+    if(dictIsOpenAddressing(iter->d))
+        return dictOaNext(iter);
     while(1){
         if(iter->entry == NULL){
-            if(iter->index == -1 && iter->table == 0){
-                if(iter->safe)
-                    iter->d->pauseRehash++;
-                else
-                    iter->fingerPrint = dictFingerprint(iter->d);
-            }
+            if(iter->index == -1 && iter->table == 0)
+                dictIteratorStart(iter);
             iter->index++;
             if(iter->index >= (long)(iter->d->ht_size_exp[iter->table] == -1? 0: (uint64_t)1 << iter->d->ht_size_exp[iter->table])){
                 if(iter->d->reHashIdx != -1 && iter->table == 0){
@@ -704,11 +1660,13 @@ void dictReleaseIterator(dictIterator *iter){
     zfree(iter);
 }
 
-dictEntry *dictGetRandomKey(dict *d){
+static dictEntry *_dictGetRandomKey(dict *d){
     dictEntry *he, *origihe;
     uint64_t h;
     int listlen, listele;
 
+    if(dictIsOpenAddressing(d))
+        return dictOaGetRandomKey(d);
     if(d->ht_used[0] + d->ht_used[1] == 0)
         return NULL;
     if(d->reHashIdx != -1)
@@ -740,8 +1698,10 @@ dictEntry *dictGetRandomKey(dict *d){
     return he;
 }
 
-uint32_t dictGetSomeKeys(dict *d, dictEntry **des, uint32_t count){
+static uint32_t _dictGetSomeKeys(dict *d, dictEntry **des, uint32_t count){
     uint64_t stored = 0, maxsizemask, maxsteps;
+    if(dictIsOpenAddressing(d))
+        return dictOaGetSomeKeys(d, des, count);
     if(d->ht_used[0] + d->ht_used[1] < count)
         count = d->ht_used[0] + d->ht_used[1];
     maxsteps = count * 10;
@@ -755,9 +1715,9 @@ uint32_t dictGetSomeKeys(dict *d, dictEntry **des, uint32_t count){
     }
     
     uint64_t tables = d->reHashIdx != -1? 2: 1;
-    maxsizemask = d->ht_size_exp[0] == -1? 0: ((d->ht_size_exp[0] == -1? 0: ((uint64_t)1 << d->ht_size_exp[0])));
-    if(tables > 1 && maxsizemask < (d->ht_size_exp[1] == -1? 0: ((d->ht_size_exp[1] == -1? 0: ((uint64_t)1 << d->ht_size_exp[1])))))
-        maxsizemask = d->ht_size_exp[1] == -1? 0: ((d->ht_size_exp[1] == -1? 0: (((uint64_t)1 << d->ht_size_exp[1]) - 1)));
+    maxsizemask = DICTHT_SIZE_MASK(d->ht_size_exp[0]);
+    if(tables > 1 && maxsizemask < DICTHT_SIZE_MASK(d->ht_size_exp[1]))
+        maxsizemask = DICTHT_SIZE_MASK(d->ht_size_exp[1]);
     uint64_t i = ((uint64_t)genrand64_int64()) & maxsizemask;
     uint64_t emptylen = 0;
     while(stored < count && maxsteps--){
@@ -799,6 +1759,14 @@ uint32_t dictGetSomeKeys(dict *d, dictEntry **des, uint32_t count){
         }
         i = (i + 1) & maxsizemask;
     }
+    return stored;
+}
+
+//slab entries are compacted by the slab itself, the others go through defragAlloc
+static void *dictDefragEntryMem(dict *d, void *ptr, dictDefragAllocFunction *defragalloc){
+    if(dictExtField(d, entrySlab))
+        return slabDefrag(d->ext->entrySlab, ptr);
+    return defragalloc? defragalloc(ptr): NULL;
 }
 
 static void dictDefragBucket(dict *d, dictEntry **bucketref, dictDefragAllocFunctions *defragfns){
@@ -806,38 +1774,45 @@ static void dictDefragBucket(dict *d, dictEntry **bucketref, dictDefragAllocFunc
     dictDefragAllocFunction *defragkey = defragfns->defragKey;
     dictDefragAllocFunction *defragval = defragfns->defragVal;
 
-    while(bucketref && *bucketref){
-        dictEntry *de = *bucketref, *newde = NULL;
-        void *newkey = defragkey? defragkey(dictGetKey(de)): NULL;
-        void *newval = defragval? defragval(dictGetVal(de)): NULL;
+    while(bucketref && dictLinkGet(bucketref)){
+        dictEntry *de = dictLinkGet(bucketref), *newde = NULL;
+        int embedded = entryHasEmbeddedKey(de);
+        void *newkey = defragkey && !embedded? defragkey(dictGetKey(de)): NULL;
+        void *newval = defragval && entryHasValue(de)? defragval(dictGetVal(de)): NULL;
         if(entryIsKey(de)){
             if(newkey)
-                *bucketref = newkey;
-            assert(entryIsKey(*bucketref));
+                dictLinkSet(bucketref, newkey);
+            assert(entryIsKey(dictLinkGet(bucketref)));
         }else if(entryIsNoValue(de)){
             dictEntryNoValue *entry = decodeEntryNoValue(de), *newentry;
-            if((newentry = defragalloc(entry))){
+            uintptr_t keyoff = (uintptr_t)entry->key - (uintptr_t)entry;
+            if((newentry = dictDefragEntryMem(d, entry, defragalloc))){
                 newde = encodeMaskedPtr(newentry, 2);
                 entry = newentry;
+                if(embedded)
+                    entry->key = (char *)entry + keyoff;
             }
             if(newkey)
                 entry->key = newkey;
         }else{
             assert(entryIsNormal(de));
-            newde = defragalloc(de);
+            uintptr_t keyoff = (uintptr_t)de->key - (uintptr_t)de;
+            newde = dictDefragEntryMem(d, de, defragalloc);
             if(newde)
                 de = newde;
+            if(newde && embedded)
+                de->key = (char *)de + keyoff;
             if(newkey)
                 de->key = newkey;
             if(newval)
                 de->v.val = newval;
         }
         if(newde){
-            *bucketref = newde;
+            dictLinkSet(bucketref, newde);
             if(d->type->afterReplaceEntry)
                 d->type->afterReplaceEntry(d, newde);
         }
-        bucketref = dictGetNextRef(*bucketref);
+        bucketref = dictGetNextRef(dictLinkGet(bucketref));
     }
 }
 
@@ -864,15 +1839,14 @@ uint64_t dictScan(dict *d, uint64_t v, dictScanFunction *fn, void *privdata){
     return dictScanDefrag(d, v, fn, NULL, privdata);
 }
 
-uint64_t dictScanDefrag(dict *d, uint64_t v, dictScanFunction *fn, dictDefragAllocFunctions *defragfns, void *privdata){
+//one step of the scan with rehashing already paused, the buckets of cursor v in both tables
+static uint64_t dictScanBuckets(dict *d, uint64_t v, dictScanFunction *fn, dictDefragAllocFunctions *defragfns, void *privdata){
     int htidx0, htidx1;
     const dictEntry *de, *next;
     uint64_t m0, m1;
 
-    if(d->ht_used[0] + d->ht_used[1] == 0)
-        return 0;
-    d->pauseRehash++;
-
+    if(dictIsOpenAddressing(d))
+        return dictOaScan(d, v, fn, defragfns, privdata);
     if(d->reHashIdx == -1){
         htidx0 = 0;
         m0 = d->ht_size_exp[htidx0] == -1? 0: ((d->ht_size_exp[htidx0] == -1? 0: (((uint64_t)1 << d->ht_size_exp[htidx0])) - 1));
@@ -896,14 +1870,13 @@ uint64_t dictScanDefrag(dict *d, uint64_t v, dictScanFunction *fn, dictDefragAll
         htidx0 = 0;
         htidx1 = 1;
 
-        if((d->ht_size_exp[htidx0] == -1? 0: (((uint64_t)1 << d->ht_size_exp[htidx1]))) > 
-        (d->ht_size_exp[htidx1] == -1? 0: (((uint64_t)1 << d->ht_size_exp[htidx1])))){
+        if(DICTHT_SIZE(d->ht_size_exp[htidx0]) > DICTHT_SIZE(d->ht_size_exp[htidx1])){
             htidx0 = 1;
             htidx1 = 0;
         }
 
-        m0 = (d->ht_size_exp[htidx0] == -1? 0: (((uint64_t)1 << d->ht_size_exp[htidx1] - 1)));
-        m1 = (d->ht_size_exp[htidx1] == -1? 0: (((uint64_t)1 << d->ht_size_exp[htidx1] - 1)));
+        m0 = DICTHT_SIZE_MASK(d->ht_size_exp[htidx0]);
+        m1 = DICTHT_SIZE_MASK(d->ht_size_exp[htidx1]);
 
         if(defragfns){
             dictDefragBucket(d, &d->ht_table[htidx0][v & m0], defragfns);
@@ -933,6 +1906,16 @@ uint64_t dictScanDefrag(dict *d, uint64_t v, dictScanFunction *fn, dictDefragAll
             v = rev(v);
         }while(v & (m0 ^ m1));
     }
+    return v;
+}
+
+static uint64_t _dictScanDefrag(dict *d, uint64_t v, dictScanFunction *fn, dictDefragAllocFunctions *defragfns, void *privdata){
+    //defragAlloc frees the old entry right away, readers may still be on it
+    assert(!defragfns || !dictExtField(d, lockFree));
+    if(d->ht_used[0] + d->ht_used[1] == 0)
+        return 0;
+    d->pauseRehash++;
+    v = dictScanBuckets(d, v, fn, defragfns, privdata);
     d->pauseRehash--;
     return v;
 }
@@ -946,14 +1929,14 @@ static int dictTypeExpandAllowed(dict *d){
 static int _dictExpandIfNeeded(dict *d){
     if(d->reHashIdx != -1)
         return DICT_OK;
-    if(((d->ht_size_exp[0] == -1? 0: (((uint64_t)1 << d->ht_size_exp[0])))))
-        return dictExpand(d, 4);
+    if(d->ht_size_exp[0] == -1)
+        return _dictExpand(d, DICT_HT_INITIAL_SIZE, NULL);
     
     if(!dictTypeExpandAllowed(d))
         return DICT_OK;
     if((dict_can_resize == DICT_RESIZE_ENABLE && d->ht_used[0] >= ((d->ht_size_exp[0]) == -1? 0: (uint64_t)1 << (d->ht_size_exp[0]))) || 
     (dict_can_resize != DICT_RESIZE_FORBID && d->ht_used[0] / ((d->ht_size_exp[0]) == -1? 0: (uint64_t)1 << (d->ht_size_exp[0])) > dict_force_resize_ratio)){
-        return dictExpand(d, d->ht_used[0] + 1);
+        return _dictExpand(d, d->ht_used[0] + 1, NULL);
     }
     return DICT_OK;
 }
@@ -970,10 +1953,15 @@ static signed char _dictNextExp(uint64_t size){
     }
 }
 
-void *dictFindPositionForInsert(dict *d, const void *key, dictEntry **existing){
+static void *_dictFindPositionForInsert(dict *d, const void *key, dictEntry **existing){
+    return _dictFindPositionForInsertWithHash(d, key, d->type->hashFunction(key), existing);
+}
+
+static void *_dictFindPositionForInsertWithHash(dict *d, const void *key, uint64_t hash, dictEntry **existing){
     uint64_t idx, table;
     dictEntry *he;
-    uint64_t hash = d->type->hashFunction(key);
+    if(dictIsOpenAddressing(d))
+        return dictOaFindPositionWithHash(d, key, hash, existing);
     if(existing)
         *existing = NULL;
     if(d->reHashIdx != -1)
@@ -981,12 +1969,14 @@ void *dictFindPositionForInsert(dict *d, const void *key, dictEntry **existing){
     
     if(_dictExpandIfNeeded(d) == DICT_ERR)
         return NULL;
+    dictStatLookup(d);
     for(table = 0; table <= 1; table++){
-        idx = hash & (d->ht_size_exp[table] == -1? 0: (((uint64_t)1 << d->ht_size_exp[table]) - 1));
+        idx = hash & DICTHT_SIZE_MASK(d->ht_size_exp[table]);
         he = d->ht_table[table][idx];
         while(he){
             void *he_key = dictGetKey(he);
-            if(key == he_key || d->type->keyCompare? d->type->keyCompare(d, key, he_key): (key == he_key)){
+            if(key == he_key || (dictEntryTagMatch(he, hash, d->ht_size_exp[table]) &&
+            dictCompareKeys(d, key, he_key))){
                 if(existing)
                     *existing = he;
                 return NULL;
@@ -1000,11 +1990,20 @@ void *dictFindPositionForInsert(dict *d, const void *key, dictEntry **existing){
     return bucket;
 }
 
+//callback is called every so many buckets of a synchronous clear, lazily freed dicts never call it
 void dictEmpty(dict *d, void(callback)(dict *)){
-    _dictClear(d, 0, callback);
-    _dictClear(d, 1, callback);
+    dictBgLock(d);
+    if(dictLazyFreeAllowed(d)){
+        dictEmptyLazily(d);
+    }else{
+        _dictClear(d, 0, callback);
+        _dictClear(d, 1, callback);
+    }
     d->reHashIdx = -1;
     d->pauseRehash = 0;
+    dictRehashingStopped(d);
+    dictBloomReset(d);
+    dictBgUnlock(d);
 }
 
 void dictSetResizeEnabled(dictResizeEnable enable){
@@ -1015,14 +2014,16 @@ uint64_t dictGetHash(dict *d, const void *key){
     return d->type->hashFunction(key);
 }
 
-dictEntry *dictFindEntryByPtrAndHash(dict *d, const void *oldptr, uint64_t hash){
+static dictEntry *_dictFindEntryByPtrAndHash(dict *d, const void *oldptr, uint64_t hash){
     dictEntry *he;
     uint64_t idx, table;
 
     if(d->ht_used[0] + d->ht_used[1] == 0)
         return NULL;
+    if(dictIsOpenAddressing(d))
+        return dictOaFindEntryByPtrAndHash(d, oldptr, hash);
     for(table = 0; table <= 1; table++){
-        idx = hash & ((d->ht_size_exp[table] == -1? 0: (((uint64_t)1 << (d->ht_size_exp[table] - 1)))));
+        idx = hash & DICTHT_SIZE_MASK(d->ht_size_exp[table]);
         he = d->ht_table[table][idx];
         while(he){
             if(oldptr == dictGetKey(he))
@@ -1033,4 +2034,3348 @@ dictEntry *dictFindEntryByPtrAndHash(dict *d, const void *oldptr, uint64_t hash)
             return NULL;
     }
     return NULL;
-}
\ No newline at end of file
+}
+/* ----------------------------- background rehashing -----------------------------
+ * A dict with background rehash enabled gets a helper thread that migrates batches of
+ * ht_table[0] buckets while the main thread keeps using the dict. Every table access of
+ * the public API takes the dict lock, the helper takes it for one batch at a time and
+ * skips the dict while pauseRehash is set, so safe iterators, dictScan and the two phase
+ * unlink keep their guarantees. Entries are only relinked, never reallocated, so the
+ * dictEntry pointers the main thread holds stay valid. */
+
+#define DICT_BG_REHASH_BATCH 128
+
+static struct{
+    pthread_mutex_t lock;//protects the list and the pending/busy flags
+    pthread_cond_t cond;
+    struct dictBgRehash *head;
+    int running;
+    pthread_t thread;
+}bg_rehash = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0};
+
+//called with the dict lock held, the lock order is always dict lock then list lock
+static void dictBgRehashNotify(dict *d){
+    struct dictBgRehash *bg = d->ext->bgRehash;
+    pthread_mutex_lock(&bg_rehash.lock);
+    bg->pending = 1;
+    bg->moved = 0;
+    bg->work_us = 0;
+    bg->start_us = bg->last_us = timeInMicroseconds();
+    pthread_cond_signal(&bg_rehash.cond);
+    pthread_mutex_unlock(&bg_rehash.lock);
+}
+
+static void *dictBgRehashMain(void *arg){
+    (void)arg;
+    pthread_mutex_lock(&bg_rehash.lock);
+    while(1){
+        struct dictBgRehash *bg = bg_rehash.head;
+        while(bg && !bg->pending)
+            bg = bg->next;
+        if(!bg){
+            pthread_cond_wait(&bg_rehash.cond, &bg_rehash.lock);
+            continue;
+        }
+        //round robin: the dict we work on goes to the tail
+        if(bg->next){
+            if(bg->prev)
+                bg->prev->next = bg->next;
+            else
+                bg_rehash.head = bg->next;
+            bg->next->prev = bg->prev;
+            struct dictBgRehash *tail = bg->next;
+            while(tail->next)
+                tail = tail->next;
+            tail->next = bg;
+            bg->prev = tail;
+            bg->next = NULL;
+        }
+        bg->busy = 1;
+        pthread_mutex_unlock(&bg_rehash.lock);
+
+        dict *d = bg->d;
+        int more = 1, paused = 0;
+        pthread_mutex_lock(&bg->lock);
+        if(d->reHashIdx == -1){
+            more = 0;
+        }else if(d->pauseRehash > 0){
+            paused = 1;
+        }else{
+            long long start = timeInMicroseconds();
+            uint64_t before = d->reHashIdx;
+            uint64_t size0 = DICTHT_SIZE(d->ht_size_exp[0]);
+            more = _dictRehash(d, DICT_BG_REHASH_BATCH);
+            bg->moved += (more? (uint64_t)d->reHashIdx: size0) - before;
+            bg->total_moved += (more? (uint64_t)d->reHashIdx: size0) - before;
+            bg->last_us = timeInMicroseconds();
+            bg->work_us += bg->last_us - start;
+        }
+        pthread_mutex_unlock(&bg->lock);
+
+        pthread_mutex_lock(&bg_rehash.lock);
+        bg->busy = 0;
+        if(!more)
+            bg->pending = 0;
+        pthread_cond_broadcast(&bg_rehash.cond);
+        if(paused){
+            //nothing else to do than wait for the iterator or scan to finish
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 1000000;
+            if(ts.tv_nsec >= 1000000000){
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&bg_rehash.cond, &bg_rehash.lock, &ts);
+        }
+    }
+    return NULL;
+}
+
+//hand the rehashing of d to the helper thread, the dict must be used from one thread only,
+//open addressing and key_are_odd dicts move entries on rehash and are not supported
+int dictEnableBackgroundRehash(dict *d){
+    if(dictExtField(d, bgRehash))
+        return DICT_OK;
+    if(dictIsOpenAddressing(d) || d->type->key_are_odd || dictExtField(d, lockFree) || d->type->scheduled_rehash)
+        return DICT_ERR;
+
+    struct dictBgRehash *bg = zcalloc(sizeof(*bg));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&bg->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    bg->d = d;
+
+    pthread_mutex_lock(&bg_rehash.lock);
+    if(!bg_rehash.running){
+        if(pthread_create(&bg_rehash.thread, NULL, dictBgRehashMain, NULL) != 0){
+            pthread_mutex_unlock(&bg_rehash.lock);
+            pthread_mutex_destroy(&bg->lock);
+            zfree(bg);
+            return DICT_ERR;
+        }
+        bg_rehash.running = 1;
+    }
+    bg->next = bg_rehash.head;
+    if(bg->next)
+        bg->next->prev = bg;
+    bg_rehash.head = bg;
+    pthread_mutex_unlock(&bg_rehash.lock);
+
+    dictExtOf(d)->bgRehash = bg;
+    if(d->reHashIdx != -1)
+        dictBgRehashNotify(d);
+    return DICT_OK;
+}
+
+void dictDisableBackgroundRehash(dict *d){
+    struct dictBgRehash *bg = dictExtField(d, bgRehash);
+    if(!bg)
+        return;
+    pthread_mutex_lock(&bg_rehash.lock);
+    while(bg->busy)
+        pthread_cond_wait(&bg_rehash.cond, &bg_rehash.lock);
+    if(bg->prev)
+        bg->prev->next = bg->next;
+    else
+        bg_rehash.head = bg->next;
+    if(bg->next)
+        bg->next->prev = bg->prev;
+    pthread_mutex_unlock(&bg_rehash.lock);
+
+    d->ext->bgRehash = NULL;
+    pthread_mutex_destroy(&bg->lock);
+    zfree(bg);
+}
+
+/* ----------------------------- lazy freeing -----------------------------
+ * dictRelease and dictEmpty of dictType.lazy_free dicts with more than DICT_LAZY_FREE_THRESHOLD
+ * entries only detach the tables, the entry chains and the entry slab, and queue them for the
+ * lazy free thread, which runs the key and value destructors. dictRelease hands over the dict
+ * itself, dictEmpty a copy of the dict header and metadata, so destructors still get a dict of
+ * the right type, and leaves d empty. dictFreeLazily queues any other big object the same way. */
+
+#define DICT_LAZY_FREE_THRESHOLD 64
+
+typedef struct dictLazyFreeJob{
+    dictLazyFreeFunction *fn;
+    void *ptr;
+    uint64_t effort;
+    struct dictLazyFreeJob *next;
+}dictLazyFreeJob;
+
+static struct{
+    pthread_mutex_t lock;//protects the queue and the counters
+    pthread_cond_t cond;
+    dictLazyFreeJob *head, *tail;
+    int running;
+    pthread_t thread;
+    uint64_t pending_jobs;//queued or running
+    uint64_t pending_effort;
+}lazy_free = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0, 0, 0};
+
+static void *dictLazyFreeMain(void *arg){
+    (void)arg;
+    pthread_mutex_lock(&lazy_free.lock);
+    while(1){
+        dictLazyFreeJob *job = lazy_free.head;
+        if(!job){
+            pthread_cond_wait(&lazy_free.cond, &lazy_free.lock);
+            continue;
+        }
+        lazy_free.head = job->next;
+        if(!lazy_free.head)
+            lazy_free.tail = NULL;
+        pthread_mutex_unlock(&lazy_free.lock);
+
+        uint64_t effort = job->effort;
+        job->fn(job->ptr);
+        zfree(job);
+
+        pthread_mutex_lock(&lazy_free.lock);
+        lazy_free.pending_jobs--;
+        lazy_free.pending_effort -= effort;
+        pthread_cond_broadcast(&lazy_free.cond);
+    }
+    return NULL;
+}
+
+//run fn(ptr) on the lazy free thread, effort is reported in the pending stats, usually the
+//number of allocations ptr holds. fn runs inline if the thread can not be started
+void dictFreeLazily(dictLazyFreeFunction *fn, void *ptr, uint64_t effort){
+    dictLazyFreeJob *job = zmalloc(sizeof(*job));
+    job->fn = fn;
+    job->ptr = ptr;
+    job->effort = effort;
+    job->next = NULL;
+
+    pthread_mutex_lock(&lazy_free.lock);
+    if(!lazy_free.running){
+        if(pthread_create(&lazy_free.thread, NULL, dictLazyFreeMain, NULL) != 0){
+            pthread_mutex_unlock(&lazy_free.lock);
+            zfree(job);
+            fn(ptr);
+            return;
+        }
+        lazy_free.running = 1;
+    }
+    if(lazy_free.tail)
+        lazy_free.tail->next = job;
+    else
+        lazy_free.head = job;
+    lazy_free.tail = job;
+    lazy_free.pending_jobs++;
+    lazy_free.pending_effort += effort;
+    pthread_cond_signal(&lazy_free.cond);
+    pthread_mutex_unlock(&lazy_free.lock);
+}
+
+//the number of queued jobs not finished yet, and their effort in *effort
+uint64_t dictLazyFreePending(uint64_t *effort){
+    pthread_mutex_lock(&lazy_free.lock);
+    uint64_t jobs = lazy_free.pending_jobs;
+    if(effort)
+        *effort = lazy_free.pending_effort;
+    pthread_mutex_unlock(&lazy_free.lock);
+    return jobs;
+}
+
+//block until every job queued so far is done, not from a lazily run destructor
+void dictLazyFreeWait(void){
+    pthread_mutex_lock(&lazy_free.lock);
+    while(lazy_free.pending_jobs)
+        pthread_cond_wait(&lazy_free.cond, &lazy_free.lock);
+    pthread_mutex_unlock(&lazy_free.lock);
+}
+
+//readers of concurrent_reads dicts may still walk the tables, they are freed synchronously
+static int dictLazyFreeAllowed(dict *d){
+    return d->type->lazy_free && !dictExtField(d, lockFree) &&
+        d->ht_used[0] + d->ht_used[1] > DICT_LAZY_FREE_THRESHOLD;
+}
+
+static void dictLazyFreeDict(void *ptr){
+    dict *d = ptr;
+    _dictClear(d, 0, NULL);
+    _dictClear(d, 1, NULL);
+    dictExtRelease(d);
+    zfree(d);
+}
+
+static void dictReleaseLazily(dict *d){
+    dictFreeLazily(dictLazyFreeDict, d, d->ht_used[0] + d->ht_used[1]);
+}
+
+//called with the dict lock held, the helper thread of d never sees the copy
+static void dictEmptyLazily(dict *d){
+    size_t metasize = d->type->dictMetadataBytes? d->type->dictMetadataBytes(): 0;
+    dict *copy = zmalloc(sizeof(*copy) + metasize);
+    memcpy(copy, d, sizeof(*d) + metasize);
+    //the copy is only cleared, it isn't on the rehash cron list and never rehashes. it takes
+    //the entry slab along, d starts a new one
+    copy->ext = NULL;
+    copy->reHashIdx = -1;
+    copy->pauseRehash = 0;
+    if(dictExtField(d, entrySlab)){
+        dictExtOf(copy)->entrySlab = d->ext->entrySlab;
+        d->ext->entrySlab = NULL;
+    }
+    _dictReset(d, 0);
+    _dictReset(d, 1);
+    dictFreeLazily(dictLazyFreeDict, copy, copy->ht_used[0] + copy->ht_used[1]);
+}
+
+/* ----------------------------- lock free reads -----------------------------
+ * dictType.concurrent_reads dicts have one writer thread and any number of reader threads
+ * calling dictFind, dictFetchValue and dictFindBatch without a lock, between epochEnter and
+ * epochExit. The writer publishes entries, links and tables with release stores and hands
+ * what it unlinks, the old table after a rehash and replaced values to its epoch limbo, so
+ * a reader can finish walking a chain that was changed under it. Moving entries to the new
+ * table may take a reader off its chain, the writer keeps seq odd while it does that or
+ * swaps tables, and a lookup that missed while seq changed is retried. Readers never rehash. */
+
+static dictEntry *dictFindLockFree(dict *d, const void *key, uint64_t h){
+    struct dictLockFree *lf = dictExtField(d, lockFree);
+
+    while(1){
+        uint64_t seq = __atomic_load_n(&lf->seq, __ATOMIC_ACQUIRE);
+        if(seq & 1)
+            continue;
+        dictEntry **tables[2];
+        int8_t exps[2];
+        for(int table = 0; table <= 1; table++){
+            tables[table] = __atomic_load_n(&d->ht_table[table], __ATOMIC_RELAXED);
+            exps[table] = __atomic_load_n(&d->ht_size_exp[table], __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&lf->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+
+        for(int table = 0; table <= 1; table++){
+            if(!tables[table])
+                continue;
+            dictEntry *he = __atomic_load_n(&tables[table][h & DICTHT_SIZE_MASK(exps[table])], __ATOMIC_ACQUIRE);
+            while(he){
+                //the next field is read once, it holds the tag of he as well
+                dictEntry **ref = dictGetNextRef(he);
+                uintptr_t next = ref? (uintptr_t)(void *)__atomic_load_n(ref, __ATOMIC_ACQUIRE): 0;
+                uint16_t tag = DICT_ENTRY_TAGS && ref? (uint16_t)(next >> ENTRY_TAG_SHIFT): 0;
+                void *he_key = dictGetKey(he);
+                if(key == he_key || (entryTagMatch(tag, h, exps[table]) &&
+                dictCompareKeys(d, key, he_key)))
+                    return he;
+                he = (dictEntry *)(void *)(next & ~dictLinkOwnerBits(next));
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&lf->seq, __ATOMIC_RELAXED) == seq)
+            return NULL;
+    }
+}
+
+//free what the readers are done with, the writer does it anyway every EPOCH_BAG_SIZE retires
+size_t dictReclaim(dict *d){
+    return dictExtField(d, lockFree)? epochReclaim(&d->ext->lockFree->limbo): 0;
+}
+
+/* ----------------------------- parallel scan -----------------------------
+ * dictScan visits the buckets in the order of the reversed cursor, so the cursors whose low
+ * bits equal p form one contiguous stretch of that order, and the buckets they visit in either
+ * table, whatever its size, all have p as their low bits. Splitting the cursor space by its
+ * low bits therefore gives 2^bits disjoint scans, and each one keeps the dictScan guarantee
+ * for the elements whose hash ends in p, rehashing between steps included. Partitions only
+ * share buckets when a table has fewer buckets than partitions, such steps run on the caller. */
+
+struct dictParallelScan{
+    dict *d;
+    int bits;
+    uint64_t *cursors;
+    uint8_t *done;
+    uint64_t remaining;
+    struct dictParallelScanJob *jobs;
+};
+
+typedef struct dictParallelScanJob{
+    dictParallelScan *ps;
+    uint64_t part;
+    int steps;
+    dictScanFunction *fn;
+    dictDefragAllocFunctions *defragfns;
+    void *privdata;
+}dictParallelScanJob;
+
+dictParallelScan *dictParallelScanStart(dict *d, int bits){
+    assert(bits >= 0 && bits <= DICT_PARALLEL_SCAN_MAX_BITS);
+    dictParallelScan *ps = zmalloc(sizeof(*ps));
+    uint64_t parts = (uint64_t)1 << bits;
+    ps->d = d;
+    ps->bits = bits;
+    ps->cursors = zmalloc(sizeof(uint64_t) * parts);
+    ps->done = zcalloc(parts);
+    ps->jobs = zmalloc(sizeof(dictParallelScanJob) * parts);
+    ps->remaining = parts;
+    for(uint64_t p = 0; p < parts; p++)
+        ps->cursors[p] = p;
+    return ps;
+}
+
+void dictParallelScanRelease(dictParallelScan *ps){
+    zfree(ps->cursors);
+    zfree(ps->done);
+    zfree(ps->jobs);
+    zfree(ps);
+}
+
+static void dictParallelScanRun(void *arg){
+    dictParallelScanJob *job = arg;
+    dictParallelScan *ps = job->ps;
+    uint64_t mask = DICTHT_SIZE_MASK(ps->bits), v = ps->cursors[job->part];
+
+    for(int i = 0; i < job->steps; i++){
+        v = dictScanBuckets(ps->d, v, job->fn, job->defragfns, job->privdata);
+        //the carry of the reversed increment reached the partition bits, or the scan wrapped
+        if(v == 0 || (v & mask) != job->part){
+            ps->done[job->part] = 1;
+            break;
+        }
+    }
+    ps->cursors[job->part] = v;
+}
+
+//advance every unfinished partition by up to steps dictScan steps, on the pool when it is given.
+//privdata[p] goes to the callbacks of partition p, which run concurrently with the ones of other
+//partitions. the dict must not be used meanwhile, it may change between steps.
+//return 0 once every partition is done
+int dictParallelScanStep(dictParallelScan *ps, struct workerPool *pool, int steps, dictScanFunction *fn, dictDefragAllocFunctions *defragfns, void **privdata){
+    dict *d = ps->d;
+    uint64_t parts = (uint64_t)1 << ps->bits;
+
+    if(!ps->remaining)
+        return 0;
+    assert(!defragfns || !dictExtField(d, lockFree));
+    if(d->ht_used[0] + d->ht_used[1] == 0){
+        memset(ps->done, 1, parts);
+        ps->remaining = 0;
+        return 0;
+    }
+    dictBgLock(d);
+    int8_t minexp = d->ht_size_exp[0];
+    if(d->reHashIdx != -1 && d->ht_size_exp[1] < minexp)
+        minexp = d->ht_size_exp[1];
+    //slab defrag and open addressing group chains cross partitions
+    int parallel = pool && ps->bits <= minexp &&
+        !(defragfns && (dictExtField(d, entrySlab) || dictIsOpenAddressing(d)));
+    d->pauseRehash++;
+    for(uint64_t p = 0; p < parts; p++){
+        if(ps->done[p])
+            continue;
+        dictParallelScanJob *job = &ps->jobs[p];
+        *job = (dictParallelScanJob){ps, p, steps, fn, defragfns, privdata? privdata[p]: NULL};
+        if(parallel)
+            workerPoolSubmit(pool, dictParallelScanRun, job);
+        else
+            dictParallelScanRun(job);
+    }
+    if(parallel)
+        workerPoolWait(pool);
+    d->pauseRehash--;
+    dictBgUnlock(d);
+
+    ps->remaining = 0;
+    for(uint64_t p = 0; p < parts; p++)
+        ps->remaining += !ps->done[p];
+    return ps->remaining != 0;
+}
+
+/* ----------------------------- bulk builder -----------------------------
+ * dictBulkBuilder buffers key/value pairs, hashes a full batch at once, on a worker pool when
+ * it is given, sizes the table for the batch with one expand, and then links the batch with
+ * rehashing paused and the buckets of the next keys prefetched. Loads skip the cascade of
+ * expands and rehash steps that the same dictAdd calls would do. */
+
+#define DICT_BULK_BATCH 65536
+#define DICT_BULK_HASH_CHUNK 4096
+#define DICT_BULK_PREFETCH 16
+
+struct dictBulkBuilder{
+    dict *d;
+    int flags;
+    struct workerPool *pool;
+    dictBulkDupFunction *dupfn;
+    void *privdata;
+    size_t count;
+    void **keys, **vals;
+    uint64_t *hashes;
+    uint64_t added, dups;
+};
+
+typedef struct{
+    dict *d;
+    void **keys;
+    uint64_t *hashes;
+    size_t count;
+}dictBulkHashJob;
+
+static void dictBulkHashRun(void *arg){
+    dictBulkHashJob *job = arg;
+    dictHashKeys(job->d, (const void **)job->keys, job->count, job->hashes);
+}
+
+//size the table for size entries with one expand. returns 0 when that can't be done now, a safe
+//iterator or an unlink pauses rehashing or a running rehash has a target too small, and the
+//batch then goes in with the usual incremental steps instead of a rehash of the whole table
+static int dictBulkReserve(dict *d, uint64_t size){
+    int table = d->reHashIdx != -1? 1: 0;
+    if(DICTHT_SIZE(d->ht_size_exp[table]) >= size)
+        return 1;
+    if(d->pauseRehash > 0 || d->reHashIdx != -1 || !dictTypeExpandAllowed(d))
+        return 0;
+    return _dictExpand(d, size, NULL) == DICT_OK;
+}
+
+static void dictBulkFlush(dictBulkBuilder *b){
+    dict *d = b->d;
+    size_t count = b->count;
+
+    if(count == 0)
+        return;
+    if(b->pool && count >= 2 * DICT_BULK_HASH_CHUNK){
+        dictBulkHashJob jobs[DICT_BULK_BATCH / DICT_BULK_HASH_CHUNK];
+        size_t njobs = 0;
+        for(size_t i = 0; i < count; i += DICT_BULK_HASH_CHUNK, njobs++){
+            jobs[njobs] = (dictBulkHashJob){d, b->keys + i, b->hashes + i,
+                count - i < DICT_BULK_HASH_CHUNK? count - i: DICT_BULK_HASH_CHUNK};
+            workerPoolSubmit(b->pool, dictBulkHashRun, &jobs[njobs]);
+        }
+        workerPoolWait(b->pool);
+    }else{
+        dictBulkHashJob job = {d, b->keys, b->hashes, count};
+        dictBulkHashRun(&job);
+    }
+
+    dictBgLock(d);
+    //an unsized table grows and rehashes as dictAdd would make it
+    int reserved = dictBulkReserve(d, d->ht_used[0] + d->ht_used[1] + count);
+    if(reserved)
+        d->pauseRehash++;
+    for(size_t i = 0; i < count; i++){
+        //the bucket of a key ahead, then the chain head of a key half way there
+        if(reserved && !dictIsOpenAddressing(d)){
+            int table = d->reHashIdx != -1? 1: 0;
+            uint64_t mask = DICTHT_SIZE_MASK(d->ht_size_exp[table]);
+            if(i + DICT_BULK_PREFETCH < count)
+                __builtin_prefetch(&d->ht_table[table][b->hashes[i + DICT_BULK_PREFETCH] & mask]);
+            if(i + DICT_BULK_PREFETCH / 2 < count){
+                dictEntry *he = d->ht_table[table][b->hashes[i + DICT_BULK_PREFETCH / 2] & mask];
+                if(he && !entryIsKey(he))
+                    __builtin_prefetch(decodeMaskedPtr(he));
+            }
+        }
+        dictEntry *de;
+        int table = d->reHashIdx != -1? 1: 0;
+        if(reserved && b->flags & DICT_BULK_UNIQUE && !dictIsOpenAddressing(d) && d->ht_table[table]){
+            dictEntry **bucket = &d->ht_table[table][b->hashes[i] & DICTHT_SIZE_MASK(d->ht_size_exp[table])];
+            de = _dictInsertAtPositionWithHash(d, b->keys[i], bucket, b->hashes[i], 1);
+        }else{
+            de = _dictAddRawWithHash(d, b->keys[i], b->hashes[i], NULL);
+        }
+        if(!de){
+            b->dups++;
+            if(b->dupfn)
+                b->dupfn(b->privdata, b->keys[i], b->vals[i]);
+            continue;
+        }
+        if(!d->type->no_value)
+            dictSetVal(d, de, b->vals[i]);
+        b->added++;
+    }
+    if(reserved)
+        d->pauseRehash--;
+    dictBgUnlock(d);
+    b->count = 0;
+}
+
+//estimate is the number of keys expected, the table is sized for it right away. with
+//DICT_BULK_UNIQUE the caller vouches that no key is added twice or is in the dict already,
+//chained dicts then link each entry at its bucket head without looking at the chain
+dictBulkBuilder *dictBulkBuilderCreate(dict *d, uint64_t estimate, int flags, struct workerPool *pool, dictBulkDupFunction *dupfn, void *privdata){
+    dictBulkBuilder *b = zmalloc(sizeof(*b));
+    b->d = d;
+    b->flags = flags;
+    b->pool = pool;
+    b->dupfn = dupfn;
+    b->privdata = privdata;
+    b->count = 0;
+    b->keys = zmalloc(sizeof(void *) * DICT_BULK_BATCH);
+    b->vals = zmalloc(sizeof(void *) * DICT_BULK_BATCH);
+    b->hashes = zmalloc(sizeof(uint64_t) * DICT_BULK_BATCH);
+    b->added = b->dups = 0;
+    if(estimate){
+        dictBgLock(d);
+        dictBulkReserve(d, d->ht_used[0] + d->ht_used[1] + estimate);
+        dictBgUnlock(d);
+    }
+    return b;
+}
+
+//key and val are taken like dictAdd takes them, but only when their batch is linked, so both
+//must stay valid until dictBulkBuilderFinish. a key already in the dict is handed to dupfn
+//then, and the caller keeps owning it
+void dictBulkBuilderAdd(dictBulkBuilder *b, void *key, void *val){
+    b->keys[b->count] = key;
+    b->vals[b->count] = val;
+    if(++b->count == DICT_BULK_BATCH)
+        dictBulkFlush(b);
+}
+
+//link what is still buffered and free the builder, return the number of keys added
+uint64_t dictBulkBuilderFinish(dictBulkBuilder *b){
+    dictBulkFlush(b);
+    uint64_t added = b->added;
+    zfree(b->keys);
+    zfree(b->vals);
+    zfree(b->hashes);
+    zfree(b);
+    return added;
+}
+
+int dictResize(dict *d){
+    dictBgLock(d);
+    int ret = _dictResize(d);
+    dictBgUnlock(d);
+    return ret;
+}
+
+int dictRehash(dict *d, int n){
+    dictBgLock(d);
+    int ret = _dictRehash(d, n);
+    dictBgUnlock(d);
+    return ret;
+}
+
+dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing){
+    dictBgLock(d);
+    dictEntry *he = _dictAddRaw(d, key, existing);
+    dictBgUnlock(d);
+    return he;
+}
+
+void *dictFindPositionForInsert(dict *d, const void *key, dictEntry **existing){
+    dictBgLock(d);
+    void *position = _dictFindPositionForInsert(d, key, existing);
+    dictBgUnlock(d);
+    return position;
+}
+
+dictEntry *dictInsertAtPosition(dict *d, void *key, void *position){
+    dictBgLock(d);
+    dictEntry *he = _dictInsertAtPosition(d, key, position);
+    dictBgUnlock(d);
+    return he;
+}
+
+dictEntry *dictAddRawWithHash(dict *d, void *key, uint64_t hash, dictEntry **existing){
+    dictBgLock(d);
+    dictEntry *he = _dictAddRawWithHash(d, key, hash, existing);
+    dictBgUnlock(d);
+    return he;
+}
+
+void *dictFindPositionForInsertWithHash(dict *d, const void *key, uint64_t hash, dictEntry **existing){
+    dictBgLock(d);
+    void *position = _dictFindPositionForInsertWithHash(d, key, hash, existing);
+    dictBgUnlock(d);
+    return position;
+}
+
+dictEntry *dictInsertAtPositionWithHash(dict *d, void *key, void *position, uint64_t hash){
+    dictBgLock(d);
+    dictEntry *he = dictIsOpenAddressing(d)? dictOaInsertAtPosition(d, key, position, hash):
+        _dictInsertAtPositionWithHash(d, key, position, hash, 0);
+    dictBgUnlock(d);
+    return he;
+}
+
+dictEntry *dictFind(dict *d, const void *key){
+    dictBgLock(d);
+    dictEntry *he = _dictFind(d, key);
+    dictBgUnlock(d);
+    return he;
+}
+
+dictEntry *dictFindWithHash(dict *d, const void *key, uint64_t hash){
+    dictBgLock(d);
+    dictEntry *he = _dictFindWithHash(d, key, hash);
+    dictBgUnlock(d);
+    return he;
+}
+
+size_t dictFindBatch(dict *d, const void **keys, size_t n, dictEntry **out){
+    dictBgLock(d);
+    size_t found = _dictFindBatch(d, keys, n, out);
+    dictBgUnlock(d);
+    return found;
+}
+
+dictEntry *dictTwoPhaseUnlinkFind(dict *d, const void *key, dictEntry ***plink, int *table_index){
+    dictBgLock(d);
+    dictEntry *he = _dictTwoPhaseUnlinkFind(d, key, plink, table_index);
+    dictBgUnlock(d);
+    return he;
+}
+
+dictEntry *dictTwoPhaseUnlinkFindWithHash(dict *d, const void *key, uint64_t hash, dictEntry ***plink, int *table_index){
+    dictBgLock(d);
+    dictEntry *he = _dictTwoPhaseUnlinkFindWithHash(d, key, hash, plink, table_index);
+    dictBgUnlock(d);
+    return he;
+}
+
+void dictTwoPhaseUnlinkFree(dict *d, dictEntry *he, dictEntry **plink, int table_index){
+    dictBgLock(d);
+    _dictTwoPhaseUnlinkFree(d, he, plink, table_index);
+    dictBgUnlock(d);
+}
+
+size_t dictMemUsage(const dict *d){
+    dictBgLock((dict *)d);
+    size_t usage = _dictMemUsage(d);
+    dictBgUnlock((dict *)d);
+    return usage;
+}
+
+dictEntry *dictGetRandomKey(dict *d){
+    dictBgLock(d);
+    dictEntry *he = _dictGetRandomKey(d);
+    dictBgUnlock(d);
+    return he;
+}
+
+uint32_t dictGetSomeKeys(dict *d, dictEntry **des, uint32_t count){
+    dictBgLock(d);
+    uint32_t stored = _dictGetSomeKeys(d, des, count);
+    dictBgUnlock(d);
+    return stored;
+}
+
+uint64_t dictScanDefrag(dict *d, uint64_t v, dictScanFunction *fn, dictDefragAllocFunctions *defragfns, void *privdata){
+    dictBgLock(d);
+    v = _dictScanDefrag(d, v, fn, defragfns, privdata);
+    dictBgUnlock(d);
+    return v;
+}
+
+dictEntry *dictFindEntryByPtrAndHash(dict *d, const void *oldptr, uint64_t hash){
+    dictBgLock(d);
+    dictEntry *he = _dictFindEntryByPtrAndHash(d, oldptr, hash);
+    dictBgUnlock(d);
+    return he;
+}
+
+//the lookup, keyCompare and rehash/expand timing counters cost a branch per call while off,
+//not for concurrent_reads dicts whose readers would race on them
+int dictEnableStats(dict *d){
+    if(dictExtField(d, lockFree))
+        return DICT_ERR;
+    dictBgLock(d);
+    if(!dictExtField(d, stats))
+        dictExtOf(d)->stats = zcalloc(sizeof(struct dictStats));
+    dictBgUnlock(d);
+    return DICT_OK;
+}
+
+void dictDisableStats(dict *d){
+    dictBgLock(d);
+    if(d->ext){
+        zfree(d->ext->stats);
+        d->ext->stats = NULL;
+    }
+    dictBgUnlock(d);
+}
+
+//the filter is built from the keys already in d, which hashes all of them. not for open
+//addressing dicts, whose probes already stop at the first group with an EMPTY slot, nor for
+//concurrent_reads dicts whose readers would race on the counters
+int dictEnableBloom(dict *d){
+    if(dictIsOpenAddressing(d) || dictExtField(d, lockFree))
+        return DICT_ERR;
+    dictBgLock(d);
+    if(!dictExtField(d, bloom)){
+        dictExtOf(d)->bloom = zcalloc(sizeof(struct dictBloom));
+        dictBloomAlloc(&d->ext->bloom->f[0], d->ht_size_exp[0]);
+        if(d->reHashIdx != -1)
+            dictBloomAlloc(&d->ext->bloom->f[1], d->ht_size_exp[1]);
+        for(int table = 0; table <= 1; table++){
+            for(uint64_t i = 0; i < DICTHT_SIZE(d->ht_size_exp[table]); i++){
+                for(dictEntry *he = d->ht_table[table][i]; he; he = dictGetNext(he)){
+                    uint64_t hash = d->type->hashFunction(dictGetKey(he));
+                    dictBloomAdd(&d->ext->bloom->f[0], hash);
+                    if(table == 1)
+                        dictBloomAdd(&d->ext->bloom->f[1], hash);
+                }
+            }
+        }
+    }
+    dictBgUnlock(d);
+    return DICT_OK;
+}
+
+void dictDisableBloom(dict *d){
+    dictBgLock(d);
+    dictBloomRelease(d);
+    dictBgUnlock(d);
+}
+
+#define DICT_STATS_VECTLEN 50
+
+static size_t dictStatsAppend(char *buf, size_t bufSize, size_t l, const char *fmt, ...){
+    if(l >= bufSize)
+        return l;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + l, bufSize - l, fmt, ap);
+    va_end(ap);
+    return n < 0? l: l + n;
+}
+
+//"0=count,1=count,..." for the nonzero lengths, the last one counts the longer ones too
+static size_t dictStatsAppendHist(char *buf, size_t bufSize, size_t l, const char *name, int table, const uint64_t *hist){
+    l = dictStatsAppend(buf, bufSize, l, "ht%d_%s:", table, name);
+    const char *sep = "";
+    for(int i = 0; i < DICT_STATS_VECTLEN; i++){
+        if(!hist[i])
+            continue;
+        l = dictStatsAppend(buf, bufSize, l, "%s%d%s=%lu", sep, i, i == DICT_STATS_VECTLEN - 1? "+": "",
+            (unsigned long)hist[i]);
+        sep = ",";
+    }
+    return dictStatsAppend(buf, bufSize, l, "\r\n");
+}
+
+//chain lengths of one table. with a good hash they follow a Poisson distribution of the load
+//factor, buckets_used far below buckets_used_expected means keys cluster in few buckets
+static size_t dictGetStatsHt(char *buf, size_t bufSize, size_t l, dict *d, int table){
+    uint64_t hist[DICT_STATS_VECTLEN] = {0}, size = DICTHT_SIZE(d->ht_size_exp[table]);
+    uint64_t used = 0, maxlen = 0;
+
+    if(dictIsOpenAddressing(d))
+        return dictOaGetStatsHt(buf, bufSize, l, d, table);
+    for(uint64_t i = 0; i < size; i++){
+        uint64_t len = 0;
+        for(dictEntry *he = d->ht_table[table][i]; he; he = dictGetNext(he))
+            len++;
+        hist[len < DICT_STATS_VECTLEN? len: DICT_STATS_VECTLEN - 1]++;
+        used += len > 0;
+        maxlen = len > maxlen? len: maxlen;
+    }
+    double load = size? (double)d->ht_used[table] / size: 0;
+    l = dictStatsAppend(buf, bufSize, l,
+        "ht%d_buckets_used:%lu\r\nht%d_buckets_used_expected:%.0f\r\n"
+        "ht%d_max_chain_len:%lu\r\nht%d_avg_chain_len:%.3f\r\n",
+        table, (unsigned long)used, table, size * (1 - exp(-load)), table, (unsigned long)maxlen,
+        table, used? (double)d->ht_used[table] / used: 0);
+    return dictStatsAppendHist(buf, bufSize, l, "chain_len_hist", table, hist);
+}
+
+//machine readable "field:value\r\n" lines, values of the two tables are comma separated.
+//full walks the tables for the chain length histograms, and reads /proc/self/smaps for the
+//huge page coverage when d has huge page backed tables
+void dictGetStats(char *buf, size_t bufSize, dict *d, int full){
+    size_t l = 0;
+    if(bufSize == 0)
+        return;
+    dictBgLock(d);
+    uint64_t size0 = DICTHT_SIZE(d->ht_size_exp[0]), size1 = DICTHT_SIZE(d->ht_size_exp[1]);
+    //open addressing tables count groups, their load factor is per slot
+    uint64_t cap0 = dictIsOpenAddressing(d)? oaSlots(d->ht_size_exp[0]): size0;
+    uint64_t cap1 = dictIsOpenAddressing(d)? oaSlots(d->ht_size_exp[1]): size1;
+    l = dictStatsAppend(buf, bufSize, l, "table_size:%lu,%lu\r\nused:%lu,%lu\r\nrehashing:%d\r\n"
+        "load_factor:%.3f,%.3f\r\nrehash_progress:%.4f\r\n",
+        (unsigned long)size0, (unsigned long)size1, (unsigned long)d->ht_used[0], (unsigned long)d->ht_used[1],
+        d->reHashIdx != -1, cap0? (double)d->ht_used[0] / cap0: 0, cap1? (double)d->ht_used[1] / cap1: 0,
+        d->reHashIdx != -1 && size0? (double)d->reHashIdx / size0: 0);
+    if(dictExtField(d, bgRehash)){
+        struct dictBgRehash *bg = d->ext->bgRehash;
+        long long elapsed = bg->last_us - bg->start_us;
+        l = dictStatsAppend(buf, bufSize, l,
+            "bg_rehash_buckets_moved:%lu\r\nbg_rehash_total_buckets_moved:%lu\r\n"
+            "bg_rehash_buckets_per_sec:%.0f\r\nbg_rehash_work_buckets_per_sec:%.0f\r\n",
+            (unsigned long)bg->moved, (unsigned long)bg->total_moved,
+            elapsed > 0? (double)bg->moved * 1000000 / elapsed: 0,
+            bg->work_us > 0? (double)bg->moved * 1000000 / bg->work_us: 0);
+    }
+    if(dictExtField(d, lockFree))
+        l = dictStatsAppend(buf, bufSize, l, "retired_pending:%lu\r\n", (unsigned long)d->ext->lockFree->limbo.pending);
+    if(dictExtField(d, stats)){
+        struct dictStats *st = d->ext->stats;
+        l = dictStatsAppend(buf, bufSize, l,
+            "lookups:%lu\r\nkey_compares:%lu\r\nkey_compares_per_lookup:%.3f\r\nkey_compare_misses:%lu\r\n"
+            "rehash_calls:%lu\r\nrehash_time_us:%lu\r\nexpand_calls:%lu\r\nexpand_time_us:%lu\r\n",
+            (unsigned long)st->lookups, (unsigned long)st->key_compares,
+            st->lookups? (double)st->key_compares / st->lookups: 0, (unsigned long)st->key_compare_misses,
+            (unsigned long)st->rehash_calls, (unsigned long)(st->rehash_ns / 1000),
+            (unsigned long)st->expand_calls, (unsigned long)(st->expand_ns / 1000));
+    }
+    if(dictExtField(d, bloom)){
+        //the rate is over the lookups of keys that weren't there, the only ones it can fail
+        struct dictBloom *b = d->ext->bloom;
+        uint64_t absent = b->negatives + b->false_positives;
+        l = dictStatsAppend(buf, bufSize, l,
+            "bloom_bytes:%lu\r\nbloom_checks:%lu\r\nbloom_negatives:%lu\r\n"
+            "bloom_false_positives:%lu\r\nbloom_false_positive_rate:%.4f\r\n",
+            (unsigned long)(dictBloomBytes(&b->f[0]) + dictBloomBytes(&b->f[1])), (unsigned long)b->checks,
+            (unsigned long)b->negatives, (unsigned long)b->false_positives,
+            absent? (double)b->false_positives / absent: 0);
+    }
+    if(full){
+        int huge = 0;
+        for(int table = 0; table <= 1; table++){
+            int8_t exp = d->ht_size_exp[table];
+            size_t bytes = dictIsOpenAddressing(d)? dictOaTableBytes(exp): dictTableBytes(exp);
+            huge += bytes >= ZMALLOC_HUGE_THRESHOLD;
+            if(d->ht_table[table])
+                l = dictGetStatsHt(buf, bufSize, l, d, table);
+        }
+        if(huge)
+            l = dictStatsAppend(buf, bufSize, l, "huge_page_tables:%d\r\nanon_huge_pages_bytes:%lu\r\n",
+                huge, (unsigned long)zmalloc_get_huge_pages(-1));
+    }
+    if(d->type->lazy_free){
+        uint64_t effort, jobs = dictLazyFreePending(&effort);
+        l = dictStatsAppend(buf, bufSize, l, "lazy_free_pending:%lu\r\nlazy_free_pending_entries:%lu\r\n",
+            (unsigned long)jobs, (unsigned long)effort);
+    }
+    dictBgUnlock(d);
+    if(l >= bufSize)
+        buf[bufSize - 1] = '\0';
+}
+
+/* ----------------------------- open addressing engine -----------------------------
+ * dictType.open_addressing dicts keep their entries inline in groups of 16 slots, with one
+ * control byte per slot: EMPTY, DELETED or the top 7 bits of the hash. A probe loads the 16
+ * control bytes of a group at once and only compares keys whose tag matches, groups are
+ * probed linearly and a probe stops at the first group that still has an EMPTY slot.
+ * ht_size_exp[] is the log2 of the number of groups, ht_table[] points to the groups.
+ * A slot starts like a dictEntry (key, v), so the dictGet and dictSet accessors work on it,
+ * but slots move when the table is rehashed, never keep one across dict calls.
+ *
+ * dictType.bounded_probe tables give every key two groups, both mixed from all bits of the
+ * hash, and insert into the emptier of the two. A lookup reads both and
+ * stops, the worst case is two control lines plus the slots whose tag matches. An insert that
+ * finds both groups full grows the table once it is half full, below that the hash is taken
+ * for degenerate and the key spills linearly past its second group like a plain table does.
+ * The table is then marked overflowed, and lookups and deletes go back to the linear rules
+ * with tombstones until the next rehash builds a fresh table. */
+
+#define DICT_OA_GROUP_SLOTS 16
+#define DICT_OA_CTRL_EMPTY ((uint8_t)0x80)
+#define DICT_OA_CTRL_DELETED ((uint8_t)0xfe)
+#define DICT_OA_GROUP_FULL_MASK ((1u << DICT_OA_GROUP_SLOTS) - 1)
+
+typedef struct{
+    void *key;
+    union {
+        void *val;
+        uint64_t u64;
+        int64_t s64;
+        double d;
+    }v;
+}dictOaSlot;
+
+typedef struct{
+    uint8_t ctrl[DICT_OA_GROUP_SLOTS];
+    dictOaSlot slots[DICT_OA_GROUP_SLOTS];
+}dictOaGroup;
+
+static inline dictOaGroup *oaGroups(dict *d, int table){
+    return (dictOaGroup *)(void *)d->ht_table[table];
+}
+
+static inline uint64_t oaSlots(int8_t exp){
+    return DICTHT_SIZE(exp) * DICT_OA_GROUP_SLOTS;
+}
+
+static inline uint8_t oaTag(uint64_t hash){
+    return hash >> 57;
+}
+
+static inline uint32_t oaMatch(const dictOaGroup *grp, uint8_t c){
+#if defined(__SSE2__)
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)(const void *)grp->ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)c)));
+#else
+    uint32_t mask = 0;
+    for(int i = 0; i < DICT_OA_GROUP_SLOTS; i++)
+        if(grp->ctrl[i] == c)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+//EMPTY and DELETED are the only control bytes with the high bit set
+static inline uint32_t oaMatchFree(const dictOaGroup *grp){
+#if defined(__SSE2__)
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(const void *)grp->ctrl));
+#else
+    uint32_t mask = 0;
+    for(int i = 0; i < DICT_OA_GROUP_SLOTS; i++)
+        if(grp->ctrl[i] & 0x80)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+static inline uint32_t oaMatchFull(const dictOaGroup *grp){
+    return ~oaMatchFree(grp) & DICT_OA_GROUP_FULL_MASK;
+}
+
+//a group without EMPTY slot may have pushed probes into the following groups
+static inline int oaGroupEverFull(const dictOaGroup *grp){
+    return oaMatch(grp, DICT_OA_CTRL_EMPTY) == 0;
+}
+
+static size_t dictOaTableBytes(int8_t exp){
+    return DICTHT_SIZE(exp) * sizeof(dictOaGroup);
+}
+
+static dictOaGroup *oaAllocTable(int8_t exp, int *malloc_failed){
+    size_t size = dictOaTableBytes(exp);
+    dictOaGroup *groups;
+    if(malloc_failed){
+        groups = ztrycalloc_huge(size);
+        *malloc_failed = groups == NULL;
+        if(*malloc_failed)
+            return NULL;
+    }else{
+        groups = zcalloc_huge(size);
+    }
+    for(uint64_t g = 0; g < DICTHT_SIZE(exp); g++)
+        memset(groups[g].ctrl, DICT_OA_CTRL_EMPTY, sizeof(groups[g].ctrl));
+    return groups;
+}
+
+static void oaFreeTable(dictOaGroup *groups, int8_t exp){
+    zfree_huge(groups, dictOaTableBytes(exp));
+}
+
+//smallest exp whose table holds size entries below the 7/8 load factor
+static int8_t oaNextExp(uint64_t size){
+    int8_t e = 0;
+    if(size >= LONG_MAX / 2)
+        return (8 * sizeof(long) - 1) - 4;
+    while(oaSlots(e) - oaSlots(e) / 8 < size)
+        e++;
+    return e;
+}
+
+static inline int oaSlotIndex(dict *d, int table, const dictOaSlot *slot, dictOaGroup **grp){
+    size_t off = (const char *)(const void *)slot - (const char *)(void *)d->ht_table[table];
+    *grp = &oaGroups(d, table)[off / sizeof(dictOaGroup)];
+    return slot - (*grp)->slots;
+}
+
+static inline int oaKeyEqual(dict *d, const void *key, const void *other){
+    return key == other || (d->type->keyCompare && dictCompareKeys(d, key, other));
+}
+
+//the two groups of a key in a bounded_probe table come from all bits of the hash, so hashes
+//with poor low bits still spread. both are the low bits of values fixed per key, the groups of a
+//key in a bigger table reduce to its groups in a smaller one, which dictScan relies on
+static inline uint64_t oaHomeGroup(dict *d, uint64_t hash, uint64_t mask){
+    if(!d->type->bounded_probe)
+        return hash & mask;
+    uint64_t m = hash * 0x9e3779b97f4a7c15ULL;
+    return (m ^ (m >> 32)) & mask;
+}
+
+static inline uint64_t oaAltGroup(uint64_t hash, uint64_t mask){
+    uint64_t m = hash * 0xc2b2ae3d27d4eb4fULL;
+    return (m ^ (m >> 32)) & mask;
+}
+
+//byptr: match the key pointer only, without keyCompare
+static inline dictOaSlot *oaMatchKey(dict *d, dictOaGroup *grp, const void *key, uint8_t tag, int byptr){
+    uint32_t match = oaMatch(grp, tag);
+    while(match){
+        int i = __builtin_ctz(match);
+        if(byptr? grp->slots[i].key == key: oaKeyEqual(d, key, grp->slots[i].key))
+            return &grp->slots[i];
+        match &= match - 1;
+    }
+    return NULL;
+}
+
+static dictOaSlot *oaProbe(dict *d, int table, const void *key, uint64_t hash, int byptr){
+    if(d->ht_size_exp[table] == -1)
+        return NULL;
+    dictOaGroup *groups = oaGroups(d, table);
+    uint64_t mask = DICTHT_SIZE_MASK(d->ht_size_exp[table]);
+    uint64_t g = oaHomeGroup(d, hash, mask);
+    uint8_t tag = oaTag(hash);
+
+    if(d->type->bounded_probe){
+        dictOaSlot *slot = oaMatchKey(d, &groups[g], key, tag, byptr);
+        if(slot)
+            return slot;
+        g = oaAltGroup(hash, mask);
+        if(!d->ext->ht_overflowed[table])
+            return oaMatchKey(d, &groups[g], key, tag, byptr);
+        //spilled keys start past the second group, the loop reads it once more on the way
+    }
+    for(uint64_t probes = 0; probes <= mask; probes++){
+        dictOaGroup *grp = &groups[g];
+        dictOaSlot *slot = oaMatchKey(d, grp, key, tag, byptr);
+        if(slot)
+            return slot;
+        if(!oaGroupEverFull(grp))
+            return NULL;
+        g = (g + 1) & mask;
+    }
+    return NULL;
+}
+
+static inline dictOaSlot *oaFindInTable(dict *d, int table, const void *key, uint64_t hash){
+    return oaProbe(d, table, key, hash, 0);
+}
+
+static dictOaSlot *oaFindFree(dict *d, int table, uint64_t hash){
+    dictOaGroup *groups = oaGroups(d, table);
+    uint64_t mask = DICTHT_SIZE_MASK(d->ht_size_exp[table]);
+    uint64_t g = oaHomeGroup(d, hash, mask);
+
+    if(d->type->bounded_probe){
+        uint64_t alt = oaAltGroup(hash, mask);
+        uint32_t free = oaMatchFree(&groups[g]), altfree = oaMatchFree(&groups[alt]);
+        //the emptier group, so both groups of a key fill up evenly
+        if(__builtin_popcount(altfree) > __builtin_popcount(free))
+            return &groups[alt].slots[__builtin_ctz(altfree)];
+        if(free)
+            return &groups[g].slots[__builtin_ctz(free)];
+        d->ext->ht_overflowed[table] = 1;
+        g = (alt + 1) & mask;
+    }
+    for(uint64_t probes = 0; probes <= mask; probes++){
+        uint32_t free = oaMatchFree(&groups[g]);
+        if(free)
+            return &groups[g].slots[__builtin_ctz(free)];
+        g = (g + 1) & mask;
+    }
+    return NULL;
+}
+
+static dictOaSlot *oaInsertAt(dict *d, int table, dictOaSlot *slot, void *key, uint64_t hash){
+    dictOaGroup *grp;
+    int i = oaSlotIndex(d, table, slot, &grp);
+    if(grp->ctrl[i] == DICT_OA_CTRL_DELETED)
+        d->ext->ht_tombstones[table]--;
+    grp->ctrl[i] = oaTag(hash);
+    slot->key = key;
+    slot->v.u64 = 0;
+    d->ht_used[table]++;
+    return slot;
+}
+
+static void oaClearSlot(dict *d, int table, dictOaGroup *grp, int i){
+    //no probe goes past a group of a bounded table that never overflowed
+    if(oaGroupEverFull(grp) && (!d->type->bounded_probe || d->ext->ht_overflowed[table])){
+        grp->ctrl[i] = DICT_OA_CTRL_DELETED;
+        d->ext->ht_tombstones[table]++;
+    }else{
+        grp->ctrl[i] = DICT_OA_CTRL_EMPTY;
+    }
+    d->ht_used[table]--;
+}
+
+static int dictOaExpand(dict *d, uint64_t size, int *malloc_failed){
+    if(malloc_failed)
+        *malloc_failed = 0;
+    if(d->reHashIdx != -1 || d->ht_used[0] > size)
+        return DICT_ERR;
+    int8_t exp = oaNextExp(size);
+    //rebuilding at the same size is only worth it to drop tombstones
+    if(exp == d->ht_size_exp[0] && d->ext->ht_tombstones[0] == 0)
+        return DICT_ERR;
+    dictOaGroup *groups = oaAllocTable(exp, malloc_failed);
+    if(!groups)
+        return DICT_ERR;
+
+    int table = d->ht_table[0] == NULL? 0: 1;
+    d->ht_table[table] = (dictEntry **)(void *)groups;
+    d->ht_size_exp[table] = exp;
+    d->ht_used[table] = 0;
+    d->ext->ht_tombstones[table] = 0;
+    d->ext->ht_overflowed[table] = 0;
+    if(table == 1){
+        d->reHashIdx = 0;
+        dictRehashingStarted(d);
+    }
+    return DICT_OK;
+}
+
+static int oaMoveSlot(dict *d, int dst, dictOaSlot *slot){
+    uint64_t h = d->type->hashFunction(slot->key);
+    dictOaSlot *to = oaFindFree(d, dst, h);
+    if(!to)
+        return DICT_ERR;
+    oaInsertAt(d, dst, to, slot->key, h);
+    to->v = slot->v;
+    return DICT_OK;
+}
+
+static int dictOaRehash(dict *d, int n){
+    int empty_visits = n * 10;
+    if(dict_can_resize == DICT_RESIZE_FORBID || d->reHashIdx == -1)
+        return 0;
+
+    //inserts during a pause may have left the target too small for what table 0 still holds
+    uint64_t slots = oaSlots(d->ht_size_exp[1]);
+    if(d->ht_used[0] + d->ht_used[1] > slots - slots / 16 && d->pauseRehash == 0){
+        oaGrowTarget(d);
+        slots = oaSlots(d->ht_size_exp[1]);
+    }
+    dictOaGroup *groups = oaGroups(d, 0);
+    while(n-- && d->ht_used[0] != 0){
+        assert(DICTHT_SIZE(d->ht_size_exp[0]) > (uint64_t)d->reHashIdx);
+        dictOaGroup *grp = &groups[d->reHashIdx];
+        uint32_t full;
+        while((full = oaMatchFull(grp)) == 0){
+            d->reHashIdx++;
+            if(--empty_visits == 0)
+                return 1;
+            grp = &groups[d->reHashIdx];
+        }
+        //still paused, the group waits until the target can grow
+        if(d->ht_used[1] + __builtin_popcount(full) > slots)
+            return 1;
+        //a group that never overflowed can go back to EMPTY, the others keep the probes
+        //of the entries still waiting in table 0 going
+        uint8_t cleared = oaGroupEverFull(grp)? DICT_OA_CTRL_DELETED: DICT_OA_CTRL_EMPTY;
+        while(full){
+            int i = __builtin_ctz(full);
+            assert(oaMoveSlot(d, 1, &grp->slots[i]) == DICT_OK);
+            grp->ctrl[i] = cleared;
+            d->ht_used[0]--;
+            full &= full - 1;
+        }
+        d->reHashIdx++;
+    }
+
+    if(d->ht_used[0] == 0){
+        oaFreeTable(oaGroups(d, 0), d->ht_size_exp[0]);
+        d->ht_table[0] = d->ht_table[1];
+        d->ht_used[0] = d->ht_used[1];
+        d->ht_size_exp[0] = d->ht_size_exp[1];
+        d->ext->ht_tombstones[0] = d->ext->ht_tombstones[1];
+        d->ext->ht_overflowed[0] = d->ext->ht_overflowed[1];
+        _dictReset(d, 1);
+        d->reHashIdx = -1;
+        dictRehashingStopped(d);
+        return 0;
+    }
+    return 1;
+}
+
+//the target table of a rehash ran out of room while the rehash was paused:
+//move what it holds into a bigger one, the entries still in table 0 keep waiting
+static void oaGrowTarget(dict *d){
+    int8_t exp = oaNextExp((d->ht_used[0] + d->ht_used[1] + 1) * 2);
+    dictOaGroup *old = oaGroups(d, 1);
+    int8_t old_exp = d->ht_size_exp[1];
+    uint64_t size = DICTHT_SIZE(old_exp);
+
+    d->ht_table[1] = (dictEntry **)(void *)oaAllocTable(exp, NULL);
+    d->ht_size_exp[1] = exp;
+    d->ht_used[1] = 0;
+    d->ext->ht_tombstones[1] = 0;
+    d->ext->ht_overflowed[1] = 0;
+    for(uint64_t g = 0; g < size; g++){
+        uint32_t full = oaMatchFull(&old[g]);
+        while(full){
+            assert(oaMoveSlot(d, 1, &old[g].slots[__builtin_ctz(full)]) == DICT_OK);
+            full &= full - 1;
+        }
+    }
+    oaFreeTable(old, old_exp);
+}
+
+static int oaExpandIfNeeded(dict *d){
+    if(d->reHashIdx != -1){
+        uint64_t slots = oaSlots(d->ht_size_exp[1]);
+        if(d->ht_used[0] + d->ht_used[1] + d->ext->ht_tombstones[1] + 1 <= slots - slots / 16)
+            return DICT_OK;
+        //growing moves every slot of the target, not while safe iterators and unlinks hold on to them.
+        //the target takes the inserts meanwhile and the rest of table 0 waits for it to grow, only
+        //a target that has no free slot left at all can't take a key
+        if(d->pauseRehash > 0){
+            assert(d->ht_used[1] < slots);
+            return DICT_OK;
+        }
+        oaGrowTarget(d);
+        return DICT_OK;
+    }
+    if(d->ht_size_exp[0] == -1)
+        return _dictExpand(d, DICT_OA_GROUP_SLOTS - DICT_OA_GROUP_SLOTS / 8, NULL);
+
+    uint64_t slots = oaSlots(d->ht_size_exp[0]);
+    uint64_t limit = slots - slots / 8;
+    if(dict_can_resize == DICT_RESIZE_AVOID)
+        limit = slots - slots / 16;
+    else if(dict_can_resize == DICT_RESIZE_FORBID)
+        limit = slots - 1;
+    if(d->ht_used[0] + d->ext->ht_tombstones[0] + 1 <= limit)
+        return DICT_OK;
+    if(d->ht_used[0] + d->ext->ht_tombstones[0] + 1 < slots && !dictTypeExpandAllowed(d))
+        return DICT_OK;
+    //mostly tombstones: rebuild at the same size, otherwise double
+    if((d->ht_used[0] + 1) * 2 <= limit)
+        return _dictExpand(d, d->ht_used[0] + 1, NULL);
+    return _dictExpand(d, (d->ht_used[0] + 1) * 2, NULL);
+}
+
+//grow the table when both groups of the key are full in the table it goes to, unless the table
+//is less than half full, then the hash is to blame and a bigger table wouldn't help
+static void oaBoundedMakeRoom(dict *d, uint64_t hash){
+    int table = d->reHashIdx != -1? 1: 0;
+    dictOaGroup *groups = oaGroups(d, table);
+    uint64_t mask = DICTHT_SIZE_MASK(d->ht_size_exp[table]);
+    if(oaMatchFree(&groups[oaHomeGroup(d, hash, mask)]) || oaMatchFree(&groups[oaAltGroup(hash, mask)]))
+        return;
+    uint64_t used = d->ht_used[0] + d->ht_used[1];
+    if(dict_can_resize == DICT_RESIZE_FORBID || used * 2 < oaSlots(d->ht_size_exp[table]) || !dictTypeExpandAllowed(d))
+        return;
+    //a paused target isn't grown under the slots held on to, the key spills past its groups
+    if(table == 1 && d->pauseRehash == 0)
+        oaGrowTarget(d);
+    else if(table == 0)
+        _dictExpand(d, (used + 1) * 2, NULL);
+}
+
+static dictOaSlot *dictOaFindWithHash(dict *d, const void *key, uint64_t hash){
+    dictStatLookup(d);
+    dictOaSlot *slot = oaFindInTable(d, 0, key, hash);
+    if(!slot && d->reHashIdx != -1)
+        slot = oaFindInTable(d, 1, key, hash);
+    return slot;
+}
+
+static dictEntry *dictOaFind(dict *d, const void *key, uint64_t hash){
+    if(d->ht_used[0] + d->ht_used[1] == 0)
+        return NULL;
+    if(d->reHashIdx != -1)
+        _dictRehashStep(d);
+    return (dictEntry *)(void *)dictOaFindWithHash(d, key, hash);
+}
+
+static size_t dictOaFindBatch(dict *d, const void **keys, size_t n, dictEntry **out){
+    uint64_t hashes[DICT_FIND_BATCH_SIZE];
+    size_t found = 0;
+
+    for(size_t base = 0; base < n; base += DICT_FIND_BATCH_SIZE){
+        size_t cnt = n - base < DICT_FIND_BATCH_SIZE? n - base: DICT_FIND_BATCH_SIZE;
+        for(size_t j = 0; j < cnt && d->reHashIdx != -1; j++)
+            _dictRehashStep(d);
+        int tables = d->reHashIdx != -1? 2: 1;
+        dictHashKeys(d, keys + base, cnt, hashes);
+        for(size_t j = 0; j < cnt; j++){
+            for(int table = 0; table < tables; table++){
+                uint64_t mask = DICTHT_SIZE_MASK(d->ht_size_exp[table]);
+                __builtin_prefetch(&oaGroups(d, table)[oaHomeGroup(d, hashes[j], mask)]);
+                if(d->type->bounded_probe)
+                    __builtin_prefetch(&oaGroups(d, table)[oaAltGroup(hashes[j], mask)]);
+            }
+        }
+        for(size_t j = 0; j < cnt; j++){
+            out[base + j] = (dictEntry *)(void *)dictOaFindWithHash(d, keys[base + j], hashes[j]);
+            if(out[base + j])
+                found++;
+        }
+    }
+    return found;
+}
+
+static void *dictOaFindPositionWithHash(dict *d, const void *key, uint64_t hash, dictEntry **existing){
+    if(existing)
+        *existing = NULL;
+    if(d->reHashIdx != -1)
+        _dictRehashStep(d);
+    if(oaExpandIfNeeded(d) == DICT_ERR)
+        return NULL;
+    dictOaSlot *slot = dictOaFindWithHash(d, key, hash);
+    if(slot){
+        if(existing)
+            *existing = (dictEntry *)(void *)slot;
+        return NULL;
+    }
+    if(d->type->bounded_probe)
+        oaBoundedMakeRoom(d, hash);
+    return oaFindFree(d, d->reHashIdx != -1? 1: 0, hash);
+}
+
+static dictEntry *dictOaAddRawWithHash(dict *d, void *key, uint64_t hash, dictEntry **existing){
+    dictOaSlot *slot = dictOaFindPositionWithHash(d, key, hash, existing);
+    if(!slot)
+        return NULL;
+    if(d->type->keyDup)
+        key = d->type->keyDup(d, key);
+    return (dictEntry *)(void *)oaInsertAt(d, d->reHashIdx != -1? 1: 0, slot, key, hash);
+}
+
+static dictEntry *dictOaInsertAtPosition(dict *d, void *key, void *position, uint64_t hash){
+    int table = d->reHashIdx != -1? 1: 0;
+    dictOaSlot *slot = position;
+    assert((char *)position >= (char *)(void *)d->ht_table[table] &&
+        (char *)position < (char *)(void *)d->ht_table[table] + DICTHT_SIZE(d->ht_size_exp[table]) * sizeof(dictOaGroup));
+    assert(!d->type->dictEntryMetadataBYtes || d->type->dictEntryMetadataBYtes(d) == 0);
+    return (dictEntry *)(void *)oaInsertAt(d, table, slot, key, hash);
+}
+
+static void oaFreeSlotKeyVal(dict *d, dictOaSlot *slot){
+    if(d->type->keyDestructor)
+        d->type->keyDestructor(d, slot->key);
+    if(d->type->valDestructor)
+        d->type->valDestructor(d, slot->v.val);
+}
+
+static int oaLocate(dict *d, const void *key, uint64_t hash, int *table, dictOaGroup **grp){
+    dictStatLookup(d);
+    for(*table = 0; *table <= 1; (*table)++){
+        dictOaSlot *slot = oaFindInTable(d, *table, key, hash);
+        if(slot)
+            return oaSlotIndex(d, *table, slot, grp);
+        if(d->reHashIdx == -1)
+            break;
+    }
+    return -1;
+}
+
+//an unlinked entry is copied out of its slot into a heap dictEntry, it has to stay valid
+//until dictFreeUnlinkedEntry while the slot itself can be reused by the next insert
+static dictEntry *dictOaGenericDelete(dict *d, const void *key, int nofree){
+    dictOaGroup *grp;
+    int table;
+
+    if(d->ht_used[0] + d->ht_used[1] == 0)
+        return NULL;
+    if(d->reHashIdx != -1)
+        _dictRehashStep(d);
+    int i = oaLocate(d, key, d->type->hashFunction(key), &table, &grp);
+    if(i == -1)
+        return NULL;
+
+    dictOaSlot *slot = &grp->slots[i];
+    dictEntry *he = (dictEntry *)(void *)slot;
+    if(nofree){
+        he = zmalloc(sizeof(*he));
+        he->key = slot->key;
+        he->v.u64 = slot->v.u64;
+        he->next = NULL;
+    }else{
+        oaFreeSlotKeyVal(d, slot);
+    }
+    oaClearSlot(d, table, grp, i);
+    return he;
+}
+
+static dictEntry *dictOaTwoPhaseUnlinkFind(dict *d, const void *key, uint64_t hash, dictEntry ***plink, int *table_index){
+    dictOaGroup *grp;
+    int table;
+
+    if(d->ht_used[0] + d->ht_used[1] == 0)
+        return NULL;
+    if(d->reHashIdx != -1)
+        _dictRehashStep(d);
+    int i = oaLocate(d, key, hash, &table, &grp);
+    if(i == -1)
+        return NULL;
+    *table_index = table;
+    *plink = (dictEntry **)(void *)&grp->slots[i];
+    d->pauseRehash++;
+    return (dictEntry *)(void *)&grp->slots[i];
+}
+
+static void dictOaTwoPhaseUnlinkFree(dict *d, dictEntry *he, int table_index){
+    dictOaGroup *grp;
+    dictOaSlot *slot = (dictOaSlot *)(void *)he;
+    int i = oaSlotIndex(d, table_index, slot, &grp);
+    oaFreeSlotKeyVal(d, slot);
+    oaClearSlot(d, table_index, grp, i);
+    d->pauseRehash--;
+}
+
+static void dictOaClear(dict *d, int htidx, void(callback)(dict *)){
+    dictOaGroup *groups = oaGroups(d, htidx);
+    for(uint64_t g = 0; g < DICTHT_SIZE(d->ht_size_exp[htidx]) && d->ht_used[htidx]; g++){
+        if(callback && (g & 0xfff) == 0)
+            callback(d);
+        uint32_t full = oaMatchFull(&groups[g]);
+        while(full){
+            oaFreeSlotKeyVal(d, &groups[g].slots[__builtin_ctz(full)]);
+            d->ht_used[htidx]--;
+            full &= full - 1;
+        }
+    }
+    oaFreeTable(oaGroups(d, htidx), d->ht_size_exp[htidx]);
+    _dictReset(d, htidx);
+}
+
+//iter->index counts slots over the whole table
+static dictEntry *dictOaNext(dictIterator *iter){
+    dict *d = iter->d;
+    if(iter->index == -1 && iter->table == 0)
+        dictIteratorStart(iter);
+    while(1){
+        iter->index++;
+        if((uint64_t)iter->index >= oaSlots(d->ht_size_exp[iter->table])){
+            if(d->reHashIdx != -1 && iter->table == 0){
+                iter->table++;
+                iter->index = -1;
+                continue;
+            }
+            iter->entry = NULL;
+            return NULL;
+        }
+        dictOaGroup *grp = &oaGroups(d, iter->table)[iter->index / DICT_OA_GROUP_SLOTS];
+        int i = iter->index % DICT_OA_GROUP_SLOTS;
+        uint32_t full = oaMatchFull(grp) >> i;
+        if(full){
+            iter->index += __builtin_ctz(full);
+            iter->entry = (dictEntry *)(void *)&grp->slots[iter->index % DICT_OA_GROUP_SLOTS];
+            return iter->entry;
+        }
+        iter->index |= DICT_OA_GROUP_SLOTS - 1;
+    }
+}
+
+static dictEntry *dictOaGetRandomKey(dict *d){
+    if(d->ht_used[0] + d->ht_used[1] == 0)
+        return NULL;
+    if(d->reHashIdx != -1)
+        _dictRehashStep(d);
+    while(1){
+        int table = 0;
+        uint64_t s0 = DICTHT_SIZE(d->ht_size_exp[0]);
+        uint64_t g;
+        if(d->reHashIdx != -1){
+            //groups of table 0 below reHashIdx are empty already
+            g = d->reHashIdx + (genrand64_int64() % (s0 + DICTHT_SIZE(d->ht_size_exp[1]) - d->reHashIdx));
+            if(g >= s0){
+                g -= s0;
+                table = 1;
+            }
+        }else{
+            g = genrand64_int64() & DICTHT_SIZE_MASK(d->ht_size_exp[0]);
+        }
+        dictOaGroup *grp = &oaGroups(d, table)[g];
+        uint32_t full = oaMatchFull(grp);
+        if(!full)
+            continue;
+        int pick = genrand64_int64() % __builtin_popcount(full);
+        while(pick--)
+            full &= full - 1;
+        return (dictEntry *)(void *)&grp->slots[__builtin_ctz(full)];
+    }
+}
+
+static uint32_t dictOaGetSomeKeys(dict *d, dictEntry **des, uint32_t count){
+    uint64_t stored = 0, maxsizemask, maxsteps;
+    if(d->ht_used[0] + d->ht_used[1] < count)
+        count = d->ht_used[0] + d->ht_used[1];
+    maxsteps = count * 10;
+    for(uint32_t j = 0; j < count && d->reHashIdx != -1; j++)
+        _dictRehashStep(d);
+
+    int tables = d->reHashIdx != -1? 2: 1;
+    maxsizemask = DICTHT_SIZE_MASK(d->ht_size_exp[0]);
+    if(tables > 1 && maxsizemask < DICTHT_SIZE_MASK(d->ht_size_exp[1]))
+        maxsizemask = DICTHT_SIZE_MASK(d->ht_size_exp[1]);
+    uint64_t g = genrand64_int64() & maxsizemask;
+    while(stored < count && maxsteps--){
+        for(int j = 0; j < tables; j++){
+            if(tables == 2 && j == 0 && g < (uint64_t)d->reHashIdx)
+                continue;
+            if(g >= DICTHT_SIZE(d->ht_size_exp[j]))
+                continue;
+            dictOaGroup *grp = &oaGroups(d, j)[g];
+            uint32_t full = oaMatchFull(grp);
+            while(full){
+                dictEntry *he = (dictEntry *)(void *)&grp->slots[__builtin_ctz(full)];
+                if(stored < count){
+                    des[stored] = he;
+                }else{
+                    uint64_t r = genrand64_int64() % (stored + 1);
+                    if(r < count)
+                        des[r] = he;
+                }
+                stored++;
+                full &= full - 1;
+            }
+        }
+        g = (g + 1) & maxsizemask;
+    }
+    return stored > count? count: stored;
+}
+
+//visit the group at the cursor and, while groups were ever full, the groups its probes
+//may have spilled into, so every entry is reached from its home group
+static void oaScanGroupChain(dict *d, int table, uint64_t g, dictScanFunction *fn, dictDefragAllocFunctions *defragfns, void *privdata){
+    dictOaGroup *groups = oaGroups(d, table);
+    uint64_t mask = DICTHT_SIZE_MASK(d->ht_size_exp[table]);
+    uint64_t start = g &= mask;
+    do{
+        dictOaGroup *grp = &groups[g];
+        uint32_t full = oaMatchFull(grp);
+        while(full){
+            dictOaSlot *slot = &grp->slots[__builtin_ctz(full)];
+            if(defragfns){
+                void *newkey = defragfns->defragKey? defragfns->defragKey(slot->key): NULL;
+                void *newval = defragfns->defragVal && !d->type->no_value? defragfns->defragVal(slot->v.val): NULL;
+                if(newkey)
+                    slot->key = newkey;
+                if(newval)
+                    slot->v.val = newval;
+            }
+            fn(privdata, (dictEntry *)(void *)slot);
+            full &= full - 1;
+        }
+        if(!oaGroupEverFull(grp) || (d->type->bounded_probe && !d->ext->ht_overflowed[table]))
+            break;
+        g = (g + 1) & mask;
+    }while(g != start);
+}
+
+static uint64_t dictOaScan(dict *d, uint64_t v, dictScanFunction *fn, dictDefragAllocFunctions *defragfns, void *privdata){
+    uint64_t m0, m1;
+    int htidx0, htidx1;
+
+    if(d->reHashIdx == -1){
+        m0 = DICTHT_SIZE_MASK(d->ht_size_exp[0]);
+        oaScanGroupChain(d, 0, v & m0, fn, defragfns, privdata);
+        v |= ~m0;
+        v = rev(v);
+        v++;
+        v = rev(v);
+    }else{
+        htidx0 = 0;
+        htidx1 = 1;
+        if(DICTHT_SIZE(d->ht_size_exp[htidx0]) > DICTHT_SIZE(d->ht_size_exp[htidx1])){
+            htidx0 = 1;
+            htidx1 = 0;
+        }
+        m0 = DICTHT_SIZE_MASK(d->ht_size_exp[htidx0]);
+        m1 = DICTHT_SIZE_MASK(d->ht_size_exp[htidx1]);
+        oaScanGroupChain(d, htidx0, v & m0, fn, defragfns, privdata);
+        do{
+            oaScanGroupChain(d, htidx1, v & m1, fn, defragfns, privdata);
+            v |= ~m1;
+            v = rev(v);
+            v++;
+            v = rev(v);
+        }while(v & (m0 ^ m1));
+    }
+    return v;
+}
+
+static dictEntry *dictOaFindEntryByPtrAndHash(dict *d, const void *oldptr, uint64_t hash){
+    for(int table = 0; table <= 1; table++){
+        if(d->ht_size_exp[table] == -1)
+            break;
+        dictOaSlot *slot = oaProbe(d, table, oldptr, hash, 1);
+        if(slot)
+            return (dictEntry *)(void *)slot;
+        if(d->reHashIdx == -1)
+            break;
+    }
+    return NULL;
+}
+
+//group fill and probe lengths, the groups a key sits past its home group, of one table
+static size_t dictOaGetStatsHt(char *buf, size_t bufSize, size_t l, dict *d, int table){
+    uint64_t fill[DICT_STATS_VECTLEN] = {0}, probe[DICT_STATS_VECTLEN] = {0};
+    uint64_t groups = DICTHT_SIZE(d->ht_size_exp[table]), mask = groups - 1, used = 0, maxprobe = 0;
+    dictOaGroup *grp = oaGroups(d, table);
+
+    for(uint64_t g = 0; g < groups; g++){
+        uint32_t full = oaMatchFull(&grp[g]);
+        fill[__builtin_popcount(full)]++;
+        used += full != 0;
+        while(full){
+            uint64_t hash = d->type->hashFunction(grp[g].slots[__builtin_ctz(full)].key);
+            uint64_t home = oaHomeGroup(d, hash, mask), dist = (g - home) & mask;
+            //the second group of a bounded table is one probe away, spills go on from there
+            if(d->type->bounded_probe && dist){
+                uint64_t alt = oaAltGroup(hash, mask);
+                dist = g == alt? 1: 1 + ((g - alt) & mask);
+            }
+            probe[dist < DICT_STATS_VECTLEN? dist: DICT_STATS_VECTLEN - 1]++;
+            maxprobe = dist > maxprobe? dist: maxprobe;
+            full &= full - 1;
+        }
+    }
+    l = dictStatsAppend(buf, bufSize, l, "ht%d_groups_used:%lu\r\nht%d_tombstones:%lu\r\nht%d_max_probe_len:%lu\r\n",
+        table, (unsigned long)used, table, (unsigned long)d->ext->ht_tombstones[table], table, (unsigned long)maxprobe);
+    if(d->type->bounded_probe)
+        l = dictStatsAppend(buf, bufSize, l, "ht%d_overflowed:%d\r\n", table, d->ext->ht_overflowed[table]);
+    l = dictStatsAppendHist(buf, bufSize, l, "group_fill_hist", table, fill);
+    return dictStatsAppendHist(buf, bufSize, l, "probe_len_hist", table, probe);
+}
+
+static size_t dictOaMemUsage(const dict *d){
+    return (DICTHT_SIZE(d->ht_size_exp[0]) + DICTHT_SIZE(d->ht_size_exp[1])) * sizeof(dictOaGroup);
+}
+
+#ifdef REDIS_TEST
+#include <time.h>
+#include "sds.h"
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+uint64_t dictTestIntHash(const void *key){
+    uintptr_t k = (uintptr_t)key;
+    return dictGenHashFunction(&k, sizeof(k));
+}
+
+uint64_t dictTestSdsHash(const void *key){
+    return dictGenHashFunction(key, sdslen((const sds)key));
+}
+
+static dictType dictTestIntType = {
+    .hashFunction = dictTestIntHash,
+};
+
+//redis-server test findbatch [keys], dictFindBatch finds what dictFind finds in batches of several
+//sizes on a settled dict, halfway through a paused rehash and while lookups step the rehash, then
+//both look every key up in random order
+int dictFindBatchTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 1000000;
+    keys = keys < 1000? 1000: keys;
+    const void **batch = zmalloc(keys * sizeof(void *));
+    dictEntry **out = zmalloc(keys * sizeof(dictEntry *));
+
+    //keys 1 to keys are in, keys + 1 to 2 * keys are not
+    dict *d = dictCreate(&dictTestIntType);
+    for(uintptr_t k = 1; k <= keys; k++)
+        assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+    while(dictRehash(d, 1000));
+    size_t sizes[4] = {1, 7, DICT_FIND_BATCH_SIZE, 1000};
+    for(int c = 0; c < 3; c++){
+        if(c == 1){
+            assert(dictExpand(d, keys * 8) == DICT_OK);
+            while(d->ht_used[0] > keys / 2)
+                dictRehash(d, 100);
+            assert(d->reHashIdx != -1);
+            d->pauseRehash++;
+        }else if(c == 2){
+            d->pauseRehash--;
+        }
+        for(int s = 0; s < 4; s++){
+            for(uintptr_t k = 1; k <= 2 * keys;){
+                size_t n = 0, hits = 0;
+                for(; n < sizes[s] && k <= 2 * keys; n++, k++){
+                    batch[n] = (void *)k;
+                    hits += k <= keys;
+                }
+                assert(dictFindBatch(d, batch, n, out) == hits);
+                for(size_t j = 0; j < n; j++)
+                    assert(out[j] == dictFind(d, batch[j]) && (out[j] != NULL) == ((uintptr_t)batch[j] <= keys));
+            }
+        }
+        assert(c != 1 || d->reHashIdx != -1);
+    }
+    assert(d->reHashIdx == -1);
+
+    //every key once in random order, one at a time and in batches
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    for(uintptr_t k = 1; k <= keys; k++)
+        batch[k - 1] = (void *)k;
+    for(uint64_t i = keys - 1; i > 0; i--){
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        uint64_t j = x % (i + 1);
+        const void *tmp = batch[i];
+        batch[i] = batch[j];
+        batch[j] = tmp;
+    }
+    long long start = monotonicUs();
+    for(uint64_t i = 0; i < keys; i++)
+        assert(dictFind(d, batch[i]));
+    long long find_us = monotonicUs() - start;
+    start = monotonicUs();
+    for(uint64_t i = 0; i < keys; i += 64)
+        assert(dictFindBatch(d, batch + i, keys - i < 64? keys - i: 64, out + i) == (keys - i < 64? keys - i: 64));
+    long long batch_us = monotonicUs() - start;
+    printf("%llu keys in random order: dictFind %.1f ns, dictFindBatch %.1f ns per lookup\n",
+        (unsigned long long)keys, find_us * 1e3 / keys, batch_us * 1e3 / keys);
+    dictRelease(d);
+    zfree(batch);
+    zfree(out);
+    return 0;
+}
+
+//redis-server test bgrehash [keys], the helper thread comes and goes with the dicts that use it,
+//finishes rehashes the main thread keeps changing the dict under, and lets go of a released dict
+int dictBgRehashTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 1000000;
+    //fewer rehash too fast to be caught halfway
+    keys = keys < 100000? 100000: keys;
+    size_t base = zmalloc_used_memory();
+
+    //enabling twice is a no op, disabling drops the dict from the helper's list
+    dict *d = dictCreate(&dictTestIntType);
+    for(int i = 0; i < 100; i++){
+        assert(dictEnableBackgroundRehash(d) == DICT_OK && dictEnableBackgroundRehash(d) == DICT_OK);
+        assert(dictExtField(d, bgRehash) && bg_rehash.running && bg_rehash.head == d->ext->bgRehash);
+        dictDisableBackgroundRehash(d);
+        dictDisableBackgroundRehash(d);
+        assert(!dictExtField(d, bgRehash) && bg_rehash.head == NULL);
+    }
+    dictType oa = {.hashFunction = dictTestIntHash, .open_addressing = 1};
+    dict *oad = dictCreate(&oa);
+    assert(dictEnableBackgroundRehash(oad) == DICT_ERR);
+    dictRelease(oad);
+
+    //adds and deletes go on while the helper moves buckets, a safe iterator holds it off
+    for(uintptr_t k = 1; k <= keys; k++)
+        assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+    while(dictRehash(d, 1000));
+    assert(dictEnableBackgroundRehash(d) == DICT_OK);
+    assert(dictExpand(d, keys * 4) == DICT_OK && d->reHashIdx != -1);
+    dictIterator *iter = dictGetSafeIterator(d);
+    dictNext(iter);
+    long idx = d->reHashIdx;
+    struct timespec ts = {0, 5 * 1000000};
+    nanosleep(&ts, NULL);
+    assert(d->reHashIdx == idx);
+    dictReleaseIterator(iter);
+    long long start = monotonicUs();
+    uintptr_t next = keys + 1, ops = 0;
+    while(d->reHashIdx != -1){
+        assert(dictAdd(d, (void *)next, NULL) == DICT_OK);
+        assert(dictDelete(d, (void *)(next - keys)) == DICT_OK);
+        assert(dictFind(d, (void *)next));
+        next++;
+        ops++;
+        assert(monotonicUs() - start < 60 * 1000000);
+    }
+    long long rehash_us = monotonicUs() - start;
+    uint64_t moved = d->ext->bgRehash->total_moved;
+    assert(moved > 0);
+    for(uintptr_t k = next - keys; k < next; k++)
+        assert(dictFind(d, (void *)k));
+    assert(dictFind(d, (void *)(next - keys - 1)) == NULL && d->ht_used[0] == keys);
+    printf("rehash of %llu keys done in %.1f ms with %llu adds and deletes meanwhile, %llu buckets moved "
+        "by the helper\n", (unsigned long long)keys, rehash_us / 1e3, (unsigned long long)ops, (unsigned long long)moved);
+
+    //a release while the helper is at it waits for its batch and takes the dict off its list
+    int midway = 0;
+    for(int i = 0; i < 20; i++){
+        assert(dictExpand(d, DICTHT_SIZE(d->ht_size_exp[0]) * 4) == DICT_OK);
+        nanosleep(&(struct timespec){0, i * 50 * 1000}, NULL);
+        midway += d->reHashIdx != -1;
+        dictRelease(d);
+        assert(bg_rehash.head == NULL);
+        d = dictCreate(&dictTestIntType);
+        for(uintptr_t k = 1; k <= keys / 10; k++)
+            assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+        while(dictRehash(d, 1000));
+        assert(dictEnableBackgroundRehash(d) == DICT_OK);
+    }
+    dictRelease(d);
+    printf("%d of 20 dicts released halfway through a rehash\n", midway);
+    assert(midway > 0 && bg_rehash.head == NULL && zmalloc_used_memory() == base);
+    return 0;
+}
+
+static dictType dictTestSlabTypes[2] = {
+    {.hashFunction = dictTestIntHash, .entry_slab = 1},
+    {.hashFunction = dictTestIntHash, .entry_slab = 1, .no_value = 1},
+};
+
+//redis-server test entryslab [keys], the slab on its own across page boundaries, then the entry
+//slabs of dicts with and without values
+int dictEntrySlabTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 1000000;
+    size_t base = zmalloc_used_memory();
+
+    //three and a half pages of objects, each holding its own address
+    slab *s = slabCreate(24);
+    uint64_t n = s->perpage * 7 / 2;
+    void **objs = zmalloc(n * sizeof(void *));
+    for(uint64_t i = 0; i < n; i++){
+        objs[i] = slabAlloc(s);
+        *(void **)objs[i] = objs[i];
+        assert(i == 0 || objs[i] != objs[i - 1]);
+    }
+    assert(s->pages == 4 && s->objects == n);
+    assert(slabMemUsage(s) == sizeof(*s) + 4 * SLAB_PAGE_SIZE);
+    //slots freed on a full page are taken again once the last page is full, before a new page
+    //is needed. the addresses in objs then are the live objects again
+    uint32_t perpage = s->perpage;
+    for(uint64_t i = perpage; i < 2 * perpage; i += 2)
+        slabFree(s, objs[i]);
+    objs = zrealloc(objs, 4 * perpage * sizeof(void *));
+    for(uint64_t i = n; i < 4 * perpage; i++){
+        objs[i] = slabAlloc(s);
+        *(void **)objs[i] = objs[i];
+    }
+    n = 4 * perpage;
+    for(uint64_t i = perpage; i < 2 * perpage; i += 2){
+        void *ptr = slabAlloc(s);
+        int reused = 0;
+        for(uint64_t j = perpage; j < 2 * perpage; j += 2)
+            reused |= ptr == objs[j];
+        assert(reused);
+        *(void **)ptr = ptr;
+    }
+    assert(s->pages == 4 && s->objects == n);
+    for(uint64_t i = 0; i < n; i++){
+        assert(*(void **)objs[i] == objs[i]);
+        assert(((uintptr_t)objs[i] & (SLAB_PAGE_SIZE - 1)) + s->objsize <= SLAB_PAGE_SIZE);
+    }
+    //a page goes back as soon as it is empty
+    for(uint64_t i = 0; i < perpage; i++)
+        slabFree(s, objs[i]);
+    assert(s->pages == 3);
+    for(uint64_t i = perpage; i < n; i++)
+        slabFree(s, objs[i]);
+    assert(s->pages == 0 && s->objects == 0);
+    slabRelease(s);
+    zfree(objs);
+
+    for(int t = 0; t < 2; t++){
+        dict *d = dictCreate(&dictTestSlabTypes[t]);
+        for(uintptr_t k = 1; k <= keys; k++)
+            assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+        assert(dictExtField(d, entrySlab) && d->ext->entrySlab->objects == keys);
+        uint64_t pages = d->ext->entrySlab->pages;
+        assert(pages == (keys + d->ext->entrySlab->perpage - 1) / d->ext->entrySlab->perpage);
+        //deletes free slots all over the pages, the adds after them take those slots
+        for(uintptr_t k = 1; k <= keys; k += 2)
+            assert(dictDelete(d, (void *)k) == DICT_OK);
+        assert(d->ext->entrySlab->objects == keys / 2 && d->ext->entrySlab->pages == pages);
+        for(uintptr_t k = keys + 1; k <= keys + keys / 2; k++)
+            assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+        assert(d->ext->entrySlab->objects == keys && d->ext->entrySlab->pages == pages);
+        //emptying gives every page back, the slab stays for the next inserts
+        dictEmpty(d, NULL);
+        assert(d->ext->entrySlab->objects == 0 && d->ext->entrySlab->pages == 0);
+        for(uintptr_t k = 1; k <= keys / 4; k++)
+            assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+        printf("%s: %llu keys, %llu entry pages, %.1f bytes per entry\n", t? "no value": "with value",
+            (unsigned long long)keys, (unsigned long long)pages, (double)pages * SLAB_PAGE_SIZE / keys);
+        dictRelease(d);
+    }
+    assert(zmalloc_used_memory() == base);
+    return 0;
+}
+
+static uint64_t dict_test_tag_compares = 0;
+
+//keys point to a value, the hash is the value without its low byte, so keys may collide fully
+static uint64_t dictTestTagHash(const void *key){
+    return *(const uint64_t *)key >> 8;
+}
+
+static int dictTestTagCompare(dict *d, const void *key1, const void *key2){
+    (void)d;
+    dict_test_tag_compares++;
+    return *(const uint64_t *)key1 == *(const uint64_t *)key2;
+}
+
+static dictType dictTestTagTypes[2] = {
+    {.hashFunction = dictTestTagHash, .keyCompare = dictTestTagCompare},
+    {.hashFunction = dictTestTagHash, .keyCompare = dictTestTagCompare, .no_value = 1},
+};
+
+//every entry's tag matches its own hash, and with valid >= 0 keeps that many bits
+static void dictTestCheckTags(dict *d, int valid){
+    for(int table = 0; table <= 1; table++){
+        for(uint64_t b = 0; d->ht_table[table] && b < DICTHT_SIZE(d->ht_size_exp[table]); b++){
+            for(dictEntry *de = d->ht_table[table][b]; de; de = dictGetNext(de)){
+                uint64_t h = d->type->hashFunction(dictGetKey(de));
+                assert((h & DICTHT_SIZE_MASK(d->ht_size_exp[table])) == b);
+                assert(dictEntryTagMatch(de, h, d->ht_size_exp[table]));
+                assert(!DICT_ENTRY_TAGS || valid < 0 || entryTagValid(dictGetTag(de)) == valid);
+            }
+        }
+    }
+}
+
+//finds every key of vals whose index i has i % step == 0 with dictFind and dictFindBatch, a
+//copy of the value is looked up so keyCompare can't be skipped. returns the keyCompare calls
+static uint64_t dictTestFindTagged(dict *d, uint64_t *vals, uint64_t n, uint64_t step){
+    uint64_t copies[DICT_FIND_BATCH_SIZE];
+    const void *batch[DICT_FIND_BATCH_SIZE];
+    dictEntry *found[DICT_FIND_BATCH_SIZE], *out[DICT_FIND_BATCH_SIZE];
+    uint64_t start = dict_test_tag_compares;
+    for(uint64_t i = 0; i < n; i += DICT_FIND_BATCH_SIZE){
+        size_t cnt = n - i < DICT_FIND_BATCH_SIZE? n - i: DICT_FIND_BATCH_SIZE, hits = 0;
+        for(size_t j = 0; j < cnt; j++){
+            copies[j] = vals[i + j];
+            batch[j] = &copies[j];
+            found[j] = dictFind(d, &copies[j]);
+            assert((found[j] != NULL) == ((i + j) % step == 0));
+            assert(!found[j] || dictGetKey(found[j]) == &vals[i + j]);
+            hits += found[j] != NULL;
+        }
+        //rehash steps relink entries, they don't move them
+        assert(dictFindBatch(d, batch, cnt, out) == hits);
+        assert(!memcmp(out, found, cnt * sizeof(dictEntry *)));
+    }
+    return dict_test_tag_compares - start;
+}
+
+//redis-server test entrytags [keys], keys in one bucket told apart by their tags, keys with the
+//same hash told apart by keyCompare, and tags that stay right over growing and shrinking rehashes
+int dictEntryTagTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 200000;
+    uint64_t *vals = zmalloc(keys * sizeof(uint64_t));
+
+    for(int t = 0; t < 2; t++){
+        //32 keys in bucket 0 of a 64 bucket table, whose hashes differ in the tag bits only
+        dict *d = dictCreate(&dictTestTagTypes[t]);
+        assert(dictExpand(d, 64) == DICT_OK);
+        int8_t exp = d->ht_size_exp[0];
+        for(uint64_t i = 0; i < 64; i++)
+            vals[i] = ((i + 1) << exp) << 8;
+        for(uint64_t i = 0; i < 64; i += 2)
+            assert(dictAdd(d, &vals[i], NULL) == DICT_OK);
+        assert(d->ht_size_exp[0] == exp && d->reHashIdx == -1);
+        dictTestCheckTags(d, ENTRY_TAG_BITS);
+        uint64_t compares = dictTestFindTagged(d, vals, 64, 2);
+        //a compare for each hit, the misses walk the same chain without any
+        assert(!DICT_ENTRY_TAGS || compares == 32 * 2);
+
+        //full collisions, 8 keys with the same hash and tag, keyCompare tells them apart
+        uint64_t same[9];
+        for(uint64_t j = 0; j < 9; j++)
+            same[j] = ((uint64_t)1000 << exp) << 8 | j;
+        for(uint64_t j = 0; j < 8; j++)
+            assert(dictAdd(d, &same[j], NULL) == DICT_OK);
+        uint64_t before = dict_test_tag_compares;
+        assert(!dictFind(d, &same[8]));
+        assert(!DICT_ENTRY_TAGS || dict_test_tag_compares - before == 8);
+        uint64_t copies[9];
+        const void *batch[9];
+        dictEntry *out[9];
+        for(uint64_t j = 0; j < 9; j++){
+            copies[j] = same[j];
+            batch[j] = &copies[j];
+        }
+        assert(dictFindBatch(d, batch, 9, out) == 8 && !out[8]);
+        for(uint64_t j = 0; j < 8; j++)
+            assert(dictGetKey(out[j]) == &same[j] && dictFind(d, &copies[j]) == out[j]);
+        dictRelease(d);
+
+        //tags over rehashes: one growing step keeps 11 bits, growing past the tag recomputes
+        //it from the hash, shrinking puts the bits dropped from the index back
+        d = dictCreate(&dictTestTagTypes[t]);
+        for(uint64_t i = 0; i < keys; i++)
+            vals[i] = (dictTestIntHash((void *)(uintptr_t)(i + 1)) >> 8) << 8;
+        for(uint64_t i = 0; i < keys; i++){
+            assert(dictAdd(d, &vals[i], NULL) == DICT_OK);
+            if(i % 10000 == 0)
+                dictTestCheckTags(d, -1);
+        }
+        while(dictRehash(d, 1000));
+        dictTestCheckTags(d, -1);
+        dictEmpty(d, NULL);
+        assert(dictExpand(d, keys) == DICT_OK);
+        for(uint64_t i = 0; i < keys; i++)
+            assert(dictAdd(d, &vals[i], NULL) == DICT_OK);
+        dictTestCheckTags(d, ENTRY_TAG_BITS);
+
+        //each step rehashes halfway, looks every kept key up on both tables and finishes
+        struct{
+            int grow;//table size shift, negative to shrink to the keys kept
+            uint64_t step;//keys kept, those i with i % step == 0
+            int valid;//tag bits expected afterwards
+        }steps[3] = {{1, 1, ENTRY_TAG_BITS - 1}, {-1, 64, ENTRY_TAG_BITS}, {ENTRY_TAG_BITS + 1, 4096, ENTRY_TAG_BITS}};
+        uint64_t kept = 1;
+        for(int s = 0; s < 3; s++){
+            for(uint64_t i = 0; i < keys; i++)
+                if(i % kept == 0 && i % steps[s].step)
+                    assert(dictDelete(d, &vals[i]) == DICT_OK);
+            kept = steps[s].step;
+            if(steps[s].grow > 0)
+                assert(dictExpand(d, DICTHT_SIZE(d->ht_size_exp[0]) << steps[s].grow) == DICT_OK);
+            else
+                assert(dictResize(d) == DICT_OK);
+            uint64_t half = d->ht_used[0] / 2;
+            while(d->ht_used[0] > half)
+                dictRehash(d, 1);
+            assert(d->reHashIdx != -1);
+            uint64_t hits = (keys + kept - 1) / kept;
+            compares = dictTestFindTagged(d, vals, keys, kept);
+            //a compare for each hit by either lookup, tag false positives are 1 in 2^valid bits
+            assert(!DICT_ENTRY_TAGS || compares < hits * 2 + hits / 15 + 10);
+            while(dictRehash(d, 1000));
+            dictTestCheckTags(d, steps[s].valid);
+        }
+        printf("%s: tags of %llu keys right after growing by 1 bit, shrinking and growing by %d bits\n",
+            t? "no value": "with value", (unsigned long long)keys, ENTRY_TAG_BITS + 1);
+        dictRelease(d);
+    }
+    zfree(vals);
+    return 0;
+}
+
+static void dictTestLfValDestructor(dict *d, void *val){
+    (void)d;
+    //a reader that reads this got a value freed under it
+    *(uint64_t *)val = 0;
+    zfree(val);
+}
+
+static dictType dictTestLfType = {
+    .hashFunction = dictTestIntHash,
+    .valDestructor = dictTestLfValDestructor,
+    .concurrent_reads = 1,
+};
+
+static void *dictTestLfVal(uintptr_t k){
+    uint64_t *val = zmalloc(sizeof(*val));
+    *val = k;
+    return val;
+}
+
+typedef struct{
+    dict *d;
+    uint64_t keys;//lookups of 1 to 2 * keys, every 8th is never deleted
+    uint64_t seed;
+    int *stop;
+    uint64_t lookups, hits;
+}dictTestLfReader;
+
+static void *dictTestLfReaderMain(void *arg){
+    dictTestLfReader *r = arg;
+    uint64_t x = r->seed;
+    while(!__atomic_load_n(r->stop, __ATOMIC_ACQUIRE)){
+        epochEnter();
+        for(int i = 0; i < 64; i++){
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            uintptr_t k = x % (2 * r->keys) + 1;
+            uint64_t *val = dictFetchValue(r->d, (void *)k);
+            assert(val || k % 8);
+            assert(!val || *val == k);
+            r->hits += val != NULL;
+        }
+        epochExit();
+        r->lookups += 64;
+    }
+    return NULL;
+}
+
+typedef struct{
+    dict *d;
+    int state;//1 once inside the epoch with val, the main thread sets 2 to let it out
+    uint64_t *val;
+}dictTestLfHolder;
+
+static void *dictTestLfHolderMain(void *arg){
+    dictTestLfHolder *h = arg;
+    epochEnter();
+    h->val = dictFetchValue(h->d, (void *)8);
+    assert(h->val && *h->val == 8);
+    __atomic_store_n(&h->state, 1, __ATOMIC_RELEASE);
+    while(__atomic_load_n(&h->state, __ATOMIC_ACQUIRE) != 2)
+        sched_yield();
+    //replaced and retired meanwhile, but not freed
+    assert(*h->val == 8);
+    epochExit();
+    return NULL;
+}
+
+//redis-server test lockfree [keys] [readers] [rounds], readers look keys up while the writer
+//adds, replaces and deletes them and the dict grows and shrinks under them
+int dictLockFreeTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 100000;
+    int readers = argc > 4? atoi(argv[4]): 4;
+    int rounds = argc > 5? atoi(argv[5]): 4;
+    keys = keys < 64? 64: keys;
+    readers = readers < 1? 1: readers > 16? 16: readers;
+    size_t base = zmalloc_used_memory();
+
+    dict *d = dictCreate(&dictTestLfType);
+    for(uintptr_t k = 8; k <= 2 * keys; k += 8)
+        assert(dictAdd(d, (void *)k, dictTestLfVal(k)) == DICT_OK);
+
+    //a reader inside its epoch holds off the reclamation of the value and the table it may be
+    //reading, until it leaves
+    while(dictRehash(d, 100));
+    while(d->ext->lockFree->limbo.pending)
+        dictReclaim(d);
+    dictTestLfHolder holder = {d, 0, NULL};
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, dictTestLfHolderMain, &holder) == 0);
+    while(__atomic_load_n(&holder.state, __ATOMIC_ACQUIRE) != 1)
+        sched_yield();
+    assert(dictReplace(d, (void *)8, dictTestLfVal(8)) == 0);
+    dictEntry **table = d->ht_table[0];
+    assert(dictExpand(d, DICTHT_SIZE(d->ht_size_exp[0]) * 4) == DICT_OK);
+    while(dictRehash(d, 100));
+    assert(d->ht_table[0] != table && d->ext->lockFree->limbo.pending == 2);
+    for(int i = 0; i < 10; i++)
+        assert(dictReclaim(d) == 0);
+    assert(d->ext->lockFree->limbo.pending == 2);
+    __atomic_store_n(&holder.state, 2, __ATOMIC_RELEASE);
+    pthread_join(tid, NULL);
+    while(d->ext->lockFree->limbo.pending)
+        dictReclaim(d);
+
+    //the writer runs rounds of adding the other keys, replacing some and deleting them all
+    //again, with resizes on the way down
+    int stop = 0;
+    pthread_t tids[16];
+    dictTestLfReader rs[16];
+    for(int t = 0; t < readers; t++){
+        rs[t] = (dictTestLfReader){d, keys, 0x9e3779b97f4a7c15ULL * (t + 1), &stop, 0, 0};
+        assert(pthread_create(&tids[t], NULL, dictTestLfReaderMain, &rs[t]) == 0);
+    }
+    uint64_t rehashes = 0;
+    long long start = monotonicUs();
+    for(int round = 0; round < rounds; round++){
+        for(uintptr_t k = 1; k <= 2 * keys; k++){
+            if(k % 8)
+                assert(dictAdd(d, (void *)k, dictTestLfVal(k)) == DICT_OK);
+            rehashes += d->reHashIdx == 0;
+        }
+        for(uintptr_t k = 3; k <= 2 * keys; k += 4)
+            assert(dictReplace(d, (void *)k, dictTestLfVal(k)) == 0);
+        for(uintptr_t k = 1; k <= 2 * keys; k++){
+            if(k % 8)
+                assert(dictDelete(d, (void *)k) == DICT_OK);
+            if(k % 1024 == 0 && dictResize(d) == DICT_OK)
+                rehashes++;
+        }
+    }
+    long long elapsed = monotonicUs() - start;
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    uint64_t lookups = 0, hits = 0;
+    for(int t = 0; t < readers; t++){
+        pthread_join(tids[t], NULL);
+        lookups += rs[t].lookups;
+        hits += rs[t].hits;
+    }
+    printf("%d readers: %llu lookups (%llu hits) during %d rounds of writes, %llu rehashes, %.2f sec, "
+        "%llu retired pointers pending\n", readers, (unsigned long long)lookups, (unsigned long long)hits,
+        rounds, (unsigned long long)rehashes, elapsed / 1e6, (unsigned long long)d->ext->lockFree->limbo.pending);
+    assert(lookups > 0 && rehashes > 0);
+    assert(d->ht_used[0] + d->ht_used[1] == keys / 4);
+    dictRelease(d);
+    assert(zmalloc_used_memory() == base);
+    return 0;
+}
+
+typedef struct{
+    uint8_t *visits;//per key, bumped by the workers of every partition
+    uint64_t part, mask;
+}dictTestScanPart;
+
+static void dictTestScanPartCount(void *privdata, const dictEntry *de){
+    dictTestScanPart *p = privdata;
+    uintptr_t k = (uintptr_t)dictGetKey(de);
+    //a partition only gets the keys whose hash ends in its number
+    assert((dictTestIntHash((void *)k) & p->mask) == p->part);
+    __atomic_fetch_add(&p->visits[k], 1, __ATOMIC_RELAXED);
+}
+
+//scan d with 2^bits partitions on pool, rehashing rehash_steps buckets between the steps
+static void dictTestParallelScan(dict *d, workerPool *pool, int bits, int rehash_steps, uint8_t *visits){
+    uint64_t parts = (uint64_t)1 << bits;
+    dictTestScanPart *ctx = zmalloc(parts * sizeof(*ctx));
+    void **privdata = zmalloc(parts * sizeof(void *));
+    for(uint64_t p = 0; p < parts; p++){
+        ctx[p] = (dictTestScanPart){visits, p, parts - 1};
+        privdata[p] = &ctx[p];
+    }
+    dictParallelScan *ps = dictParallelScanStart(d, bits);
+    while(dictParallelScanStep(ps, pool, 4, dictTestScanPartCount, NULL, privdata))
+        if(rehash_steps)
+            dictRehash(d, rehash_steps);
+    dictParallelScanRelease(ps);
+    zfree(privdata);
+    zfree(ctx);
+}
+
+//redis-server test parallelscan [keys] [threads], every key is visited exactly once across the
+//partitions of a settled dict, a dict halfway through a rehash and one rehashing between steps
+int dictParallelScanTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 200000;
+    int threads = argc > 4? atoi(argv[4]): 4;
+    const char *names[3] = {"settled", "halfway rehash", "rehash between steps"};
+    workerPool *pool = threads > 0? workerPoolCreate(threads): NULL;
+    uint8_t *visits = zmalloc(keys + 1);
+
+    for(int c = 0; c < 3; c++){
+        for(int bits = 0; bits <= 6; bits += 3){
+            dict *d = dictCreate(&dictTestIntType);
+            for(uintptr_t k = 1; k <= keys; k++)
+                assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+            while(dictRehash(d, 1000));
+            if(c > 0)
+                assert(dictExpand(d, keys * 8) == DICT_OK && d->reHashIdx == 0);
+            if(c == 1)
+                dictRehash(d, DICTHT_SIZE(d->ht_size_exp[0]) / 2);
+            memset(visits, 0, keys + 1);
+            dictTestParallelScan(d, pool, bits, c == 2? 64: 0, visits);
+            for(uint64_t k = 1; k <= keys; k++)
+                assert(visits[k] == 1);
+            if(bits == 6)
+                printf("%s: %llu keys visited once with 1, 8 and 64 partitions\n", names[c], (unsigned long long)keys);
+            dictRelease(d);
+        }
+    }
+    zfree(visits);
+    if(pool)
+        workerPoolRelease(pool);
+    return 0;
+}
+
+static void dictTestCheckKeys(dict *d, uint64_t keys, uint64_t step);
+static dict *dictTestRehashing(dictType *type, uint64_t keys);
+
+//redis-server test dictbulk [keys] [threads], loads the keys with dictAdd and with the builder
+int dictBulkTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 5000000;
+    int threads = argc > 4? atoi(argv[4]): 4;
+
+    //both loads run on a heap that held the same dict before, the way a reload does
+    dict *d = dictCreate(&dictTestIntType);
+    for(uintptr_t k = 1; k <= keys; k++)
+        assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+    dictRelease(d);
+
+    d = dictCreate(&dictTestIntType);
+    long long start = monotonicUs();
+    for(uintptr_t k = 1; k <= keys; k++)
+        assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+    long long add_us = monotonicUs() - start;
+    dictRelease(d);
+
+    workerPool *pool = threads > 0? workerPoolCreate(threads): NULL;
+    d = dictCreate(&dictTestIntType);
+    start = monotonicUs();
+    dictBulkBuilder *b = dictBulkBuilderCreate(d, keys, DICT_BULK_UNIQUE, pool, NULL, NULL);
+    for(uintptr_t k = 1; k <= keys; k++)
+        dictBulkBuilderAdd(b, (void *)k, NULL);
+    assert(dictBulkBuilderFinish(b) == keys);
+    long long bulk_us = monotonicUs() - start;
+    for(uintptr_t k = 1; k <= keys; k += 9973)
+        assert(dictFind(d, (void *)k));
+    assert(d->ht_used[0] + d->ht_used[1] == keys);
+    dictRelease(d);
+
+    //a safe iterator pauses rehashing: the batch doesn't move the halfway rehash on or resize
+    d = dictTestRehashing(&dictTestIntType, keys / 10);
+    dictRehash(d, DICTHT_SIZE(d->ht_size_exp[0]) / 2);
+    dictIterator *iter = dictGetSafeIterator(d);
+    dictNext(iter);
+    long long idx = d->reHashIdx;
+    dictEntry **tables[2] = {d->ht_table[0], d->ht_table[1]};
+    b = dictBulkBuilderCreate(d, keys / 10, DICT_BULK_UNIQUE, pool, NULL, NULL);
+    for(uintptr_t k = keys / 10 + 1; k <= keys / 5; k++)
+        dictBulkBuilderAdd(b, (void *)k, NULL);
+    assert(dictBulkBuilderFinish(b) == keys / 10);
+    assert(d->reHashIdx == idx && d->ht_table[0] == tables[0] && d->ht_table[1] == tables[1]);
+    dictReleaseIterator(iter);
+    dictTestCheckKeys(d, keys / 5, 1);
+    dictRelease(d);
+    if(pool)
+        workerPoolRelease(pool);
+
+    printf("%llu keys: dictAdd %.2f sec, bulk builder (%d threads) %.2f sec, %.2fx\n",
+        (unsigned long long)keys, add_us / 1e6, threads, bulk_us / 1e6, (double)add_us / (bulk_us? bulk_us: 1));
+    return 0;
+}
+
+static void dictTestValDestructor(dict *d, void *val){
+    (void)d;
+    zfree(val);
+}
+
+static dictType dictTestLazyTypes[2] = {
+    {.hashFunction = dictTestIntHash, .valDestructor = dictTestValDestructor},
+    {.hashFunction = dictTestIntHash, .valDestructor = dictTestValDestructor, .lazy_free = 1},
+};
+
+//the dict a lazily run destructor gets is off the rehash cron list and not rehashing
+static void dictTestLazyCronValDestructor(dict *d, void *val){
+    assert(!dictExtField(d, rehashing) && d->reHashIdx == -1 && !d->pauseRehash);
+    zfree(val);
+}
+
+static dictType dictTestLazyCronType = {
+    .hashFunction = dictTestIntHash,
+    .valDestructor = dictTestLazyCronValDestructor,
+    .lazy_free = 1,
+    .scheduled_rehash = 1,
+};
+
+static dict *dictTestLazyFill(dictType *type, uint64_t keys){
+    dict *d = dictCreate(type);
+    for(uintptr_t k = 1; k <= keys; k++)
+        assert(dictAdd(d, (void *)k, zmalloc(64)) == DICT_OK);
+    return d;
+}
+
+//redis-server test lazyfree [keys], how long the caller of dictEmpty and dictRelease blocks
+int dictLazyFreeTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 2000000;
+    const char *names[2] = {"sync", "lazy"};
+    size_t base = zmalloc_used_memory();
+
+    for(int lazy = 0; lazy <= 1; lazy++){
+        dict *d = dictTestLazyFill(&dictTestLazyTypes[lazy], keys);
+        long long start = monotonicUs();
+        dictEmpty(d, NULL);
+        long long empty_us = monotonicUs() - start;
+        assert(d->ht_used[0] + d->ht_used[1] == 0);
+        //the emptied dict is usable right away
+        for(uintptr_t k = 1; k <= keys; k++)
+            assert(dictAdd(d, (void *)k, zmalloc(64)) == DICT_OK);
+        start = monotonicUs();
+        dictRelease(d);
+        long long release_us = monotonicUs() - start;
+        uint64_t effort, jobs = dictLazyFreePending(&effort);
+        start = monotonicUs();
+        dictLazyFreeWait();
+        long long wait_us = monotonicUs() - start;
+        assert(zmalloc_used_memory() == base);
+        printf("%s: %llu keys, dictEmpty %.3f ms, dictRelease %.3f ms, %llu jobs with %llu entries "
+            "pending after them, freed %.1f ms later\n", names[lazy], (unsigned long long)keys,
+            empty_us / 1e3, release_us / 1e3, (unsigned long long)jobs, (unsigned long long)effort,
+            wait_us / 1e3);
+    }
+
+    //emptied halfway through a scheduled rehash, the dict goes back on the cron list with its
+    //next rehash while the old tables are freed
+    dict *d = dictTestLazyFill(&dictTestLazyCronType, keys / 10);
+    while(dictRehash(d, 1000));
+    assert(dictExpand(d, DICTHT_SIZE(d->ht_size_exp[0]) * 4) == DICT_OK && dictExtField(d, rehashing));
+    dictRehash(d, 100);
+    dictEmpty(d, NULL);
+    assert(!dictExtField(d, rehashing) && d->reHashIdx == -1);
+    for(uintptr_t k = 1; k <= keys / 10; k++)
+        assert(dictAdd(d, (void *)k, zmalloc(64)) == DICT_OK);
+    while(d->reHashIdx != -1)
+        dictRehashCron(1000);
+    assert(!dictExtField(d, rehashing));
+    dictRelease(d);
+    dictLazyFreeWait();
+    assert(zmalloc_used_memory() == base);
+    return 0;
+}
+
+//redis-server test hugetable [keys], random lookups on a dict whose bucket array is huge page
+//backed, and dependent random reads of that array against a zcalloc one of the same size
+int dictHugeTableTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 8000000;
+    uint64_t lookups = 20000000;
+    char stats[1024];
+
+    dict *d = dictCreate(&dictTestIntType);
+    for(uintptr_t k = 1; k <= keys; k++)
+        assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+    uint64_t x = 88172645463325252ULL, found = 0;
+    long long start = monotonicUs();
+    for(uint64_t i = 0; i < lookups; i++){
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        found += dictFind(d, (void *)(uintptr_t)(x % keys + 1)) != NULL;
+    }
+    long long find_us = monotonicUs() - start;
+    assert(found == lookups);
+    dictGetStats(stats, sizeof(stats), d, 1);
+    printf("%llu keys, %.1f ns per dictFind\n%s", (unsigned long long)keys, find_us * 1e3 / lookups, stats);
+
+    size_t bytes = dictTableBytes(d->ht_size_exp[0]);
+    uint64_t mask = DICTHT_SIZE(d->ht_size_exp[0]) - 1;
+    dictEntry **arrays[2] = {zcalloc(bytes), d->ht_table[0]};
+    const char *names[2] = {"zcalloc", "huge pages"};
+    memcpy(arrays[0], arrays[1], bytes);
+    for(int a = 0; a <= 1; a++){
+        uintptr_t sum = 0;
+        start = monotonicUs();
+        for(uint64_t i = 0; i < lookups; i++){
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            //dependent loads, the next index waits for this one
+            sum += (uintptr_t)arrays[a][(x ^ sum) & mask];
+        }
+        printf("%s: %.1f MB bucket array, %.1f ns per random read (%lu)\n", names[a],
+            (double)bytes / (1 << 20), (monotonicUs() - start) * 1e3 / lookups, (unsigned long)(sum & 1));
+    }
+    zfree(arrays[0]);
+    dictRelease(d);
+    return 0;
+}
+static int dictTestIntCompare(dict *d, const void *key1, const void *key2){
+    (void)d;
+    return key1 == key2;
+}
+
+//keeps only 12 hash bits, like a seed that collapses most of the hash
+static uint64_t dictTestBadHash(const void *key){
+    return dictTestIntHash(key) & 0xfff;
+}
+
+//redis-server test dictstats [keys], dictGetStats of a good and a collapsed hash on both
+//engines, and the cost of the counters on dictFind
+int dictStatsTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 100000;
+    dictType types[4] = {
+        {.hashFunction = dictTestIntHash, .keyCompare = dictTestIntCompare},
+        {.hashFunction = dictTestBadHash, .keyCompare = dictTestIntCompare},
+        {.hashFunction = dictTestIntHash, .keyCompare = dictTestIntCompare, .open_addressing = 1},
+        {.hashFunction = dictTestBadHash, .keyCompare = dictTestIntCompare, .open_addressing = 1},
+    };
+    const char *names[4] = {"chained, good hash", "chained, 12 bit hash", "open addressing, good hash",
+        "open addressing, 12 bit hash"};
+    char stats[8192];
+
+    for(int t = 0; t < 4; t++){
+        //the bad hash makes inserts quadratic, keep it small
+        uint64_t n = t & 1? keys / 10: keys;
+        dict *d = dictCreate(&types[t]);
+        assert(dictEnableStats(d) == DICT_OK);
+        for(uintptr_t k = 1; k <= n; k++)
+            assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+        for(uintptr_t k = 1; k <= n; k++)
+            assert(dictFind(d, (void *)k));
+        dictGetStats(stats, sizeof(stats), d, 1);
+        printf("--- %s, %llu keys\n%s", names[t], (unsigned long long)n, stats);
+        dictRelease(d);
+    }
+
+    //the counters on the find path
+    dict *d = dictCreate(&types[0]);
+    for(uintptr_t k = 1; k <= keys; k++)
+        assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+    for(uintptr_t k = 1; k <= keys; k++)
+        assert(dictFind(d, (void *)k));
+    for(int on = 0; on <= 1; on++){
+        if(on)
+            dictEnableStats(d);
+        long long start = monotonicUs();
+        for(int round = 0; round < 20; round++)
+            for(uintptr_t k = 1; k <= keys; k++)
+                assert(dictFind(d, (void *)k));
+        printf("stats %s: %.1f ns per dictFind\n", on? "on": "off", (monotonicUs() - start) * 1e3 / (keys * 20));
+    }
+    dictRelease(d);
+    return 0;
+}
+static uint64_t dictTestStrHash(const void *key){
+    return dictGenHashFunction(key, strlen(key));
+}
+
+static void dictTestStrHashBatch(const void **keys, size_t n, uint64_t *hashes){
+    size_t lens[DICT_FIND_BATCH_SIZE];
+    for(size_t base = 0; base < n; base += DICT_FIND_BATCH_SIZE){
+        size_t cnt = n - base < DICT_FIND_BATCH_SIZE? n - base: DICT_FIND_BATCH_SIZE;
+        for(size_t i = 0; i < cnt; i++)
+            lens[i] = strlen(keys[base + i]);
+        dictGenHashFunctionBatch(keys + base, lens, cnt, hashes + base);
+    }
+}
+
+static int dictTestStrCompare(dict *d, const void *key1, const void *key2){
+    (void)d;
+    return !strcmp(key1, key2);
+}
+
+//redis-server test hashbatch [keys] [keylen], batched siphash against siphash one key at a time
+int dictHashBatchTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 1000000;
+    size_t keylen = argc > 4? strtoull(argv[4], NULL, 10): 16;
+    uint8_t data[4096], seed[16];
+    uint64_t x = 88172645463325252ULL;
+    for(size_t i = 0; i < sizeof(data); i++)
+        data[i] = (x = x * 6364136223846793005ULL + 1442695040888963407ULL) >> 56;
+    memcpy(seed, data, sizeof(seed));
+    dictSetHashFunctionSeed(seed);
+
+    //every batch size, with lengths spread out inside a batch so the lanes finish apart
+    const void *in[64];
+    size_t lens[64];
+    uint64_t hashes[64];
+    for(int round = 0; round < 2000; round++){
+        size_t n = 1 + round % 64;
+        for(size_t i = 0; i < n; i++){
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+            lens[i] = (x >> 33) % (round & 1? 24: 300);
+            in[i] = data + (x >> 20) % (sizeof(data) - 300);
+        }
+        dictGenHashFunctionBatch(in, lens, n, hashes);
+        for(size_t i = 0; i < n; i++)
+            assert(hashes[i] == dictGenHashFunction(in[i], lens[i]));
+    }
+
+    //raw hashing speed
+    size_t lengths[] = {8, 16, 24, 40, 64, 128};
+    for(size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++){
+        uint64_t sink = 0, iters = 4000000 / 64;
+        for(size_t i = 0; i < 64; i++){
+            in[i] = data + i * 7;
+            lens[i] = lengths[l];
+        }
+        long long start = monotonicUs();
+        for(uint64_t it = 0; it < iters; it++)
+            for(size_t i = 0; i < 64; i++)
+                sink += dictGenHashFunction(in[i], lens[i]);
+        long long one_us = monotonicUs() - start;
+        start = monotonicUs();
+        for(uint64_t it = 0; it < iters; it++){
+            dictGenHashFunctionBatch(in, lens, 64, hashes);
+            sink += hashes[it & 63];
+        }
+        long long batch_us = monotonicUs() - start;
+        printf("%3zu byte keys: siphash %.2f ns/key, batched %.2f ns/key, %.2fx (%d)\n", lengths[l],
+            one_us * 1e3 / (iters * 64), batch_us * 1e3 / (iters * 64), (double)one_us / (batch_us? batch_us: 1),
+            (int)(sink & 1));
+    }
+
+    //dictFindBatch and the bulk builder with and without the type batch hook
+    char **strs = zmalloc(keys * sizeof(char *));
+    for(uint64_t k = 0; k < keys; k++){
+        strs[k] = zmalloc(keylen + 1);
+        int len = snprintf(strs[k], keylen + 1, "key:%llu", (unsigned long long)k);
+        memset(strs[k] + len, 'x', keylen > (size_t)len? keylen - len: 0);
+        strs[k][keylen] = '\0';
+    }
+    dictType types[2] = {
+        {.hashFunction = dictTestStrHash, .keyCompare = dictTestStrCompare},
+        {.hashFunction = dictTestStrHash, .keyCompare = dictTestStrCompare, .hashFunctionBatch = dictTestStrHashBatch},
+    };
+    dictEntry *out[DICT_FIND_BATCH_SIZE];
+    for(int t = 0; t < 2; t++){
+        for(int oa = 0; oa <= 1; oa++){
+            types[t].open_addressing = oa;
+            dict *d = dictCreate(&types[t]);
+            long long start = monotonicUs();
+            dictBulkBuilder *b = dictBulkBuilderCreate(d, keys, DICT_BULK_UNIQUE, NULL, NULL, NULL);
+            for(uint64_t k = 0; k < keys; k++)
+                dictBulkBuilderAdd(b, strs[k], NULL);
+            assert(dictBulkBuilderFinish(b) == keys);
+            long long bulk_us = monotonicUs() - start;
+            start = monotonicUs();
+            uint64_t found = 0;
+            for(int round = 0; round < 5; round++){
+                for(uint64_t k = 0; k < keys; k += DICT_FIND_BATCH_SIZE){
+                    size_t n = keys - k < DICT_FIND_BATCH_SIZE? keys - k: DICT_FIND_BATCH_SIZE;
+                    found += dictFindBatch(d, (const void **)strs + k, n, out);
+                }
+            }
+            long long find_us = monotonicUs() - start;
+            assert(found == keys * 5);
+            printf("%s, %s: bulk load %.1f ns/key, dictFindBatch %.1f ns/key\n", oa? "open addressing": "chained",
+                t? "batched hash": "siphash", bulk_us * 1e3 / keys, find_us * 1e3 / (keys * 5));
+            dictRelease(d);
+        }
+    }
+    for(uint64_t k = 0; k < keys; k++)
+        zfree(strs[k]);
+    zfree(strs);
+    return 0;
+}
+
+static uint64_t dictTestCycles(void){
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    return monotonicNs();
+#endif
+}
+
+static int dictTestCmpU64(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y? -1: x > y;
+}
+
+static void dictTestScanCount(void *privdata, const dictEntry *de){
+    (void)de;
+    (*(uint64_t *)privdata)++;
+}
+
+//every key from 1 to keys is found, once by dictFind and at least once by dictScan
+static void dictTestCheckKeys(dict *d, uint64_t keys, uint64_t step){
+    uint64_t scanned = 0, v = 0;
+    for(uintptr_t k = 1; k <= keys; k++)
+        assert((dictFind(d, (void *)k) != NULL) == (k % step == 0));
+    do{
+        v = dictScan(d, v, dictTestScanCount, &scanned);
+    }while(v);
+    assert(scanned >= keys / step);
+}
+
+//a cheap hash of structured keys, every 64th group or bucket gets them all
+static uint64_t dictTestSkewedHash(const void *key){
+    return dictTestIntHash(key) << 6;
+}
+
+static uint64_t dictTestBadHash4(const void *key){
+    return dictTestIntHash(key) & 0xf;
+}
+
+//redis-server test boundedprobe [keys], lookup latency percentiles of chained, open addressing
+//and bounded probe tables, and a degenerate hash on a bounded table
+int dictBoundedProbeTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 200000;
+    dictType types[3] = {
+        {.hashFunction = dictTestIntHash, .keyCompare = dictTestIntCompare},
+        {.hashFunction = dictTestIntHash, .keyCompare = dictTestIntCompare, .open_addressing = 1},
+        {.hashFunction = dictTestIntHash, .keyCompare = dictTestIntCompare, .open_addressing = 1, .bounded_probe = 1},
+    };
+    const char *names[3] = {"chained", "open addressing", "bounded probe"};
+    uint64_t (*hashes[2])(const void *) = {dictTestIntHash, dictTestSkewedHash};
+    uint64_t *lat = zmalloc(keys * sizeof(uint64_t)), *order = zmalloc(keys * sizeof(uint64_t));
+    char stats[4096];
+
+    for(uint64_t i = 0; i < keys; i++)
+        order[i] = i + 1;
+    for(uint64_t i = keys - 1; i > 0; i--){
+        uint64_t j = genrand64_int64() % (i + 1), t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    for(int t = 0; t < 6; t++){
+        if(t % 3 == 0)
+            printf("--- %s\n", t? "hash with 6 dead low bits": "siphash");
+        types[t % 3].hashFunction = hashes[t / 3];
+        dict *d = dictCreate(&types[t % 3]);
+        for(uintptr_t k = 1; k <= keys; k++)
+            assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+        //churn half the keys, deletes leave tombstones in full groups of a plain table
+        for(uint64_t i = 0; i < keys / 2; i++){
+            assert(dictDelete(d, (void *)(uintptr_t)order[i]) == DICT_OK);
+            assert(dictAdd(d, (void *)(uintptr_t)(order[i] + 2 * keys), NULL) == DICT_OK);
+        }
+        while(dictRehash(d, 1000));
+        for(int miss = 0; miss <= 1; miss++){
+            for(uint64_t i = 0; i < keys; i++){
+                uintptr_t k = miss? order[i] + keys: i < keys / 2? order[i] + 2 * keys: order[i];
+                uint64_t start = dictTestCycles();
+                dictEntry *de = dictFind(d, (void *)k);
+                lat[i] = dictTestCycles() - start;
+                assert((de != NULL) == !miss);
+            }
+            qsort(lat, keys, sizeof(uint64_t), dictTestCmpU64);
+            printf("%-16s %s: p50 %4lu p99 %5lu p99.9 %5lu max %7lu cycles\n", names[t % 3], miss? "misses": "hits  ",
+                (unsigned long)lat[keys / 2], (unsigned long)lat[keys * 99 / 100], (unsigned long)lat[keys * 999 / 1000],
+                (unsigned long)lat[keys - 1]);
+        }
+        dictGetStats(stats, sizeof(stats), d, 1);
+        char *probe = strstr(stats, "max_probe_len:"), *chain = strstr(stats, "max_chain_len:");
+        char *line = probe? probe: chain;
+        printf("%-16s %.1f MB, %s", names[t % 3], dictMemUsage(d) / 1048576.0, line? strtok(line, "\r"): "");
+        printf("\n");
+        dictRelease(d);
+    }
+
+    //deletes, reinserts and scans with a good hash, then with a 4 bit hash that can't be bounded,
+    //the table must spill and stay correct instead of growing for good. lookups are linear in
+    //the number of keys then, keep them few
+    for(int bad = 0; bad <= 1; bad++){
+        dictType type = {.hashFunction = bad? dictTestBadHash4: dictTestIntHash, .keyCompare = dictTestIntCompare,
+            .open_addressing = 1, .bounded_probe = 1};
+        uint64_t n = bad? 2000: keys;
+        dict *d = dictCreate(&type);
+        for(uintptr_t k = 1; k <= n; k++)
+            assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+        dictTestCheckKeys(d, n, 1);
+        for(uintptr_t k = 1; k <= n; k++)
+            if(k % 2)
+                assert(dictDelete(d, (void *)k) == DICT_OK);
+        dictTestCheckKeys(d, n, 2);
+        for(uintptr_t k = 1; k <= n; k += 2)
+            assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+        dictTestCheckKeys(d, n, 1);
+        while(dictRehash(d, 1000));
+        assert(d->ext->ht_overflowed[0] == bad);
+        //no more than the up to 5 slots a key plain growth leaves right past a power of two
+        assert(dictMemUsage(d) < 5 * (n + DICT_OA_GROUP_SLOTS) * (sizeof(dictOaSlot) + 1) + 1024);
+        dictRelease(d);
+    }
+    zfree(lat);
+    zfree(order);
+    return 0;
+}
+
+//p50, p99 and max of n call durations, sorted in place
+static void dictTestPrintCalls(const char *what, uint64_t *ns, uint64_t n){
+    qsort(ns, n, sizeof(*ns), dictTestCmpU64);
+    printf("%-32s %6llu calls: p50 %6.1f p99 %6.1f max %7.1f usec\n", what, (unsigned long long)n,
+        ns[n / 2] / 1e3, ns[n * 99 / 100] / 1e3, ns[n - 1] / 1e3);
+}
+
+//a dict of keys that has just started rehashing into a table 8 times bigger
+static dict *dictTestRehashing(dictType *type, uint64_t keys){
+    dict *d = dictCreate(type);
+    for(uintptr_t k = 1; k <= keys; k++)
+        assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+    while(dictRehash(d, 1000));
+    assert(dictExpand(d, keys * 8) == DICT_OK && d->reHashIdx == 0);
+    return d;
+}
+
+//redis-server test rehashcron [dicts] [keys] [budget usec], dicts of keys, half of them open
+//addressing, rehashing under dictRehashCron calls of budget usec, then single dicts under
+//dictRehashMicroseconds calls of several budgets
+int dictRehashCronTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t ndicts = argc > 3? strtoull(argv[3], NULL, 10): 16;
+    uint64_t keys = argc > 4? strtoull(argv[4], NULL, 10): 100000;
+    uint64_t budget = argc > 5? strtoull(argv[5], NULL, 10): 100;
+    dictType types[2] = {
+        {.hashFunction = dictTestIntHash, .keyCompare = dictTestIntCompare, .scheduled_rehash = 1},
+        {.hashFunction = dictTestIntHash, .keyCompare = dictTestIntCompare, .open_addressing = 1, .scheduled_rehash = 1},
+    };
+
+    //the clock keeps pace with CLOCK_MONOTONIC
+    printf("clock: %s\n", monotonicInit());
+    struct timespec t0, t1;
+    uint64_t m0 = monotonicNs();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    nanosleep(&(struct timespec){.tv_nsec = 100000000}, NULL);
+    uint64_t m1 = monotonicNs();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double posix_ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    double drift = fabs((m1 - m0) - posix_ns) / posix_ns;
+    printf("drift against CLOCK_MONOTONIC over %.0f usec: %.4f%%\n", posix_ns / 1e3, drift * 100);
+    assert(drift < 0.01);
+
+    dict **ds = zmalloc(ndicts * sizeof(*ds));
+    for(uint64_t i = 0; i < ndicts; i++)
+        ds[i] = dictTestRehashing(&types[i % 2], keys);
+    assert(dictRehashingCount() == ndicts);
+    uint64_t cap = 1024, calls = 0, *call_ns = zmalloc(cap * sizeof(*call_ns));
+    while(dictRehashingCount()){
+        uint64_t start = monotonicNs();
+        dictRehashCron(budget);
+        if(calls == cap)
+            call_ns = zrealloc(call_ns, (cap *= 2) * sizeof(*call_ns));
+        call_ns[calls++] = monotonicNs() - start;
+    }
+    char what[64];
+    snprintf(what, sizeof(what), "dictRehashCron(%llu), %llu dicts", (unsigned long long)budget,
+        (unsigned long long)ndicts);
+    dictTestPrintCalls(what, call_ns, calls);
+    assert(call_ns[calls / 2] <= budget * 1000 * 5 / 4);
+    for(uint64_t i = 0; i < ndicts; i++){
+        assert(ds[i]->reHashIdx == -1 && !dictExtField(ds[i], rehashing));
+        dictTestCheckKeys(ds[i], keys, 1);
+        dictRelease(ds[i]);
+    }
+    zfree(ds);
+
+    //a dict released or emptied while rehashing leaves the list
+    dict *d = dictTestRehashing(&types[0], 1000);
+    dict *e = dictTestRehashing(&types[1], 1000);
+    assert(dictRehashingCount() == 2);
+    dictRelease(d);
+    dictEmpty(e, NULL);
+    assert(dictRehashingCount() == 0 && dictRehashCron(budget) == 0);
+    dictRelease(e);
+
+    const uint64_t budgets[] = {10, 100, 1000};
+    for(int oa = 0; oa <= 1; oa++){
+        for(size_t b = 0; b < sizeof(budgets) / sizeof(budgets[0]); b++){
+            d = dictTestRehashing(&types[oa], keys * 4);
+            //a chained table is first touched by the rehash, a page fault on one of its huge
+            //pages clears 2MB in one go, longer than a batch can plan for
+            if(!oa)
+                memset(d->ht_table[1], 0, dictTableBytes(d->ht_size_exp[1]));
+            calls = 0;
+            while(d->reHashIdx != -1){
+                uint64_t start = monotonicNs();
+                dictRehashMicroseconds(d, budgets[b]);
+                if(calls == cap)
+                    call_ns = zrealloc(call_ns, (cap *= 2) * sizeof(*call_ns));
+                call_ns[calls++] = monotonicNs() - start;
+            }
+            snprintf(what, sizeof(what), "%s dictRehashMicroseconds(%llu)", oa? "open addressing": "chained",
+                (unsigned long long)budgets[b]);
+            dictTestPrintCalls(what, call_ns, calls);
+            //a batch is sized to fit what is left, so only the call freeing the old table, a
+            //page fault or the scheduler can push a call well past its budget
+            uint64_t over = 0;
+            for(uint64_t c = 0; c < calls; c++)
+                over += call_ns[c] > (budgets[b] + budgets[b] / 10 + 50) * 1000;
+            assert(over <= calls / 50 + 1);
+            dictRelease(d);
+        }
+    }
+    zfree(call_ns);
+    return 0;
+}
+//ns per lookup of n keys, the best of 3 passes over them
+static double dictTestLookupNs(dict *d, char **keys, uint64_t n, int expect){
+    uint64_t best = UINT64_MAX;
+    for(int pass = 0; pass < 3; pass++){
+        uint64_t start = monotonicNs();
+        for(uint64_t i = 0; i < n; i++)
+            assert((dictFind(d, keys[i]) != NULL) == expect);
+        uint64_t ns = monotonicNs() - start;
+        best = ns < best? ns: best;
+    }
+    return (double)best / n;
+}
+
+//redis-server test bloom [keys], the filter through adds, deletes, rehashes and empties, then
+//misses and hits of string keys with and without it, and the false positive rate
+int dictBloomTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 1000000;
+    dictType type = {.hashFunction = dictTestIntHash, .keyCompare = dictTestIntCompare};
+    dictType oatype = {.hashFunction = dictTestIntHash, .keyCompare = dictTestIntCompare, .open_addressing = 1};
+    char stats[4096];
+
+    dict *d = dictCreate(&oatype);
+    assert(dictEnableBloom(d) == DICT_ERR);
+    dictRelease(d);
+
+    //no key the dict holds may be filtered out, whatever path put it there
+    uint64_t n = keys / 10;
+    d = dictCreate(&type);
+    assert(dictEnableBloom(d) == DICT_OK);
+    for(uintptr_t k = 1; k <= n; k++)
+        assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+    dictTestCheckKeys(d, n, 1);
+    for(uintptr_t k = 1; k <= n; k += 2)
+        assert(dictDelete(d, (void *)k) == DICT_OK);
+    for(uintptr_t k = 2; k <= n; k += 4){
+        int table;
+        dictEntry **plink, *he = dictTwoPhaseUnlinkFind(d, (void *)k, &plink, &table);
+        assert(he);
+        dictTwoPhaseUnlinkFree(d, he, plink, table);
+    }
+    dictTestCheckKeys(d, n, 4);
+    for(uintptr_t k = 1; k <= n; k++)
+        if(k % 4)
+            assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+    dictTestCheckKeys(d, n, 1);
+    //shrinking rehashes too
+    for(uintptr_t k = 1; k <= n; k++)
+        if(k % 8)
+            assert(dictDelete(d, (void *)k) == DICT_OK);
+    while(dictRehash(d, 1000));
+    assert(dictExpand(d, n / 8) == DICT_OK && d->reHashIdx == 0);
+    dictTestCheckKeys(d, n, 8);
+    while(dictRehash(d, 1000));
+    dictTestCheckKeys(d, n, 8);
+    dictEmpty(d, NULL);
+    for(uintptr_t k = 1; k <= n; k++)
+        assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+    dictTestCheckKeys(d, n, 1);
+    dictGetStats(stats, sizeof(stats), d, 0);
+    printf("%s", stats);
+    dictRelease(d);
+
+    //enabled on a dict partway through a rehash
+    d = dictTestRehashing(&type, n);
+    dictRehash(d, DICTHT_SIZE(d->ht_size_exp[0]) / 4);
+    assert(d->reHashIdx != -1 && dictEnableBloom(d) == DICT_OK);
+    dictTestCheckKeys(d, n, 1);
+    for(uintptr_t k = n + 1; k <= 2 * n; k++)
+        assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+    dictTestCheckKeys(d, 2 * n, 1);
+    for(uintptr_t k = 2 * n + 1; k <= 3 * n; k++)
+        assert(!dictFind(d, (void *)k));
+    assert(d->ext->bloom->negatives > n / 2);
+    dictDisableBloom(d);
+    dictTestCheckKeys(d, 2 * n, 1);
+    dictRelease(d);
+
+    //cache-aside misses of string keys, settled and while a rehash walks two tables
+    dictType strtype = {.hashFunction = dictTestStrHash, .keyCompare = dictTestStrCompare};
+    char *buf = zmalloc(keys * 2 * 24), **present = zmalloc(keys * sizeof(char *)), **absent = zmalloc(keys * sizeof(char *));
+    for(uint64_t i = 0; i < keys; i++){
+        present[i] = buf + i * 48;
+        absent[i] = buf + i * 48 + 24;
+        snprintf(present[i], 24, "key:%llu", (unsigned long long)i);
+        snprintf(absent[i], 24, "miss:%llu", (unsigned long long)i);
+    }
+    for(int rehashing = 0; rehashing <= 1; rehashing++){
+        d = dictCreate(&strtype);
+        for(uint64_t i = 0; i < keys; i++)
+            assert(dictAdd(d, present[i], NULL) == DICT_OK);
+        while(dictRehash(d, 1000));
+        //looked up in random order, not in the order the entries were allocated in
+        for(uint64_t i = keys - 1; i > 0; i--){
+            uint64_t j = genrand64_int64() % (i + 1);
+            char *t = present[i];
+            present[i] = present[j];
+            present[j] = t;
+        }
+        if(rehashing){
+            assert(dictExpand(d, keys * 4) == DICT_OK);
+            dictRehash(d, DICTHT_SIZE(d->ht_size_exp[0]) / 2);
+            d->pauseRehash++;
+        }
+        double miss[2], hit[2];
+        for(int on = 0; on <= 1; on++){
+            if(on)
+                assert(dictEnableBloom(d) == DICT_OK);
+            miss[on] = dictTestLookupNs(d, absent, keys, 0);
+            hit[on] = dictTestLookupNs(d, present, keys, 1);
+        }
+        struct dictBloom *b = d->ext->bloom;
+        double rate = (double)b->false_positives / (b->negatives + b->false_positives);
+        printf("%s, %llu keys: miss %.1f -> %.1f ns, hit %.1f -> %.1f ns, false positives %.2f%%, "
+            "filter %llu bytes\n", rehashing? "rehashing": "settled", (unsigned long long)keys,
+            miss[0], miss[1], hit[0], hit[1], rate * 100,
+            (unsigned long long)(dictBloomBytes(&b->f[0]) + dictBloomBytes(&b->f[1])));
+        assert(rate < 0.1);
+        if(rehashing)
+            d->pauseRehash--;
+        dictRelease(d);
+    }
+    zfree(present);
+    zfree(absent);
+    zfree(buf);
+    return 0;
+}
+
+static uint64_t dict_test_hashes;
+
+static uint64_t dictTestCountingStrHash(const void *key){
+    dict_test_hashes++;
+    return dictTestStrHash(key);
+}
+
+//move every key of src to dst, hashed once with withhash, else by both dicts
+static uint64_t dictTestMoveNs(dict *src, dict *dst, char **keys, uint64_t n, int withhash){
+    uint64_t start = monotonicNs();
+    for(uint64_t i = 0; i < n; i++){
+        int table;
+        dictEntry **plink, *he;
+        if(withhash){
+            uint64_t h = dictGetHash(src, keys[i]);
+            he = dictTwoPhaseUnlinkFindWithHash(src, keys[i], h, &plink, &table);
+            assert(he && dictAddRawWithHash(dst, dictGetKey(he), h, NULL));
+        }else{
+            he = dictTwoPhaseUnlinkFind(src, keys[i], &plink, &table);
+            assert(he && dictAddRaw(dst, dictGetKey(he), NULL));
+        }
+        dictTwoPhaseUnlinkFree(src, he, plink, table);
+    }
+    return monotonicNs() - start;
+}
+
+//redis-server test withhash [keys] [key length], the WithHash calls never hash and agree with
+//the plain ones, a rehash goes by the tags of what they inserted, and keys moved between dicts
+int dictWithHashTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 200000;
+    size_t len = argc > 4? strtoull(argv[4], NULL, 10): 256;
+    dictType types[2] = {
+        {.hashFunction = dictTestCountingStrHash, .keyCompare = dictTestStrCompare},
+        {.hashFunction = dictTestCountingStrHash, .keyCompare = dictTestStrCompare, .open_addressing = 1},
+    };
+    assert(len >= 24);
+    char *buf = zmalloc(keys * (len + 1)), **k = zmalloc(keys * sizeof(char *));
+    uint64_t *hashes = zmalloc(keys * sizeof(uint64_t));
+    for(uint64_t i = 0; i < keys; i++){
+        k[i] = buf + i * (len + 1);
+        int n = snprintf(k[i], len + 1, "%llu:", (unsigned long long)i);
+        memset(k[i] + n, 'k', len - n);
+        k[i][len] = '\0';
+    }
+
+    for(int t = 0; t < 2; t++){
+        dict *d = dictCreate(&types[t]);
+        assert(dictExpand(d, keys) == DICT_OK);
+        while(dictRehash(d, 1000));
+        for(uint64_t i = 0; i < keys; i++)
+            hashes[i] = dictGetHash(d, k[i]);
+        dict_test_hashes = 0;
+        for(uint64_t i = 0; i < keys; i++){
+            if(i % 2){
+                assert(dictAddRawWithHash(d, k[i], hashes[i], NULL));
+                continue;
+            }
+            dictEntry *existing;
+            void *position = dictFindPositionForInsertWithHash(d, k[i], hashes[i], &existing);
+            assert(position && !existing);
+            assert(dictInsertAtPositionWithHash(d, k[i], position, hashes[i]));
+        }
+        for(uint64_t i = 0; i < keys; i++){
+            dictEntry *existing, *he = dictFindWithHash(d, k[i], hashes[i]);
+            assert(he && dictGetKey(he) == k[i]);
+            assert(!dictAddRawWithHash(d, k[i], hashes[i], &existing) && existing == he);
+            assert(!dictFindPositionForInsertWithHash(d, k[i], hashes[i], &existing) && existing == he);
+        }
+        assert(dict_test_hashes == 0);
+        for(uint64_t i = 0; i < keys; i++)
+            assert(dictFind(d, k[i]) == dictFindWithHash(d, k[i], hashes[i]));
+        assert(dict_test_hashes == keys);
+
+        //growing by fewer bits than the tags hold rehashes without hashing, open addressing has no tags
+        dict_test_hashes = 0;
+        assert(dictExpand(d, keys * 16) == DICT_OK);
+        while(dictRehash(d, 1000));
+        assert(t || !DICT_ENTRY_TAGS || dict_test_hashes == 0);
+
+        for(uint64_t i = 0; i < keys; i += 2){
+            int table;
+            dictEntry **plink, *he = dictTwoPhaseUnlinkFindWithHash(d, k[i], hashes[i], &plink, &table);
+            assert(he && dictGetKey(he) == k[i]);
+            dictTwoPhaseUnlinkFree(d, he, plink, table);
+        }
+        for(uint64_t i = 0; i < keys; i++)
+            assert((dictFindWithHash(d, k[i], hashes[i]) != NULL) == (i % 2));
+        dictRelease(d);
+    }
+
+    //a key moved between two dicts, like MOVE between databases, there and back a few times
+    for(int t = 0; t < 2; t++){
+        dict *a = dictCreate(&types[t]), *b = dictCreate(&types[t]);
+        assert(dictExpand(a, keys) == DICT_OK && dictExpand(b, keys) == DICT_OK);
+        while(dictRehash(a, 1000) || dictRehash(b, 1000));
+        for(uint64_t i = 0; i < keys; i++)
+            assert(dictAdd(a, k[i], NULL) == DICT_OK);
+        uint64_t best[2] = {UINT64_MAX, UINT64_MAX}, calls[2];
+        for(int pass = 0; pass < 6; pass++){
+            int withhash = pass % 2;
+            dict_test_hashes = 0;
+            uint64_t ns = dictTestMoveNs(a, b, k, keys, withhash) + dictTestMoveNs(b, a, k, keys, withhash);
+            calls[withhash] = dict_test_hashes;
+            best[withhash] = ns < best[withhash]? ns: best[withhash];
+        }
+        assert(calls[0] == keys * 4 && calls[1] == keys * 2);
+        assert(a->ht_used[0] + a->ht_used[1] == keys && b->ht_used[0] + b->ht_used[1] == 0);
+        printf("%s, %llu keys of %zu bytes moved: %.1f ns plain, %.1f ns hashed once\n",
+            t? "open addressing": "chained", (unsigned long long)keys, len,
+            (double)best[0] / (keys * 2), (double)best[1] / (keys * 2));
+        dictRelease(a);
+        dictRelease(b);
+    }
+    zfree(hashes);
+    zfree(k);
+    zfree(buf);
+    return 0;
+}
+
+static uint64_t dictTestEmbedHash(const void *key){
+    return dictTestStrHash(key);
+}
+
+static void *dictTestEmbedDup(dict *d, const void *key){
+    (void)d;
+    size_t len = strlen(key) + 1;
+    return memcpy(zmalloc(len), key, len);
+}
+
+static void dictTestEmbedDestructor(dict *d, void *key){
+    (void)d;
+    zfree(key);
+}
+
+//keys up to 32 bytes go in the entry
+static size_t dictTestEmbedSize(dict *d, const void *key){
+    (void)d;
+    size_t len = strlen(key) + 1;
+    return len <= 32? len: 0;
+}
+
+static void *dictTestEmbed(dict *d, void *buf, const void *key){
+    (void)d;
+    return memcpy(buf, key, strlen(key) + 1);
+}
+
+//redis-server test embedkeys [keys], embedded and out of line keys added, replaced and deleted
+//through every insert path, owned by the dict or borrowed for keyDup, leave no memory behind
+int dictEmbedKeyTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 100000;
+    dictType types[2] = {
+        {.hashFunction = dictTestEmbedHash, .keyCompare = dictTestStrCompare, .keyDestructor = dictTestEmbedDestructor,
+            .keyEmbedSize = dictTestEmbedSize, .keyEmbed = dictTestEmbed},
+        {.hashFunction = dictTestEmbedHash, .keyCompare = dictTestStrCompare, .keyDestructor = dictTestEmbedDestructor,
+            .keyDup = dictTestEmbedDup, .keyEmbedSize = dictTestEmbedSize, .keyEmbed = dictTestEmbed},
+    };
+    char key[64];
+
+    for(int t = 0; t < 2; t++){
+        size_t before = zmalloc_used_memory();
+        dict *d = dictCreate(&types[t]);
+        for(uint64_t i = 0; i < keys; i++){
+            //every fourth key is too long to embed
+            snprintf(key, sizeof(key), i % 4? "k:%llu": "a long key that stays out of line:%llu", (unsigned long long)i);
+            //the dict owns what it is given unless it duplicates it
+            char *owned = t? key: dictTestEmbedDup(NULL, key);
+            if(i % 2){
+                assert(dictAdd(d, owned, NULL) == DICT_OK);
+            }else{
+                dictEntry *existing;
+                void *position = dictFindPositionForInsert(d, key, &existing);
+                assert(position && !existing);
+                //dictInsertAtPosition always takes ownership
+                assert(dictInsertAtPosition(d, dictTestEmbedDup(NULL, key), position));
+                if(!t)
+                    zfree(owned);
+            }
+            dictEntry *de = dictFind(d, key);
+            assert(de && !strcmp(dictGetKey(de), key));
+            assert(entryHasEmbeddedKey(de) == (i % 4 != 0));
+        }
+        //dictSetKey swaps keys in place, the replaced key is freed with the entry or right away,
+        //also while the helper thread rehashes the entries
+        while(dictRehash(d, 1000));
+        assert(dictEnableBackgroundRehash(d) == DICT_OK);
+        assert(dictExpand(d, DICTHT_SIZE(d->ht_size_exp[0]) * 4) == DICT_OK);
+        for(uint64_t i = 0; i < keys; i += 3){
+            snprintf(key, sizeof(key), i % 4? "k:%llu": "a long key that stays out of line:%llu", (unsigned long long)i);
+            dictEntry *de = dictFind(d, key);
+            assert(de);
+            char *same = t? key: dictTestEmbedDup(NULL, key);
+            if(!entryHasEmbeddedKey(de))
+                d->type->keyDestructor(d, dictGetKey(de));
+            dictSetKey(d, de, same);
+            assert(dictFind(d, key) == de);
+        }
+        for(uint64_t i = 0; i < keys; i += 2){
+            snprintf(key, sizeof(key), i % 4? "k:%llu": "a long key that stays out of line:%llu", (unsigned long long)i);
+            assert(dictDelete(d, key) == DICT_OK);
+        }
+        assert(d->ht_used[0] + d->ht_used[1] == keys / 2);
+        dictRelease(d);
+        size_t after = zmalloc_used_memory();
+        printf("%s: %zu bytes before, %zu after\n", t? "keyDup": "owned keys", before, after);
+        assert(after == before);
+    }
+    return 0;
+}
+
+//a dict rehashing into the table it picked itself, about twice its size
+static dict *dictTestOaRehashing(dictType *type, uintptr_t *next){
+    dict *d = dictCreate(type);
+    while(d->reHashIdx == -1 || d->ht_used[0] < 1000)
+        assert(dictAdd(d, (void *)(*next)++, NULL) == DICT_OK);
+    return d;
+}
+
+//redis-server test oadict [keys], adds, finds and deletes on an open addressing dict, tombstones
+//reused and dropped, a rehash walked with changes on both tables, and a safe iterator that keeps
+//the target table from growing under it
+int dictOaTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 100000;
+    dictType type = {.hashFunction = dictTestIntHash, .keyCompare = dictTestIntCompare, .open_addressing = 1};
+
+    dict *d = dictCreate(&type);
+    for(uintptr_t k = 1; k <= keys; k++)
+        assert(dictAdd(d, (void *)k, (void *)(k * 3)) == DICT_OK);
+    while(dictRehash(d, 1000));
+    assert(dictAdd(d, (void *)1, NULL) == DICT_ERR);
+    for(uintptr_t k = 1; k <= keys; k++)
+        assert(dictFetchValue(d, (void *)k) == (void *)(k * 3));
+    //deletes in full groups leave tombstones, lookups go past them
+    for(uintptr_t k = 1; k <= keys; k++)
+        if(k % 2)
+            assert(dictDelete(d, (void *)k) == DICT_OK);
+    assert(dictDelete(d, (void *)1) == DICT_ERR);
+    uint64_t tombstones = d->ext->ht_tombstones[0];
+    assert(tombstones > 0 && d->ht_used[0] == keys / 2);
+    dictTestCheckKeys(d, keys, 2);
+    //inserts take the tombstones back
+    for(uintptr_t k = 1; k <= keys; k++)
+        if(k % 2)
+            assert(dictAdd(d, (void *)k, (void *)(k * 3)) == DICT_OK);
+    assert(d->ext->ht_tombstones[0] < tombstones);
+    dictTestCheckKeys(d, keys, 1);
+
+    //churn on a steady size: tombstones don't pile up, the table gets rebuilt
+    int8_t exp = d->ht_size_exp[0];
+    for(uintptr_t k = keys + 1; k <= keys * 10; k++){
+        assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+        assert(dictDelete(d, (void *)(k - keys)) == DICT_OK);
+        assert(d->ht_used[0] + d->ht_used[1] == keys);
+        assert(d->ext->ht_tombstones[0] < oaSlots(d->ht_size_exp[0]));
+    }
+    while(dictRehash(d, 1000));
+    assert(d->ht_size_exp[0] <= exp + 1);
+    for(uintptr_t k = keys * 9 + 1; k <= keys * 10; k++)
+        assert(dictFind(d, (void *)k));
+    dictRelease(d);
+
+    //adds and deletes while the rehash is halfway, on keys of both tables
+    d = dictTestRehashing(&type, keys);
+    dictRehash(d, DICTHT_SIZE(d->ht_size_exp[0]) / 2);
+    assert(d->reHashIdx != -1 && d->ht_used[0] && d->ht_used[1]);
+    for(uintptr_t k = 1; k <= keys; k += 2)
+        assert(dictDelete(d, (void *)k) == DICT_OK);
+    for(uintptr_t k = keys + 2; k <= keys * 2; k += 2)
+        assert(dictAdd(d, (void *)k, NULL) == DICT_OK);
+    dictTestCheckKeys(d, keys * 2, 2);
+    while(dictRehash(d, 1000));
+    assert(d->reHashIdx == -1);
+    dictTestCheckKeys(d, keys * 2, 2);
+    dictRelease(d);
+
+    //the target takes inserts under a safe iterator instead of growing, the slots it handed out
+    //stay. a two-choice table doesn't make room in its groups either, keys spill past them
+    dictType bounded = type;
+    bounded.bounded_probe = 1;
+    dictType *pausetypes[2] = {&type, &bounded};
+    for(int t = 0; t < 2; t++){
+        uintptr_t next = 1;
+        d = dictTestOaRehashing(pausetypes[t], &next);
+        //few keys left to move, the target runs full rather than the source
+        while(d->ht_used[0] > oaSlots(d->ht_size_exp[1]) / 64)
+            dictRehash(d, 1);
+        dictIterator *iter = dictGetSafeIterator(d);
+        dictEntry *held[16];
+        void *heldkeys[16];
+        for(int i = 0; i < 16; i++){
+            held[i] = dictNext(iter);
+            heldkeys[i] = dictGetKey(held[i]);
+        }
+        //more keys than the target has room for next to table 0, up to its last group
+        dictEntry **target = d->ht_table[1];
+        uint64_t slots = oaSlots(d->ht_size_exp[1]);
+        while(d->ht_used[1] < slots - DICT_OA_GROUP_SLOTS){
+            assert(dictAdd(d, (void *)next, NULL) == DICT_OK);
+            next++;
+        }
+        assert(d->ht_table[1] == target && d->ht_used[0] + d->ht_used[1] > slots);
+        for(int i = 0; i < 16; i++)
+            assert(dictGetKey(held[i]) == heldkeys[i]);
+        uint64_t seen = 16;
+        while(dictNext(iter))
+            seen++;
+        assert(seen >= next - 1);
+        //rehashing waits for room while paused
+        uint64_t waiting = d->ht_used[0];
+        assert(dictRehash(d, 1000) == 1 && d->ht_table[1] == target);
+        assert(d->ht_used[0] + DICT_OA_GROUP_SLOTS > waiting && d->ht_used[1] <= slots);
+        dictReleaseIterator(iter);
+        //with the iterator gone the target grows again
+        assert(dictAdd(d, (void *)next, NULL) == DICT_OK);
+        assert(d->ht_table[1] != target);
+        dictTestCheckKeys(d, next, 1);
+        dictRelease(d);
+    }
+    return 0;
+}
+#endif
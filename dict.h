@@ -16,7 +16,7 @@ typedef struct dictEntry{
         int64_t s64;
         double d;
     }v;
-    struct dictEntry *next;
+    struct dictEntry *next;//top bits may hold a hash tag of this entry, only dict.c reads it
     void *metadata[];
 } dictEntry;
 
@@ -33,9 +33,40 @@ typedef struct dictType{
     size_t (*dictEntryMetadataBYtes)(dict *d);
     size_t (*dictMetadataBytes)(void);
     void (*afterReplaceEntry)(dict *d, dictEntry *entry);
+    //keep short keys in the entry allocation, after the entry metadata. keyEmbedSize returns the
+    //bytes key needs there or 0 to keep it out of line, keyEmbed copies key into buf and returns
+    //the copy. keyDup and keyDestructor are skipped for embedded keys, entry_slab is ignored
+    size_t (*keyEmbedSize)(dict *d, const void *key);
+    void *(*keyEmbed)(dict *d, void *buf, const void *key);
+    //optional, hashes[i] = hashFunction(keys[i]) for n keys in one call, so types can hash
+    //several keys in parallel, e.g. with dictGenHashFunctionBatch. used by dictFindBatch and
+    //dictBulkBuilder
+    void (*hashFunctionBatch)(const void **keys, size_t n, uint64_t *hashes);
 
     uint32_t no_value:1;//by experience, no_value will ignore init value when announce
     uint32_t key_are_odd:1;
+    //keep entries inline in SIMD probed groups instead of chained dictEntry allocations,
+    //entries then move on rehash, so a dictEntry pointer is only valid until the next dict call.
+    //while a rehash is paused its target table can't grow, inserts assert once it has no free slot
+    uint32_t open_addressing:1;
+    //allocate dictEntry and dictEntryNoValue from a per-dict slab of fixed size objects,
+    //ignored by open addressing dicts
+    uint32_t entry_slab:1;
+    //one writer thread, and reader threads calling dictFind, dictFetchValue and dictFindBatch
+    //without locks inside epochEnter/epochExit. found entries and fetched values stay valid until
+    //epochExit, the writer must not use dictSetKey or defrag. not for open addressing dicts
+    uint32_t concurrent_reads:1;
+    //dictRelease and dictEmpty of big dicts only detach the tables, a background thread frees
+    //the entries. the key and value destructors then run on that thread
+    uint32_t lazy_free:1;
+    //open addressing only: a key sits in one of two groups picked by its hash, so a lookup
+    //reads at most two groups. an insert that finds both full grows the table instead of
+    //probing on, only a degenerate hash spills keys further, see dictGetStats
+    uint32_t bounded_probe:1;
+    //while it rehashes the dict is on the global list dictRehashCron works through, so many
+    //dicts share one rehash budget. the list isn't locked, use such dicts and dictRehashCron
+    //from one thread only, background rehashing is refused
+    uint32_t scheduled_rehash:1;
 }dictType;
 
 #define DICTHT_SIZE(exp) ((exp) == -1? 0: (uint64_t)1 << (exp))
@@ -52,6 +83,8 @@ struct dict{
     int16_t pauseRehash;
     int8_t ht_size_exp[2];
 
+    struct dictExt *ext;//state of the opt-in features, NULL until one needs it
+
     void *metadata[];
 };
 
@@ -64,6 +97,11 @@ typedef struct dictIterator{
 }dictIterator;
 
 typedef void (dictScanFunction)(void *privData, const dictEntry *de);
+typedef struct dictParallelScan dictParallelScan;
+typedef struct dictBulkBuilder dictBulkBuilder;
+typedef void (dictBulkDupFunction)(void *privdata, void *key, void *val);
+typedef void (dictLazyFreeFunction)(void *ptr);
+struct workerPool;
 typedef void *(dictDefragAllocFunction)(void *ptr);
 typedef struct{
     dictDefragAllocFunction *defragAlloc;
@@ -71,6 +109,8 @@ typedef struct{
     dictDefragAllocFunction *defragVal;
 }dictDefragAllocFunctions;
 
+#define DICT_PARALLEL_SCAN_MAX_BITS 16
+#define DICT_BULK_UNIQUE (1 << 0)//dictBulkBuilderCreate: skip the duplicate check
 #define DICT_HT_INITIAL_EXP 2
 #define DICT_HT_INITIAL_SIZE (1 << (DICT_HT_INITIAL_EXP))
 
@@ -100,6 +140,7 @@ void dictFreeUnlinkedEntry(dict *d, dictEntry *he);
 dictEntry *dictTwoPhaseUnlinkFind(dict *d, const void *key, dictEntry ***plink, int *table_index);
 void dictRelease(dict *d);
 dictEntry *dictFind(dict *d, const void *key);
+size_t dictFindBatch(dict *d, const void **keys, size_t n, dictEntry **out);
 void *dictFetchValue(dict *d, const void *key);
 int dictResize(dict *d);
 void dictSetKey(dict *d, dictEntry *de, void *key);
@@ -108,8 +149,11 @@ void dictSetSignedIntegerVal(dictEntry *de, int64_t val);
 void dictSetUnsignedINtegerVal(dictEntry *de, uint64_t val);
 void dictSetDoubleVal(dictEntry *de, double val);
 int64_t dictIncrSignedIntegerVal(dictEntry *de, int64_t val);
-uint64_t dictINcrUnsignedIntegerVal(dictEntry *de, uint64_t val);
+uint64_t dictIncrUnsignedIntegerVal(dictEntry *de, uint64_t val);
 double dictIncrDoubleVal(dictEntry *de, double val);
+int64_t dictAtomicIncrSignedIntegerVal(dictEntry *de, int64_t val);
+uint64_t dictAtomicIncrUnsignedIntegerVal(dictEntry *de, uint64_t val);
+double dictAtomicIncrDoubleVal(dictEntry *de, double val);
 void *dictEntryMetadata(dictEntry *de);
 void *dictGetKey(const dictEntry *de);
 void *dictGetVal(const dictEntry *de);
@@ -118,7 +162,7 @@ uint64_t dictGetUnsignedIntegerVal(const dictEntry *de);
 double dictGetDoubleVal(const dictEntry *de);
 double *dictGetDoubleValPtr(dictEntry *de);
 size_t dictMemUsage(const dict *d);
-size_t dictEntryMemUsage(void);
+size_t dictEntryMemUsage(dict *d);
 dictIterator *dictGetIterator(dict *d);
 dictIterator *dictGetSafeIterator(dict *d);
 void dictInitIterator(dictIterator *iter, dict *d);
@@ -130,15 +174,69 @@ dictEntry *dictGetRandomKey(dict *d);
 dictEntry *dictGetFairRandomKey(dict *d);
 uint32_t dictGetSomeKeys(dict *d, dictEntry **des, uint32_t count);
 void dictGetStats(char *buf, size_t bufSize, dict *d, int full);
+int dictEnableStats(dict *d);
+void dictDisableStats(dict *d);
+int dictEnableBloom(dict *d);
+void dictDisableBloom(dict *d);
 uint64_t dictGenHashFunction(const void *key, size_t len);
 uint64_t dictGenCaseHashFunction(const uint8_t *buf, size_t len);
+uint64_t dictGenFastHashFunction(const void *key, size_t len);
+void dictGenHashFunctionBatch(const void **keys, const size_t *lens, size_t n, uint64_t *hashes);
+uint64_t dictGenFastCaseHashFunction(const uint8_t *buf, size_t len);
 void dictEmpty(dict *d, void(callback)(dict *));
 void dictSetREsizeEnabled(dictResizeEnable enable);
 int dictRehash(dict *d, int n);
 int dictRehashMilliseconds(dict *d, int ms);
+int dictRehashMicroseconds(dict *d, uint64_t us);
+uint64_t dictRehashCron(uint64_t us);
+uint64_t dictRehashingCount(void);
+int dictEnableBackgroundRehash(dict *d);
+void dictDisableBackgroundRehash(dict *d);
+size_t dictReclaim(dict *d);
+void dictFreeLazily(dictLazyFreeFunction *fn, void *ptr, uint64_t effort);
+uint64_t dictLazyFreePending(uint64_t *effort);
+void dictLazyFreeWait(void);
 void dictSetHashFunctionSeed(uint8_t *seed);
 uint8_t *dictGetHashFunctionSeed(void);
 uint64_t dictScan(dict *d, uint64_t v, dictScanFunction *fn, void *privdata);
 uint64_t dictScanDefrag(dict *d, uint64_t v, dictScanFunction *fn, dictDefragAllocFunctions *defragfns, void *privdata);
+dictParallelScan *dictParallelScanStart(dict *d, int bits);
+int dictParallelScanStep(dictParallelScan *ps, struct workerPool *pool, int steps, dictScanFunction *fn, dictDefragAllocFunctions *defragfns, void **privdata);
+void dictParallelScanRelease(dictParallelScan *ps);
+dictBulkBuilder *dictBulkBuilderCreate(dict *d, uint64_t estimate, int flags, struct workerPool *pool, dictBulkDupFunction *dupfn, void *privdata);
+void dictBulkBuilderAdd(dictBulkBuilder *b, void *key, void *val);
+uint64_t dictBulkBuilderFinish(dictBulkBuilder *b);
 uint64_t dictGetHash(dict *d, const void *key);
-dictEntry *dictFindEntryByPtrAndHash(dict *d, const void *oldptr, uint64_t hash);
\ No newline at end of file
+dictEntry *dictFindEntryByPtrAndHash(dict *d, const void *oldptr, uint64_t hash);
+//hash is dictGetHash of the key, for callers that already have it, like moves between dicts
+//of the same hash function. entries inserted with it get their tag from it and rehash with the tag
+dictEntry *dictFindWithHash(dict *d, const void *key, uint64_t hash);
+dictEntry *dictAddRawWithHash(dict *d, void *key, uint64_t hash, dictEntry **existing);
+void *dictFindPositionForInsertWithHash(dict *d, const void *key, uint64_t hash, dictEntry **existing);
+dictEntry *dictInsertAtPositionWithHash(dict *d, void *key, void *position, uint64_t hash);
+dictEntry *dictTwoPhaseUnlinkFindWithHash(dict *d, const void *key, uint64_t hash, dictEntry ***plink, int *table_index);
+
+#ifdef REDIS_TEST
+int dictFindBatchTest(int argc, char *argv[], int flags);
+int dictBgRehashTest(int argc, char *argv[], int flags);
+int dictEntrySlabTest(int argc, char *argv[], int flags);
+int dictEntryTagTest(int argc, char *argv[], int flags);
+int dictLockFreeTest(int argc, char *argv[], int flags);
+int dictParallelScanTest(int argc, char *argv[], int flags);
+int dictBulkTest(int argc, char *argv[], int flags);
+int dictLazyFreeTest(int argc, char *argv[], int flags);
+int dictHugeTableTest(int argc, char *argv[], int flags);
+int dictStatsTest(int argc, char *argv[], int flags);
+int fasthashTest(int argc, char *argv[], int flags);
+int dictHashBatchTest(int argc, char *argv[], int flags);
+int dictBoundedProbeTest(int argc, char *argv[], int flags);
+int dictRehashCronTest(int argc, char *argv[], int flags);
+int dictBloomTest(int argc, char *argv[], int flags);
+int dictWithHashTest(int argc, char *argv[], int flags);
+int dictOaTest(int argc, char *argv[], int flags);
+int dictEmbedKeyTest(int argc, char *argv[], int flags);
+//key hashes for the tests of dict and the modules built on it, of keys that are integers
+//stored in the pointer and of sds keys
+uint64_t dictTestIntHash(const void *key);
+uint64_t dictTestSdsHash(const void *key);
+#endif
@@ -0,0 +1,553 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dictimage.h"
+#include "zmalloc.h"
+#include "redisassert.h"
+
+uint64_t fasthash(const uint8_t *in, const size_t inlen, const uint8_t *k);
+
+#define DICT_IMAGE_ALIGN 64
+
+static inline uint64_t dictImageHash(const uint8_t *seed, const sds key, size_t len){
+    return fasthash((const uint8_t *)key, len, seed);
+}
+
+static inline int dictImageIsDead(dictImage *img, uint64_t i){
+    return (img->dead[i >> 6] >> (i & 63)) & 1;
+}
+
+static inline void dictImageSetDead(dictImage *img, uint64_t i){
+    img->dead[i >> 6] |= (uint64_t)1 << (i & 63);
+    img->dead_count++;
+}
+
+/* ----------------------------- saving -----------------------------
+ * The file is the header, the key and value sds strings back to back from data_off, each with
+ * the smallest sds header that holds its length and alloc == len, and the slot table from
+ * slots_off, 64 byte aligned. Slots are placed by linear probing on the fast hash with a seed
+ * kept in the header, so the image doesn't depend on the hash seed of the process that loads
+ * it. The table is at most half full, a probe always ends on an empty slot. */
+
+//write s with an sds header, return the offset s gets in the file
+static int dictImageWriteSds(FILE *fp, uint64_t *off, const sds s, uint64_t *pos){
+    size_t len = sdslen(s), hdrlen;
+    union{
+        struct sdshdr8 h8;
+        struct sdshdr16 h16;
+        struct sdshdr32 h32;
+        struct sdshdr64 h64;
+    }hdr;
+    if(len < (size_t)1 << 8){
+        hdr.h8 = (struct sdshdr8){.len = len, .alloc = len, .flags = SDS_TYPE_8};
+        hdrlen = sizeof(hdr.h8);
+    }else if(len < (size_t)1 << 16){
+        hdr.h16 = (struct sdshdr16){.len = len, .alloc = len, .flags = SDS_TYPE_16};
+        hdrlen = sizeof(hdr.h16);
+    }else if(len < (size_t)1 << 32){
+        hdr.h32 = (struct sdshdr32){.len = len, .alloc = len, .flags = SDS_TYPE_32};
+        hdrlen = sizeof(hdr.h32);
+    }else{
+        hdr.h64 = (struct sdshdr64){.len = len, .alloc = len, .flags = SDS_TYPE_64};
+        hdrlen = sizeof(hdr.h64);
+    }
+    if(fwrite(&hdr, hdrlen, 1, fp) != 1 || fwrite(s, len + 1, 1, fp) != 1)
+        return -1;
+    *pos = *off + hdrlen;
+    *off += hdrlen + len + 1;
+    return 0;
+}
+
+static int dictImagePad(FILE *fp, uint64_t *off){
+    static const char zeros[DICT_IMAGE_ALIGN];
+    size_t pad = (DICT_IMAGE_ALIGN - *off % DICT_IMAGE_ALIGN) % DICT_IMAGE_ALIGN;
+    if(pad && fwrite(zeros, pad, 1, fp) != 1)
+        return -1;
+    *off += pad;
+    return 0;
+}
+
+//write the image of d to path, through a temp file renamed in place, so a crash leaves the old
+//image. the values must be sds unless the type has no_value
+int dictImageSave(dict *d, const char *path){
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp-%d", path, (int)getpid());
+    FILE *fp = fopen(tmp, "w");
+    if(!fp)
+        return DICT_ERR;
+    setvbuf(fp, NULL, _IOFBF, 1 << 20);
+
+    dictImageHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, DICT_IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = DICT_IMAGE_VERSION;
+    hdr.no_value = d->type->no_value;
+    hdr.count = d->ht_used[0] + d->ht_used[1];
+    hdr.slots = 16;
+    while(hdr.slots < hdr.count * 2)
+        hdr.slots <<= 1;
+    memcpy(hdr.seed, dictGetHashFunctionSeed(), sizeof(hdr.seed));
+
+    dictImageSlot *slots = zcalloc(hdr.slots * sizeof(dictImageSlot));
+    uint64_t off = 0, mask = hdr.slots - 1, written = 0;
+    int err = fwrite(&hdr, sizeof(hdr), 1, fp) != 1;
+    off += sizeof(hdr);
+    err = err || dictImagePad(fp, &off);
+    hdr.data_off = off;
+
+    dictIterator *iter = dictGetIterator(d);
+    dictEntry *de;
+    while(!err && (de = dictNext(iter))){
+        sds key = dictGetKey(de);
+        size_t len = sdslen(key);
+        uint64_t h = dictImageHash(hdr.seed, key, len), i = h & mask;
+        while(slots[i].key)
+            i = (i + 1) & mask;
+        slots[i].hash = h;
+        err = dictImageWriteSds(fp, &off, key, &slots[i].key);
+        if(!err && !hdr.no_value)
+            err = dictImageWriteSds(fp, &off, dictGetVal(de), &slots[i].val);
+        written++;
+    }
+    dictReleaseIterator(iter);
+
+    err = err || written != hdr.count || dictImagePad(fp, &off);
+    hdr.slots_off = off;
+    err = err || fwrite(slots, sizeof(dictImageSlot), hdr.slots, fp) != hdr.slots;
+    hdr.file_size = off + hdr.slots * sizeof(dictImageSlot);
+    zfree(slots);
+    err = err || fseek(fp, 0, SEEK_SET) == -1 || fwrite(&hdr, sizeof(hdr), 1, fp) != 1;
+    err = err || fflush(fp) == EOF || fsync(fileno(fp)) == -1;
+    err = fclose(fp) == EOF || err;
+    if(err || rename(tmp, path) == -1){
+        int saved = errno;
+        unlink(tmp);
+        errno = saved;
+        return DICT_ERR;
+    }
+    return DICT_OK;
+}
+
+/* ----------------------------- loading ----------------------------- */
+
+//map the image at path, NULL with errno set when it can't be opened or isn't an image. type
+//must have keyDup, and valDup unless it has no_value, the keys and values that move to the heap
+//are copied out of the mapping through them
+dictImage *dictImageLoad(const char *path, dictType *type){
+    if(!type->keyDup || (!type->no_value && !type->valDup)){
+        errno = EINVAL;
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY);
+    if(fd == -1)
+        return NULL;
+    struct stat st;
+    if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(dictImageHeader)){
+        if(errno == 0)
+            errno = EINVAL;
+        close(fd);
+        return NULL;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return NULL;
+
+    const dictImageHeader *hdr = (const dictImageHeader *)map;
+    if(memcmp(hdr->magic, DICT_IMAGE_MAGIC, sizeof(hdr->magic)) || hdr->version != DICT_IMAGE_VERSION ||
+        hdr->no_value != type->no_value || hdr->file_size != (uint64_t)st.st_size ||
+        !hdr->slots || (hdr->slots & (hdr->slots - 1)) || hdr->count * 2 > hdr->slots ||
+        hdr->data_off < sizeof(*hdr) || hdr->slots_off < hdr->data_off || hdr->slots_off % DICT_IMAGE_ALIGN ||
+        hdr->slots_off > hdr->file_size || hdr->slots > (hdr->file_size - hdr->slots_off) / sizeof(dictImageSlot)){
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+    //the slot table is hit by every lookup, read it ahead, the data only as it is touched
+    madvise(map + hdr->slots_off, hdr->slots * sizeof(dictImageSlot), MADV_WILLNEED);
+    madvise(map, hdr->slots_off, MADV_RANDOM);
+
+    dictImage *img = zcalloc(sizeof(*img));
+    img->d = dictCreate(type);
+    img->map = map;
+    img->map_size = st.st_size;
+    img->hdr = hdr;
+    img->slots = (const dictImageSlot *)(map + hdr->slots_off);
+    img->dead = zcalloc(((hdr->slots + 63) / 64) * sizeof(uint64_t));
+    return img;
+}
+
+static void dictImageUnmap(dictImage *img){
+    if(!img->map)
+        return;
+    munmap(img->map, img->map_size);
+    zfree(img->dead);
+    img->map = NULL;
+    img->hdr = NULL;
+    img->slots = NULL;
+    img->dead = NULL;
+}
+
+void dictImageRelease(dictImage *img){
+    dictImageUnmap(img);
+    dictRelease(img->d);
+    zfree(img);
+}
+
+/* ----------------------------- access -----------------------------
+ * Keys are looked up in d first, then in the image, where a dead slot hides the key. Keys and
+ * values returned from the image are read only sds pointing into the mapping, valid until the
+ * next call that migrates or releases the image. The header is checked by the load, the slots
+ * only as they are touched: a slot whose key or value isn't an sds within the data is a corrupt
+ * image, its key is a miss and the migration drops it. */
+
+//whether the sds at off, header, string and terminator, lies within the data
+static int dictImageSdsValid(dictImage *img, uint64_t off){
+    static const uint8_t hdrlens[] = {1, sizeof(struct sdshdr8), sizeof(struct sdshdr16),
+        sizeof(struct sdshdr32), sizeof(struct sdshdr64)};
+    const dictImageHeader *hdr = img->hdr;
+    if(off <= hdr->data_off || off >= hdr->slots_off)
+        return 0;
+    uint8_t type = img->map[off - 1] & SDS_TYPE_MASK;
+    if(type > SDS_TYPE_64 || off - hdr->data_off < hdrlens[type])
+        return 0;
+    return sdslen(img->map + off) < hdr->slots_off - off;
+}
+
+static int dictImageSlotValid(dictImage *img, const dictImageSlot *s){
+    if(!dictImageSdsValid(img, s->key))
+        return 0;
+    return img->hdr->no_value? !s->val: dictImageSdsValid(img, s->val);
+}
+
+//the live slot of key in the image, -1 if none. the probe gives up after a lap of the table,
+//which a corrupt image may have left without an empty slot
+static int64_t dictImageLocate(dictImage *img, const sds key){
+    if(!img->map)
+        return -1;
+    size_t len = sdslen(key);
+    uint64_t h = dictImageHash(img->hdr->seed, key, len), mask = img->hdr->slots - 1;
+    for(uint64_t n = 0, i = h & mask; n <= mask; n++, i = (i + 1) & mask){
+        const dictImageSlot *s = &img->slots[i];
+        if(!s->key)
+            return -1;
+        if(s->hash != h)
+            continue;
+        if(!dictImageSlotValid(img, s))
+            return -1;
+        const sds other = img->map + s->key;
+        if(sdslen(other) == len && !memcmp(other, key, len))
+            return dictImageIsDead(img, i)? -1: (int64_t)i;
+    }
+    return -1;
+}
+
+//copy slot i to d through keyDup and valDup, the slot is dead afterwards. NULL if the key is in
+//d already, only a corrupt image has a key twice
+static dictEntry *dictImageMove(dictImage *img, uint64_t i){
+    const dictImageSlot *s = &img->slots[i];
+    dictEntry *de = dictAddRaw(img->d, img->map + s->key, NULL);
+    if(de && !img->hdr->no_value)
+        dictSetVal(img->d, de, img->map + s->val);
+    dictImageSetDead(img, i);
+    return de;
+}
+
+int dictImageExists(dictImage *img, const sds key){
+    return dictFind(img->d, key) || dictImageLocate(img, key) != -1;
+}
+
+void *dictImageFetchValue(dictImage *img, const sds key){
+    dictEntry *de = dictFind(img->d, key);
+    if(de)
+        return dictGetVal(de);
+    int64_t i = dictImageLocate(img, key);
+    return i == -1 || !img->slots[i].val? NULL: img->map + img->slots[i].val;
+}
+
+//the entry of key in d, where it can be changed in place, moving it out of the image first.
+//NULL if the key doesn't exist
+dictEntry *dictImageFindForWrite(dictImage *img, const sds key){
+    dictEntry *de = dictFind(img->d, key);
+    if(de)
+        return de;
+    int64_t i = dictImageLocate(img, key);
+    return i == -1? NULL: dictImageMove(img, i);
+}
+
+//like dictAdd on d, DICT_ERR when the key exists in d or in the image
+int dictImageAdd(dictImage *img, sds key, void *val){
+    if(dictImageLocate(img, key) != -1)
+        return DICT_ERR;
+    return dictAdd(img->d, key, val);
+}
+
+//like dictReplace on d, a key in the image counts as existing and its slot dies
+int dictImageReplace(dictImage *img, sds key, void *val){
+    int64_t i = dictImageLocate(img, key);
+    if(i != -1)
+        dictImageSetDead(img, i);
+    return dictReplace(img->d, key, val) && i == -1;
+}
+
+int dictImageDelete(dictImage *img, const sds key){
+    if(dictDelete(img->d, key) == DICT_OK)
+        return DICT_OK;
+    int64_t i = dictImageLocate(img, key);
+    if(i == -1)
+        return DICT_ERR;
+    dictImageSetDead(img, i);
+    return DICT_OK;
+}
+
+uint64_t dictImageSize(dictImage *img){
+    uint64_t size = img->d->ht_used[0] + img->d->ht_used[1];
+    //dropped slots of a corrupt image may outnumber the count
+    return img->map && img->hdr->count > img->dead_count? size + img->hdr->count - img->dead_count: size;
+}
+
+//move up to count live keys of the image to d, in slot order, and unmap the image once the
+//last one moved. meant for a cron, so the mapping doesn't stay around for good. returns the
+//number of keys moved
+uint64_t dictImageMigrate(dictImage *img, uint64_t count){
+    uint64_t moved = 0;
+    while(img->map && moved < count && img->migrate_cursor < img->hdr->slots){
+        uint64_t i = img->migrate_cursor++;
+        if(!img->slots[i].key || dictImageIsDead(img, i))
+            continue;
+        if(!dictImageSlotValid(img, &img->slots[i]))
+            dictImageSetDead(img, i);
+        else if(dictImageMove(img, i))
+            moved++;
+    }
+    if(img->map && img->migrate_cursor == img->hdr->slots)
+        dictImageUnmap(img);
+    return moved;
+}
+
+#ifdef REDIS_TEST
+#include "monotonic.h"
+
+static int dictImageTestCompare(dict *d, const void *key1, const void *key2){
+    (void)d;
+    size_t len = sdslen((const sds)key1);
+    return len == sdslen((const sds)key2) && !memcmp(key1, key2, len);
+}
+
+static void *dictImageTestDup(dict *d, const void *s){
+    (void)d;
+    return sdsdup((const sds)s);
+}
+
+static void dictImageTestFree(dict *d, void *s){
+    (void)d;
+    sdsfree(s);
+}
+
+static dictType dictImageTestType = {
+    .hashFunction = dictTestSdsHash,
+    .keyCompare = dictImageTestCompare,
+    .keyDup = dictImageTestDup,
+    .valDup = dictImageTestDup,
+    .keyDestructor = dictImageTestFree,
+    .valDestructor = dictImageTestFree,
+};
+
+static sds dictImageTestKey(uint64_t k){
+    char buf[32];
+    return sdsnewlen(buf, snprintf(buf, sizeof(buf), "key:%llu", (unsigned long long)k));
+}
+
+static int dictImageTestValueIs(void *val, uint64_t k, int version){
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "value:%llu:%d:0123456789abcdef", (unsigned long long)k, version);
+    return val && sdslen(val) == (size_t)len && !memcmp(val, buf, len);
+}
+
+static sds dictImageTestValue(uint64_t k, int version){
+    char buf[64];
+    return sdsnewlen(buf, snprintf(buf, sizeof(buf), "value:%llu:%d:0123456789abcdef", (unsigned long long)k, version));
+}
+
+//redis-server test dictimage [keys] [path], rebuilding a dict entry by entry against mapping its
+//image, then writes, deletes and a full migration to the heap on the mapped dict
+int dictImageTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 2000000;
+    keys = keys < 10? 10: keys - keys % 10;
+    const char *path = argc > 4? argv[4]: "/tmp/dictimage.test";
+    size_t base = zmalloc_used_memory();
+
+    long long start = monotonicUs();
+    dict *d = dictCreate(&dictImageTestType);
+    for(uint64_t k = 0; k < keys; k++){
+        sds key = dictImageTestKey(k), val = dictImageTestValue(k, 0);
+        assert(dictAdd(d, key, val) == DICT_OK);
+        sdsfree(key);
+        sdsfree(val);
+    }
+    long long build_us = monotonicUs() - start;
+    start = monotonicUs();
+    assert(dictImageSave(d, path) == DICT_OK);
+    long long save_us = monotonicUs() - start;
+
+    start = monotonicUs();
+    dictImage *img = dictImageLoad(path, &dictImageTestType);
+    assert(img);
+    long long load_us = monotonicUs() - start;
+    assert(dictImageSize(img) == keys);
+    start = monotonicUs();
+    for(uint64_t k = 0; k < keys; k++){
+        sds key = dictImageTestKey(k);
+        assert(dictImageTestValueIs(dictImageFetchValue(img, key), k, 0));
+        sdsfree(key);
+    }
+    long long read_us = monotonicUs() - start;
+    //freed only now, glibc consolidating millions of small free chunks is no part of a restart
+    dictRelease(d);
+    printf("%llu keys: dictAdd rebuild %.2f sec, save %.2f sec (%.1f MB), load %.3f ms, "
+        "first read of every key %.2f sec\n", (unsigned long long)keys, build_us / 1e6, save_us / 1e6,
+        img->map_size / 1048576.0, load_us / 1e3, read_us / 1e6);
+
+    //writes move keys to the heap, deletes only kill the slot, new keys go to the heap
+    for(uint64_t k = 0; k < keys; k += 10){
+        sds key = dictImageTestKey(k), val = dictImageTestValue(k, 1);
+        dictEntry *de = dictImageFindForWrite(img, key);
+        assert(de && dictImageTestValueIs(dictGetVal(de), k, 0));
+        dictImageTestFree(img->d, dictGetVal(de));
+        dictSetVal(img->d, de, val);
+        sdsfree(val);
+        sdsfree(key);
+        key = dictImageTestKey(k + 1);
+        assert(dictImageDelete(img, key) == DICT_OK);
+        assert(dictImageDelete(img, key) == DICT_ERR);
+        sdsfree(key);
+        key = dictImageTestKey(k + 2);
+        val = dictImageTestValue(k + 2, 2);
+        assert(dictImageAdd(img, key, val) == DICT_ERR);
+        assert(dictImageReplace(img, key, val) == 0);
+        sdsfree(val);
+        sdsfree(key);
+        key = dictImageTestKey(keys + k);
+        val = dictImageTestValue(keys + k, 0);
+        assert(dictImageAdd(img, key, val) == DICT_OK);
+        sdsfree(val);
+        sdsfree(key);
+    }
+    assert(dictImageSize(img) == keys);
+
+    for(int pass = 0; pass < 2; pass++){
+        for(uint64_t k = 0; k < keys * 2; k++){
+            sds key = dictImageTestKey(k);
+            void *val = dictImageFetchValue(img, key);
+            if(k >= keys)
+                assert(k % 10 == 0? dictImageTestValueIs(val, k, 0): !val);
+            else if(k % 10 == 1)
+                assert(!val);
+            else
+                assert(dictImageTestValueIs(val, k, k % 10 == 0? 1: k % 10 == 2? 2: 0));
+            sdsfree(key);
+        }
+        if(pass)
+            break;
+        //everything to the heap, a slice at a time
+        start = monotonicUs();
+        uint64_t moved = 0, step;
+        while((step = dictImageMigrate(img, 10000)) || img->map)
+            moved += step;
+        printf("migrated the remaining %llu keys to the heap in %.2f sec\n", (unsigned long long)moved,
+            (monotonicUs() - start) / 1e6);
+        assert(!img->map && dictImageSize(img) == keys);
+    }
+    dictImageRelease(img);
+
+    //a corrupt image: a key offset out of the data, a value offset out of it, a key whose length
+    //runs past it and a table without an empty slot. the keys of those slots miss, a missing key
+    //doesn't probe forever, the rest reads as before and the migration drops the bad slots
+    d = dictCreate(&dictImageTestType);
+    for(uint64_t k = 0; k < 64; k++){
+        sds key = dictImageTestKey(k), val = dictImageTestValue(k, 0);
+        assert(dictAdd(d, key, val) == DICT_OK);
+        sdsfree(key);
+        sdsfree(val);
+    }
+    assert(dictImageSave(d, path) == DICT_OK);
+    dictRelease(d);
+    img = dictImageLoad(path, &dictImageTestType);
+    assert(img);
+    dictImageHeader hdr = *img->hdr;
+    dictImageSlot *slots = zmalloc(hdr.slots * sizeof(dictImageSlot));
+    memcpy(slots, img->slots, hdr.slots * sizeof(dictImageSlot));
+    uint64_t bad[3] = {0, 0, 0}, good = 0;
+    //the key written last, the data ends a value and some padding past it
+    for(uint64_t i = 0; i < hdr.slots; i++)
+        if(slots[i].key > slots[bad[2]].key)
+            bad[2] = i;
+    for(uint64_t i = 0, n = 0; i < hdr.slots; i++){
+        if(!slots[i].key || i == bad[2])
+            continue;
+        if(n == 2){
+            good = i;
+            break;
+        }
+        bad[n++] = i;
+    }
+    sds badkeys[3];
+    for(int j = 0; j < 3; j++)
+        badkeys[j] = sdsnewlen(img->map + slots[bad[j]].key, sdslen(img->map + slots[bad[j]].key));
+    uint64_t lenoff = slots[bad[2]].key - sizeof(struct sdshdr8);
+    dictImageRelease(img);
+    slots[bad[0]].key = hdr.file_size;
+    slots[bad[1]].val = 1;
+    for(uint64_t i = 0; i < hdr.slots; i++)
+        if(!slots[i].key)
+            slots[i] = (dictImageSlot){.hash = 0, .key = slots[good].key, .val = slots[good].val};
+    uint8_t len = 255;
+    FILE *fp = fopen(path, "r+");
+    assert(fp && fseek(fp, hdr.slots_off, SEEK_SET) == 0);
+    assert(fwrite(slots, sizeof(dictImageSlot), hdr.slots, fp) == hdr.slots);
+    assert(fseek(fp, lenoff, SEEK_SET) == 0 && fwrite(&len, 1, 1, fp) == 1 && fclose(fp) == 0);
+    zfree(slots);
+
+    img = dictImageLoad(path, &dictImageTestType);
+    assert(img);
+    for(int pass = 0; pass < 2; pass++){
+        for(int j = 0; j < 3; j++)
+            assert(!dictImageFetchValue(img, badkeys[j]) && !dictImageFindForWrite(img, badkeys[j]));
+        uint64_t found = 0;
+        for(uint64_t k = 0; k < 128; k++){
+            sds key = dictImageTestKey(k);
+            void *val = dictImageFetchValue(img, key);
+            int isbad = dictImageTestCompare(NULL, key, badkeys[0]) || dictImageTestCompare(NULL, key, badkeys[1]) ||
+                dictImageTestCompare(NULL, key, badkeys[2]);
+            assert(val? k < 64 && !isbad && dictImageTestValueIs(val, k, 0): k >= 64 || isbad);
+            found += val != NULL;
+            sdsfree(key);
+        }
+        assert(found == 61);
+        if(pass)
+            break;
+        while(dictImageMigrate(img, 16) || img->map);
+        assert(dictImageSize(img) == 61);
+    }
+    dictImageRelease(img);
+    for(int j = 0; j < 3; j++)
+        sdsfree(badkeys[j]);
+
+    //a slot table said to start past the end of the file
+    hdr.slots_off = hdr.file_size + DICT_IMAGE_ALIGN;
+    fp = fopen(path, "r+");
+    assert(fp && fwrite(&hdr, sizeof(hdr), 1, fp) == 1 && fclose(fp) == 0);
+    assert(!dictImageLoad(path, &dictImageTestType) && errno == EINVAL);
+    unlink(path);
+    assert(zmalloc_used_memory() == base);
+    return 0;
+}
+#endif
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dict.h"
+#include "sds.h"
+
+//a dict of sds keys and sds values, or no values, saved as a position independent file image
+//and served from a read only mapping of it after a restart, so loading costs an mmap instead of
+//rebuilding the dict entry by entry. keys and values live in the image in sds layout, a pointer
+//into the mapping is a read only sds. a key moves to the heap dict d the first time it is
+//written, which keyDup and valDup of the type copy, the image slot is then dead for good
+#define DICT_IMAGE_MAGIC "RDICTIMG"
+#define DICT_IMAGE_VERSION 1
+
+typedef struct dictImageHeader{
+    char magic[8];
+    uint32_t version;
+    uint32_t no_value;
+    uint64_t count;
+    uint64_t slots;//power of two, linear probing
+    uint64_t data_off;//keys and values
+    uint64_t slots_off;
+    uint64_t file_size;
+    uint8_t seed[16];//of the fast hash the slots are placed by
+}dictImageHeader;
+
+typedef struct dictImageSlot{
+    uint64_t hash;
+    uint64_t key;//offset of the key sds, past its header, 0 for an empty slot
+    uint64_t val;//offset of the value sds, 0 without value
+}dictImageSlot;
+
+typedef struct dictImage{
+    dict *d;//keys written since the load and new keys
+    char *map;//NULL once everything moved to d
+    size_t map_size;
+    const dictImageHeader *hdr;
+    const dictImageSlot *slots;
+    uint64_t *dead;//a bit per slot, the key moved to d or was deleted
+    uint64_t dead_count;
+    uint64_t migrate_cursor;
+}dictImage;
+
+int dictImageSave(dict *d, const char *path);
+dictImage *dictImageLoad(const char *path, dictType *type);
+void dictImageRelease(dictImage *img);
+int dictImageExists(dictImage *img, const sds key);
+void *dictImageFetchValue(dictImage *img, const sds key);
+dictEntry *dictImageFindForWrite(dictImage *img, const sds key);
+int dictImageAdd(dictImage *img, sds key, void *val);
+int dictImageReplace(dictImage *img, sds key, void *val);
+int dictImageDelete(dictImage *img, const sds key);
+uint64_t dictImageSize(dictImage *img);
+uint64_t dictImageMigrate(dictImage *img, uint64_t count);
+
+#ifdef REDIS_TEST
+int dictImageTest(int argc, char *argv[], int flags);
+#endif
@@ -0,0 +1,156 @@
+#include <pthread.h>
+#include <sched.h>
+
+#include "epoch.h"
+#include "zmalloc.h"
+#include "redisassert.h"
+
+struct epochBag{
+    uint64_t epoch;//global epoch the items were retired in
+    int count;
+    struct epochBag *next;
+    struct{
+        void *ptr;
+        epochFreeFunction *fn;
+        void *privdata;
+    }items[EPOCH_BAG_SIZE];
+};
+
+typedef struct epochReader{
+    uint64_t state;//epoch << 1 | 1 while inside, 0 outside
+    int depth;
+    struct epochReader *prev, *next;
+}epochReader;
+
+static uint64_t global_epoch = 0;
+
+static struct{
+    pthread_mutex_t lock;//guards the list, the states are read and written atomically
+    epochReader *head;
+    pthread_key_t key;
+    pthread_once_t once;
+}epoch_readers = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, PTHREAD_ONCE_INIT};
+
+static __thread epochReader *epoch_self = NULL;
+
+static void epochReaderUnregister(void *arg){
+    epochReader *r = arg;
+    pthread_mutex_lock(&epoch_readers.lock);
+    if(r->prev)
+        r->prev->next = r->next;
+    else
+        epoch_readers.head = r->next;
+    if(r->next)
+        r->next->prev = r->prev;
+    pthread_mutex_unlock(&epoch_readers.lock);
+    zfree(r);
+}
+
+static void epochKeyInit(void){
+    pthread_key_create(&epoch_readers.key, epochReaderUnregister);
+}
+
+static epochReader *epochReaderRegister(void){
+    pthread_once(&epoch_readers.once, epochKeyInit);
+    epochReader *r = zcalloc(sizeof(*r));
+    pthread_mutex_lock(&epoch_readers.lock);
+    r->next = epoch_readers.head;
+    if(r->next)
+        r->next->prev = r;
+    epoch_readers.head = r;
+    pthread_mutex_unlock(&epoch_readers.lock);
+    pthread_setspecific(epoch_readers.key, r);
+    epoch_self = r;
+    return r;
+}
+
+void epochEnter(void){
+    epochReader *r = epoch_self? epoch_self: epochReaderRegister();
+    if(r->depth++ == 0){
+        uint64_t e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&r->state, e << 1 | 1, __ATOMIC_RELAXED);
+        //the state must be visible before the first load of shared data
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+void epochExit(void){
+    epochReader *r = epoch_self;
+    assert(r && r->depth > 0);
+    if(--r->depth == 0)
+        __atomic_store_n(&r->state, 0, __ATOMIC_RELEASE);
+}
+
+int epochInside(void){
+    return epoch_self && epoch_self->depth > 0;
+}
+
+//move the global epoch on when every reader inside has seen the current one, return the epoch
+static uint64_t epochTryAdvance(void){
+    uint64_t e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&epoch_readers.lock);
+    for(epochReader *r = epoch_readers.head; r; r = r->next){
+        uint64_t s = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+        if((s & 1) && (s >> 1) != e){
+            pthread_mutex_unlock(&epoch_readers.lock);
+            return e;
+        }
+    }
+    pthread_mutex_unlock(&epoch_readers.lock);
+    //another writer may have advanced it meanwhile, that is as good
+    __atomic_compare_exchange_n(&global_epoch, &e, e + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    return __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+}
+
+void epochRetire(epochLimbo *l, void *ptr, epochFreeFunction *fn, void *privdata){
+    uint64_t e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    epochBag *bag = l->tail;
+    if(!bag || bag->epoch != e || bag->count == EPOCH_BAG_SIZE){
+        bag = zmalloc(sizeof(*bag));
+        bag->epoch = e;
+        bag->count = 0;
+        bag->next = NULL;
+        if(l->tail)
+            l->tail->next = bag;
+        else
+            l->head = bag;
+        l->tail = bag;
+    }
+    bag->items[bag->count].ptr = ptr;
+    bag->items[bag->count].fn = fn;
+    bag->items[bag->count].privdata = privdata;
+    bag->count++;
+    if(++l->pending % EPOCH_BAG_SIZE == 0)
+        epochReclaim(l);
+}
+
+//free what no reader can reach anymore, return how many pointers were freed
+size_t epochReclaim(epochLimbo *l){
+    size_t freed = 0;
+    if(!l->head)
+        return 0;
+    uint64_t e = epochTryAdvance();
+    while(l->head && l->head->epoch + 2 <= e){
+        epochBag *bag = l->head;
+        for(int i = 0; i < bag->count; i++)
+            bag->items[i].fn(bag->items[i].ptr, bag->items[i].privdata);
+        freed += bag->count;
+        l->pending -= bag->count;
+        l->head = bag->next;
+        if(!l->head)
+            l->tail = NULL;
+        zfree(bag);
+    }
+    return freed;
+}
+
+//wait for the readers and free everything retired so far
+void epochDrain(epochLimbo *l){
+    assert(!epochInside());
+    while(l->head){
+        epochReclaim(l);
+        if(l->head)
+            sched_yield();
+    }
+}
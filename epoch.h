@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+//epoch based reclamation. readers wrap their lock free accesses in epochEnter/epochExit, a
+//writer retires what it unlinked into its own limbo instead of freeing it, and a retired pointer
+//is freed once the global epoch moved on twice, i.e. when no reader can still hold it
+#define EPOCH_BAG_SIZE 64
+
+typedef void (epochFreeFunction)(void *ptr, void *privdata);
+
+typedef struct epochBag epochBag;
+
+typedef struct epochLimbo{
+    epochBag *head, *tail;
+    uint64_t pending;
+}epochLimbo;
+
+//may nest, a thread inside an epoch must not wait for epochDrain
+void epochEnter(void);
+void epochExit(void);
+int epochInside(void);
+
+//limbo functions are called by the limbo's owner only, retired pointers are freed on its thread
+void epochRetire(epochLimbo *l, void *ptr, epochFreeFunction *fn, void *privdata);
+size_t epochReclaim(epochLimbo *l);
+void epochDrain(epochLimbo *l);
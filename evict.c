@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "evict.h"
+#include "zmalloc.h"
+#include "redisassert.h"
+
+static long long evictMstime(void){
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static inline uint32_t *evictMeta(dictEntry *de){
+    return dictEntryMetadata(de);
+}
+
+size_t evictEntryMetadataBytes(dict *d){
+    (void)d;
+    return EVICT_META_BYTES;
+}
+
+/* ----------------------------- LRU ----------------------------- */
+
+static uint32_t evictLruClock(void){
+    return (evictMstime() / EVICT_LRU_CLOCK_RESOLUTION) & EVICT_LRU_CLOCK_MAX;
+}
+
+//milliseconds since lru, the clock wraps every 194 days
+static uint64_t evictLruIdle(uint32_t lru){
+    uint32_t now = evictLruClock();
+    if(now >= lru)
+        return (uint64_t)(now - lru) * EVICT_LRU_CLOCK_RESOLUTION;
+    return (uint64_t)(now + (EVICT_LRU_CLOCK_MAX - lru)) * EVICT_LRU_CLOCK_RESOLUTION;
+}
+
+/* ----------------------------- LFU -----------------------------
+ * The 24 bits hold the minute of the last decrement in the top 16 bits and a logarithmic access
+ * counter in the low 8 bits. The counter grows with probability 1 / ((counter - init) * factor + 1)
+ * and loses one per EVICT_LFU_DECAY_TIME minutes without access, so it reflects recent frequency. */
+
+static uint32_t evictLfuMinutes(void){
+    return (evictMstime() / 60000) & 65535;
+}
+
+static uint32_t evictLfuElapsed(uint32_t ldt){
+    uint32_t now = evictLfuMinutes();
+    if(now >= ldt)
+        return now - ldt;
+    return 65535 - ldt + now;
+}
+
+static uint8_t evictLfuLogIncr(uint8_t counter){
+    if(counter == 255)
+        return 255;
+    double r = (double)rand() / RAND_MAX;
+    double baseval = counter - EVICT_LFU_INIT_VAL;
+    if(baseval < 0)
+        baseval = 0;
+    double p = 1.0 / (baseval * EVICT_LFU_LOG_FACTOR + 1);
+    if(r < p)
+        counter++;
+    return counter;
+}
+
+//the counter after the decay owed since the last decrement, the entry is not changed
+static uint8_t evictLfuDecr(uint32_t meta){
+    uint32_t ldt = meta >> 8;
+    uint32_t counter = meta & 255;
+    uint32_t periods = EVICT_LFU_DECAY_TIME? evictLfuElapsed(ldt) / EVICT_LFU_DECAY_TIME: 0;
+    if(periods)
+        counter = periods > counter? 0: counter - periods;
+    return counter;
+}
+
+/* ----------------------------- evictor ----------------------------- */
+
+evictor *evictorCreate(evictPolicy policy, size_t maxmemory){
+    evictor *ev = zcalloc(sizeof(*ev));
+    ev->policy = policy;
+    ev->maxmemory = maxmemory;
+    ev->samples = EVICT_DEFAULT_SAMPLES;
+    ev->max_per_call = EVICT_DEFAULT_MAX_PER_CALL;
+    return ev;
+}
+
+void evictorRelease(evictor *ev){
+    zfree(ev);
+}
+
+//the dict type needs at least EVICT_META_BYTES of entry metadata and values
+int evictorAddDict(evictor *ev, dict *d){
+    if(ev->ndicts == EVICT_MAX_DICTS)
+        return -1;
+    assert(!d->type->no_value && d->type->dictEntryMetadataBYtes &&
+        d->type->dictEntryMetadataBYtes(d) >= EVICT_META_BYTES);
+    ev->dicts[ev->ndicts++] = d;
+    return 0;
+}
+
+//also drops the pool candidates of d, call it before releasing d
+void evictorRemoveDict(evictor *ev, dict *d){
+    int id;
+    for(id = 0; id < ev->ndicts && ev->dicts[id] != d; id++);
+    if(id == ev->ndicts)
+        return;
+    memset(ev->pool, 0, sizeof(ev->pool));
+    memmove(&ev->dicts[id], &ev->dicts[id + 1], sizeof(dict *) * (ev->ndicts - id - 1));
+    ev->ndicts--;
+}
+
+void evictorSetCallback(evictor *ev, evictFunction *fn, void *privdata){
+    ev->fn = fn;
+    ev->privdata = privdata;
+}
+
+//for entries just added
+void evictorInitEntry(evictor *ev, dictEntry *de){
+    if(ev->policy == EVICT_POLICY_LFU)
+        *evictMeta(de) = evictLfuMinutes() << 8 | EVICT_LFU_INIT_VAL;
+    else
+        *evictMeta(de) = evictLruClock();
+}
+
+//for every access of an entry
+void evictorTouch(evictor *ev, dictEntry *de){
+    uint32_t *meta = evictMeta(de);
+    if(ev->policy == EVICT_POLICY_LFU){
+        uint8_t counter = evictLfuLogIncr(evictLfuDecr(*meta));
+        *meta = evictLfuMinutes() << 8 | counter;
+    }else{
+        *meta = evictLruClock();
+    }
+}
+
+uint64_t evictorIdleScore(evictor *ev, dictEntry *de){
+    uint32_t meta = *evictMeta(de) & EVICT_LRU_CLOCK_MAX;
+    if(ev->policy == EVICT_POLICY_LFU)
+        return 255 - evictLfuDecr(meta);
+    return evictLruIdle(meta);
+}
+
+//sample dict dictid into the pool, which stays sorted by idle score ascending with the empty
+//slots on the right, a sample better than the worst candidate of a full pool replaces it
+static void evictPoolPopulate(evictor *ev, int dictid){
+    dictEntry *samples[EVICT_POOL_SIZE * 4];
+    dict *d = ev->dicts[dictid];
+    int want = ev->samples < (int)(sizeof(samples) / sizeof(samples[0]))? ev->samples: (int)(sizeof(samples) / sizeof(samples[0]));
+    evictPoolEntry *pool = ev->pool;
+
+    uint32_t count = dictGetSomeKeys(d, samples, want);
+    for(uint32_t j = 0; j < count; j++){
+        dictEntry *de = samples[j];
+        void *key = dictGetKey(de);
+        uint64_t idle = evictorIdleScore(ev, de);
+        int k = 0;
+
+        while(k < EVICT_POOL_SIZE && pool[k].key && pool[k].idle < idle)
+            k++;
+        if(k == 0 && pool[EVICT_POOL_SIZE - 1].key){
+            //worse than every candidate of a full pool
+            continue;
+        }else if(k < EVICT_POOL_SIZE && !pool[k].key){
+            //an empty slot
+        }else{
+            if(!pool[EVICT_POOL_SIZE - 1].key){
+                //room on the right, shift up
+                memmove(pool + k + 1, pool + k, sizeof(pool[0]) * (EVICT_POOL_SIZE - k - 1));
+            }else{
+                //drop the worst candidate on the left, shift down
+                k--;
+                memmove(pool, pool + 1, sizeof(pool[0]) * k);
+            }
+        }
+        pool[k].idle = idle;
+        pool[k].key = key;
+        pool[k].hash = dictGetHash(d, key);
+        pool[k].dictid = dictid;
+    }
+}
+
+//take the best candidate still in its dict, NULL when the pool runs dry
+static dictEntry *evictPoolPopBest(evictor *ev, int *dictid){
+    for(int k = EVICT_POOL_SIZE - 1; k >= 0; k--){
+        evictPoolEntry *pe = &ev->pool[k];
+        if(!pe->key)
+            continue;
+        //the key may be gone since it was sampled, it is only looked up by address
+        dictEntry *de = dictFindEntryByPtrAndHash(ev->dicts[pe->dictid], pe->key, pe->hash);
+        *dictid = pe->dictid;
+        pe->key = NULL;
+        if(de)
+            return de;
+    }
+    return NULL;
+}
+
+//delete keys until used memory is under maxmemory, cheap when it already is, so it can run
+//before every write. stops after max_per_call deletions, the memory of dicts with
+//concurrent_reads is only freed once their readers moved on
+int evictorPerform(evictor *ev){
+    int deleted = 0;
+
+    while(zmalloc_used_memory() > ev->maxmemory){
+        if(deleted == ev->max_per_call)
+            return EVICT_RUNNING;
+        dictEntry *de = NULL;
+        int dictid = 0;
+        while(!de){
+            uint64_t keys = 0;
+            for(int i = 0; i < ev->ndicts; i++){
+                dict *d = ev->dicts[i];
+                uint64_t size = d->ht_used[0] + d->ht_used[1];
+                if(size){
+                    keys += size;
+                    evictPoolPopulate(ev, i);
+                }
+            }
+            if(!keys)
+                return EVICT_FAIL;
+            de = evictPoolPopBest(ev, &dictid);
+        }
+        dict *d = ev->dicts[dictid];
+        if(ev->fn)
+            ev->fn(ev->privdata, d, de);
+        dictDelete(d, dictGetKey(de));
+        ev->evicted++;
+        deleted++;
+    }
+    return EVICT_OK;
+}
+
+#ifdef REDIS_TEST
+#include "monotonic.h"
+
+static void evictTestValDestructor(dict *d, void *val){
+    (void)d;
+    zfree(val);
+}
+
+static dictType evictTestType = {
+    .hashFunction = dictTestIntHash,
+    .valDestructor = evictTestValDestructor,
+    .dictEntryMetadataBYtes = evictEntryMetadataBytes,
+};
+
+//redis-server test evict [writes] [maxmemory MB], every write of a 128 byte value evicts first
+int evictTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t writes = argc > 3? strtoull(argv[3], NULL, 10): 2000000;
+    size_t maxmemory = (argc > 4? strtoull(argv[4], NULL, 10): 64) << 20;
+    const char *names[2] = {"lru", "lfu"};
+
+    for(int policy = EVICT_POLICY_LRU; policy <= EVICT_POLICY_LFU; policy++){
+        size_t base = zmalloc_used_memory();
+        evictor *ev = evictorCreate(policy, base + maxmemory);
+        dict *d = dictCreate(&evictTestType);
+        assert(evictorAddDict(ev, d) == 0);
+
+        uint64_t x = 88172645463325252ULL, hot_hits = 0, hot_lookups = 0;
+        long long evict_us = 0, start = monotonicUs();
+        for(uint64_t i = 0; i < writes; i++){
+            long long t = monotonicUs();
+            assert(evictorPerform(ev) != EVICT_FAIL);
+            evict_us += monotonicUs() - t;
+
+            dictEntry *de = dictAddRaw(d, (void *)(uintptr_t)(i + 1), NULL);
+            dictSetVal(d, de, zmalloc(128));
+            evictorInitEntry(ev, de);
+
+            //a small hot set read all the time should survive the eviction
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            uint64_t hot = x % 1000 + 1;
+            if(i > 1000){
+                hot_lookups++;
+                if((de = dictFind(d, (void *)(uintptr_t)hot))){
+                    hot_hits++;
+                    evictorTouch(ev, de);
+                }
+            }else if((de = dictFind(d, (void *)(uintptr_t)hot))){
+                evictorTouch(ev, de);
+            }
+        }
+        long long elapsed = monotonicUs() - start;
+        assert(evictorPerform(ev) == EVICT_OK);
+        printf("%s: %llu writes, %llu evicted, %llu keys left, %.3f usec per evictorPerform, "
+            "%.1f%% hot set hits, %.2f sec\n", names[policy], (unsigned long long)writes,
+            (unsigned long long)ev->evicted, (unsigned long long)(d->ht_used[0] + d->ht_used[1]),
+            (double)evict_us / writes, hot_lookups? 100.0 * hot_hits / hot_lookups: 0, elapsed / 1e6);
+        evictorRemoveDict(ev, d);
+        dictRelease(d);
+        evictorRelease(ev);
+    }
+    return 0;
+}
+#endif
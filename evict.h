@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dict.h"
+
+//approximated LRU/LFU eviction over the keys of up to EVICT_MAX_DICTS dicts. every entry keeps
+//a 24 bit LRU clock, or for LFU the minute of its last decrement and a logarithmic counter, in
+//the first EVICT_META_BYTES bytes of its metadata. evictorPerform samples keys with
+//dictGetSomeKeys into a small pool sorted by idle score and deletes the best candidates until
+//zmalloc_used_memory() is under the limit
+#define EVICT_MAX_DICTS 16
+#define EVICT_POOL_SIZE 16
+#define EVICT_DEFAULT_SAMPLES 5
+#define EVICT_DEFAULT_MAX_PER_CALL 64
+#define EVICT_META_BYTES sizeof(uint32_t)
+
+#define EVICT_LRU_BITS 24
+#define EVICT_LRU_CLOCK_MAX ((1 << EVICT_LRU_BITS) - 1)
+#define EVICT_LRU_CLOCK_RESOLUTION 1000//ms
+#define EVICT_LFU_INIT_VAL 5
+#define EVICT_LFU_LOG_FACTOR 10
+#define EVICT_LFU_DECAY_TIME 1//minutes per counter decrement
+
+#define EVICT_OK 0//under the limit
+#define EVICT_RUNNING 1//still over the limit after max_per_call deletions
+#define EVICT_FAIL 2//over the limit with nothing left to evict
+
+typedef enum{
+    EVICT_POLICY_LRU,
+    EVICT_POLICY_LFU,
+}evictPolicy;
+
+//called right before an entry is deleted by the evictor
+typedef void (evictFunction)(void *privdata, dict *d, dictEntry *de);
+
+typedef struct evictPoolEntry{
+    uint64_t idle;//bigger is a better candidate
+    uint64_t hash;
+    void *key;//NULL for an empty slot, only compared by address
+    int dictid;
+}evictPoolEntry;
+
+typedef struct evictor{
+    evictPolicy policy;
+    size_t maxmemory;
+    int samples;
+    int max_per_call;
+    int ndicts;
+    dict *dicts[EVICT_MAX_DICTS];
+    evictFunction *fn;
+    void *privdata;
+    uint64_t evicted;
+    evictPoolEntry pool[EVICT_POOL_SIZE];
+}evictor;
+
+evictor *evictorCreate(evictPolicy policy, size_t maxmemory);
+void evictorRelease(evictor *ev);
+int evictorAddDict(evictor *ev, dict *d);
+void evictorRemoveDict(evictor *ev, dict *d);
+void evictorSetCallback(evictor *ev, evictFunction *fn, void *privdata);
+void evictorInitEntry(evictor *ev, dictEntry *de);
+void evictorTouch(evictor *ev, dictEntry *de);
+uint64_t evictorIdleScore(evictor *ev, dictEntry *de);
+int evictorPerform(evictor *ev);
+
+//for dictType.dictEntryMetadataBYtes of the dicts an evictor covers
+size_t evictEntryMetadataBytes(dict *d);
+
+#ifdef REDIS_TEST
+int evictTest(int argc, char *argv[], int flags);
+#endif
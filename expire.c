@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "expire.h"
+#include "zmalloc.h"
+#include "redisassert.h"
+
+static long long expireUstime(void){
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static long long expireMstime(void){
+    return expireUstime() / 1000;
+}
+
+/* ----------------------------- timer wheel -----------------------------
+ * Level l slot s holds the keys due in the ticks whose bits l*6 and up match s, for deadlines
+ * less than 64^(l+1) ticks past wheel_tick when they were added. Every 64 ticks the next slot of
+ * level 1 cascades into level 0, every 64^2 ticks the next slot of level 2 and so on, so a level 0
+ * slot only ever holds keys due in its tick and a burst of deadlines is reclaimed in one go.
+ * Items are hints, a key is only deleted if the expires dict still has it with a past deadline. */
+
+static void expireWheelAdd(expireIndex *ex, void *key, uint64_t hash, long long when){
+    uint64_t tick = when / EXPIRE_WHEEL_TICK;
+    if(tick < ex->wheel_tick)
+        tick = ex->wheel_tick;
+    uint64_t delta = tick - ex->wheel_tick;
+    int level = 0;
+    while(level < EXPIRE_WHEEL_LEVELS && delta >> (EXPIRE_WHEEL_BITS * (level + 1)))
+        level++;
+    //too far ahead, left to sampling
+    if(level == EXPIRE_WHEEL_LEVELS)
+        return;
+    expireWheelSlot *slot = &ex->wheel[level][(tick >> (EXPIRE_WHEEL_BITS * level)) & EXPIRE_WHEEL_MASK];
+    if(slot->count == slot->cap){
+        slot->cap = slot->cap? slot->cap * 2: 4;
+        slot->items = zrealloc(slot->items, sizeof(expireWheelItem) * slot->cap);
+    }
+    slot->items[slot->count].key = key;
+    slot->items[slot->count].hash = hash;
+    slot->items[slot->count].when = when;
+    slot->count++;
+    ex->wheel_items++;
+}
+
+//1 when the budget ran out, checked every 64 calls
+static int expireOverBudget(int *checks, long long deadline_us){
+    if(++*checks < 64)
+        return 0;
+    *checks = 0;
+    return expireUstime() > deadline_us;
+}
+
+//move the current slot of a level down, 1 when the budget ran out first. the items re-added never
+//land in the slot being emptied, so a cascade cut short simply goes on in the next cycle
+static int expireWheelCascade(expireIndex *ex, int level, long long deadline_us, int *checks){
+    uint64_t idx = (ex->wheel_tick >> (EXPIRE_WHEEL_BITS * level)) & EXPIRE_WHEEL_MASK;
+    expireWheelSlot *slot = &ex->wheel[level][idx];
+    while(slot->count){
+        expireWheelItem item = slot->items[--slot->count];
+        ex->wheel_items--;
+        expireWheelAdd(ex, item.key, item.hash, item.when);
+        if(slot->count && expireOverBudget(checks, deadline_us))
+            return 1;
+    }
+    zfree(slot->items);
+    slot->items = NULL;
+    slot->cap = 0;
+    return 0;
+}
+
+static void expireWheelClear(expireIndex *ex){
+    for(int l = 0; l < EXPIRE_WHEEL_LEVELS; l++){
+        for(int s = 0; s < EXPIRE_WHEEL_SLOTS; s++){
+            zfree(ex->wheel[l][s].items);
+            ex->wheel[l][s].items = NULL;
+            ex->wheel[l][s].count = ex->wheel[l][s].cap = 0;
+        }
+    }
+    ex->wheel_items = 0;
+}
+
+/* ----------------------------- expire index ----------------------------- */
+
+expireIndex *expireIndexCreate(dict *keys){
+    expireIndex *ex = zcalloc(sizeof(*ex));
+    ex->keys = keys;
+    ex->type = *keys->type;
+    //the expires dict borrows the keys of keys and keeps its deadlines in v.s64
+    ex->type.keyDup = NULL;
+    ex->type.valDup = NULL;
+    ex->type.keyDestructor = NULL;
+    ex->type.valDestructor = NULL;
+    ex->type.dictEntryMetadataBYtes = NULL;
+    ex->type.dictMetadataBytes = NULL;
+    ex->type.afterReplaceEntry = NULL;
+    ex->type.keyEmbedSize = NULL;
+    ex->type.keyEmbed = NULL;
+    ex->type.no_value = 0;
+    ex->type.concurrent_reads = 0;
+    ex->expires = dictCreate(&ex->type);
+    ex->effort = EXPIRE_DEFAULT_EFFORT;
+    ex->use_wheel = 1;
+    ex->wheel_tick = expireMstime() / EXPIRE_WHEEL_TICK;
+    return ex;
+}
+
+//keys is not touched
+void expireIndexRelease(expireIndex *ex){
+    expireWheelClear(ex);
+    dictRelease(ex->expires);
+    zfree(ex);
+}
+
+void expireSetCallback(expireIndex *ex, expireFunction *fn, void *privdata){
+    ex->fn = fn;
+    ex->privdata = privdata;
+}
+
+//DICT_ERR when key is not in keys
+int expireSet(expireIndex *ex, const void *key, long long when){
+    dictEntry *de = dictFind(ex->keys, key);
+    if(!de)
+        return DICT_ERR;
+    void *k = dictGetKey(de);
+    de = dictAddOrFind(ex->expires, k);
+    dictSetSignedIntegerVal(de, when);
+    if(ex->use_wheel)
+        expireWheelAdd(ex, k, dictGetHash(ex->expires, k), when);
+    return DICT_OK;
+}
+
+//-1 for keys without a deadline
+long long expireGet(expireIndex *ex, const void *key){
+    dictEntry *de = dictFind(ex->expires, key);
+    return de? dictGetSignedIntegerVal(de): -1;
+}
+
+//drop the deadline of key, also required before deleting a key from keys by other means, for
+//example from an evictFunction
+int expirePersist(expireIndex *ex, const void *key){
+    return dictDelete(ex->expires, key);
+}
+
+//delete key from keys and from expires
+int expireDelete(expireIndex *ex, const void *key){
+    dictDelete(ex->expires, key);
+    return dictDelete(ex->keys, key);
+}
+
+//key is a key pointer of keys, the expires entry goes first since it borrows the key
+static void expireDeleteExpired(expireIndex *ex, void *key){
+    dictEntry *de = dictFind(ex->keys, key);
+    if(ex->fn && de)
+        ex->fn(ex->privdata, ex->keys, de);
+    dictDelete(ex->expires, key);
+    dictDelete(ex->keys, key);
+}
+
+//lazy expiration on access, 1 when key was expired and is now deleted
+int expireIfNeeded(expireIndex *ex, const void *key){
+    dictEntry *de = dictFind(ex->expires, key);
+    if(!de || dictGetSignedIntegerVal(de) > expireMstime())
+        return 0;
+    expireDeleteExpired(ex, dictGetKey(de));
+    ex->expired_lazy++;
+    return 1;
+}
+
+//run the due wheel ticks, 1 when the budget ran out first. a burst slot may take several
+//cycles, its remaining items stay in place
+static int expireWheelRun(expireIndex *ex, long long now, long long deadline_us, uint64_t *expired){
+    uint64_t now_tick = now / EXPIRE_WHEEL_TICK;
+    int checks = 0;
+
+    while(ex->wheel_tick < now_tick){
+        if(!ex->wheel_items){
+            ex->wheel_tick = now_tick;
+            break;
+        }
+        uint64_t idx = ex->wheel_tick & EXPIRE_WHEEL_MASK;
+        for(int l = 1; !idx && l < EXPIRE_WHEEL_LEVELS; l++){
+            if(expireWheelCascade(ex, l, deadline_us, &checks))
+                return 1;
+            idx = (ex->wheel_tick >> (EXPIRE_WHEEL_BITS * l)) & EXPIRE_WHEEL_MASK;
+        }
+        expireWheelSlot *slot = &ex->wheel[0][ex->wheel_tick & EXPIRE_WHEEL_MASK];
+        while(slot->count){
+            expireWheelItem item = slot->items[--slot->count];
+            ex->wheel_items--;
+            dictEntry *de = dictFindEntryByPtrAndHash(ex->expires, item.key, item.hash);
+            if(de && dictGetSignedIntegerVal(de) <= now){
+                expireDeleteExpired(ex, item.key);
+                ex->expired_wheel++;
+                (*expired)++;
+            }
+            //a deletion costs about four cascade moves
+            checks += 3;
+            if(slot->count && expireOverBudget(&checks, deadline_us))
+                return 1;
+        }
+        zfree(slot->items);
+        slot->items = NULL;
+        slot->cap = 0;
+        ex->wheel_tick++;
+        if(expireOverBudget(&checks, deadline_us))
+            return 1;
+    }
+    return 0;
+}
+
+//delete expired keys for at most budget_us, returns how many. the wheel goes first, then
+//random samples until a loop finds no more than the acceptable share of expired keys
+uint64_t expireCycle(expireIndex *ex, long long budget_us){
+    long long start = expireUstime(), deadline_us = start + budget_us;
+    long long now = start / 1000;
+    int effort = ex->effort < 1? 1: ex->effort > 10? 10: ex->effort;
+    uint32_t keys_per_loop = EXPIRE_KEYS_PER_LOOP + EXPIRE_KEYS_PER_LOOP / 4 * effort;
+    uint32_t acceptable_stale = EXPIRE_ACCEPTABLE_STALE - effort;
+    uint64_t expired = 0, sampled = 0, sampled_expired = 0;
+
+    if(ex->use_wheel && expireWheelRun(ex, now, deadline_us, &expired)){
+        ex->timelimit_exits++;
+        return expired;
+    }
+    //sampling only finds the keys the wheel missed. while few samples were expired on average
+    //it runs every EXPIRE_SAMPLE_EVERY cycles, which keeps the average current
+    if(ex->use_wheel && ex->stale_perc * 100 < acceptable_stale && ++ex->sample_skips < EXPIRE_SAMPLE_EVERY)
+        return expired;
+    ex->sample_skips = 0;
+
+    dictEntry *samples[EXPIRE_KEYS_PER_LOOP * 4];
+    void *victims[EXPIRE_KEYS_PER_LOOP * 4];
+    int iteration = 0;
+    uint32_t n, loop_expired;
+    do{
+        uint64_t size = ex->expires->ht_used[0] + ex->expires->ht_used[1];
+        if(!size)
+            break;
+        n = size < keys_per_loop? size: keys_per_loop;
+        n = dictGetSomeKeys(ex->expires, samples, n);
+        //entries may move on the next dict call, take the keys first
+        loop_expired = 0;
+        for(uint32_t j = 0; j < n; j++){
+            if(dictGetSignedIntegerVal(samples[j]) <= now)
+                victims[loop_expired++] = dictGetKey(samples[j]);
+        }
+        for(uint32_t j = 0; j < loop_expired; j++)
+            expireDeleteExpired(ex, victims[j]);
+        sampled += n;
+        sampled_expired += loop_expired;
+        if(!n)
+            break;
+        if((++iteration & 15) == 0 && expireUstime() > deadline_us){
+            ex->timelimit_exits++;
+            break;
+        }
+    }while(loop_expired * 100 > acceptable_stale * n);
+
+    ex->expired_sampled += sampled_expired;
+    expired += sampled_expired;
+    if(sampled)
+        ex->stale_perc = (double)sampled_expired / sampled * 0.05 + ex->stale_perc * 0.95;
+    return expired;
+}
+
+#ifdef REDIS_TEST
+#include <time.h>
+
+static void expireTestValDestructor(dict *d, void *val){
+    (void)d;
+    zfree(val);
+}
+
+static dictType expireTestType = {
+    .hashFunction = dictTestIntHash,
+    .valDestructor = expireTestValDestructor,
+};
+
+//redis-server test expire [keys] [ttl ms], a session cache: a tenth of the keys have no deadline,
+//half of the rest live for an hour and the other half expire in bursts of 1000 sharing a
+//deadline. expireCycle runs with the default budget every 10ms, the same as a 100 hz server cron,
+//until ttl ms after the last deadline
+int expireTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t keys = argc > 3? strtoull(argv[3], NULL, 10): 1000000;
+    long long ttl = argc > 4? strtoll(argv[4], NULL, 10): 3000;
+    const char *names[2] = {"sampling", "wheel+sampling"};
+
+    for(int use_wheel = 0; use_wheel <= 1; use_wheel++){
+        dict *d = dictCreate(&expireTestType);
+        expireIndex *ex = expireIndexCreate(d);
+        ex->use_wheel = use_wheel;
+
+        long long start = expireMstime(), last_deadline = start + 2 * ttl - 1;
+        uint64_t persistent = 0, long_lived = 0;
+        for(uint64_t i = 0; i < keys; i++){
+            void *key = (void *)(uintptr_t)(i + 1);
+            dictAdd(d, key, zmalloc(128));
+            if(i % 10 == 9){
+                persistent++;
+                continue;
+            }
+            long long when = start + ttl + (long long)(i / 1000) % ttl;
+            if(i % 2){
+                when = start + 3600 * 1000;
+                long_lived++;
+            }
+            assert(expireSet(ex, key, when) == DICT_OK);
+        }
+        size_t loaded = zmalloc_used_memory();
+
+        long long cycle_us = 0, worst_us = 0, drained = -1;
+        uint64_t cycles = 0;
+        while(expireMstime() < last_deadline + ttl){
+            struct timespec ts = {0, 10 * 1000000};
+            nanosleep(&ts, NULL);
+            long long t = expireUstime();
+            expireCycle(ex, EXPIRE_DEFAULT_BUDGET);
+            t = expireUstime() - t;
+            cycle_us += t;
+            worst_us = t > worst_us? t: worst_us;
+            cycles++;
+            if(drained < 0 && ex->expires->ht_used[0] + ex->expires->ht_used[1] == long_lived)
+                drained = expireMstime() - last_deadline;
+        }
+        uint64_t left = ex->expires->ht_used[0] + ex->expires->ht_used[1] - long_lived;
+        assert(d->ht_used[0] + d->ht_used[1] == persistent + long_lived + left);
+        assert(expireGet(ex, (void *)(uintptr_t)10) == -1 && !expireIfNeeded(ex, (void *)(uintptr_t)10));
+        printf("%s: %llu keys, %.1f MB reclaimed, %llu expired keys left %lld ms after the last "
+            "deadline, drained after %lld ms, %llu cycles, %.1f usec per cycle, %lld usec worst, "
+            "%llu by the wheel, %llu by sampling, %llu time limit exits\n", names[use_wheel],
+            (unsigned long long)keys, (double)(loaded - zmalloc_used_memory()) / (1 << 20),
+            (unsigned long long)left, ttl, drained, (unsigned long long)cycles,
+            cycles? (double)cycle_us / cycles: 0, worst_us, (unsigned long long)ex->expired_wheel,
+            (unsigned long long)ex->expired_sampled, (unsigned long long)ex->timelimit_exits);
+        for(uint64_t i = 0; i < keys; i++)
+            expireIfNeeded(ex, (void *)(uintptr_t)(i + 1));
+        assert(d->ht_used[0] + d->ht_used[1] == persistent + long_lived && ex->expired_lazy == left);
+        expireIndexRelease(ex);
+        dictRelease(d);
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dict.h"
+
+//key expiration for the keys of one dict. the expires dict maps the key pointers stored in
+//keys, never copies, to their unix time deadline in ms. expireCycle reclaims expired keys
+//nobody asks for: first the due slots of a coarse hierarchical timer wheel, then random samples
+//from dictGetSomeKeys, repeated while the share of expired samples stays high
+#define EXPIRE_WHEEL_BITS 6
+#define EXPIRE_WHEEL_SLOTS (1 << EXPIRE_WHEEL_BITS)
+#define EXPIRE_WHEEL_MASK (EXPIRE_WHEEL_SLOTS - 1)
+#define EXPIRE_WHEEL_LEVELS 4
+#define EXPIRE_WHEEL_TICK 16//ms, the wheel covers deadlines up to 64^4 ticks, about 3 days, ahead
+
+#define EXPIRE_KEYS_PER_LOOP 20//samples per loop at effort 0
+#define EXPIRE_ACCEPTABLE_STALE 10//% of expired samples that stops the loop at effort 0
+#define EXPIRE_SAMPLE_EVERY 10//cycles per sampling with the wheel on while little is stale
+#define EXPIRE_DEFAULT_EFFORT 1//1 to 10
+#define EXPIRE_DEFAULT_BUDGET 1000//usec per expireCycle
+
+//called right before an expired key is deleted, de is its entry in keys
+typedef void (expireFunction)(void *privdata, dict *keys, dictEntry *de);
+
+typedef struct expireWheelItem{
+    void *key;//only compared by address, the key may be gone or have a new deadline
+    uint64_t hash;
+    long long when;
+}expireWheelItem;
+
+typedef struct expireWheelSlot{
+    expireWheelItem *items;
+    uint32_t count;
+    uint32_t cap;
+}expireWheelSlot;
+
+typedef struct expireIndex{
+    dict *keys;
+    dict *expires;
+    dictType type;//keys->type without key and value ownership
+    int effort;
+    int use_wheel;
+    expireFunction *fn;
+    void *privdata;
+
+    uint64_t wheel_tick;//next tick to process
+    uint64_t wheel_items;
+    expireWheelSlot wheel[EXPIRE_WHEEL_LEVELS][EXPIRE_WHEEL_SLOTS];
+
+    double stale_perc;//moving average of the expired share of samples
+    uint32_t sample_skips;//cycles since the last sampling
+    uint64_t expired_wheel;
+    uint64_t expired_sampled;
+    uint64_t expired_lazy;
+    uint64_t timelimit_exits;
+}expireIndex;
+
+expireIndex *expireIndexCreate(dict *keys);
+void expireIndexRelease(expireIndex *ex);
+void expireSetCallback(expireIndex *ex, expireFunction *fn, void *privdata);
+int expireSet(expireIndex *ex, const void *key, long long when);
+long long expireGet(expireIndex *ex, const void *key);
+int expirePersist(expireIndex *ex, const void *key);
+int expireDelete(expireIndex *ex, const void *key);
+int expireIfNeeded(expireIndex *ex, const void *key);
+uint64_t expireCycle(expireIndex *ex, long long budget_us);
+
+#ifdef REDIS_TEST
+int expireTest(int argc, char *argv[], int flags);
+#endif
@@ -0,0 +1,412 @@
+/* A keyed 64 bit hash for hash tables, tuned for throughput rather than for resistance against
+ * an attacker who can observe hash values, which siphash gives.
+ *
+ * Keys up to 256 bytes go through a wyhash style multiply-mix: 128 bit products of the input
+ * xored with the secrets, 16 bytes per step, three independent lanes from 48 bytes up. Longer
+ * keys are folded 64 bytes at a time into eight 64 bit accumulators, xxh3 style: each lane
+ * adds the product of the low and high halves of its keyed input and the raw input of its
+ * neighbour, every 1024 bytes the accumulators are scrambled. That loop has an AVX2 version
+ * picked at run time, both produce the same hash.
+ *
+ * The 128 bit key k is the same 16 byte seed siphash takes, both halves feed every hash. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#include <pthread.h>
+#define FASTHASH_AVX2 1
+#else
+#define FASTHASH_AVX2 0
+#endif
+
+static const uint64_t fh_secret[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull};
+
+#define FH_PRIME32 0x9E3779B1ull
+#define FH_LONG 256
+#define FH_STRIPE 64
+#define FH_BLOCK_STRIPES 16
+
+static inline void fh_mum(uint64_t *a, uint64_t *b){
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t fh_mix(uint64_t a, uint64_t b){
+    fh_mum(&a, &b);
+    return a ^ b;
+}
+
+//ASCII 'A'-'Z' to lower case in every byte of x, as siptlw does byte by byte
+static inline uint64_t fh_lower64(uint64_t x){
+    uint64_t heptets = x & 0x7f7f7f7f7f7f7f7full;
+    uint64_t above_z = heptets + 0x2525252525252525ull;//bit 7 set for bytes > 'Z'
+    uint64_t from_a = heptets + 0x3f3f3f3f3f3f3f3full;//bit 7 set for bytes >= 'A'
+    uint64_t upper = ~x & (from_a ^ above_z) & 0x8080808080808080ull;
+    return x | (upper >> 2);
+}
+
+static inline uint64_t fh_r8(const uint8_t *p, int nocase){
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return nocase? fh_lower64(v): v;
+}
+
+static inline uint64_t fh_r4(const uint8_t *p, int nocase){
+    uint32_t v;
+    memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return nocase? fh_lower64(v): v;
+}
+
+//1 to 3 bytes
+static inline uint64_t fh_r3(const uint8_t *p, size_t len, int nocase){
+    uint64_t v = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+    return nocase? fh_lower64(v): v;
+}
+
+/* ----------------------------- long keys ----------------------------- */
+
+static inline void fh_lane_keys(uint64_t *lane, uint64_t seed, uint64_t k1){
+    for(int i = 0; i < 8; i++)
+        lane[i] = fh_mix(seed ^ fh_secret[i & 3] ^ (uint64_t)i, k1 ^ fh_secret[(i + 1) & 3]);
+}
+
+static inline void fh_stripe(uint64_t *acc, const uint8_t *p, const uint64_t *lane, int nocase){
+    for(int i = 0; i < 8; i++){
+        uint64_t data = fh_r8(p + 8 * i, nocase);
+        uint64_t dk = data ^ lane[i];
+        acc[i ^ 1] += data;
+        acc[i] += (dk & 0xffffffff) * (dk >> 32);
+    }
+}
+
+static inline void fh_scramble(uint64_t *acc, const uint64_t *lane){
+    for(int i = 0; i < 8; i++){
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= lane[i];
+        acc[i] *= FH_PRIME32;
+    }
+}
+
+//the stripes before the last partial block
+static void fh_accumulate(uint64_t *acc, const uint8_t *p, size_t stripes, const uint64_t *lane, int nocase){
+    for(size_t s = 0; s < stripes; s++){
+        fh_stripe(acc, p + s * FH_STRIPE, lane, nocase);
+        if(s % FH_BLOCK_STRIPES == FH_BLOCK_STRIPES - 1)
+            fh_scramble(acc, lane);
+    }
+}
+
+#if FASTHASH_AVX2
+__attribute__((target("avx2")))
+static void fh_accumulate_avx2(uint64_t *acc, const uint8_t *p, size_t stripes, const uint64_t *lane){
+    __m256i a0 = _mm256_loadu_si256((const __m256i *)(const void *)acc);
+    __m256i a1 = _mm256_loadu_si256((const __m256i *)(const void *)(acc + 4));
+    const __m256i k0 = _mm256_loadu_si256((const __m256i *)(const void *)lane);
+    const __m256i k1 = _mm256_loadu_si256((const __m256i *)(const void *)(lane + 4));
+    const __m256i prime = _mm256_set1_epi64x(FH_PRIME32);
+
+    for(size_t s = 0; s < stripes; s++){
+        const uint8_t *q = p + s * FH_STRIPE;
+        __m256i d0 = _mm256_loadu_si256((const __m256i *)(const void *)q);
+        __m256i d1 = _mm256_loadu_si256((const __m256i *)(const void *)(q + 32));
+        __m256i dk0 = _mm256_xor_si256(d0, k0);
+        __m256i dk1 = _mm256_xor_si256(d1, k1);
+        //lane i gets the input of lane i ^ 1, a swap of the 64 bit halves of every 128 bits
+        a0 = _mm256_add_epi64(a0, _mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2)));
+        a1 = _mm256_add_epi64(a1, _mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2)));
+        a0 = _mm256_add_epi64(a0, _mm256_mul_epu32(dk0, _mm256_srli_epi64(dk0, 32)));
+        a1 = _mm256_add_epi64(a1, _mm256_mul_epu32(dk1, _mm256_srli_epi64(dk1, 32)));
+        if(s % FH_BLOCK_STRIPES == FH_BLOCK_STRIPES - 1){
+            a0 = _mm256_xor_si256(_mm256_xor_si256(a0, _mm256_srli_epi64(a0, 47)), k0);
+            a1 = _mm256_xor_si256(_mm256_xor_si256(a1, _mm256_srli_epi64(a1, 47)), k1);
+            //64 by 32 bit multiply from two 32 by 32 bit ones
+            a0 = _mm256_add_epi64(_mm256_mul_epu32(a0, prime),
+                _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a0, 32), prime), 32));
+            a1 = _mm256_add_epi64(_mm256_mul_epu32(a1, prime),
+                _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a1, 32), prime), 32));
+        }
+    }
+    _mm256_storeu_si256((__m256i *)(void *)acc, a0);
+    _mm256_storeu_si256((__m256i *)(void *)(acc + 4), a1);
+}
+
+static pthread_once_t fh_avx2_once = PTHREAD_ONCE_INIT;
+static int fh_avx2 = 0;
+
+static void fh_avx2_init(void){
+    __builtin_cpu_init();
+    fh_avx2 = __builtin_cpu_supports("avx2")? 1: 0;
+}
+
+//hashed from worker threads too, the cpu is detected once for all of them
+static int fh_has_avx2(void){
+    pthread_once(&fh_avx2_once, fh_avx2_init);
+    return fh_avx2;
+}
+#endif
+
+static uint64_t fh_long(const uint8_t *p, size_t len, uint64_t seed, uint64_t k1, int nocase){
+    uint64_t lane[8], acc[8];
+    fh_lane_keys(lane, seed, k1);
+    for(int i = 0; i < 8; i++)
+        acc[i] = fh_secret[i & 3] ^ seed;
+
+    //every full stripe but the last, then the last 64 bytes, which may overlap the previous stripe
+    size_t stripes = (len - 1) / FH_STRIPE;
+#if FASTHASH_AVX2
+    if(!nocase && fh_has_avx2())
+        fh_accumulate_avx2(acc, p, stripes, lane);
+    else
+#endif
+        fh_accumulate(acc, p, stripes, lane, nocase);
+    fh_stripe(acc, p + len - FH_STRIPE, lane, nocase);
+
+    uint64_t h = (uint64_t)len * fh_secret[0];
+    for(int i = 0; i < 8; i += 2)
+        h += fh_mix(acc[i] ^ lane[(i + 3) & 7], acc[i + 1] ^ lane[(i + 6) & 7]);
+    return fh_mix(h ^ seed, k1 ^ fh_secret[1]);
+}
+
+/* ----------------------------- entry points ----------------------------- */
+
+static inline uint64_t fh_hash(const uint8_t *p, size_t len, const uint8_t *k, int nocase){
+    uint64_t k0, k1, a, b;
+    memcpy(&k0, k, 8);
+    memcpy(&k1, k + 8, 8);
+    uint64_t seed = k0 ^ fh_mix(k0 ^ fh_secret[0], k1 ^ fh_secret[1]);
+
+    if(len <= 16){
+        if(len >= 4){
+            a = (fh_r4(p, nocase) << 32) | fh_r4(p + ((len >> 3) << 2), nocase);
+            b = (fh_r4(p + len - 4, nocase) << 32) | fh_r4(p + len - 4 - ((len >> 3) << 2), nocase);
+        }else if(len > 0){
+            a = fh_r3(p, len, nocase);
+            b = 0;
+        }else{
+            a = b = 0;
+        }
+    }else if(len <= FH_LONG){
+        size_t i = len;
+        if(i > 48){
+            uint64_t see1 = seed ^ k1, see2 = seed;
+            do{
+                seed = fh_mix(fh_r8(p, nocase) ^ fh_secret[1], fh_r8(p + 8, nocase) ^ seed);
+                see1 = fh_mix(fh_r8(p + 16, nocase) ^ fh_secret[2], fh_r8(p + 24, nocase) ^ see1);
+                see2 = fh_mix(fh_r8(p + 32, nocase) ^ fh_secret[3], fh_r8(p + 40, nocase) ^ see2);
+                p += 48;
+                i -= 48;
+            }while(i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while(i > 16){
+            seed = fh_mix(fh_r8(p, nocase) ^ fh_secret[1], fh_r8(p + 8, nocase) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = fh_r8(p + i - 16, nocase);
+        b = fh_r8(p + i - 8, nocase);
+    }else{
+        return fh_long(p, len, seed, k1, nocase);
+    }
+    a ^= fh_secret[1];
+    b ^= seed;
+    fh_mum(&a, &b);
+    return fh_mix(a ^ fh_secret[0] ^ len, b ^ fh_secret[1]);
+}
+
+uint64_t fasthash(const uint8_t *in, const size_t inlen, const uint8_t *k){
+    return fh_hash(in, inlen, k, 0);
+}
+
+//the hash of the input with ASCII upper case letters turned to lower case
+uint64_t fasthash_nocase(const uint8_t *in, const size_t inlen, const uint8_t *k){
+    return fh_hash(in, inlen, k, 1);
+}
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <assert.h>
+#include <math.h>
+
+uint64_t siphash(const uint8_t *in, const size_t inlen, const uint8_t *k);
+
+int fasthashTest(int argc, char *argv[], int flags);
+
+//tsc cycles where there is one, ns elsewhere
+static uint64_t fhTestCycles(void){
+#if FASTHASH_AVX2
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static uint64_t fhTestRand(uint64_t *x){
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+static int fhTestCmp(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y? -1: x > y;
+}
+
+//64 bit collisions and the chi-square of the low 16 bits over n hashes
+static void fhTestQuality(const char *name, uint64_t *h, size_t n){
+    static uint32_t buckets[1 << 16];
+    memset(buckets, 0, sizeof(buckets));
+    for(size_t i = 0; i < n; i++)
+        buckets[h[i] & 0xffff]++;
+    double expected = (double)n / (1 << 16), chi2 = 0;
+    for(int i = 0; i < 1 << 16; i++)
+        chi2 += (buckets[i] - expected) * (buckets[i] - expected) / expected;
+    qsort(h, n, sizeof(uint64_t), fhTestCmp);
+    size_t collisions = 0;
+    for(size_t i = 1; i < n; i++)
+        collisions += h[i] == h[i - 1];
+    //65535 degrees of freedom, the standard deviation is about 362
+    printf("%-28s %zu keys, %zu collisions, chi2 %.0f (65535 +- 362)\n", name, n, collisions, chi2);
+    assert(collisions == 0 && chi2 < 65535 + 8 * 362);
+}
+
+//redis-server test fasthash [mb], hash quality checks and bytes per cycle against siphash
+int fasthashTest(int argc, char *argv[], int flags){
+    (void)flags;
+    size_t mb = argc > 3? strtoull(argv[3], NULL, 10): 64;
+    uint8_t k[16];
+    uint64_t x = 88172645463325252ULL;
+    for(int i = 0; i < 16; i++)
+        k[i] = fhTestRand(&x);
+    size_t n = 1000000;
+    uint64_t *h = malloc(n * sizeof(uint64_t));
+    char buf[64];
+
+    //sequential decimal keys
+    for(size_t i = 0; i < n; i++)
+        h[i] = fasthash((uint8_t *)buf, snprintf(buf, sizeof(buf), "key:%zu", i), k);
+    fhTestQuality("decimal keys", h, n);
+    //8 byte keys with a single bit set, and pairs of bits
+    size_t m = 0;
+    for(int i = 0; i < 64; i++){
+        for(int j = i; j < 64; j++){
+            uint64_t v = ((uint64_t)1 << i) | ((uint64_t)1 << j);
+            h[m++] = fasthash((uint8_t *)&v, 8, k);
+        }
+    }
+    fhTestQuality("8 byte keys, 1-2 bits set", h, m);
+    //the same random 300 byte key with one byte changed, through the long key path
+    uint8_t longkey[300];
+    for(size_t i = 0; i < sizeof(longkey); i++)
+        longkey[i] = fhTestRand(&x);
+    m = 0;
+    for(size_t i = 0; i < sizeof(longkey); i++){
+        uint8_t saved = longkey[i];
+        for(int v = 0; v < 256; v++){
+            if(v == saved)
+                continue;
+            longkey[i] = v;
+            h[m++] = fasthash(longkey, sizeof(longkey), k);
+        }
+        longkey[i] = saved;
+    }
+    fhTestQuality("300 byte keys, 1 byte diff", h, m);
+    //every key length from 0 to 1024 over the same buffer
+    uint8_t *data = malloc((mb << 20) + 64);
+    for(size_t i = 0; i < (mb << 20) + 64; i++)
+        data[i] = fhTestRand(&x);
+    for(m = 0; m <= 1024; m++)
+        h[m] = fasthash(data, m, k);
+    fhTestQuality("lengths 0-1024", h, m);
+
+    //avalanche: flipping one input bit flips each output bit with probability 1/2
+    size_t lens[] = {3, 8, 16, 40, 100, 300, 2000};
+    for(size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++){
+        double worst = 0;
+        uint32_t flips[64] = {0}, trials = 0;
+        for(int r = 0; r < 50; r++){
+            uint8_t *key = data + r * 17;
+            for(size_t bit = 0; bit < lens[l] * 8; bit++){
+                uint64_t before = fasthash(key, lens[l], k);
+                key[bit / 8] ^= 1 << (bit % 8);
+                uint64_t diff = before ^ fasthash(key, lens[l], k);
+                key[bit / 8] ^= 1 << (bit % 8);
+                for(int o = 0; o < 64; o++)
+                    flips[o] += (diff >> o) & 1;
+                trials++;
+            }
+        }
+        for(int o = 0; o < 64; o++){
+            double bias = (double)flips[o] / trials - 0.5;
+            bias = bias < 0? -bias: bias;
+            worst = bias > worst? bias: worst;
+        }
+        printf("avalanche, %4zu byte keys: worst output bit bias %.4f over %u flips\n", lens[l], worst, trials);
+        //five standard deviations of the share of flips for an ideal hash
+        assert(worst < 2.5 / sqrt(trials));
+    }
+
+    //the nocase hash ignores ASCII case only
+    assert(fasthash_nocase((uint8_t *)"Hello, World! [AZ@]", 19, k) == fasthash((uint8_t *)"hello, world! [az@]", 19, k));
+    assert(fasthash((uint8_t *)"Hello", 5, k) != fasthash((uint8_t *)"hello", 5, k));
+    for(size_t len = 0; len <= 1024; len += 7){
+        char *lower = malloc(len + 1), *mixed = malloc(len + 1);
+        for(size_t i = 0; i < len; i++){
+            lower[i] = 'a' + fhTestRand(&x) % 26;
+            mixed[i] = fhTestRand(&x) & 1? lower[i] - 'a' + 'A': lower[i];
+        }
+        assert(fasthash_nocase((uint8_t *)mixed, len, k) == fasthash((uint8_t *)lower, len, k));
+        free(lower);
+        free(mixed);
+    }
+#if FASTHASH_AVX2
+    //both long key loops agree
+    if(fh_has_avx2()){
+        uint64_t seed = 12345, k1 = 67890, lane[8], a[8], b[8];
+        fh_lane_keys(lane, seed, k1);
+        for(int i = 0; i < 8; i++)
+            a[i] = b[i] = fh_secret[i & 3] ^ seed;
+        fh_accumulate(a, data, 1000, lane, 0);
+        fh_accumulate_avx2(b, data, 1000, lane);
+        assert(!memcmp(a, b, sizeof(a)));
+    }
+    printf("avx2: %s\n", fh_has_avx2()? "yes": "no");
+#endif
+
+    size_t sizes[] = {8, 16, 32, 64, 256, 1024, 65536, mb << 20};
+    for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+        size_t len = sizes[s], iters = (mb << 20) / len;
+        uint64_t sink = 0, t[2];
+        for(int f = 0; f < 2; f++){
+            uint64_t start = fhTestCycles();
+            for(size_t i = 0; i < iters; i++){
+                const uint8_t *p = data + (i * 8) % 64;
+                sink += f? fasthash(p, len, k): siphash(p, len, k);
+            }
+            t[f] = fhTestCycles() - start;
+        }
+        printf("%9zu byte keys: siphash %6.2f bytes/cycle %7.1f cycles/hash, fasthash %6.2f bytes/cycle %7.1f cycles/hash (%lu)\n",
+            len, (double)len * iters / t[0], (double)t[0] / iters, (double)len * iters / t[1],
+            (double)t[1] / iters, (unsigned long)(sink & 1));
+    }
+    free(data);
+    free(h);
+    return 0;
+}
+#endif
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+
+#include "monotonic.h"
+
+#define MONOTONIC_CALIBRATION_NS 2000000
+
+static pthread_once_t monotonic_once = PTHREAD_ONCE_INIT;
+static char monotonic_info[64];
+
+static uint64_t monotonicPosixNs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if defined(__x86_64__)
+//ns = tsc_ns + (tsc - tsc_base) * tsc_mult / 2^32
+static uint64_t tsc_base, tsc_ns, tsc_mult;
+
+static uint64_t monotonicTscNs(void){
+    uint64_t ticks = __rdtsc() - tsc_base;
+    return tsc_ns + (uint64_t)(((__uint128_t)ticks * tsc_mult) >> 32);
+}
+
+//the TSC runs at a constant rate in every P and C state, and is synced across cores
+static int monotonicTscInvariant(void){
+    unsigned int a, b, c, d;
+    if(!__get_cpuid(0x80000007, &a, &b, &c, &d))
+        return 0;
+    return (d >> 8) & 1;
+}
+
+static int monotonicTscCalibrate(void){
+    if(!monotonicTscInvariant())
+        return 0;
+    uint64_t ns0 = monotonicPosixNs(), tsc0 = __rdtsc(), ns1, tsc1;
+    do{
+        ns1 = monotonicPosixNs();
+        tsc1 = __rdtsc();
+    }while(ns1 - ns0 < MONOTONIC_CALIBRATION_NS);
+    if(tsc1 <= tsc0)
+        return 0;
+    uint64_t mult = (uint64_t)(((__uint128_t)(ns1 - ns0) << 32) / (tsc1 - tsc0));
+    //between 0.1 and 100 GHz, or the TSC isn't usable
+    if(mult > ((uint64_t)10 << 32) || mult < ((uint64_t)1 << 32) / 100)
+        return 0;
+    tsc_base = tsc1;
+    tsc_ns = ns1;
+    tsc_mult = mult;
+    snprintf(monotonic_info, sizeof(monotonic_info), "X86 TSC @ %.3f ticks/ns",
+        (double)((uint64_t)1 << 32) / mult);
+    return 1;
+}
+#endif
+
+static uint64_t monotonicLazyNs(void){
+    monotonicInit();
+    return monotonicNs();
+}
+
+uint64_t (*monotonicNs)(void) = monotonicLazyNs;
+
+static void monotonicCalibrate(void){
+#if defined(__x86_64__)
+    if(monotonicTscCalibrate()){
+        monotonicNs = monotonicTscNs;
+        return;
+    }
+#endif
+    snprintf(monotonic_info, sizeof(monotonic_info), "POSIX clock_gettime");
+    monotonicNs = monotonicPosixNs;
+}
+
+const char *monotonicInit(void){
+    pthread_once(&monotonic_once, monotonicCalibrate);
+    return monotonic_info;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+
+//a cheap monotonic clock in ns. on x86-64 with an invariant TSC it reads the TSC and scales it
+//by a ratio calibrated once against CLOCK_MONOTONIC, elsewhere it is clock_gettime. the first
+//call calibrates, which takes a couple of ms, monotonicInit does it ahead of time
+extern uint64_t (*monotonicNs)(void);
+
+//returns what the clock runs on
+const char *monotonicInit(void);
+
+static inline uint64_t monotonicUs(void){
+    return monotonicNs() / 1000;
+}
@@ -1,6 +1,62 @@
+#include <string.h>
+#include <strings.h>
 #include "log.h"
 #include "zmalloc_test.h"
-int main(){
+#ifdef REDIS_TEST
+#include "dict.h"
+#include "cdict.h"
+#include "evict.h"
+#include "expire.h"
+#include "dictimage.h"
+#include "smalldict.h"
+#include "defrag.h"
+
+struct redisTest{
+    char *name;
+    int (*proc)(int, char **, int);
+}redisTests[] = {
+    {"findbatch", dictFindBatchTest},
+    {"bgrehash", dictBgRehashTest},
+    {"entryslab", dictEntrySlabTest},
+    {"entrytags", dictEntryTagTest},
+    {"cdict", cdictTest},
+    {"lockfree", dictLockFreeTest},
+    {"parallelscan", dictParallelScanTest},
+    {"cdictcounters", cdictCounterTest},
+    {"dictbulk", dictBulkTest},
+    {"evict", evictTest},
+    {"expire", expireTest},
+    {"lazyfree", dictLazyFreeTest},
+    {"hugetable", dictHugeTableTest},
+    {"dictstats", dictStatsTest},
+    {"fasthash", fasthashTest},
+    {"hashbatch", dictHashBatchTest},
+    {"dictimage", dictImageTest},
+    {"boundedprobe", dictBoundedProbeTest},
+    {"rehashcron", dictRehashCronTest},
+    {"bloom", dictBloomTest},
+    {"withhash", dictWithHashTest},
+    {"embedkeys", dictEmbedKeyTest},
+    {"oadict", dictOaTest},
+    {"smalldict", smallDictTest},
+    {"defrag", defragTest},
+};
+#endif
+
+int main(int argc, char **argv){
+#ifdef REDIS_TEST
+    //redis-server test <name> [args]
+    if(argc >= 3 && !strcasecmp(argv[1], "test")){
+        for(size_t i = 0; i < sizeof(redisTests) / sizeof(redisTests[0]); i++){
+            if(!strcasecmp(argv[2], redisTests[i].name))
+                return redisTests[i].proc(argc, argv, 0);
+        }
+        return -1;
+    }
+#else
+    (void)argc;
+    (void)argv;
+#endif
     zmalloc_test();
     return 0;
-}
\ No newline at end of file
+}
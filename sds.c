@@ -146,6 +146,28 @@ sds sdsdup(const sds s){
     return sdsnewlen(s, sdslen(s));
 }
 
+//bytes needed to keep a copy of s inside another allocation, 0 when s is too long for it
+size_t sdsembedsize(const sds s){
+    size_t len = sdslen(s);
+    if(len > sdsTypeMaxSize(SDS_TYPE_8))
+        return 0;
+    return sizeof(struct sdshdr8) + len + 1;
+}
+
+//copy s into buf, which holds sdsembedsize(s) bytes. the copy has no free space and
+//must never be freed or grown, it lives as long as the memory around it
+sds sdsembed(void *buf, const sds s){
+    size_t len = sdslen(s);
+    sds e = (char *)buf + sizeof(struct sdshdr8);
+    SDS_HDR_VAR(8, e);
+    sh->len = len;
+    sh->alloc = len;
+    e[-1] = SDS_TYPE_8;
+    memcpy(e, s, len);
+    e[len] = '\0';
+    return e;
+}
+
 void sdsfree(sds s){
     if(s == NULL)
         return;
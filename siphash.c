@@ -196,4 +196,208 @@ uint64_t siphash_nocase(const uint8_t *in, const size_t inlen, const uint8_t *k)
 #else
     return b;
 #endif
-}
\ No newline at end of file
+}
+/* siphash of several independent keys at once, one key per 64 bit SIMD lane. Every lane
+ * absorbs its own message words, the 8 byte blocks and then the length word, lanes that ran
+ * out of words keep their state while the longer ones go on, the finalization runs on all
+ * lanes together. The hashes are the ones siphash returns for each key. */
+
+#define SIP_LANES_MAX 8
+
+//the w-th message word of a key, the block or the final length word
+static inline uint64_t sipword(const uint8_t *in, size_t inlen, size_t w) {
+    uint64_t m = 0;
+    if (w < inlen / 8) {
+        memcpy(&m, in + 8 * w, 8);
+    } else {
+        if (inlen & 7) memcpy(&m, in + 8 * w, inlen & 7);
+        m |= ((uint64_t)inlen) << 56;
+    }
+    return m;
+}
+
+static void siphash_lanes_scalar(const uint8_t *const *in, const size_t *inlen, int n,
+                                 const uint8_t *k, uint64_t *out) {
+    for (int i = 0; i < n; i++) out[i] = siphash(in[i], inlen[i], k);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__) && defined(UNALIGNED_LE_CPU)
+#include <immintrin.h>
+#include <pthread.h>
+
+#define SIPROUND_V(ADD, XOR, ROTL_V, ROTL32_V)                                 \
+    do {                                                                       \
+        v0 = ADD(v0, v1);                                                      \
+        v1 = ROTL_V(v1, 13);                                                   \
+        v1 = XOR(v1, v0);                                                      \
+        v0 = ROTL32_V(v0);                                                     \
+        v2 = ADD(v2, v3);                                                      \
+        v3 = ROTL_V(v3, 16);                                                   \
+        v3 = XOR(v3, v2);                                                      \
+        v0 = ADD(v0, v3);                                                      \
+        v3 = ROTL_V(v3, 21);                                                   \
+        v3 = XOR(v3, v0);                                                      \
+        v2 = ADD(v2, v1);                                                      \
+        v1 = ROTL_V(v1, 17);                                                   \
+        v1 = XOR(v1, v2);                                                      \
+        v2 = ROTL32_V(v2);                                                     \
+    } while (0)
+
+#define ROTL_256(x, b) _mm256_or_si256(_mm256_slli_epi64((x), (b)), _mm256_srli_epi64((x), 64 - (b)))
+#define ROTL32_256(x) _mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+
+__attribute__((target("avx2")))
+static void siphash_x4_avx2(const uint8_t *const *in, const size_t *inlen, const uint8_t *k,
+                            uint64_t *out) {
+    uint64_t k0 = U8TO64_LE(k), k1 = U8TO64_LE(k + 8);
+    __m256i v0 = _mm256_set1_epi64x(0x736f6d6570736575ULL ^ k0);
+    __m256i v1 = _mm256_set1_epi64x(0x646f72616e646f6dULL ^ k1);
+    __m256i v2 = _mm256_set1_epi64x(0x6c7967656e657261ULL ^ k0);
+    __m256i v3 = _mm256_set1_epi64x(0x7465646279746573ULL ^ k1);
+    size_t words[4], maxwords = 0, common = SIZE_MAX;
+    uint64_t m[4];
+
+    for (int i = 0; i < 4; i++) {
+        words[i] = inlen[i] / 8 + 1;
+        if (words[i] > maxwords) maxwords = words[i];
+        if (words[i] - 1 < common) common = words[i] - 1;
+    }
+    //the blocks every lane has
+    for (size_t w = 0; w < common; w++) {
+        for (int i = 0; i < 4; i++) m[i] = U8TO64_LE(in[i] + 8 * w);
+        __m256i mv = _mm256_loadu_si256((const __m256i *)(const void *)m);
+        v3 = _mm256_xor_si256(v3, mv);
+        SIPROUND_V(_mm256_add_epi64, _mm256_xor_si256, ROTL_256, ROTL32_256);
+        v0 = _mm256_xor_si256(v0, mv);
+    }
+    const __m256i lanewords = _mm256_loadu_si256((const __m256i *)(const void *)words);
+    for (size_t w = common; w < maxwords; w++) {
+        for (int i = 0; i < 4; i++)
+            m[i] = w < words[i] ? sipword(in[i], inlen[i], w) : 0;
+        __m256i mv = _mm256_loadu_si256((const __m256i *)(const void *)m);
+        __m256i active = _mm256_cmpgt_epi64(lanewords, _mm256_set1_epi64x((long long)w));
+        __m256i s0 = v0, s1 = v1, s2 = v2, s3 = v3;
+
+        v3 = _mm256_xor_si256(v3, mv);
+        SIPROUND_V(_mm256_add_epi64, _mm256_xor_si256, ROTL_256, ROTL32_256);
+        v0 = _mm256_xor_si256(v0, mv);
+
+        v0 = _mm256_blendv_epi8(s0, v0, active);
+        v1 = _mm256_blendv_epi8(s1, v1, active);
+        v2 = _mm256_blendv_epi8(s2, v2, active);
+        v3 = _mm256_blendv_epi8(s3, v3, active);
+    }
+
+    v2 = _mm256_xor_si256(v2, _mm256_set1_epi64x(0xff));
+    SIPROUND_V(_mm256_add_epi64, _mm256_xor_si256, ROTL_256, ROTL32_256);
+    SIPROUND_V(_mm256_add_epi64, _mm256_xor_si256, ROTL_256, ROTL32_256);
+    __m256i h = _mm256_xor_si256(_mm256_xor_si256(v0, v1), _mm256_xor_si256(v2, v3));
+    _mm256_storeu_si256((__m256i *)(void *)out, h);
+}
+
+#define ROTL_512(x, b) _mm512_rol_epi64((x), (b))
+#define ROTL32_512(x) _mm512_rol_epi64((x), 32)
+
+__attribute__((target("avx512f")))
+static void siphash_x8_avx512(const uint8_t *const *in, const size_t *inlen, const uint8_t *k,
+                              uint64_t *out) {
+    uint64_t k0 = U8TO64_LE(k), k1 = U8TO64_LE(k + 8);
+    __m512i v0 = _mm512_set1_epi64(0x736f6d6570736575ULL ^ k0);
+    __m512i v1 = _mm512_set1_epi64(0x646f72616e646f6dULL ^ k1);
+    __m512i v2 = _mm512_set1_epi64(0x6c7967656e657261ULL ^ k0);
+    __m512i v3 = _mm512_set1_epi64(0x7465646279746573ULL ^ k1);
+    size_t words[8], maxwords = 0, common = SIZE_MAX;
+    uint64_t m[8];
+
+    for (int i = 0; i < 8; i++) {
+        words[i] = inlen[i] / 8 + 1;
+        if (words[i] > maxwords) maxwords = words[i];
+        if (words[i] - 1 < common) common = words[i] - 1;
+    }
+    //the blocks every lane has
+    for (size_t w = 0; w < common; w++) {
+        for (int i = 0; i < 8; i++) m[i] = U8TO64_LE(in[i] + 8 * w);
+        __m512i mv = _mm512_loadu_si512(m);
+        v3 = _mm512_xor_si512(v3, mv);
+        SIPROUND_V(_mm512_add_epi64, _mm512_xor_si512, ROTL_512, ROTL32_512);
+        v0 = _mm512_xor_si512(v0, mv);
+    }
+    const __m512i lanewords = _mm512_loadu_si512(words);
+    for (size_t w = common; w < maxwords; w++) {
+        for (int i = 0; i < 8; i++)
+            m[i] = w < words[i] ? sipword(in[i], inlen[i], w) : 0;
+        __m512i mv = _mm512_loadu_si512(m);
+        __mmask8 active = _mm512_cmpgt_epu64_mask(lanewords, _mm512_set1_epi64((long long)w));
+        __m512i s0 = v0, s1 = v1, s2 = v2, s3 = v3;
+
+        v3 = _mm512_xor_si512(v3, mv);
+        SIPROUND_V(_mm512_add_epi64, _mm512_xor_si512, ROTL_512, ROTL32_512);
+        v0 = _mm512_xor_si512(v0, mv);
+
+        v0 = _mm512_mask_blend_epi64(active, s0, v0);
+        v1 = _mm512_mask_blend_epi64(active, s1, v1);
+        v2 = _mm512_mask_blend_epi64(active, s2, v2);
+        v3 = _mm512_mask_blend_epi64(active, s3, v3);
+    }
+
+    v2 = _mm512_xor_si512(v2, _mm512_set1_epi64(0xff));
+    SIPROUND_V(_mm512_add_epi64, _mm512_xor_si512, ROTL_512, ROTL32_512);
+    SIPROUND_V(_mm512_add_epi64, _mm512_xor_si512, ROTL_512, ROTL32_512);
+    __m512i h = _mm512_xor_si512(_mm512_xor_si512(v0, v1), _mm512_xor_si512(v2, v3));
+    _mm512_storeu_si512(out, h);
+}
+
+static pthread_once_t sipsimd_once = PTHREAD_ONCE_INIT;
+static int sipsimd = 0;
+
+static void siphash_simd_init(void) {
+    __builtin_cpu_init();
+    sipsimd = __builtin_cpu_supports("avx512f") ? 2 : __builtin_cpu_supports("avx2") ? 1 : 0;
+}
+
+//2 with AVX-512F, 1 with AVX2, 0 for the scalar loop. batches are hashed from worker threads
+//too, the cpu is detected once for all of them
+static int siphash_simd(void) {
+    pthread_once(&sipsimd_once, siphash_simd_init);
+    return sipsimd;
+}
+
+void siphash_x4(const uint8_t *const *in, const size_t *inlen, const uint8_t *k, uint64_t *out) {
+    if (siphash_simd())
+        siphash_x4_avx2(in, inlen, k, out);
+    else
+        siphash_lanes_scalar(in, inlen, 4, k, out);
+}
+
+void siphash_x8(const uint8_t *const *in, const size_t *inlen, const uint8_t *k, uint64_t *out) {
+    int simd = siphash_simd();
+    if (simd == 2) {
+        siphash_x8_avx512(in, inlen, k, out);
+    } else if (simd == 1) {
+        siphash_x4_avx2(in, inlen, k, out);
+        siphash_x4_avx2(in + 4, inlen + 4, k, out + 4);
+    } else {
+        siphash_lanes_scalar(in, inlen, 8, k, out);
+    }
+}
+
+#else
+
+void siphash_x4(const uint8_t *const *in, const size_t *inlen, const uint8_t *k, uint64_t *out) {
+    siphash_lanes_scalar(in, inlen, 4, k, out);
+}
+
+void siphash_x8(const uint8_t *const *in, const size_t *inlen, const uint8_t *k, uint64_t *out) {
+    siphash_lanes_scalar(in, inlen, 8, k, out);
+}
+
+#endif
+
+//hash n keys, 8 and then 4 at a time, the rest one by one
+void siphash_batch(const uint8_t *const *in, const size_t *inlen, size_t n, const uint8_t *k,
+                   uint64_t *out) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) siphash_x8(in + i, inlen + i, k, out + i);
+    for (; i + 4 <= n; i += 4) siphash_x4(in + i, inlen + i, k, out + i);
+    for (; i < n; i++) out[i] = siphash(in[i], inlen[i], k);
+}
@@ -0,0 +1,151 @@
+#include <string.h>
+
+#include "slab.h"
+#include "zmalloc.h"
+#include "redisassert.h"
+
+struct slabPage{
+    slab *owner;
+    slabPage *prev, *next;
+    void *freelist;
+    uint32_t used;
+    uint32_t bumped;//objects handed out from the never used tail of the page
+    int partial;
+    char data[] __attribute__((aligned(16)));
+};
+
+//a page used by less than a quarter gets its objects moved out by slabDefrag
+#define SLAB_SPARSE_DIVISOR 4
+
+static inline slabPage *slabPageOf(const void *ptr){
+    return (slabPage *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+slab *slabCreate(size_t objsize){
+    slab *s = zmalloc(sizeof(*s));
+    if(objsize < sizeof(void *))
+        objsize = sizeof(void *);
+    s->objsize = (objsize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    s->perpage = (SLAB_PAGE_SIZE - sizeof(slabPage)) / s->objsize;
+    assert(s->perpage > 0);
+    s->partial_head = s->partial_tail = NULL;
+    s->pages = 0;
+    s->objects = 0;
+    return s;
+}
+
+static void slabPartialLink(slab *s, slabPage *page){
+    page->prev = s->partial_tail;
+    page->next = NULL;
+    if(s->partial_tail)
+        s->partial_tail->next = page;
+    else
+        s->partial_head = page;
+    s->partial_tail = page;
+    page->partial = 1;
+}
+
+static void slabPartialLinkHead(slab *s, slabPage *page){
+    page->prev = NULL;
+    page->next = s->partial_head;
+    if(s->partial_head)
+        s->partial_head->prev = page;
+    else
+        s->partial_tail = page;
+    s->partial_head = page;
+    page->partial = 1;
+}
+
+static void slabPartialUnlink(slab *s, slabPage *page){
+    if(page->prev)
+        page->prev->next = page->next;
+    else
+        s->partial_head = page->next;
+    if(page->next)
+        page->next->prev = page->prev;
+    else
+        s->partial_tail = page->prev;
+    page->prev = page->next = NULL;
+    page->partial = 0;
+}
+
+static slabPage *slabNewPage(slab *s){
+    slabPage *page = zmalloc_aligned(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+    page->owner = s;
+    page->freelist = NULL;
+    page->used = 0;
+    page->bumped = 0;
+    slabPartialLink(s, page);
+    s->pages++;
+    return page;
+}
+
+void *slabAlloc(slab *s){
+    slabPage *page = s->partial_head;
+    void *ptr;
+
+    if(!page)
+        page = slabNewPage(s);
+    if(page->freelist){
+        ptr = page->freelist;
+        page->freelist = *(void **)ptr;
+    }else{
+        assert(page->bumped < s->perpage);
+        ptr = page->data + (size_t)page->bumped * s->objsize;
+        page->bumped++;
+    }
+    if(++page->used == s->perpage)
+        slabPartialUnlink(s, page);
+    s->objects++;
+    return ptr;
+}
+
+void slabFree(slab *s, void *ptr){
+    slabPage *page = slabPageOf(ptr);
+    assert(page->owner == s);
+
+    *(void **)ptr = page->freelist;
+    page->freelist = ptr;
+    page->used--;
+    s->objects--;
+    if(page->used == 0){
+        if(page->partial)
+            slabPartialUnlink(s, page);
+        zfree(page);
+        s->pages--;
+    }else if(!page->partial){
+        slabPartialLink(s, page);
+    }
+}
+
+//move ptr out of a sparsely used page into the page allocations are served from,
+//return the new location or NULL when the object is better left where it is
+void *slabDefrag(slab *s, void *ptr){
+    slabPage *page = slabPageOf(ptr);
+    slabPage *target = s->partial_head;
+
+    if(page->used * SLAB_SPARSE_DIVISOR > s->perpage)
+        return NULL;
+    if(!target || target == page)
+        return NULL;
+    if(target->used < page->used){
+        //the fuller page serves the next allocations, later sparse objects drain into it
+        slabPartialUnlink(s, page);
+        slabPartialLinkHead(s, page);
+        return NULL;
+    }
+    void *newptr = slabAlloc(s);
+    memcpy(newptr, ptr, s->objsize);
+    slabFree(s, ptr);
+    return newptr;
+}
+
+size_t slabMemUsage(const slab *s){
+    return sizeof(*s) + s->pages * SLAB_PAGE_SIZE;
+}
+
+//every object has to be freed already, empty pages are given back by slabFree
+void slabRelease(slab *s){
+    assert(s->objects == 0 && s->pages == 0);
+    zfree(s);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+//objects of one fixed size carved out of SLAB_PAGE_SIZE aligned pages, the page of an
+//object is found by masking its address, a page is given back as soon as it is empty
+#define SLAB_PAGE_SIZE 4096
+
+typedef struct slabPage slabPage;
+
+typedef struct slab{
+    size_t objsize;
+    uint32_t perpage;
+    slabPage *partial_head, *partial_tail;//pages with free objects, allocation takes the head
+    uint64_t pages;
+    uint64_t objects;
+}slab;
+
+slab *slabCreate(size_t objsize);
+void slabRelease(slab *s);
+void *slabAlloc(slab *s);
+void slabFree(slab *s, void *ptr);
+void *slabDefrag(slab *s, void *ptr);
+size_t slabMemUsage(const slab *s);
@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "smalldict.h"
+#include "zmalloc.h"
+#include "redisassert.h"
+
+/* ----------------------------- packed encoding -----------------------------
+ * The blob holds a tag byte per entry, then the 16 bit offset of every entry in the data, then
+ * the entries back to back in offset order. An entry is the key and, unless the type has
+ * no_value, the value, both as sds with an 8 bit header and no free space, so a pointer to
+ * either is a read only sds. A lookup compares the tag of the key against 16 tags at a time and
+ * only compares the keys whose tag matches. */
+
+#define SMALLDICT_TAG_GROUP 16
+
+static inline uint8_t *sdTags(smallDictBlob *b){
+    return b->buf;
+}
+
+static inline uint16_t *sdOffsets(smallDictBlob *b){
+    return (uint16_t *)(void *)(b->buf + b->cap);
+}
+
+static inline uint8_t *sdData(smallDictBlob *b){
+    return b->buf + (size_t)b->cap * 3;
+}
+
+static inline sds sdKey(smallDictBlob *b, uint32_t i){
+    return (sds)(sdData(b) + sdOffsets(b)[i] + sizeof(struct sdshdr8));
+}
+
+static inline sds sdVal(sds key){
+    return key + sdslen(key) + 1 + sizeof(struct sdshdr8);
+}
+
+static inline uint32_t sdEntryEnd(smallDictBlob *b, uint32_t i){
+    return i + 1 < b->count? sdOffsets(b)[i + 1]: b->used;
+}
+
+//from the length and the last 8 bytes, where keys like field:1 ... field:99 differ
+static inline uint8_t sdTag(const char *s, size_t len){
+    uint64_t w = 0;
+    if(len >= 8)
+        memcpy(&w, s + len - 8, 8);
+    else
+        memcpy(&w, s, len);
+    return ((w ^ len) * 0x9e3779b97f4a7c15ULL) >> 56;
+}
+
+static inline uint32_t sdMatchTags(const uint8_t *tags, uint8_t tag){
+#if defined(__SSE2__)
+    __m128i t = _mm_loadu_si128((const __m128i *)(const void *)tags);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(t, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t mask = 0;
+    for(int i = 0; i < SMALLDICT_TAG_GROUP; i++)
+        if(tags[i] == tag)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+//the index of key in the blob, -1 if none
+static int sdLocate(smallDictBlob *b, const sds key){
+    if(!b)
+        return -1;
+    size_t len = sdslen(key);
+    uint8_t tag = sdTag(key, len), *tags = sdTags(b);
+    for(uint32_t i = 0; i < b->count; i += SMALLDICT_TAG_GROUP){
+        uint32_t mask = sdMatchTags(tags + i, tag);
+        if(b->count - i < SMALLDICT_TAG_GROUP)
+            mask &= (1u << (b->count - i)) - 1;
+        while(mask){
+            uint32_t j = i + __builtin_ctz(mask);
+            sds k = sdKey(b, j);
+            if(sdslen(k) == len && !memcmp(k, key, len))
+                return j;
+            mask &= mask - 1;
+        }
+    }
+    return -1;
+}
+
+static inline size_t sdEntrySize(smallDict *sd, const sds key, const sds val){
+    return sdsembedsize(key) + (sd->type->no_value? 0: sdsembedsize(val));
+}
+
+//room for one more entry of esize bytes, cap grows 16 entries at a time, the data after the
+//offsets moves up with it
+static smallDictBlob *sdMakeRoom(smallDictBlob *b, size_t esize){
+    uint32_t count = b? b->count: 0, cap = b? b->cap: 0, used = b? b->used: 0;
+    uint32_t newcap = count < cap? cap: cap + SMALLDICT_TAG_GROUP;
+    size_t need = sizeof(*b) + (size_t)newcap * 3 + used + esize;
+    if(b && need <= b->size && newcap == cap)
+        return b;
+    size_t usable;
+    b = zrealloc_usable(b, need > (b? b->size: 0)? need: b->size, &usable);
+    if(!cap)
+        b->count = b->used = 0;
+    if(newcap != cap){
+        memmove(b->buf + (size_t)newcap * 3, b->buf + (size_t)cap * 3, used);
+        memmove(b->buf + newcap, b->buf + cap, (size_t)cap * sizeof(uint16_t));
+        b->cap = newcap;
+    }
+    b->size = usable;
+    return b;
+}
+
+static void sdAppend(smallDict *sd, const sds key, const sds val){
+    size_t esize = sdEntrySize(sd, key, val);
+    smallDictBlob *b = sd->blob = sdMakeRoom(sd->blob, esize);
+    uint8_t *p = sdData(b) + b->used;
+    sdTags(b)[b->count] = sdTag(key, sdslen(key));
+    sdOffsets(b)[b->count] = b->used;
+    sdsembed(p, key);
+    if(!sd->type->no_value)
+        sdsembed(p + sdsembedsize(key), val);
+    b->used += esize;
+    b->count++;
+}
+
+static void sdRemove(smallDict *sd, uint32_t i){
+    smallDictBlob *b = sd->blob;
+    uint16_t *offs = sdOffsets(b);
+    uint32_t start = offs[i], end = sdEntryEnd(b, i), esize = end - start;
+    memmove(sdData(b) + start, sdData(b) + end, b->used - end);
+    for(uint32_t j = i + 1; j < b->count; j++)
+        offs[j - 1] = offs[j] - esize;
+    memmove(sdTags(b) + i, sdTags(b) + i + 1, b->count - i - 1);
+    b->used -= esize;
+    if(--b->count == 0){
+        zfree(b);
+        sd->blob = NULL;
+        return;
+    }
+    //give back the room of deleted entries once it is most of the allocation
+    size_t need = sizeof(*b) + (size_t)b->cap * 3 + b->used, usable;
+    if(need * 2 < b->size){
+        sd->blob = zrealloc_usable(b, need, &usable);
+        sd->blob->size = usable;
+    }
+}
+
+//move every entry to a dict of the type, the dict copies them
+static void sdConvert(smallDict *sd){
+    smallDictBlob *b = sd->blob;
+    sd->d = dictCreate(sd->type);
+    if(!b)
+        return;
+    dictExpand(sd->d, b->count);
+    for(uint32_t i = 0; i < b->count; i++){
+        sds key = sdKey(b, i);
+        assert(dictAdd(sd->d, key, sd->type->no_value? NULL: sdVal(key)) == DICT_OK);
+    }
+    zfree(b);
+    sd->blob = NULL;
+}
+
+//convert unless key and val fit the limits next to the entries already there
+static int sdFits(smallDict *sd, const sds key, const sds val){
+    uint32_t count = sd->blob? sd->blob->count: 0, used = sd->blob? sd->blob->used: 0;
+    if(count >= sd->max_entries || sdslen(key) > sd->max_value ||
+        (!sd->type->no_value && sdslen(val) > sd->max_value) ||
+        used + sdEntrySize(sd, key, val) > SMALLDICT_MAX_DATA){
+        sdConvert(sd);
+        return 0;
+    }
+    return 1;
+}
+
+/* ----------------------------- API ----------------------------- */
+
+//keys and values must be sds, the type needs keyDup, and valDup unless it has no_value, the
+//dict a small dict converts to copies the packed entries with them
+smallDict *smallDictCreate(dictType *type){
+    assert(type->keyDup && (type->no_value || type->valDup));
+    smallDict *sd = zcalloc(sizeof(*sd));
+    sd->type = type;
+    sd->max_entries = SMALLDICT_MAX_ENTRIES;
+    sd->max_value = SMALLDICT_MAX_VALUE;
+    return sd;
+}
+
+void smallDictRelease(smallDict *sd){
+    if(sd->d)
+        dictRelease(sd->d);
+    zfree(sd->blob);
+    zfree(sd);
+}
+
+//max_value is capped at SMALLDICT_MAX_VALUE_LIMIT. a small dict already over max_entries
+//converts right away, one with longer keys or values on its next write
+void smallDictSetLimits(smallDict *sd, unsigned max_entries, unsigned max_value){
+    sd->max_entries = max_entries > UINT16_MAX? UINT16_MAX: max_entries;
+    sd->max_value = max_value > SMALLDICT_MAX_VALUE_LIMIT? SMALLDICT_MAX_VALUE_LIMIT: max_value;
+    if(!sd->d && smallDictSize(sd) > sd->max_entries)
+        sdConvert(sd);
+}
+
+int smallDictAdd(smallDict *sd, const sds key, const sds val){
+    if(!sd->d){
+        if(sdLocate(sd->blob, key) != -1)
+            return DICT_ERR;
+        if(sdFits(sd, key, val)){
+            sdAppend(sd, key, val);
+            return DICT_OK;
+        }
+    }
+    return dictAdd(sd->d, key, val);
+}
+
+//1 if key was added, 0 if it was there and got val, or was there at all without values
+int smallDictReplace(smallDict *sd, const sds key, const sds val){
+    if(sd->type->no_value)
+        return smallDictAdd(sd, key, val) == DICT_OK;
+    if(!sd->d){
+        int i = sdLocate(sd->blob, key);
+        if(i != -1){
+            sds old = sdVal(sdKey(sd->blob, i));
+            if(sdslen(old) == sdslen(val)){
+                memcpy(old, val, sdslen(val));
+                return 0;
+            }
+            sdRemove(sd, i);
+        }
+        if(sdFits(sd, key, val))
+            sdAppend(sd, key, val);
+        else
+            assert(dictAdd(sd->d, key, val) == DICT_OK);
+        return i == -1;
+    }
+    return dictReplace(sd->d, key, val);
+}
+
+int smallDictDelete(smallDict *sd, const sds key){
+    if(sd->d)
+        return dictDelete(sd->d, key);
+    int i = sdLocate(sd->blob, key);
+    if(i == -1)
+        return DICT_ERR;
+    sdRemove(sd, i);
+    return DICT_OK;
+}
+
+int smallDictExists(smallDict *sd, const sds key){
+    if(sd->d)
+        return dictFind(sd->d, key) != NULL;
+    return sdLocate(sd->blob, key) != -1;
+}
+
+//a packed value is a read only sds, valid until the next write
+void *smallDictFetchValue(smallDict *sd, const sds key){
+    if(sd->d)
+        return dictFetchValue(sd->d, key);
+    int i = sdLocate(sd->blob, key);
+    return i == -1 || sd->type->no_value? NULL: sdVal(sdKey(sd->blob, i));
+}
+
+uint64_t smallDictSize(smallDict *sd){
+    if(sd->d)
+        return sd->d->ht_used[0] + sd->d->ht_used[1];
+    return sd->blob? sd->blob->count: 0;
+}
+
+//fn must not write to sd
+void smallDictForEach(smallDict *sd, smallDictEntryFunction *fn, void *privdata){
+    if(sd->d){
+        dictIterator *iter = dictGetIterator(sd->d);
+        dictEntry *de;
+        while((de = dictNext(iter)))
+            fn(privdata, dictGetKey(de), sd->type->no_value? NULL: dictGetVal(de));
+        dictReleaseIterator(iter);
+        return;
+    }
+    smallDictBlob *b = sd->blob;
+    for(uint32_t i = 0; b && i < b->count; i++){
+        sds key = sdKey(b, i);
+        fn(privdata, key, sd->type->no_value? NULL: sdVal(key));
+    }
+}
+
+#ifdef REDIS_TEST
+#include "monotonic.h"
+
+static int smallDictTestCompare(dict *d, const void *key1, const void *key2){
+    (void)d;
+    size_t len = sdslen((const sds)key1);
+    return len == sdslen((const sds)key2) && !memcmp(key1, key2, len);
+}
+
+static void *smallDictTestDup(dict *d, const void *s){
+    (void)d;
+    return sdsdup((const sds)s);
+}
+
+static void smallDictTestFree(dict *d, void *s){
+    (void)d;
+    sdsfree(s);
+}
+
+static dictType smallDictTestType = {
+    .hashFunction = dictTestSdsHash,
+    .keyCompare = smallDictTestCompare,
+    .keyDup = smallDictTestDup,
+    .valDup = smallDictTestDup,
+    .keyDestructor = smallDictTestFree,
+    .valDestructor = smallDictTestFree,
+};
+
+static dictType smallDictTestSetType = {
+    .hashFunction = dictTestSdsHash,
+    .keyCompare = smallDictTestCompare,
+    .keyDup = smallDictTestDup,
+    .keyDestructor = smallDictTestFree,
+    .no_value = 1,
+};
+
+static sds smallDictTestField(uint64_t k){
+    char buf[32];
+    return sdsnewlen(buf, snprintf(buf, sizeof(buf), "field:%llu", (unsigned long long)k));
+}
+
+//a value of len bytes, different for every k and version
+static sds smallDictTestValue(uint64_t k, int version, size_t len){
+    char buf[128];
+    assert(len <= sizeof(buf));
+    for(size_t i = 0; i < len; i++)
+        buf[i] = 'a' + (k * 7 + version * 3 + i) % 26;
+    return sdsnewlen(buf, len);
+}
+
+static void smallDictTestCount(void *privdata, const sds key, void *val){
+    dict *ref = ((void **)privdata)[0];
+    uint64_t *seen = ((void **)privdata)[1];
+    dictEntry *de = dictFind(ref, key);
+    assert(de);
+    assert(ref->type->no_value? !val: smallDictTestCompare(ref, dictGetVal(de), val));
+    (*seen)++;
+}
+
+static void smallDictTestCheck(smallDict *sd, dict *ref, uint64_t fields){
+    assert(smallDictSize(sd) == ref->ht_used[0] + ref->ht_used[1]);
+    for(uint64_t k = 0; k < fields; k++){
+        sds key = smallDictTestField(k);
+        dictEntry *de = dictFind(ref, key);
+        assert(smallDictExists(sd, key) == (de != NULL));
+        if(de && !ref->type->no_value)
+            assert(smallDictTestCompare(ref, smallDictFetchValue(sd, key), dictGetVal(de)));
+        sdsfree(key);
+    }
+    uint64_t seen = 0;
+    void *pd[2] = {ref, &seen};
+    smallDictForEach(sd, smallDictTestCount, pd);
+    assert(seen == ref->ht_used[0] + ref->ht_used[1]);
+}
+
+//random writes against a plain dict, with the packed encoding converting on entries, on
+//value length or not at all
+static void smallDictTestRandom(dictType *type, int converts){
+    smallDict *sd = smallDictCreate(type);
+    dict *ref = dictCreate(type);
+    uint64_t fields = converts == 1? 200: 100;
+    for(int op = 0; op < 20000; op++){
+        uint64_t k = genrand64_int64() % fields;
+        size_t len = genrand64_int64() % (converts == 2? 80: 40);
+        sds key = smallDictTestField(k), val = smallDictTestValue(k, op, len);
+        switch(genrand64_int64() % 4){
+        case 0:
+            assert(smallDictAdd(sd, key, val) == dictAdd(ref, key, val));
+            break;
+        case 1:
+            assert(smallDictReplace(sd, key, val) ==
+                (type->no_value? dictAdd(ref, key, val) == DICT_OK: dictReplace(ref, key, val)));
+            break;
+        case 2:
+            assert(smallDictDelete(sd, key) == dictDelete(ref, key));
+            break;
+        default:
+            assert(smallDictExists(sd, key) == (dictFind(ref, key) != NULL));
+        }
+        sdsfree(key);
+        sdsfree(val);
+        if(op % 97 == 0)
+            smallDictTestCheck(sd, ref, fields);
+    }
+    smallDictTestCheck(sd, ref, fields);
+    assert((sd->d != NULL) == (converts == 1 || (converts == 2 && !type->no_value)));
+    smallDictRelease(sd);
+    dictRelease(ref);
+}
+
+//redis-server test smalldict [objects] [fields] [value bytes], packed against dict encoded
+//objects of fields field:N, then random writes checked against a plain dict
+int smallDictTest(int argc, char *argv[], int flags){
+    (void)flags;
+    uint64_t objects = argc > 3? strtoull(argv[3], NULL, 10): 100000;
+    uint64_t fields = argc > 4? strtoull(argv[4], NULL, 10): 32;
+    size_t vlen = argc > 5? strtoull(argv[5], NULL, 10): 16;
+    vlen = vlen > 128? 128: vlen;
+    size_t base = zmalloc_used_memory(), mem[2];
+    long long lookup_ns[2];
+    smallDict **objs = zmalloc(objects * sizeof(*objs));
+
+    for(int packed = 1; packed >= 0; packed--){
+        size_t start = zmalloc_used_memory();
+        for(uint64_t o = 0; o < objects; o++){
+            objs[o] = smallDictCreate(&smallDictTestType);
+            if(!packed)
+                smallDictSetLimits(objs[o], 0, 0);
+            for(uint64_t k = 0; k < fields; k++){
+                sds key = smallDictTestField(k), val = smallDictTestValue(o + k, 0, vlen);
+                assert(smallDictAdd(objs[o], key, val) == DICT_OK);
+                sdsfree(key);
+                sdsfree(val);
+            }
+            assert((objs[o]->d == NULL) == (packed && fields <= SMALLDICT_MAX_ENTRIES && vlen <= SMALLDICT_MAX_VALUE));
+        }
+        mem[packed] = zmalloc_used_memory() - start;
+
+        sds *keys = zmalloc(fields * sizeof(sds));
+        for(uint64_t k = 0; k < fields; k++)
+            keys[k] = smallDictTestField(k);
+        long long t = monotonicNs();
+        uint64_t found = 0;
+        for(uint64_t o = 0; o < objects; o++)
+            for(uint64_t k = 0; k < fields; k++)
+                found += smallDictFetchValue(objs[o], keys[(k * 7 + o) % fields]) != NULL;
+        lookup_ns[packed] = monotonicNs() - t;
+        assert(found == objects * fields);
+        for(uint64_t k = 0; k < fields; k++)
+            sdsfree(keys[k]);
+        zfree(keys);
+        for(uint64_t o = 0; o < objects; o++)
+            smallDictRelease(objs[o]);
+    }
+    zfree(objs);
+    for(int packed = 1; packed >= 0; packed--)
+        printf("%s %llu objects of %llu fields, %zu byte values: %.1f bytes per field, %.1f ns per lookup\n",
+            packed? "packed": "dict  ", (unsigned long long)objects, (unsigned long long)fields, vlen,
+            (double)mem[packed] / (objects * fields), (double)lookup_ns[packed] / (objects * fields));
+    printf("memory ratio %.2fx\n", (double)mem[0] / mem[1]);
+    if(fields <= SMALLDICT_MAX_ENTRIES && vlen <= SMALLDICT_MAX_VALUE)
+        assert(mem[1] < mem[0]);
+
+    for(int converts = 0; converts < 3; converts++){
+        smallDictTestRandom(&smallDictTestType, converts);
+        smallDictTestRandom(&smallDictTestSetType, converts);
+    }
+    assert(zmalloc_used_memory() == base);
+    return 0;
+}
+#endif
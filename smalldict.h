@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dict.h"
+#include "sds.h"
+
+//a dict of sds keys and sds values, or no values, for the many small hashes and sets. up to
+//max_entries entries of at most max_value bytes each are packed in one allocation and found by a
+//SIMD scan of a tag byte per entry, the first write past a limit converts it to a dict of the
+//type for good. keys and values are copied in, with keyDup and valDup once it is a dict
+#define SMALLDICT_MAX_ENTRIES 128
+#define SMALLDICT_MAX_VALUE 64
+#define SMALLDICT_MAX_VALUE_LIMIT 255//keys and values are packed with an 8 bit sds header
+#define SMALLDICT_MAX_DATA 65535//entry offsets are 16 bit, the packed data converts beyond it
+
+typedef struct smallDictBlob{
+    uint16_t count;
+    uint16_t cap;//entries the tags and offsets have room for, a multiple of 16
+    uint32_t used;//bytes of entry data
+    uint32_t size;//usable bytes of the allocation
+    uint8_t buf[];//tags[cap], uint16_t offsets[cap], then the entries
+}smallDictBlob;
+
+typedef struct smallDict{
+    dictType *type;
+    smallDictBlob *blob;//NULL while empty and once converted
+    dict *d;//NULL while packed
+    uint16_t max_entries;
+    uint16_t max_value;
+}smallDict;
+
+//called for each entry, key and val are read only and valid until the next write
+typedef void (smallDictEntryFunction)(void *privdata, const sds key, void *val);
+
+smallDict *smallDictCreate(dictType *type);
+void smallDictRelease(smallDict *sd);
+void smallDictSetLimits(smallDict *sd, unsigned max_entries, unsigned max_value);
+int smallDictAdd(smallDict *sd, const sds key, const sds val);
+int smallDictReplace(smallDict *sd, const sds key, const sds val);
+int smallDictDelete(smallDict *sd, const sds key);
+int smallDictExists(smallDict *sd, const sds key);
+void *smallDictFetchValue(smallDict *sd, const sds key);
+uint64_t smallDictSize(smallDict *sd);
+void smallDictForEach(smallDict *sd, smallDictEntryFunction *fn, void *privdata);
+
+#ifdef REDIS_TEST
+int smallDictTest(int argc, char *argv[], int flags);
+#endif
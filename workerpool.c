@@ -0,0 +1,109 @@
+#include <pthread.h>
+
+#include "workerpool.h"
+#include "zmalloc.h"
+#include "redisassert.h"
+
+typedef struct workerJob{
+    workerJobFunction *fn;
+    void *arg;
+    struct workerJob *next;
+}workerJob;
+
+struct workerPool{
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;//a job was queued or the pool stops
+    pthread_cond_t done_cond;//pending dropped to 0
+    workerJob *head, *tail;
+    int pending;//queued or running
+    int stop;
+    int nthreads;
+    pthread_t *threads;
+};
+
+static void *workerPoolMain(void *arg){
+    workerPool *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while(1){
+        while(!p->head && !p->stop)
+            pthread_cond_wait(&p->work_cond, &p->lock);
+        if(!p->head)
+            break;
+        workerJob *job = p->head;
+        p->head = job->next;
+        if(!p->head)
+            p->tail = NULL;
+        pthread_mutex_unlock(&p->lock);
+
+        job->fn(job->arg);
+        zfree(job);
+
+        pthread_mutex_lock(&p->lock);
+        if(--p->pending == 0)
+            pthread_cond_broadcast(&p->done_cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+workerPool *workerPoolCreate(int nthreads){
+    assert(nthreads > 0);
+    workerPool *p = zcalloc(sizeof(*p));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work_cond, NULL);
+    pthread_cond_init(&p->done_cond, NULL);
+    p->threads = zmalloc(sizeof(pthread_t) * nthreads);
+    for(int i = 0; i < nthreads; i++){
+        if(pthread_create(&p->threads[i], NULL, workerPoolMain, p) != 0)
+            break;
+        p->nthreads++;
+    }
+    if(p->nthreads == 0){
+        workerPoolRelease(p);
+        return NULL;
+    }
+    return p;
+}
+
+//the queued jobs still run before the threads exit
+void workerPoolRelease(workerPool *p){
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+    for(int i = 0; i < p->nthreads; i++)
+        pthread_join(p->threads[i], NULL);
+    pthread_cond_destroy(&p->done_cond);
+    pthread_cond_destroy(&p->work_cond);
+    pthread_mutex_destroy(&p->lock);
+    zfree(p->threads);
+    zfree(p);
+}
+
+int workerPoolThreads(workerPool *p){
+    return p->nthreads;
+}
+
+void workerPoolSubmit(workerPool *p, workerJobFunction *fn, void *arg){
+    workerJob *job = zmalloc(sizeof(*job));
+    job->fn = fn;
+    job->arg = arg;
+    job->next = NULL;
+    pthread_mutex_lock(&p->lock);
+    assert(!p->stop);
+    if(p->tail)
+        p->tail->next = job;
+    else
+        p->head = job;
+    p->tail = job;
+    p->pending++;
+    pthread_cond_signal(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void workerPoolWait(workerPool *p){
+    pthread_mutex_lock(&p->lock);
+    while(p->pending)
+        pthread_cond_wait(&p->done_cond, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+//a fixed set of threads running submitted jobs in submission order, workerPoolWait blocks until
+//every job submitted so far has finished
+typedef void (workerJobFunction)(void *arg);
+
+typedef struct workerPool workerPool;
+
+workerPool *workerPoolCreate(int nthreads);
+void workerPoolRelease(workerPool *p);
+int workerPoolThreads(workerPool *p);
+void workerPoolSubmit(workerPool *p, workerJobFunction *fn, void *arg);
+void workerPoolWait(workerPool *p);
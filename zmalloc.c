@@ -8,6 +8,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
 void zlibc_free(void *ptr){
     free(ptr);
@@ -203,6 +204,16 @@ void *zrealloc_usable(void *ptr, size_t size, size_t *usable){
     return ptr;
 }
 
+void *zmalloc_aligned(size_t alignment, size_t size){
+    void *ptr;
+    if(size >= SIZE_MAX / 2 || posix_memalign(&ptr, alignment, MALLOC_MIN_SIZE(size)) != 0){
+        zmalloc_oom_handler(size);
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&used_memory, malloc_usable_size(ptr), memory_order_relaxed);
+    return ptr;
+}
+
 void zfree(void *ptr){
     if(ptr == NULL)
         return;
@@ -210,6 +221,57 @@ void zfree(void *ptr){
     free(ptr);
 }
 
+static size_t zmalloc_huge_round(size_t size){
+    return (size + ZMALLOC_HUGE_PAGE_SIZE - 1) & ~(size_t)(ZMALLOC_HUGE_PAGE_SIZE - 1);
+}
+
+//map size + one huge page and unmap the misaligned head and the tail
+static void *zmalloc_huge_map(size_t size){
+    size = zmalloc_huge_round(size);
+    if(size == 0 || size >= SIZE_MAX / 2)
+        return NULL;
+    char *p = mmap(NULL, size + ZMALLOC_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED)
+        return NULL;
+    char *aligned = (char *)(((uintptr_t)p + ZMALLOC_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(ZMALLOC_HUGE_PAGE_SIZE - 1));
+    if(aligned > p)
+        munmap(p, aligned - p);
+    if(aligned + size < p + size + ZMALLOC_HUGE_PAGE_SIZE)
+        munmap(aligned + size, p + size + ZMALLOC_HUGE_PAGE_SIZE - (aligned + size));
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    atomic_fetch_add_explicit(&used_memory, size, memory_order_relaxed);
+    return aligned;
+}
+
+void *ztrycalloc_huge(size_t size){
+    if(size < ZMALLOC_HUGE_THRESHOLD)
+        return ztrycalloc(size);
+    return zmalloc_huge_map(size);
+}
+
+void *zcalloc_huge(size_t size){
+    if(size < ZMALLOC_HUGE_THRESHOLD)
+        return zcalloc(size);
+    void *ptr = zmalloc_huge_map(size);
+    if(!ptr)
+        zmalloc_oom_handler(size);
+    return ptr;
+}
+
+void zfree_huge(void *ptr, size_t size){
+    if(size < ZMALLOC_HUGE_THRESHOLD){
+        zfree(ptr);
+        return;
+    }
+    if(ptr == NULL)
+        return;
+    size = zmalloc_huge_round(size);
+    atomic_fetch_sub_explicit(&used_memory, size, memory_order_relaxed);
+    munmap(ptr, size);
+}
+
 void zfree_usable(void *ptr, size_t *usable){
     if(ptr == NULL)
         return;
@@ -261,7 +323,7 @@ int get_proc_stat_ll(int i, long long *res){
         return 0;
     p++;
     while(*p == ' ')
-        return 0;
+        p++;
     i-=3;
     if(i < 0)
         return 0;
@@ -283,8 +345,22 @@ int get_proc_stat_ll(int i, long long *res){
     return 1;
 }
 
+//rss pages are field 24 of /proc/self/stat
+size_t zmalloc_get_rss(void){
+    long long rss;
+    if(!get_proc_stat_ll(24, &rss))
+        return 0;
+    return (size_t)rss * sysconf(_SC_PAGESIZE);
+}
+
+//glibc keeps no per page counts: allocated is what malloc handed out, active what the arenas
+//and the mmapped chunks hold, free holes included, even after malloc_trim returned their pages.
+//resident is the process RSS, which is what goes down when pages are returned
 int zmalloc_get_allocator_info(size_t *allocated, size_t *active, size_t *resident){
-    *allocated = *resident = *active = 0;
+    struct mallinfo2 mi = mallinfo2();
+    *allocated = mi.uordblks + mi.hblkhd;
+    *active = mi.arena + mi.hblkhd;
+    *resident = zmalloc_get_rss();
     return 1;
 }
 
@@ -292,7 +368,10 @@ void set_jemalloc_bg_thread(int enable){
     (void)enable;
 }
 
+//glibc: consolidate the free chunks and return the free pages, at the top of the heap and the
+//whole free pages inside it
 int jemalloc_purge(void){
+    malloc_trim(0);
     return 0;
 }
 
@@ -306,7 +385,7 @@ size_t zmalloc_get_smap_byte_by_field(char *field, long pid){
         fp = fopen("/proc/self/smaps", "r");
     }else{
         char filename[128];
-        snprintf(filename, sizeof(filename), "proc/%ld/smaps", pid);
+        snprintf(filename, sizeof(filename), "/proc/%ld/smaps", pid);
         fp = fopen(filename, "r");
     }
 
@@ -329,6 +408,11 @@ size_t zmalloc_get_private_dirty(long pid){
     return zmalloc_get_smap_byte_by_field("Private_Dirty:", pid);
 }
 
+//anonymous memory backed by transparent huge pages
+size_t zmalloc_get_huge_pages(long pid){
+    return zmalloc_get_smap_byte_by_field("AnonHugePages:", pid);
+}
+
 size_t zmalloc_get_memory_size(void){
     return (size_t)sysconf(_SC_PHYS_PAGES) * (size_t)sysconf(_SC_PAGE_SIZE);
 }
\ No newline at end of file
@@ -29,6 +29,22 @@ void *ztryrealloc(void *ptr, size_t size);
 
 void zfree(void *ptr);
 
+//alloc size byte memory starting at a multiple of alignment(a power of two), free it with zfree
+__attribute__((malloc, alloc_size(2), noinline))
+void *zmalloc_aligned(size_t alignment, size_t size);
+
+//zeroed memory for big arrays, from ZMALLOC_HUGE_THRESHOLD bytes up a 2MB aligned mmap of whole
+//2MB pages advised MADV_HUGEPAGE, smaller sizes come from zcalloc. free it with zfree_huge and
+//the size it was allocated with
+#define ZMALLOC_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define ZMALLOC_HUGE_THRESHOLD ZMALLOC_HUGE_PAGE_SIZE
+
+void *zcalloc_huge(size_t size);
+
+void *ztrycalloc_huge(size_t size);
+
+void zfree_huge(void *ptr, size_t size);
+
 void *zmalloc_usable(size_t size, size_t *usable);
 
 void *zcalloc_usable(size_t size, size_t *usable);
@@ -61,6 +77,8 @@ int jemalloc_purge(void);
 
 size_t zmalloc_get_private_dirty(long pid);
 
+size_t zmalloc_get_huge_pages(long pid);
+
 size_t zmalloc_get_smap_byte_by_field(char *field, long pid);
 
 size_t zmalloc_get_memory_size(void);